@@ -1,5 +1,6 @@
 from bcc import ArgString, BPF, DEBUG_LLVM_IR, DEBUG_PREPROCESSOR, DEBUG_SOURCE, DEBUG_BPF_REGISTER_STATE
-from debug import print_bpf_insn_struct
+import os
+import subprocess
 
 # define BPF program
 bpf_text = """
@@ -82,4 +83,9 @@ if goal == 'annotated bytecode':
 elif goal == 'dump C code':
     b = BPF(text=bpf_text)
     bytecode = b.dump_func("trace_entry")
-    print_bpf_insn_struct(bytecode)
+    # Prints the bytecode as the equivalent bpf_insn[] in C, with each
+    # instruction disassembled in a comment. Build ../opensnoop/bpf_disasm
+    # first.
+    bpf_disasm = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                              "..", "opensnoop", "bpf_disasm")
+    subprocess.run([bpf_disasm, "-c", "-"], input=bytecode, check=True)
@@ -1,4 +1,5 @@
 #!/bin/sh
 # Note the generated load-bpf executable must be
 # run with sudo.
-clang -g -o load-bpf load-bpf.c
+clang -g -o load-bpf load-bpf.c ../opensnoop/analyzer.c \
+    ../opensnoop/disasm.c ../opensnoop/optimizer.c
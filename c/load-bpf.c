@@ -1,3 +1,6 @@
+#include "../opensnoop/analyzer.h"
+#include "../opensnoop/optimizer.h"
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -9,6 +12,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -36,13 +41,46 @@ static inline __u64 ptr_to_u64(const void *ptr) {
  *     attr.kern_version = LINUX_VERSION_CODE;
  */
 int bpf_prog_load(enum bpf_prog_type type, const struct bpf_insn *insns,
-                  int insn_cnt, const char *license) {
+                  int insn_cnt, const char *license,
+                  unsigned int kern_version) {
+  // Catch what the verifier would most likely reject without a round trip
+  // to the kernel, and report it where the verifier would, in bpf_log_buf.
+  struct analysis analysis;
+  if (analyze_program(insns, insn_cnt, &analysis) < 0) {
+    FILE *log = fmemopen(bpf_log_buf, LOG_BUF_SIZE, "w");
+    if (log != NULL) {
+      analyze_print(log, "analyzer", insns, insn_cnt, &analysis);
+      fclose(log);
+    }
+    analyze_free(&analysis);
+    errno = EINVAL;
+    return -1;
+  }
+  // Anything it was unsure of, such as helpers newer than its headers, is
+  // left to the verifier.
+  analyze_print_warnings(stderr, "analyzer", &analysis);
+  analyze_free(&analysis);
+
+  // Then shrink it with the peephole optimiser, which works in place.
+  struct bpf_insn *optimized = malloc(insn_cnt * sizeof(struct bpf_insn));
+  if (optimized == NULL) {
+    return -1;
+  }
+  memcpy(optimized, insns, insn_cnt * sizeof(struct bpf_insn));
+  int optimized_cnt = optimize_program(optimized, insn_cnt, NULL, 0, NULL);
+  if (optimized_cnt < 0) {
+    free(optimized);
+    return -1;
+  }
+  fprintf(stderr, "optimizer: removed %d of %d instructions\n",
+          insn_cnt - optimized_cnt, insn_cnt);
+
   union bpf_attr attr;
   memset(&attr, 0, sizeof(attr));
 
   attr.prog_type = type;
-  attr.insns = ptr_to_u64(insns);
-  attr.insn_cnt = insn_cnt;
+  attr.insns = ptr_to_u64(optimized);
+  attr.insn_cnt = optimized_cnt;
   attr.license = ptr_to_u64(license);
 
   attr.log_buf = ptr_to_u64(bpf_log_buf);
@@ -50,12 +88,16 @@ int bpf_prog_load(enum bpf_prog_type type, const struct bpf_insn *insns,
   attr.log_level = 1;
 
   // As noted in bpf(2), kern_version is checked when prog_type=kprobe.
-  attr.kern_version = LINUX_VERSION_CODE;
+  attr.kern_version = kern_version;
 
   // If this returns a non-zero number, printing the contents of
   // bpf_log_buf may help. libbpf.c has a bpf_print_hints() function that
   // can help with this.
-  return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+  int fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+  int saved_errno = errno;
+  free(optimized);
+  errno = saved_errno;
+  return fd;
 }
 
 int waitForSigInt() {
@@ -126,20 +168,26 @@ int attachTracingEvent(int progFd, const char *event_path, int *pfd) {
 
   if (ioctl(*pfd, PERF_EVENT_IOC_SET_BPF, progFd) < 0) {
     perror("ioctl(PERF_EVENT_IOC_SET_BPF)");
-    return -1;
+    goto error;
   }
   if (ioctl(*pfd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
     perror("ioctl(PERF_EVENT_IOC_ENABLE)");
-    return -1;
+    goto error;
   }
 
   return 0;
+
+error:
+  close(*pfd);
+  *pfd = -1;
+  return -1;
 }
 
 /**
- * Simplified version of bpf_attach_kprobe() from libbpf.c.
+ * Simplified version of bpf_attach_kprobe() from libbpf.c, which attaches
+ * progFd to the entry of fn_name, or to its return if isReturn is nonzero.
  */
-int attachKprobe(int progFd) {
+int attachKprobe(int progFd, int isReturn, const char *fn_name) {
   static char *event_type = "kprobe";
 
   // Note that bpf_try_perf_event_open_with_probe() fails on my system
@@ -156,14 +204,11 @@ int attachKprobe(int progFd) {
 
   char buf[256];
   char event_alias[128];
-  const char *ev_name = "p_do_sys_open";
-  // I don't think fn_name matters: I think it's just used to help namespace
-  // the probe ID?
-  const char *fn_name = "do_sys_open";
 
   // I believe that parameterizing the event alias by PID was done because of:
   // https://github.com/iovisor/bcc/issues/872.
-  snprintf(event_alias, sizeof(event_alias), "%s_bcc_%d", ev_name, getpid());
+  snprintf(event_alias, sizeof(event_alias), "%c_%s_bcc_%d",
+           isReturn ? 'r' : 'p', fn_name, getpid());
 
   // These are defined in libbpf.h, not bpf.h.
   int BPF_PROBE_ENTRY = 0;
@@ -171,7 +216,7 @@ int attachKprobe(int progFd) {
 
   // I'm assuming the function offset is 0. I'm not sure where to get the
   // function offset because I do not build my program the way libbpf does.
-  int attach_type = BPF_PROBE_ENTRY;
+  int attach_type = isReturn ? BPF_PROBE_RETURN : BPF_PROBE_ENTRY;
   snprintf(buf, sizeof(buf), "%c:%ss/%s %s",
            attach_type == BPF_PROBE_ENTRY ? 'p' : 'r', event_type, event_alias,
            fn_name);
@@ -206,7 +251,425 @@ int attachKprobe(int progFd) {
   return pfd;
 }
 
+/*
+ * What follows is a loader for the BPF object files that llc produces, such
+ * as target/bpf/hello.o, so that they can be loaded without gobpf. It is
+ * modelled on bpf_load.c from the kernel's samples/bpf and on
+ * gobpf/elf/elf.go:
+ *
+ * - Each program is in an executable section whose name says what to attach
+ *   it to, e.g. "kprobe/SyS_clone".
+ * - The "license" and "version" sections hold the license string and the
+ *   kernel version to pass to BPF_PROG_LOAD.
+ * - Maps are described by an array of struct bpf_map_def in the "maps"
+ *   section, and each instruction that loads a map's address has a
+ *   relocation against the symbol of its struct bpf_map_def.
+ *
+ * The object is mmap()ed rather than read. The mapping is private, so only
+ * the pages that relocations write to are ever copied.
+ */
+
+// Value of the "version" section that means "whatever kernel this runs on",
+// as bcc and gobpf also treat it.
+#define ANY_KERNEL_VERSION 0xFFFFFFFE
+
+#define MAX_MAPS 32
+#define MAX_PROGRAMS 32
+
+/**
+ * The prefix of struct bpf_map_def in samples/bpf/bpf_helpers.h. Some
+ * toolchains append fields, so the real size of an entry is worked out from
+ * the size of the "maps" section and the number of symbols in it.
+ */
+struct bpf_map_def {
+  unsigned int type;
+  unsigned int key_size;
+  unsigned int value_size;
+  unsigned int max_entries;
+  unsigned int map_flags;
+};
+
+struct elf_object {
+  const char *path;
+  unsigned char *data;
+  size_t size;
+  const Elf64_Shdr *sections;
+  int numSections;
+  // Section header string table.
+  const char *sectionNames;
+  const Elf64_Sym *symbols;
+  int numSymbols;
+  const char *license;
+  unsigned int kernVersion;
+  // Index of the "maps" section, or 0 if there is none.
+  int mapsSection;
+  size_t mapDefSize;
+  int mapFds[MAX_MAPS];
+  int numMaps;
+};
+
+struct elf_program {
+  const char *section;
+  int progFd;
+  int perfEventFd;
+};
+
+/**
+ * Returns the contents of section index, or NULL if the index or the
+ * section's extent in the file is invalid.
+ */
+static void *sectionData(const struct elf_object *obj, int index) {
+  if (index <= 0 || index >= obj->numSections) {
+    return NULL;
+  }
+  const Elf64_Shdr *section = &obj->sections[index];
+  if (section->sh_type == SHT_NOBITS || section->sh_offset > obj->size ||
+      section->sh_size > obj->size - section->sh_offset) {
+    return NULL;
+  }
+  return obj->data + section->sh_offset;
+}
+
+static const char *sectionName(const struct elf_object *obj, int index) {
+  return obj->sectionNames + obj->sections[index].sh_name;
+}
+
+static int hasPrefix(const char *s, const char *prefix) {
+  return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+/**
+ * Maps path into memory and checks that it is a relocatable BPF object.
+ * Returns 0, or -1 after printing an error.
+ */
+int openElfObject(const char *path, struct elf_object *obj) {
+  memset(obj, 0, sizeof(*obj));
+  obj->path = path;
+  obj->kernVersion = LINUX_VERSION_CODE;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "fstat(%s): %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  obj->size = st.st_size;
+  if (obj->size < sizeof(Elf64_Ehdr)) {
+    fprintf(stderr, "%s: too small to be an ELF file\n", path);
+    close(fd);
+    return -1;
+  }
+  // Writable but private, so that relocations can be applied in place.
+  obj->data =
+      mmap(NULL, obj->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (obj->data == MAP_FAILED) {
+    fprintf(stderr, "mmap(%s): %s\n", path, strerror(errno));
+    obj->data = NULL;
+    return -1;
+  }
+
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)obj->data;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_type != ET_REL ||
+      ehdr->e_machine != EM_BPF) {
+    fprintf(stderr, "%s: not a 64-bit relocatable BPF object\n", path);
+    return -1;
+  }
+  if (ehdr->e_shentsize != sizeof(Elf64_Shdr) || ehdr->e_shoff > obj->size ||
+      (size_t)ehdr->e_shnum * sizeof(Elf64_Shdr) >
+          obj->size - ehdr->e_shoff) {
+    fprintf(stderr, "%s: bad section header table\n", path);
+    return -1;
+  }
+  obj->sections = (const Elf64_Shdr *)(obj->data + ehdr->e_shoff);
+  obj->numSections = ehdr->e_shnum;
+  obj->sectionNames = sectionData(obj, ehdr->e_shstrndx);
+  if (obj->sectionNames == NULL) {
+    fprintf(stderr, "%s: missing section name table\n", path);
+    return -1;
+  }
+  size_t namesSize = obj->sections[ehdr->e_shstrndx].sh_size;
+  for (int i = 0; i < obj->numSections; i++) {
+    if (obj->sections[i].sh_name >= namesSize) {
+      fprintf(stderr, "%s: bad name for section %d\n", path, i);
+      return -1;
+    }
+  }
+  if (namesSize == 0 || obj->sectionNames[namesSize - 1] != '\0') {
+    fprintf(stderr, "%s: unterminated section name table\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+void closeElfObject(struct elf_object *obj) {
+  for (int i = 0; i < obj->numMaps; i++) {
+    close(obj->mapFds[i]);
+  }
+  if (obj->data != NULL) {
+    munmap(obj->data, obj->size);
+  }
+  memset(obj, 0, sizeof(*obj));
+}
+
+/**
+ * Reads the license, version and symbol table sections, and creates the
+ * maps described by the "maps" section. Returns 0, or -1 after printing an
+ * error.
+ */
+int readElfSections(struct elf_object *obj) {
+  for (int i = 1; i < obj->numSections; i++) {
+    const Elf64_Shdr *section = &obj->sections[i];
+    const char *name = sectionName(obj, i);
+    void *data = sectionData(obj, i);
+    if (strcmp(name, "license") == 0) {
+      if (data == NULL || memchr(data, '\0', section->sh_size) == NULL) {
+        fprintf(stderr, "%s: bad license section\n", obj->path);
+        return -1;
+      }
+      obj->license = data;
+    } else if (strcmp(name, "version") == 0) {
+      unsigned int version;
+      if (data == NULL || section->sh_size != sizeof(version)) {
+        fprintf(stderr, "%s: bad version section\n", obj->path);
+        return -1;
+      }
+      memcpy(&version, data, sizeof(version));
+      if (version != ANY_KERNEL_VERSION) {
+        obj->kernVersion = version;
+      }
+    } else if (strcmp(name, "maps") == 0) {
+      obj->mapsSection = i;
+    } else if (section->sh_type == SHT_SYMTAB) {
+      const char *strings = sectionData(obj, section->sh_link);
+      if (data == NULL || strings == NULL ||
+          section->sh_entsize != sizeof(Elf64_Sym)) {
+        fprintf(stderr, "%s: bad symbol table\n", obj->path);
+        return -1;
+      }
+      obj->symbols = data;
+      obj->numSymbols = section->sh_size / sizeof(Elf64_Sym);
+    }
+  }
+  if (obj->license == NULL) {
+    fprintf(stderr, "%s: no license section\n", obj->path);
+    return -1;
+  }
+  if (obj->mapsSection == 0) {
+    return 0;
+  }
+
+  const unsigned char *maps = sectionData(obj, obj->mapsSection);
+  size_t mapsSize = obj->sections[obj->mapsSection].sh_size;
+  int numMaps = 0;
+  for (int i = 0; i < obj->numSymbols; i++) {
+    // The section's own STT_SECTION symbol is not a map.
+    numMaps += obj->symbols[i].st_shndx == obj->mapsSection &&
+               ELF64_ST_TYPE(obj->symbols[i].st_info) == STT_OBJECT;
+  }
+  if (maps == NULL || numMaps == 0 || numMaps > MAX_MAPS ||
+      mapsSize % numMaps != 0 ||
+      mapsSize / numMaps < sizeof(struct bpf_map_def)) {
+    fprintf(stderr, "%s: bad maps section\n", obj->path);
+    return -1;
+  }
+  obj->mapDefSize = mapsSize / numMaps;
+  for (int i = 0; i < numMaps; i++) {
+    struct bpf_map_def def;
+    memcpy(&def, maps + i * obj->mapDefSize, sizeof(def));
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = def.type;
+    attr.key_size = def.key_size;
+    attr.value_size = def.value_size;
+    attr.max_entries = def.max_entries;
+    attr.map_flags = def.map_flags;
+    int mapFd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+    if (mapFd < 0) {
+      fprintf(stderr, "%s: creating map %d: %s\n", obj->path, i,
+              strerror(errno));
+      return -1;
+    }
+    obj->mapFds[obj->numMaps++] = mapFd;
+  }
+  return 0;
+}
+
+/**
+ * Applies the relocations in every SHT_REL section that targets the program
+ * in section progSection. Only loads of a map's address are supported.
+ * Returns 0, or -1 after printing an error.
+ */
+int relocateProgram(struct elf_object *obj, int progSection) {
+  struct bpf_insn *insns = sectionData(obj, progSection);
+  size_t numInsns = obj->sections[progSection].sh_size / sizeof(*insns);
+  for (int i = 1; i < obj->numSections; i++) {
+    const Elf64_Shdr *section = &obj->sections[i];
+    if (section->sh_type != SHT_REL || section->sh_info != progSection) {
+      continue;
+    }
+    const Elf64_Rel *rels = sectionData(obj, i);
+    if (rels == NULL || obj->symbols == NULL) {
+      fprintf(stderr, "%s: bad relocation section %s\n", obj->path,
+              sectionName(obj, i));
+      return -1;
+    }
+
+    size_t numRels = section->sh_size / sizeof(Elf64_Rel);
+    for (size_t j = 0; j < numRels; j++) {
+      size_t insnIndex = rels[j].r_offset / sizeof(struct bpf_insn);
+      size_t symIndex = ELF64_R_SYM(rels[j].r_info);
+      if (insnIndex >= numInsns || symIndex >= obj->numSymbols) {
+        fprintf(stderr, "%s: bad relocation in %s\n", obj->path,
+                sectionName(obj, i));
+        return -1;
+      }
+      const Elf64_Sym *sym = &obj->symbols[symIndex];
+      struct bpf_insn *insn = &insns[insnIndex];
+      // A relocation against the section symbol rather than the map's own
+      // symbol has the map's offset in the instruction's imm instead.
+      size_t offset = sym->st_value;
+      if (ELF64_ST_TYPE(sym->st_info) == STT_SECTION) {
+        offset += (unsigned int)insn->imm;
+      }
+      if (obj->mapsSection == 0 || sym->st_shndx != obj->mapsSection ||
+          insn->code != (BPF_LD | BPF_IMM | BPF_DW) ||
+          offset / obj->mapDefSize >= obj->numMaps) {
+        fprintf(stderr,
+                "%s: unsupported relocation of instruction %zu in %s\n",
+                obj->path, insnIndex, sectionName(obj, progSection));
+        return -1;
+      }
+      insn->src_reg = BPF_PSEUDO_MAP_FD;
+      insn->imm = obj->mapFds[offset / obj->mapDefSize];
+    }
+  }
+  return 0;
+}
+
+/**
+ * Loads the program in section index and attaches it according to the
+ * section's name: "kprobe/FUNCTION", "kretprobe/FUNCTION" or
+ * "tracepoint/CATEGORY/NAME". Returns 0, 1 if the section is not a program
+ * that this knows how to attach, or -1 after printing an error.
+ */
+int loadElfProgram(struct elf_object *obj, int index,
+                   struct elf_program *prog) {
+  const char *name = sectionName(obj, index);
+  enum bpf_prog_type type;
+  int isReturn = 0;
+  const char *target;
+  if (hasPrefix(name, "kprobe/")) {
+    type = BPF_PROG_TYPE_KPROBE;
+    target = name + strlen("kprobe/");
+  } else if (hasPrefix(name, "kretprobe/")) {
+    type = BPF_PROG_TYPE_KPROBE;
+    isReturn = 1;
+    target = name + strlen("kretprobe/");
+  } else if (hasPrefix(name, "tracepoint/")) {
+    type = BPF_PROG_TYPE_TRACEPOINT;
+    target = name + strlen("tracepoint/");
+  } else {
+    return 1;
+  }
+
+  struct bpf_insn *insns = sectionData(obj, index);
+  size_t size = obj->sections[index].sh_size;
+  if (insns == NULL || size == 0 || size % sizeof(struct bpf_insn) != 0) {
+    fprintf(stderr, "%s: bad program section %s\n", obj->path, name);
+    return -1;
+  }
+  if (relocateProgram(obj, index) < 0) {
+    return -1;
+  }
+
+  prog->section = name;
+  prog->perfEventFd = -1;
+  prog->progFd = bpf_prog_load(type, insns, size / sizeof(struct bpf_insn),
+                               obj->license, obj->kernVersion);
+  if (prog->progFd < 0) {
+    fprintf(stderr, "Error loading %s: %s\n%s\n", name, strerror(errno),
+            bpf_log_buf);
+    return -1;
+  }
+
+  if (type == BPF_PROG_TYPE_KPROBE) {
+    prog->perfEventFd = attachKprobe(prog->progFd, isReturn, target);
+  } else {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/kernel/debug/tracing/events/%s",
+             target);
+    if (attachTracingEvent(prog->progFd, path, &prog->perfEventFd) < 0) {
+      prog->perfEventFd = -1;
+    }
+  }
+  if (prog->perfEventFd < 0) {
+    fprintf(stderr, "Error attaching %s\n", name);
+    close(prog->progFd);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Loads and attaches every program in the object file at path, and then
+ * waits for SIGINT. Returns the exit code for main().
+ */
+int runElfObject(const char *path) {
+  struct elf_object obj;
+  struct elf_program progs[MAX_PROGRAMS];
+  int numProgs = 0, exitCode = 1;
+  if (openElfObject(path, &obj) < 0 || readElfSections(&obj) < 0) {
+    goto out;
+  }
+
+  for (int i = 1; i < obj.numSections; i++) {
+    const Elf64_Shdr *section = &obj.sections[i];
+    if (section->sh_type != SHT_PROGBITS ||
+        !(section->sh_flags & SHF_EXECINSTR)) {
+      continue;
+    }
+    if (numProgs == MAX_PROGRAMS) {
+      fprintf(stderr, "%s: more than %d programs\n", path, MAX_PROGRAMS);
+      goto out;
+    }
+    int rc = loadElfProgram(&obj, i, &progs[numProgs]);
+    if (rc < 0) {
+      goto out;
+    } else if (rc == 0) {
+      fprintf(stderr, "Attached %s\n", progs[numProgs].section);
+      numProgs++;
+    }
+  }
+  if (numProgs == 0) {
+    fprintf(stderr, "%s: no programs to attach\n", path);
+    goto out;
+  }
+
+  exitCode = waitForSigInt();
+
+out:
+  for (int i = 0; i < numProgs; i++) {
+    close(progs[i].perfEventFd);
+    close(progs[i].progFd);
+  }
+  closeElfObject(&obj);
+  return exitCode;
+}
+
 int main(int argc, char **argv) {
+  // Given an object file such as ../target/bpf/hello.o, load the programs in
+  // it instead of the one below.
+  if (argc > 1) {
+    return runElfObject(argv[1]);
+  }
+
   // This array was generated from bpf_trace_printk.py.
   struct bpf_insn prog[] = {
       ((struct bpf_insn){
@@ -310,13 +773,14 @@ int main(int argc, char **argv) {
   };
 
   int insn_cnt = sizeof(prog) / sizeof(struct bpf_insn);
-  int progFd = bpf_prog_load(BPF_PROG_TYPE_KPROBE, prog, insn_cnt, "GPL");
+  int progFd = bpf_prog_load(BPF_PROG_TYPE_KPROBE, prog, insn_cnt, "GPL",
+                             LINUX_VERSION_CODE);
   if (progFd == -1) {
     perror("Error calling bpf_prog_load()");
     return 1;
   }
 
-  int perfEventFd = attachKprobe(progFd);
+  int perfEventFd = attachKprobe(progFd, /* isReturn */ 0, "do_sys_open");
   if (perfEventFd < 0) {
     perror("Error calling attachKprobe()");
     close(progFd);
@@ -0,0 +1,967 @@
+#include "analyzer.h"
+#include "disasm.h"
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sign-extending loads, which older <linux/bpf.h> do not define.
+#ifndef BPF_MEMSX
+#define BPF_MEMSX 0x80
+#endif
+
+#define NUM_REGS (BPF_REG_10 + 1)
+
+// Stack pointers further than this from r10 are no longer tracked, which
+// also keeps their offsets from overflowing.
+#define MAX_TRACKED_OFFSET (1 << 20)
+// How many times the offsets of a stack pointer may widen where paths meet
+// before it is no longer tracked, so that loops which move a pointer each
+// time around do not keep the analysis going.
+#define MAX_WIDENINGS 8
+
+enum insn_flag {
+  // Starts a block.
+  INSN_LEADER = 1,
+  // The second half of an ld_imm64, which is never executed on its own.
+  INSN_SECOND_HALF = 2,
+  // The entry of the program or of a subprogram.
+  INSN_ROOT = 4,
+};
+
+/** What is known about a register at some instruction. */
+enum reg_kind {
+  // Not written on some path to here.
+  REG_UNINIT,
+  // Written, but nothing more is known.
+  REG_VALUE,
+  // Points between minOff and maxOff bytes from r10 on every path to here.
+  REG_STACK,
+};
+
+struct reg {
+  enum reg_kind kind;
+  int minOff;
+  int maxOff;
+  // How many times paths with other offsets have met.
+  int widenings;
+};
+
+struct state {
+  struct reg regs[NUM_REGS];
+};
+
+struct analyzer {
+  const struct bpf_insn *insns;
+  size_t numInsns;
+  struct analysis *result;
+  // enum insn_flag for each instruction.
+  unsigned char *flags;
+  // The block each instruction is in.
+  int *blockOf;
+  // The state on entry to each block, once hasState is set.
+  struct state *states;
+  unsigned char *hasState;
+  // Blocks reachable from the entry, each after all of its successors, and
+  // how many of them there are.
+  int *postorder;
+  int numPostorder;
+};
+
+static int fail(struct analyzer *an, size_t insn, const char *format, ...) {
+  struct analysis *result = an->result;
+  int len = snprintf(result->error, sizeof(result->error), "insn %zu: ",
+                     insn);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(result->error + len, sizeof(result->error) - len, format, args);
+  va_end(args);
+  result->errorInsn = insn;
+  return -1;
+}
+
+/**
+ * Records a problem that only the kernel can judge. Only the first is
+ * described, but all of them are counted.
+ */
+static void warn(struct analyzer *an, size_t insn, const char *format, ...) {
+  struct analysis *result = an->result;
+  if (result->numWarnings++ > 0) {
+    return;
+  }
+  int len = snprintf(result->warning, sizeof(result->warning), "insn %zu: ",
+                     insn);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(result->warning + len, sizeof(result->warning) - len, format,
+            args);
+  va_end(args);
+}
+
+static int isLoadImm64(const struct bpf_insn *insn) {
+  return insn->code == (BPF_LD | BPF_IMM | BPF_DW);
+}
+
+static int isJumpClass(const struct bpf_insn *insn) {
+  return BPF_CLASS(insn->code) == BPF_JMP ||
+         BPF_CLASS(insn->code) == BPF_JMP32;
+}
+
+static int isExit(const struct bpf_insn *insn) {
+  return insn->code == (BPF_JMP | BPF_EXIT);
+}
+
+static int isCall(const struct bpf_insn *insn) {
+  return insn->code == (BPF_JMP | BPF_CALL);
+}
+
+/** Returns nonzero for goto and the conditional jumps. */
+static int isJump(const struct bpf_insn *insn) {
+  return isJumpClass(insn) && !isExit(insn) && !isCall(insn);
+}
+
+/** Returns the index the jump at index goes to, which may be out of range. */
+static long long jumpTarget(const struct bpf_insn *insn, size_t index) {
+  // The 32-bit goto keeps its offset in imm, for jumps past 32K.
+  int isLong = insn->code == (BPF_JMP32 | BPF_JA);
+  return (long long)index + 1 + (isLong ? insn->imm : insn->off);
+}
+
+static int accessSize(int size) {
+  switch (size) {
+  case BPF_B:
+    return 1;
+  case BPF_H:
+    return 2;
+  case BPF_W:
+    return 4;
+  default:
+    return 8;
+  }
+}
+
+/**
+ * Checks that target, the destination of a jump, call or function pointer
+ * at index, is in the program, and marks it as a leader with flags.
+ */
+static int markTarget(struct analyzer *an, size_t index, long long target,
+                      int flags) {
+  if (target < 0 || target >= (long long)an->numInsns) {
+    return fail(an, index, "target %lld is out of range", target);
+  }
+  if (an->flags[target] & INSN_SECOND_HALF) {
+    return fail(an, index, "target %lld is the middle of an ld_imm64",
+                target);
+  }
+  an->flags[target] |= flags;
+  return 0;
+}
+
+static int checkAlu(struct analyzer *an, size_t index,
+                    const struct bpf_insn *insn) {
+  int op = BPF_OP(insn->code);
+  int is64 = BPF_CLASS(insn->code) == BPF_ALU64;
+  int isX = BPF_SRC(insn->code) == BPF_X;
+  if (op > BPF_END) {
+    return fail(an, index, "invalid ALU op 0x%x", op);
+  }
+  if (insn->dst_reg == BPF_REG_10) {
+    return fail(an, index, "r10 is read-only");
+  }
+
+  int validOff = insn->off == 0;
+  if ((op == BPF_DIV || op == BPF_MOD) && insn->off == 1) {
+    // sdiv and smod.
+    validOff = 1;
+  } else if (op == BPF_MOV && isX &&
+             (insn->off == 8 || insn->off == 16 || (is64 && insn->off == 32))) {
+    // movsx.
+    validOff = 1;
+  }
+  if (!validOff) {
+    return fail(an, index, "invalid offset %d", insn->off);
+  }
+
+  if (op == BPF_END) {
+    if ((is64 && isX) ||
+        (insn->imm != 16 && insn->imm != 32 && insn->imm != 64)) {
+      return fail(an, index, "invalid byte swap");
+    }
+  } else if (op == BPF_NEG) {
+    if (isX) {
+      return fail(an, index, "invalid neg with a source register");
+    }
+  } else if (!isX) {
+    if ((op == BPF_DIV || op == BPF_MOD) && insn->imm == 0) {
+      return fail(an, index, "division by zero");
+    }
+    if ((op == BPF_LSH || op == BPF_RSH || op == BPF_ARSH) &&
+        (insn->imm < 0 || insn->imm >= (is64 ? 64 : 32))) {
+      return fail(an, index, "shift by %d is out of range", insn->imm);
+    }
+  }
+  return 0;
+}
+
+static int checkJump(struct analyzer *an, size_t index,
+                     const struct bpf_insn *insn) {
+  int op = BPF_OP(insn->code);
+  int is32 = BPF_CLASS(insn->code) == BPF_JMP32;
+  if (op > BPF_JSLE || ((op == BPF_CALL || op == BPF_EXIT) && is32)) {
+    return fail(an, index, "invalid jump op 0x%x", op);
+  }
+  if (op != BPF_CALL) {
+    return 0;
+  }
+  switch (insn->src_reg) {
+  case 0:
+    if (insn->imm <= BPF_FUNC_unspec) {
+      return fail(an, index, "invalid helper %d", insn->imm);
+    }
+    if (insn->imm >= __BPF_FUNC_MAX_ID) {
+      // The kernel may well be newer than the headers this was built with.
+      warn(an, index, "unknown helper %d", insn->imm);
+      return 0;
+    }
+    an->result->helperCalls[insn->imm]++;
+    return 0;
+  case BPF_PSEUDO_CALL:
+  case BPF_PSEUDO_KFUNC_CALL:
+    return 0;
+  default:
+    return fail(an, index, "invalid call source %d", insn->src_reg);
+  }
+}
+
+static int checkLoadImm64(struct analyzer *an, size_t index,
+                          const struct bpf_insn *insn) {
+  const struct bpf_insn *next = insn + 1;
+  if (index + 1 >= an->numInsns || next->code != 0 || next->dst_reg != 0 ||
+      next->src_reg != 0 || next->off != 0) {
+    return fail(an, index, "ld_imm64 without a second half");
+  }
+  if (insn->dst_reg == BPF_REG_10) {
+    return fail(an, index, "r10 is read-only");
+  }
+  if (insn->src_reg > BPF_PSEUDO_FUNC) {
+    return fail(an, index, "invalid ld_imm64 source %d", insn->src_reg);
+  }
+  return 0;
+}
+
+static int checkMemory(struct analyzer *an, size_t index,
+                       const struct bpf_insn *insn) {
+  int cls = BPF_CLASS(insn->code);
+  int mode = BPF_MODE(insn->code);
+  int size = BPF_SIZE(insn->code);
+  if (cls == BPF_LD) {
+    // The legacy packet loads, which read from the skb in r6 into r0.
+    if ((mode != BPF_ABS && mode != BPF_IND) || size == BPF_DW) {
+      return fail(an, index, "invalid load");
+    }
+    return 0;
+  }
+  if (cls == BPF_LDX) {
+    if (mode != BPF_MEM && (mode != BPF_MEMSX || size == BPF_DW)) {
+      return fail(an, index, "invalid load mode 0x%x", mode);
+    }
+    if (insn->dst_reg == BPF_REG_10) {
+      return fail(an, index, "r10 is read-only");
+    }
+    return 0;
+  }
+  if (mode == BPF_MEM) {
+    return 0;
+  }
+  if (cls == BPF_ST || mode != BPF_ATOMIC) {
+    return fail(an, index, "invalid store mode 0x%x", mode);
+  }
+
+  int op = insn->imm & ~BPF_FETCH;
+  if (size != BPF_W && size != BPF_DW) {
+    return fail(an, index, "invalid atomic size");
+  }
+  if (insn->imm != BPF_XCHG && insn->imm != BPF_CMPXCHG && op != BPF_ADD &&
+      op != BPF_AND && op != BPF_OR && op != BPF_XOR) {
+    return fail(an, index, "invalid atomic op 0x%x", insn->imm);
+  }
+  if ((insn->imm & BPF_FETCH) && insn->imm != BPF_CMPXCHG &&
+      insn->src_reg == BPF_REG_10) {
+    return fail(an, index, "r10 is read-only");
+  }
+  return 0;
+}
+
+/**
+ * Checks the encoding of every instruction, marks the second halves of
+ * ld_imm64 and counts the helper calls.
+ */
+static int checkInsns(struct analyzer *an) {
+  for (size_t i = 0; i < an->numInsns; i++) {
+    const struct bpf_insn *insn = &an->insns[i];
+    int rc;
+    if (insn->dst_reg > BPF_REG_10 || insn->src_reg > BPF_REG_10) {
+      return fail(an, i, "invalid register");
+    }
+    switch (BPF_CLASS(insn->code)) {
+    case BPF_ALU:
+    case BPF_ALU64:
+      rc = checkAlu(an, i, insn);
+      break;
+    case BPF_JMP:
+    case BPF_JMP32:
+      rc = checkJump(an, i, insn);
+      break;
+    case BPF_LD:
+      if (isLoadImm64(insn)) {
+        if ((rc = checkLoadImm64(an, i, insn)) == 0) {
+          an->flags[++i] |= INSN_SECOND_HALF;
+        }
+      } else {
+        rc = checkMemory(an, i, insn);
+      }
+      break;
+    default:
+      rc = checkMemory(an, i, insn);
+      break;
+    }
+    if (rc < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Marks the first instruction of every block and of every subprogram. */
+static int markLeaders(struct analyzer *an) {
+  an->flags[0] |= INSN_LEADER | INSN_ROOT;
+  for (size_t i = 0; i < an->numInsns; i++) {
+    const struct bpf_insn *insn = &an->insns[i];
+    if (an->flags[i] & INSN_SECOND_HALF) {
+      continue;
+    }
+    int rc = 0;
+    if (isJump(insn)) {
+      rc = markTarget(an, i, jumpTarget(insn, i), INSN_LEADER);
+    } else if (isCall(insn) && insn->src_reg == BPF_PSEUDO_CALL) {
+      rc = markTarget(an, i, (long long)i + 1 + insn->imm,
+                      INSN_LEADER | INSN_ROOT);
+    } else if (isLoadImm64(insn) && insn->src_reg == BPF_PSEUDO_FUNC) {
+      rc = markTarget(an, i, (long long)i + 1 + insn->imm,
+                      INSN_LEADER | INSN_ROOT);
+    }
+    if (rc < 0) {
+      return -1;
+    }
+    if ((isJump(insn) || isExit(insn)) && i + 1 < an->numInsns) {
+      an->flags[i + 1] |= INSN_LEADER;
+    }
+  }
+  return 0;
+}
+
+/** Returns the index of the last instruction executed in block. */
+static size_t lastInsn(const struct analyzer *an,
+                       const struct analysis_block *block) {
+  size_t last = block->end - 1;
+  return (an->flags[last] & INSN_SECOND_HALF) ? last - 1 : last;
+}
+
+static int buildBlocks(struct analyzer *an) {
+  struct analysis *result = an->result;
+  int numBlocks = 0;
+  for (size_t i = 0; i < an->numInsns; i++) {
+    numBlocks += (an->flags[i] & INSN_LEADER) != 0;
+  }
+  result->blocks = calloc(numBlocks, sizeof(struct analysis_block));
+  if (result->blocks == NULL) {
+    return fail(an, 0, "out of memory");
+  }
+
+  struct analysis_block *block = NULL;
+  for (size_t i = 0; i < an->numInsns; i++) {
+    if (an->flags[i] & INSN_LEADER) {
+      block = &result->blocks[result->numBlocks++];
+      block->start = i;
+    }
+    block->end = i + 1;
+    an->blockOf[i] = result->numBlocks - 1;
+    if (!(an->flags[i] & INSN_SECOND_HALF)) {
+      block->numInsns++;
+      block->numCalls += isCall(&an->insns[i]);
+    }
+  }
+
+  for (int b = 0; b < result->numBlocks; b++) {
+    block = &result->blocks[b];
+    size_t last = lastInsn(an, block);
+    const struct bpf_insn *insn = &an->insns[last];
+    int numSucc = 0;
+    block->succ[0] = block->succ[1] = -1;
+    if (isJump(insn)) {
+      block->succ[numSucc++] = an->blockOf[jumpTarget(insn, last)];
+    }
+    if (!isExit(insn) && !(isJump(insn) && BPF_OP(insn->code) == BPF_JA) &&
+        block->end < an->numInsns &&
+        (numSucc == 0 || an->blockOf[block->end] != block->succ[0])) {
+      block->succ[numSucc++] = an->blockOf[block->end];
+    }
+  }
+  return 0;
+}
+
+/**
+ * Walks the blocks depth first from each root, to find the blocks that
+ * cannot be reached, the ones that run off the end of the program, and
+ * loops, and to order the blocks reachable from the entry for findPaths().
+ */
+static int walkBlocks(struct analyzer *an) {
+  struct analysis *result = an->result;
+  int numBlocks = result->numBlocks;
+  // 0 for blocks not seen yet, 1 for those on the stack, and 2 for those
+  // whose successors have all been walked.
+  unsigned char *color = calloc(numBlocks, 1);
+  int *stack = malloc(numBlocks * sizeof(int));
+  int *nextSucc = malloc(numBlocks * sizeof(int));
+  int rc = -1;
+  if (color == NULL || stack == NULL || nextSucc == NULL) {
+    fail(an, 0, "out of memory");
+    goto out;
+  }
+
+  for (int root = 0; root < numBlocks; root++) {
+    if (!(an->flags[result->blocks[root].start] & INSN_ROOT) ||
+        color[root] != 0) {
+      continue;
+    }
+    int depth = 0;
+    stack[depth++] = root;
+    color[root] = 1;
+    nextSucc[root] = 0;
+    while (depth > 0) {
+      int b = stack[depth - 1];
+      const struct analysis_block *block = &result->blocks[b];
+      if (nextSucc[b] == 0) {
+        size_t last = lastInsn(an, block);
+        const struct bpf_insn *insn = &an->insns[last];
+        if (block->end == an->numInsns && !isExit(insn) &&
+            !(isJump(insn) && BPF_OP(insn->code) == BPF_JA)) {
+          fail(an, last, "control runs off the end of the program");
+          goto out;
+        }
+      }
+      if (nextSucc[b] < 2 && block->succ[nextSucc[b]] != -1) {
+        int succ = block->succ[nextSucc[b]++];
+        if (color[succ] == 0) {
+          color[succ] = 1;
+          nextSucc[succ] = 0;
+          stack[depth++] = succ;
+        } else if (color[succ] == 1 && !result->hasLoop) {
+          result->hasLoop = 1;
+          result->loopInsn = lastInsn(an, block);
+        }
+        continue;
+      }
+      color[b] = 2;
+      depth--;
+      if (root == 0) {
+        an->postorder[an->numPostorder++] = b;
+      }
+    }
+  }
+
+  for (int b = 0; b < numBlocks; b++) {
+    if (color[b] == 0) {
+      fail(an, result->blocks[b].start, "unreachable instruction");
+      goto out;
+    }
+  }
+  rc = 0;
+
+out:
+  free(color);
+  free(stack);
+  free(nextSucc);
+  return rc;
+}
+
+static int readReg(struct analyzer *an, size_t index, const struct state *s,
+                   int reg) {
+  if (s->regs[reg].kind == REG_UNINIT) {
+    return fail(an, index, "r%d is read before it is written", reg);
+  }
+  return 0;
+}
+
+/**
+ * Checks an access of size bytes at off from reg, if reg points into the
+ * stack, and records how deep it goes. A size of 0 stands for a pointer that
+ * may be handed to a helper, whose extent is not known.
+ */
+static int accessStack(struct analyzer *an, size_t index, const struct reg *reg,
+                       int off, int size) {
+  if (reg->kind != REG_STACK || (size == 0 && reg->minOff + off >= 0)) {
+    return 0;
+  }
+  long long start = (long long)reg->minOff + off;
+  long long highest = (long long)reg->maxOff + off;
+  if (size > 0 && highest + size > 0) {
+    return fail(an, index, "stack access at r10%+lld is above the frame",
+                highest);
+  }
+  if (-start > ANALYZE_MAX_STACK) {
+    return fail(an, index, "stack access at r10%+lld is beyond the %d-byte "
+                           "stack", start, ANALYZE_MAX_STACK);
+  }
+  if (-start > an->result->stackDepth) {
+    an->result->stackDepth = -start;
+  }
+  return 0;
+}
+
+static int stepAlu(struct analyzer *an, size_t index,
+                   const struct bpf_insn *insn, struct state *s) {
+  int op = BPF_OP(insn->code);
+  int is64 = BPF_CLASS(insn->code) == BPF_ALU64;
+  int isX = BPF_SRC(insn->code) == BPF_X;
+  struct reg *dst = &s->regs[insn->dst_reg];
+  if ((isX && op != BPF_END && readReg(an, index, s, insn->src_reg) < 0) ||
+      (op != BPF_MOV && readReg(an, index, s, insn->dst_reg) < 0)) {
+    return -1;
+  }
+
+  if (op == BPF_MOV && is64 && isX && insn->off == 0) {
+    *dst = s->regs[insn->src_reg];
+  } else if ((op == BPF_ADD || op == BPF_SUB) && is64 && !isX &&
+             dst->kind == REG_STACK) {
+    long long delta = op == BPF_ADD ? insn->imm : -(long long)insn->imm;
+    long long minOff = dst->minOff + delta, maxOff = dst->maxOff + delta;
+    dst->minOff = minOff;
+    dst->maxOff = maxOff;
+    if (minOff < -MAX_TRACKED_OFFSET || maxOff > MAX_TRACKED_OFFSET) {
+      dst->kind = REG_VALUE;
+    }
+  } else {
+    dst->kind = REG_VALUE;
+  }
+  return 0;
+}
+
+static int stepJump(struct analyzer *an, size_t index,
+                    const struct bpf_insn *insn, struct state *s) {
+  if (isExit(insn)) {
+    return readReg(an, index, s, BPF_REG_0);
+  }
+  if (isCall(insn)) {
+    // Which arguments a helper takes is not known, so only stack pointers
+    // are checked, as far as where they point.
+    for (int reg = BPF_REG_1; reg <= BPF_REG_5; reg++) {
+      if (accessStack(an, index, &s->regs[reg], 0, 0) < 0) {
+        return -1;
+      }
+      s->regs[reg].kind = REG_UNINIT;
+    }
+    s->regs[BPF_REG_0].kind = REG_VALUE;
+    return 0;
+  }
+  if (BPF_OP(insn->code) == BPF_JA) {
+    return 0;
+  }
+  if (readReg(an, index, s, insn->dst_reg) < 0 ||
+      (BPF_SRC(insn->code) == BPF_X &&
+       readReg(an, index, s, insn->src_reg) < 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+static int stepMemory(struct analyzer *an, size_t index,
+                      const struct bpf_insn *insn, struct state *s) {
+  int cls = BPF_CLASS(insn->code);
+  int size = accessSize(BPF_SIZE(insn->code));
+  if (cls == BPF_LD) {
+    if (isLoadImm64(insn)) {
+      s->regs[insn->dst_reg].kind = REG_VALUE;
+      return 0;
+    }
+    if (readReg(an, index, s, BPF_REG_6) < 0 ||
+        (BPF_MODE(insn->code) == BPF_IND &&
+         readReg(an, index, s, insn->src_reg) < 0)) {
+      return -1;
+    }
+    // Like a helper call, these clobber r1 to r5.
+    for (int reg = BPF_REG_1; reg <= BPF_REG_5; reg++) {
+      s->regs[reg].kind = REG_UNINIT;
+    }
+    s->regs[BPF_REG_0].kind = REG_VALUE;
+    return 0;
+  }
+  if (cls == BPF_LDX) {
+    if (readReg(an, index, s, insn->src_reg) < 0 ||
+        accessStack(an, index, &s->regs[insn->src_reg], insn->off, size) <
+            0) {
+      return -1;
+    }
+    s->regs[insn->dst_reg].kind = REG_VALUE;
+    return 0;
+  }
+  if (readReg(an, index, s, insn->dst_reg) < 0 ||
+      (cls == BPF_STX && readReg(an, index, s, insn->src_reg) < 0) ||
+      accessStack(an, index, &s->regs[insn->dst_reg], insn->off, size) < 0) {
+    return -1;
+  }
+  if (BPF_MODE(insn->code) == BPF_ATOMIC) {
+    if (insn->imm == BPF_CMPXCHG) {
+      if (readReg(an, index, s, BPF_REG_0) < 0) {
+        return -1;
+      }
+      s->regs[BPF_REG_0].kind = REG_VALUE;
+    } else if (insn->imm & BPF_FETCH) {
+      s->regs[insn->src_reg].kind = REG_VALUE;
+    }
+  }
+  return 0;
+}
+
+/** Runs the instructions of block b from state s. */
+static int stepBlock(struct analyzer *an, int b, struct state *s) {
+  const struct analysis_block *block = &an->result->blocks[b];
+  for (size_t i = block->start; i < block->end; i++) {
+    const struct bpf_insn *insn = &an->insns[i];
+    int rc;
+    if (an->flags[i] & INSN_SECOND_HALF) {
+      continue;
+    }
+    switch (BPF_CLASS(insn->code)) {
+    case BPF_ALU:
+    case BPF_ALU64:
+      rc = stepAlu(an, i, insn, s);
+      break;
+    case BPF_JMP:
+    case BPF_JMP32:
+      rc = stepJump(an, i, insn, s);
+      break;
+    default:
+      rc = stepMemory(an, i, insn, s);
+      break;
+    }
+    if (rc < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Merges from, the state at the end of one path into a block, into the
+ * block's state into. Returns nonzero if into changed.
+ */
+static int joinState(struct state *into, const struct state *from) {
+  int changed = 0;
+  for (int reg = 0; reg < NUM_REGS; reg++) {
+    struct reg *a = &into->regs[reg];
+    const struct reg *b = &from->regs[reg];
+    if (a->kind == REG_UNINIT) {
+      continue;
+    }
+    if (b->kind == REG_UNINIT) {
+      a->kind = REG_UNINIT;
+      changed = 1;
+    } else if (a->kind != REG_STACK ||
+               (b->kind == REG_STACK && b->minOff >= a->minOff &&
+                b->maxOff <= a->maxOff)) {
+      continue;
+    } else if (b->kind != REG_STACK || a->widenings >= MAX_WIDENINGS) {
+      a->kind = REG_VALUE;
+      changed = 1;
+    } else {
+      a->minOff = b->minOff < a->minOff ? b->minOff : a->minOff;
+      a->maxOff = b->maxOff > a->maxOff ? b->maxOff : a->maxOff;
+      a->widenings++;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+/**
+ * Propagates what is known about the registers through the blocks until
+ * nothing changes, checking each instruction against it.
+ */
+static int trackRegisters(struct analyzer *an) {
+  struct analysis *result = an->result;
+  int numBlocks = result->numBlocks;
+  // A ring of the blocks whose state changed, each in it at most once.
+  int *queue = malloc(numBlocks * sizeof(int));
+  unsigned char *queued = calloc(numBlocks, 1);
+  int head = 0, numQueued = 0, rc = -1;
+  if (queue == NULL || queued == NULL) {
+    fail(an, 0, "out of memory");
+    goto out;
+  }
+
+  for (int b = 0; b < numBlocks; b++) {
+    if (!(an->flags[result->blocks[b].start] & INSN_ROOT)) {
+      continue;
+    }
+    // The program gets ctx in r1, and subprograms up to five arguments.
+    struct state *s = &an->states[b];
+    memset(s, 0, sizeof(*s));
+    for (int reg = 0; reg < NUM_REGS; reg++) {
+      s->regs[reg].kind =
+          reg == BPF_REG_1 || (b != 0 && reg <= BPF_REG_5 && reg != BPF_REG_0)
+              ? REG_VALUE
+              : REG_UNINIT;
+    }
+    s->regs[BPF_REG_10].kind = REG_STACK;
+    an->hasState[b] = 1;
+    queue[(head + numQueued++) % numBlocks] = b;
+    queued[b] = 1;
+  }
+
+  while (numQueued > 0) {
+    int b = queue[head];
+    head = (head + 1) % numBlocks;
+    numQueued--;
+    queued[b] = 0;
+
+    struct state s = an->states[b];
+    if (stepBlock(an, b, &s) < 0) {
+      goto out;
+    }
+    for (int i = 0; i < 2; i++) {
+      int succ = result->blocks[b].succ[i];
+      if (succ == -1) {
+        continue;
+      }
+      int changed = 1;
+      if (an->hasState[succ]) {
+        changed = joinState(&an->states[succ], &s);
+      } else {
+        an->states[succ] = s;
+        an->hasState[succ] = 1;
+      }
+      if (changed && !queued[succ]) {
+        queue[(head + numQueued++) % numBlocks] = succ;
+        queued[succ] = 1;
+      }
+    }
+  }
+  rc = 0;
+
+out:
+  free(queue);
+  free(queued);
+  return rc;
+}
+
+static unsigned long long addSaturating(unsigned long long a,
+                                        unsigned long long b) {
+  return a > ULLONG_MAX - b ? ULLONG_MAX : a + b;
+}
+
+/**
+ * Counts the paths from the entry to an exit and measures the shortest and
+ * longest, which is only possible without loops.
+ */
+static int findPaths(struct analyzer *an) {
+  struct analysis *result = an->result;
+  int numBlocks = result->numBlocks;
+  unsigned long long *numPaths = malloc(numBlocks * sizeof(*numPaths));
+  unsigned long long *minInsns = malloc(numBlocks * sizeof(*minInsns));
+  unsigned long long *maxInsns = malloc(numBlocks * sizeof(*maxInsns));
+  unsigned long long *maxCalls = malloc(numBlocks * sizeof(*maxCalls));
+  // The successor on the longest path from each block, or -1.
+  int *next = malloc(numBlocks * sizeof(int));
+  int rc = -1;
+  if (numPaths == NULL || minInsns == NULL || maxInsns == NULL ||
+      maxCalls == NULL || next == NULL) {
+    fail(an, 0, "out of memory");
+    goto out;
+  }
+
+  // Successors come first in postorder, so each block can be finished from
+  // theirs.
+  for (int i = 0; i < an->numPostorder; i++) {
+    int b = an->postorder[i];
+    const struct analysis_block *block = &result->blocks[b];
+    numPaths[b] = 0;
+    minInsns[b] = ULLONG_MAX;
+    maxInsns[b] = maxCalls[b] = 0;
+    next[b] = -1;
+    for (int j = 0; j < 2; j++) {
+      int succ = block->succ[j];
+      if (succ == -1) {
+        continue;
+      }
+      numPaths[b] = addSaturating(numPaths[b], numPaths[succ]);
+      if (minInsns[succ] < minInsns[b]) {
+        minInsns[b] = minInsns[succ];
+      }
+      if (next[b] == -1 || maxInsns[succ] > maxInsns[b] ||
+          (maxInsns[succ] == maxInsns[b] && maxCalls[succ] > maxCalls[b])) {
+        maxInsns[b] = maxInsns[succ];
+        maxCalls[b] = maxCalls[succ];
+        next[b] = succ;
+      }
+    }
+    if (next[b] == -1) {
+      // An exit.
+      numPaths[b] = 1;
+      minInsns[b] = 0;
+    }
+    minInsns[b] += block->numInsns;
+    maxInsns[b] += block->numInsns;
+    maxCalls[b] += block->numCalls;
+  }
+
+  result->numPaths = numPaths[0];
+  result->minPathInsns = minInsns[0];
+  result->maxPathInsns = maxInsns[0];
+  result->maxPathCalls = maxCalls[0];
+  result->worstPath = malloc(numBlocks * sizeof(int));
+  if (result->worstPath == NULL) {
+    fail(an, 0, "out of memory");
+    goto out;
+  }
+  for (int b = 0; b != -1; b = next[b]) {
+    result->worstPath[result->worstPathLen++] = b;
+  }
+  rc = 0;
+
+out:
+  free(numPaths);
+  free(minInsns);
+  free(maxInsns);
+  free(maxCalls);
+  free(next);
+  return rc;
+}
+
+int analyze_program(const struct bpf_insn *insns, size_t numInsns,
+                    struct analysis *result) {
+  memset(result, 0, sizeof(*result));
+  struct analyzer an = {.insns = insns, .numInsns = numInsns,
+                        .result = result};
+  if (numInsns == 0 || numInsns > ANALYZE_MAX_INSNS) {
+    return fail(&an, 0, "%zu instructions is not between 1 and %d",
+                numInsns, ANALYZE_MAX_INSNS);
+  }
+
+  int rc = -1;
+  an.flags = calloc(numInsns, 1);
+  an.blockOf = malloc(numInsns * sizeof(int));
+  if (an.flags == NULL || an.blockOf == NULL) {
+    fail(&an, 0, "out of memory");
+    goto out;
+  }
+  if (checkInsns(&an) < 0 || markLeaders(&an) < 0 || buildBlocks(&an) < 0) {
+    goto out;
+  }
+
+  an.states = malloc(result->numBlocks * sizeof(struct state));
+  an.hasState = calloc(result->numBlocks, 1);
+  an.postorder = malloc(result->numBlocks * sizeof(int));
+  if (an.states == NULL || an.hasState == NULL || an.postorder == NULL) {
+    fail(&an, 0, "out of memory");
+    goto out;
+  }
+  if (walkBlocks(&an) < 0 || trackRegisters(&an) < 0 ||
+      (!result->hasLoop && findPaths(&an) < 0)) {
+    goto out;
+  }
+  rc = 0;
+
+out:
+  free(an.flags);
+  free(an.blockOf);
+  free(an.states);
+  free(an.hasState);
+  free(an.postorder);
+  return rc;
+}
+
+void analyze_free(struct analysis *result) {
+  free(result->blocks);
+  free(result->worstPath);
+  result->blocks = NULL;
+  result->worstPath = NULL;
+}
+
+/**
+ * Prints item after the others on the current line, which has reached
+ * *column, or on a new line if it would not fit in 80 columns.
+ */
+static void printWrapped(FILE *out, int *column, const char *item) {
+  int len = strlen(item);
+  if (*column + len >= 80) {
+    fputs("\n   ", out);
+    *column = 3;
+  }
+  fputs(item, out);
+  *column += len;
+}
+
+void analyze_print(FILE *out, const char *name, const struct bpf_insn *insns,
+                   size_t numInsns, const struct analysis *result) {
+  if (result->error[0] != '\0') {
+    fprintf(out, "%s: %s\n", name, result->error);
+    if (result->errorInsn < numInsns) {
+      char line[DISASM_MAX_LINE];
+      disasm_insn(&insns[result->errorInsn], numInsns - result->errorInsn,
+                  result->errorInsn, NULL, line, sizeof(line));
+      fprintf(out, "%7zu: %s\n", result->errorInsn, line);
+    }
+    return;
+  }
+
+  char item[64];
+  int column;
+  fprintf(out, "%s: %zu instructions in %d blocks, %d bytes of stack\n", name,
+          numInsns, result->numBlocks, result->stackDepth);
+  if (result->hasLoop) {
+    fprintf(out, "  paths: unbounded, as insn %zu can loop\n",
+            result->loopInsn);
+  } else {
+    fprintf(out, "  paths: %llu%s, of %llu to %llu instructions\n",
+            result->numPaths, result->numPaths == ULLONG_MAX ? " or more" : "",
+            result->minPathInsns, result->maxPathInsns);
+    column = fprintf(out, "  longest path, with %llu calls:",
+                     result->maxPathCalls);
+    for (int i = 0; i < result->worstPathLen; i++) {
+      const struct analysis_block *block =
+          &result->blocks[result->worstPath[i]];
+      snprintf(item, sizeof(item), " %zu-%zu", block->start, block->end - 1);
+      printWrapped(out, &column, item);
+    }
+    fputc('\n', out);
+  }
+
+  column = fprintf(out, "  helpers:");
+  int numHelpers = 0;
+  for (int func = 0; func < __BPF_FUNC_MAX_ID; func++) {
+    if (result->helperCalls[func] != 0) {
+      if (numHelpers++ > 0) {
+        fputc(',', out);
+        column++;
+      }
+      snprintf(item, sizeof(item), " %s x%u", disasm_helper_name(func),
+               result->helperCalls[func]);
+      printWrapped(out, &column, item);
+    }
+  }
+  fprintf(out, "%s\n", numHelpers == 0 ? " none" : "");
+  analyze_print_warnings(out, name, result);
+}
+
+void analyze_print_warnings(FILE *out, const char *name,
+                            const struct analysis *result) {
+  if (result->numWarnings == 0) {
+    return;
+  }
+  fprintf(out, "%s: warning: %s", name, result->warning);
+  if (result->numWarnings > 1) {
+    fprintf(out, " (and %d more)", result->numWarnings - 1);
+  }
+  fputc('\n', out);
+}
@@ -0,0 +1,115 @@
+/**
+ * A static analyser for BPF programs, run on the instructions before they are
+ * loaded. It catches the mistakes the verifier would reject most often
+ * without a round trip to the kernel, and measures what a program costs so
+ * that the hot path can be judged from the bytecode alone.
+ *
+ * It builds the control-flow graph and checks the following:
+ * - every opcode and register is valid
+ * - every jump lands on an instruction in the program
+ * - both halves of each ld_imm64 are present and nothing jumps between them
+ * - no instruction is unreachable
+ * - control never runs off the end
+ * - no register is read before it is written
+ * - r10 is never written
+ * - stack accesses through r10 stay within the 512-byte frame
+ * Calls to helpers that the headers it was built with do not know are only
+ * warned about, as the kernel that loads the program may be newer.
+ * Then it reports the following:
+ * - the deepest stack access, including memory handed to helpers
+ * - the helpers called
+ * - the number of paths from entry to exit
+ * - the fewest and most instructions executed along one of them
+ *
+ * It is no substitute for the verifier. It does not track types or bounds,
+ * so pointers that are not derived from r10 are not checked at all. It also
+ * analyses BPF-to-BPF subprograms only as far as their own instructions go:
+ * a call counts as one instruction on the caller's paths.
+ */
+#pragma once
+
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// The most stack a program may use below r10.
+#define ANALYZE_MAX_STACK 512
+// BPF_COMPLEXITY_LIMIT_INSNS, the most instructions the kernel accepts.
+#define ANALYZE_MAX_INSNS 1000000
+
+/** A run of instructions that control only enters at the first. */
+struct analysis_block {
+  size_t start;
+  // One past the last instruction.
+  size_t end;
+  // Instructions executed, where an ld_imm64 counts as one, and calls made
+  // by them.
+  int numInsns;
+  int numCalls;
+  // The blocks control can continue in, or -1.
+  int succ[2];
+};
+
+struct analysis {
+  // In order of their first instruction.
+  struct analysis_block *blocks;
+  int numBlocks;
+
+  // Bytes below r10 used by the deepest access to the stack.
+  int stackDepth;
+  // Call sites of each helper, indexed by enum bpf_func_id.
+  unsigned int helperCalls[__BPF_FUNC_MAX_ID];
+
+  // If nonzero, the jump at loopInsn can lead back to itself, and the path
+  // statistics below are not computed.
+  int hasLoop;
+  size_t loopInsn;
+
+  // Paths from the first instruction to an exit (saturating at ULLONG_MAX),
+  // the fewest and most instructions executed along one, and the calls made
+  // along the longest.
+  unsigned long long numPaths;
+  unsigned long long minPathInsns;
+  unsigned long long maxPathInsns;
+  unsigned long long maxPathCalls;
+  // The blocks of the longest path, in order.
+  int *worstPath;
+  int worstPathLen;
+
+  // Why analyze_program() failed, and the instruction at fault.
+  char error[128];
+  size_t errorInsn;
+
+  // The first problem found that is left to the kernel to judge, described
+  // like error, and how many there were in all.
+  char warning[128];
+  int numWarnings;
+};
+
+/**
+ * Analyses numInsns instructions into *result, which must later be released
+ * with analyze_free() whether or not this succeeds.
+ *
+ * Returns 0, or -1 with result->error describing the first problem found,
+ * in which case only the statistics gathered until then are filled in.
+ */
+int analyze_program(const struct bpf_insn *insns, size_t numInsns,
+                    struct analysis *result);
+
+void analyze_free(struct analysis *result);
+
+/**
+ * Prints the report for the program called name to out. If
+ * analyze_program() failed, this is the error and the disassembled
+ * instruction at fault instead.
+ */
+void analyze_print(FILE *out, const char *name, const struct bpf_insn *insns,
+                   size_t numInsns, const struct analysis *result);
+
+/**
+ * Prints the warnings in result for the program called name to out, which
+ * analyze_print() does after a successful report. Prints nothing if there
+ * are none.
+ */
+void analyze_print_warnings(FILE *out, const char *name,
+                            const struct analysis *result);
@@ -0,0 +1,109 @@
+/*
+ * Benchmark of what tracing costs each open(), for comparing the --attach
+ * modes. Recommended usage:
+ *
+ * clang -O3 attach_benchmark.c -o attach_benchmark
+ * sudo ./attach_benchmark ./opensnoop [NUM_OPENS]
+ *
+ * This times NUM_OPENS openat() and close() calls with nothing attached,
+ * then again while ./opensnoop runs with each --attach mode (writing to
+ * /dev/null), and prints the time per open and the overhead of each mode.
+ * Half of the opens fail, so that the error path is measured too. Any
+ * further arguments after NUM_OPENS are passed to ./opensnoop, e.g. -x.
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long to give opensnoop to load and attach its programs.
+#define STARTUP_DELAY_US 2000000
+
+static const char *modes[] = {"kprobe", "tracepoint", "fentry"};
+
+static double nowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/** Returns the average time of an open in nanoseconds. */
+static double timeOpens(int numOpens) {
+  double start = nowSeconds();
+  for (int i = 0; i < numOpens; i++) {
+    int fd = openat(AT_FDCWD, i % 2 == 0 ? "/dev/null" : "/nonexistent",
+                    O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return (nowSeconds() - start) * 1e9 / numOpens;
+}
+
+/**
+ * Starts opensnoop with --attach mode and extraArgs, with its output
+ * discarded. Returns its pid, or -1 on error.
+ */
+static pid_t startOpensnoop(const char *opensnoop, const char *mode,
+                            char **extraArgs, int numExtraArgs) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  int devNull = open("/dev/null", O_WRONLY);
+  dup2(devNull, STDOUT_FILENO);
+  dup2(devNull, STDERR_FILENO);
+  char **argv = calloc(numExtraArgs + 4, sizeof(char *));
+  argv[0] = (char *)opensnoop;
+  argv[1] = "--attach";
+  argv[2] = (char *)mode;
+  memcpy(argv + 3, extraArgs, numExtraArgs * sizeof(char *));
+  execv(opensnoop, argv);
+  _exit(127);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s OPENSNOOP [NUM_OPENS [OPENSNOOP_ARGS...]]\n",
+            argv[0]);
+    return 1;
+  }
+  const char *opensnoop = argv[1];
+  int numOpens = argc > 2 ? atoi(argv[2]) : 1000000;
+  char **extraArgs = argv + (argc > 2 ? 3 : 2);
+  int numExtraArgs = argc - (argc > 2 ? 3 : 2);
+
+  // Warm up the dentry cache and the CPU frequency.
+  timeOpens(numOpens / 10 + 1);
+  double baseline = timeOpens(numOpens);
+  printf("%-12s %8.1f ns/open\n", "none", baseline);
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    pid_t pid = startOpensnoop(opensnoop, modes[i], extraArgs, numExtraArgs);
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    usleep(STARTUP_DELAY_US);
+
+    // opensnoop exits if it fails to attach, e.g. without root or, for
+    // fentry, without BTF.
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != 0) {
+      printf("%-12s unavailable\n", modes[i]);
+      continue;
+    }
+
+    double traced = timeOpens(numOpens);
+    kill(pid, SIGINT);
+    waitpid(pid, &status, 0);
+    printf("%-12s %8.1f ns/open (%+.1f ns)\n", modes[i], traced,
+           traced - baseline);
+  }
+  return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * A small assembler for the BPF programs in programs.c, so that every
+ * program opensnoop loads is put together at run time by plain C rather than
+ * compiled by bcc and LLVM at build time.
+ *
+ * Instructions are spelled with the BPF_*() macros from <bcc/libbpf.h> and
+ * appended with emit(). Jumps name a struct label instead of an offset: a
+ * jump to a label that is already bound gets its offset straight away, and
+ * one to a label further on is patched when bindLabel() reaches it. Nothing
+ * is written past capacity; the program is marked as overflowed instead,
+ * and programLength() reports the failure.
+ *
+ * A memory offset that is not known yet when the program is assembled can be
+ * left as a relocation with emitReloc() and filled in later by
+ * patchProgram(), so that a program that only differs in such offsets is
+ * assembled once.
+ *
+ * Everything here is static inline, so there is nothing to link.
+ */
+#pragma once
+
+#include <bcc/libbpf.h>
+#include <errno.h>
+
+// Number of jumps that can be waiting for a label to be bound.
+#define MAX_LABEL_REFS 32
+
+// Number of relocations a program can have.
+#define MAX_RELOCS 8
+
+/** An instruction whose offset field is filled in by patchProgram(). */
+struct reloc {
+  int insn;
+  // Index of the value in the array passed to patchProgram().
+  int slot;
+};
+
+struct relocs {
+  struct reloc entries[MAX_RELOCS];
+  int num;
+};
+
+struct program {
+  struct bpf_insn *insns;
+  int len;
+  // Size of insns.
+  int capacity;
+  // Set once an instruction, a jump to a label or a relocation did not fit.
+  int overflowed;
+  // Where emitReloc() records relocations, or NULL if there are none.
+  struct relocs *relocs;
+};
+
+/** A jump target, which is zeroed (unbound) when it is declared. */
+struct label {
+  // Jumps emitted before the label was bound.
+  int refs[MAX_LABEL_REFS];
+  int numRefs;
+  // 1 + the index of the instruction the label is bound to, or 0.
+  int boundAt;
+};
+
+static inline void emit(struct program *prog, struct bpf_insn insn) {
+  if (prog->len >= prog->capacity) {
+    prog->overflowed = 1;
+    return;
+  }
+  prog->insns[prog->len++] = insn;
+}
+
+static inline void emitCall(struct program *prog, int func) {
+  emit(prog, BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func));
+}
+
+static inline void emitLoadMapFd(struct program *prog, int reg, int fd) {
+  struct bpf_insn insns[] = {BPF_LD_MAP_FD(reg, fd)};
+  emit(prog, insns[0]);
+  emit(prog, insns[1]);
+}
+
+static inline void emitLoadImm64(struct program *prog, int reg,
+                                 unsigned long long imm) {
+  struct bpf_insn insns[] = {BPF_LD_IMM64(reg, imm)};
+  emit(prog, insns[0]);
+  emit(prog, insns[1]);
+}
+
+/**
+ * Emits insn with its offset left to be filled in with the value in slot by
+ * patchProgram().
+ */
+static inline void emitReloc(struct program *prog, struct bpf_insn insn,
+                             int slot) {
+  struct relocs *relocs = prog->relocs;
+  if (relocs == NULL || relocs->num >= MAX_RELOCS) {
+    prog->overflowed = 1;
+    return;
+  }
+  relocs->entries[relocs->num++] =
+      (struct reloc){.insn = prog->len, .slot = slot};
+  emit(prog, insn);
+}
+
+/** Emits reg = r10 + offset, the address of a stack slot. */
+static inline void emitStackAddr(struct program *prog, int reg, int offset) {
+  emit(prog, BPF_MOV64_REG(reg, BPF_REG_10));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, reg, offset));
+}
+
+/** jump must be a BPF_JMP instruction whose offset will be overwritten. */
+static inline void emitJump(struct program *prog, struct label *target,
+                            struct bpf_insn jump) {
+  if (target->boundAt != 0) {
+    jump.off = target->boundAt - 1 - prog->len - 1;
+  } else if (target->numRefs < MAX_LABEL_REFS) {
+    target->refs[target->numRefs++] = prog->len;
+  } else {
+    prog->overflowed = 1;
+  }
+  emit(prog, jump);
+}
+
+/**
+ * Makes every jump to target, both those already emitted and those still to
+ * come, land on the next instruction emitted.
+ */
+static inline void bindLabel(struct program *prog, struct label *target) {
+  for (int i = 0; i < target->numRefs; i++) {
+    int index = target->refs[i];
+    if (index < prog->len) {
+      prog->insns[index].off = prog->len - index - 1;
+    }
+  }
+  target->numRefs = 0;
+  target->boundAt = prog->len + 1;
+}
+
+/**
+ * Returns the number of instructions emitted, or -1 with errno set to E2BIG
+ * if they did not all fit.
+ */
+static inline int programLength(const struct program *prog) {
+  if (prog->overflowed) {
+    errno = E2BIG;
+    return -1;
+  }
+  return prog->len;
+}
+
+/** Fills in every relocation of insns with its value from values[]. */
+static inline void patchProgram(struct bpf_insn *insns,
+                                const struct relocs *relocs,
+                                const long long values[]) {
+  for (int i = 0; i < relocs->num; i++) {
+    const struct reloc *reloc = &relocs->entries[i];
+    insns[reloc->insn].off = values[reloc->slot];
+  }
+}
@@ -0,0 +1,610 @@
+/*
+ * Disassembles BPF programs with disasm.c. Recommended usage:
+ *
+ * clang -O3 bpf_disasm.c analyzer.c disasm.c optimizer.c programs.c \
+ *     -o bpf_disasm
+ * ./bpf_disasm ../target/bpf/hello.o [SECTION]
+ * ./bpf_disasm prog.bin
+ * sudo ./bpf_disasm --pinned /sys/fs/bpf/PROG
+ * ./bpf_disasm --opensnoop
+ *
+ * A file is read as an ELF object if it is one, in which case every
+ * executable section (or only SECTION) is disassembled with its function
+ * names and the symbols that its relocations refer to. Any other file, or
+ * - for stdin, is read as an array of struct bpf_insn, such as the output
+ * of bpftool prog dump xlated file or of bcc's BPF.dump_func(). --pinned
+ * reads back the instructions of a program pinned in bpffs, as the verifier
+ * rewrote them, and --opensnoop shows the programs that opensnoop assembles
+ * for its default configuration, with placeholder map fds, after the
+ * optimiser has been over them as it is in opensnoop.
+ *
+ * -b prints the bytes of each instruction, and -c prints the instructions
+ * as a C array of struct bpf_insn instead. -a follows each program with the
+ * report of analyzer.c, and exits with 1 if it finds a program is bad. For
+ * --opensnoop, it also says how many instructions the optimiser removed.
+ */
+#include "analyzer.h"
+#include "disasm.h"
+#include "optimizer.h"
+#include "programs.h"
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Large enough that a multi-megabyte dump is written in few syscalls.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+static int opt_a = 0;
+static int opt_c = 0;
+// Set if -a found something wrong with a program.
+static int analysisFailed = 0;
+
+/** Per-instruction labels and comments, for disasm_options. */
+struct annotations {
+  const char **labels;
+  const char **comments;
+};
+
+static const char *labelAt(void *cookie, size_t index) {
+  return ((struct annotations *)cookie)->labels[index];
+}
+
+static const char *commentAt(void *cookie, size_t index) {
+  return ((struct annotations *)cookie)->comments[index];
+}
+
+static int allocAnnotations(struct annotations *annotations,
+                            size_t numInsns) {
+  annotations->labels = calloc(numInsns + 1, sizeof(const char *));
+  annotations->comments = calloc(numInsns + 1, sizeof(const char *));
+  if (annotations->labels == NULL || annotations->comments == NULL) {
+    free(annotations->labels);
+    free(annotations->comments);
+    return -1;
+  }
+  return 0;
+}
+
+static void freeAnnotations(struct annotations *annotations) {
+  free(annotations->labels);
+  free(annotations->comments);
+}
+
+/** Prints the instructions as a C array, with their disassembly. */
+static int printC(const struct bpf_insn *insns, size_t numInsns,
+                  const struct disasm_options *options) {
+  printf("struct bpf_insn prog[] = {\n");
+  for (size_t i = 0; i < numInsns; i++) {
+    char text[DISASM_MAX_LINE];
+    // The second half of an ld_imm64 is printed without a comment.
+    int consumed = disasm_insn(&insns[i], numInsns - i, i, options, text,
+                               sizeof(text));
+    for (int j = 0; j < consumed; j++) {
+      const struct bpf_insn *insn = &insns[i + j];
+      printf("    {.code = 0x%02x, .dst_reg = %d, .src_reg = %d, .off = %d, "
+             ".imm = %d},",
+             insn->code, insn->dst_reg, insn->src_reg, insn->off, insn->imm);
+      printf(j == 0 ? " // %zu: %s\n" : "\n", i, text);
+    }
+    i += consumed - 1;
+  }
+  printf("};\n");
+  return ferror(stdout) ? -1 : 0;
+}
+
+/** Prints the program called name, followed by its analysis with -a. */
+static int print(const char *name, const struct bpf_insn *insns,
+                 size_t numInsns, const struct disasm_options *options) {
+  int rc = opt_c ? printC(insns, numInsns, options)
+                 : disasm_print(stdout, insns, numInsns, options);
+  if (rc < 0 || !opt_a) {
+    return rc;
+  }
+  struct analysis analysis;
+  if (analyze_program(insns, numInsns, &analysis) < 0) {
+    analysisFailed = 1;
+  }
+  printf("\n");
+  analyze_print(stdout, name, insns, numInsns, &analysis);
+  analyze_free(&analysis);
+  return ferror(stdout) ? -1 : 0;
+}
+
+struct elf_file {
+  const unsigned char *data;
+  size_t size;
+  const Elf64_Shdr *sections;
+  int numSections;
+  const char *sectionNames;
+  const Elf64_Sym *symbols;
+  size_t numSymbols;
+  const char *symbolNames;
+  size_t symbolNamesSize;
+};
+
+static const void *sectionData(const struct elf_file *elf, int index) {
+  if (index <= 0 || index >= elf->numSections) {
+    return NULL;
+  }
+  const Elf64_Shdr *section = &elf->sections[index];
+  if (section->sh_type == SHT_NOBITS || section->sh_offset > elf->size ||
+      section->sh_size > elf->size - section->sh_offset) {
+    return NULL;
+  }
+  return elf->data + section->sh_offset;
+}
+
+/** Returns the name of a symbol, or of its section if it has none. */
+static const char *symbolName(const struct elf_file *elf,
+                              const Elf64_Sym *sym) {
+  if (sym->st_name != 0 && sym->st_name < elf->symbolNamesSize) {
+    return elf->symbolNames + sym->st_name;
+  }
+  if (sym->st_shndx > 0 && sym->st_shndx < elf->numSections) {
+    return elf->sectionNames + elf->sections[sym->st_shndx].sh_name;
+  }
+  return NULL;
+}
+
+/**
+ * Validates the ELF headers at data and fills in elf. Returns 0, or -1
+ * after printing an error.
+ */
+static int parseElf(const char *path, const unsigned char *data, size_t size,
+                    struct elf_file *elf) {
+  memset(elf, 0, sizeof(*elf));
+  elf->data = data;
+  elf->size = size;
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+  if (size < sizeof(*ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_ident[EI_DATA] != ELFDATA2LSB || ehdr->e_machine != EM_BPF) {
+    fprintf(stderr, "%s: not a 64-bit little-endian BPF object\n", path);
+    return -1;
+  }
+  if (ehdr->e_shentsize != sizeof(Elf64_Shdr) || ehdr->e_shoff > size ||
+      (size_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > size - ehdr->e_shoff) {
+    fprintf(stderr, "%s: bad section header table\n", path);
+    return -1;
+  }
+  elf->sections = (const Elf64_Shdr *)(data + ehdr->e_shoff);
+  elf->numSections = ehdr->e_shnum;
+  elf->sectionNames = sectionData(elf, ehdr->e_shstrndx);
+  if (elf->sectionNames == NULL) {
+    fprintf(stderr, "%s: missing section name table\n", path);
+    return -1;
+  }
+  size_t namesSize = elf->sections[ehdr->e_shstrndx].sh_size;
+  if (namesSize == 0 || elf->sectionNames[namesSize - 1] != '\0') {
+    fprintf(stderr, "%s: unterminated section name table\n", path);
+    return -1;
+  }
+  for (int i = 0; i < elf->numSections; i++) {
+    const Elf64_Shdr *section = &elf->sections[i];
+    if (section->sh_name >= namesSize) {
+      fprintf(stderr, "%s: bad name for section %d\n", path, i);
+      return -1;
+    }
+    if (section->sh_type == SHT_SYMTAB &&
+        section->sh_entsize == sizeof(Elf64_Sym) &&
+        sectionData(elf, i) != NULL &&
+        sectionData(elf, section->sh_link) != NULL &&
+        elf->sections[section->sh_link].sh_size > 0 &&
+        ((const char *)sectionData(
+            elf, section->sh_link))[elf->sections[section->sh_link].sh_size -
+                                    1] == '\0') {
+      elf->symbols = sectionData(elf, i);
+      elf->numSymbols = section->sh_size / sizeof(Elf64_Sym);
+      elf->symbolNames = sectionData(elf, section->sh_link);
+      elf->symbolNamesSize = elf->sections[section->sh_link].sh_size;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Labels the functions in section index and comments each relocated
+ * instruction with the symbol it refers to.
+ */
+static void annotateElfSection(const struct elf_file *elf, int index,
+                               size_t numInsns,
+                               struct annotations *annotations) {
+  for (size_t i = 0; i < elf->numSymbols; i++) {
+    const Elf64_Sym *sym = &elf->symbols[i];
+    int type = ELF64_ST_TYPE(sym->st_info);
+    if (sym->st_shndx == index && sym->st_name != 0 &&
+        type != STT_SECTION && type != STT_FILE &&
+        sym->st_value / sizeof(struct bpf_insn) < numInsns) {
+      annotations->labels[sym->st_value / sizeof(struct bpf_insn)] =
+          symbolName(elf, sym);
+    }
+  }
+  for (int i = 0; i < elf->numSections; i++) {
+    const Elf64_Shdr *section = &elf->sections[i];
+    const Elf64_Rel *rels = sectionData(elf, i);
+    if (section->sh_type != SHT_REL || (int)section->sh_info != index ||
+        rels == NULL) {
+      continue;
+    }
+    for (size_t j = 0; j < section->sh_size / sizeof(Elf64_Rel); j++) {
+      size_t insn = rels[j].r_offset / sizeof(struct bpf_insn);
+      size_t symIndex = ELF64_R_SYM(rels[j].r_info);
+      if (insn < numInsns && symIndex < elf->numSymbols) {
+        annotations->comments[insn] =
+            symbolName(elf, &elf->symbols[symIndex]);
+      }
+    }
+  }
+}
+
+/**
+ * Disassembles the executable sections of an ELF object, or only the one
+ * named onlySection. Returns 0, or -1 after printing an error.
+ */
+static int disassembleElf(const char *path, const unsigned char *data,
+                          size_t size, const char *onlySection,
+                          struct disasm_options *options) {
+  struct elf_file elf;
+  if (parseElf(path, data, size, &elf) < 0) {
+    return -1;
+  }
+  int numFound = 0;
+  for (int i = 1; i < elf.numSections; i++) {
+    const Elf64_Shdr *section = &elf.sections[i];
+    const char *name = elf.sectionNames + section->sh_name;
+    const struct bpf_insn *insns = sectionData(&elf, i);
+    if (section->sh_type != SHT_PROGBITS || insns == NULL ||
+        (onlySection != NULL ? strcmp(name, onlySection) != 0
+                             : !(section->sh_flags & SHF_EXECINSTR))) {
+      continue;
+    }
+    size_t numInsns = section->sh_size / sizeof(struct bpf_insn);
+    struct annotations annotations;
+    if (allocAnnotations(&annotations, numInsns) < 0) {
+      perror("Error disassembling");
+      return -1;
+    }
+    annotateElfSection(&elf, i, numInsns, &annotations);
+    options->label = labelAt;
+    options->annotate = commentAt;
+    options->cookie = &annotations;
+    printf("%sDisassembly of section %s:\n", numFound > 0 ? "\n" : "", name);
+    int rc = print(name, insns, numInsns, options);
+    freeAnnotations(&annotations);
+    if (rc < 0) {
+      perror("Error writing the disassembly");
+      return -1;
+    }
+    numFound++;
+  }
+  if (numFound == 0) {
+    fprintf(stderr, "%s: no %s\n", path,
+            onlySection != NULL ? "such section" : "executable sections");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Reads the whole of path, or stdin for "-", into *data. A regular file is
+ * mapped rather than copied, so that large dumps cost no more than a pass
+ * over them. Returns 0, or -1 after printing an error.
+ */
+static int readInput(const char *path, unsigned char **data, size_t *size,
+                     int *mapped) {
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  struct stat st;
+  *data = NULL;
+  *size = 0;
+  *mapped = 0;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*data != MAP_FAILED) {
+      *size = st.st_size;
+      *mapped = 1;
+      if (fd != STDIN_FILENO) {
+        close(fd);
+      }
+      return 0;
+    }
+    *data = NULL;
+  }
+
+  size_t capacity = 0;
+  for (;;) {
+    if (*size == capacity) {
+      capacity = capacity == 0 ? 65536 : capacity * 2;
+      unsigned char *bigger = realloc(*data, capacity);
+      if (bigger == NULL) {
+        break;
+      }
+      *data = bigger;
+    }
+    ssize_t n = read(fd, *data + *size, capacity - *size);
+    if (n == 0) {
+      if (fd != STDIN_FILENO) {
+        close(fd);
+      }
+      return 0;
+    }
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    *size += n > 0 ? n : 0;
+  }
+  fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  free(*data);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  return -1;
+}
+
+static int disassembleFile(const char *path, const char *onlySection,
+                           struct disasm_options *options) {
+  unsigned char *data;
+  size_t size;
+  int mapped, rc;
+  if (readInput(path, &data, &size, &mapped) < 0) {
+    return -1;
+  }
+  if (size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0) {
+    rc = disassembleElf(path, data, size, onlySection, options);
+  } else {
+    if (size % sizeof(struct bpf_insn) != 0) {
+      fprintf(stderr, "%s: ignoring %zu trailing bytes\n", path,
+              size % sizeof(struct bpf_insn));
+    }
+    rc = print(path, (const struct bpf_insn *)data,
+               size / sizeof(struct bpf_insn), options);
+    if (rc < 0) {
+      perror("Error writing the disassembly");
+    }
+  }
+  if (mapped) {
+    munmap(data, size);
+  } else {
+    free(data);
+  }
+  return rc;
+}
+
+static int bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Disassembles the program pinned at path, as loaded. Returns 0, or -1
+ * after printing an error.
+ */
+static int disassemblePinned(const char *path,
+                             struct disasm_options *options) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.pathname = (unsigned long)path;
+  int fd = bpf(BPF_OBJ_GET, &attr);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  // The first call gives the size of the instructions, the second them.
+  struct bpf_prog_info info = {};
+  struct bpf_insn *insns = NULL;
+  int rc = -1;
+  for (int pass = 0; pass < 2; pass++) {
+    unsigned int len = info.xlated_prog_len;
+    memset(&info, 0, sizeof(info));
+    if (pass == 1) {
+      insns = malloc(len > 0 ? len : 1);
+      if (insns == NULL) {
+        perror("Error reading the program");
+        goto error;
+      }
+      info.xlated_prog_len = len;
+      info.xlated_prog_insns = (unsigned long)insns;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.info.bpf_fd = fd;
+    attr.info.info_len = sizeof(info);
+    attr.info.info = (unsigned long)&info;
+    if (bpf(BPF_OBJ_GET_INFO_BY_FD, &attr) < 0) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      goto error;
+    }
+  }
+  if (info.xlated_prog_len == 0) {
+    // Without CAP_SYS_ADMIN, or with kernel.kptr_restrict set, the kernel
+    // reports the program but not its instructions.
+    fprintf(stderr, "%s: the kernel did not return the instructions\n",
+            path);
+    goto error;
+  }
+  printf("%s: program %u \"%.*s\"\n", path, info.id,
+         (int)sizeof(info.name), info.name);
+  options->mapIds = 1;
+  rc = print(path, insns, info.xlated_prog_len / sizeof(struct bpf_insn),
+             options);
+  if (rc < 0) {
+    perror("Error writing the disassembly");
+  }
+
+error:
+  free(insns);
+  close(fd);
+  return rc;
+}
+
+/**
+ * Disassembles the entry and return programs that opensnoop assembles with
+ * its default options, naming the maps their placeholder fds stand for.
+ */
+static int disassembleOpensnoop(struct disasm_options *options) {
+  enum {
+    FD_INFOTMP = 1,
+    FD_EVENTS,
+    FD_CONFIG,
+    FD_SCRATCH,
+    FD_STATS,
+  };
+  static const char *mapNames[] = {
+      [FD_INFOTMP] = "infotmp", [FD_EVENTS] = "events",
+      [FD_CONFIG] = "config",   [FD_SCRATCH] = "scratch",
+      [FD_STATS] = "stats",
+  };
+  struct trace_entry_params entryParams = {
+      .infotmpFd = FD_INFOTMP,
+      .filterFd = -1,
+      .cgroupFd = -1,
+      .statsFd = FD_STATS,
+  };
+  struct trace_return_params returnParams = {
+      .infotmpFd = FD_INFOTMP,
+      .filterFd = -1,
+      .cgroupFd = -1,
+      .eventsFd = FD_EVENTS,
+      .configFd = FD_CONFIG,
+      .scratchFd = FD_SCRATCH,
+      .statsFd = FD_STATS,
+      .topFd = -1,
+      .histFd = -1,
+      .histBy = HIST_BY_NONE,
+      .fnameMax = NAME_MAX + 1,
+  };
+  static struct bpf_insn entryInsns[MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS];
+  static struct bpf_insn returnInsns[MAX_NUM_TRACE_RETURN_INSTRUCTIONS];
+  struct relocs entryRelocs = {}, returnRelocs = {};
+  int numEntryInsns =
+      assemble_trace_entry(entryInsns, &entryParams, &entryRelocs);
+  int numReturnInsns =
+      assemble_trace_return(returnInsns, &returnParams, &returnRelocs);
+  if (numEntryInsns < 0 || numReturnInsns < 0) {
+    perror("Error assembling the programs");
+    return -1;
+  }
+
+  struct {
+    const char *name;
+    struct bpf_insn *insns;
+    struct relocs *relocs;
+    int numAssembled;
+    int numInsns;
+  } programs[] = {
+      {"trace_entry", entryInsns, &entryRelocs, numEntryInsns, numEntryInsns},
+      {"trace_return", returnInsns, &returnRelocs, numReturnInsns,
+       numReturnInsns},
+  };
+  for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    // As in opensnoop, the relocated instructions must stay put.
+    struct relocs *relocs = programs[i].relocs;
+    int pinned[MAX_RELOCS];
+    for (int j = 0; j < relocs->num; j++) {
+      pinned[j] = relocs->entries[j].insn;
+    }
+    programs[i].numInsns =
+        optimize_program(programs[i].insns, programs[i].numAssembled, pinned,
+                         relocs->num, NULL);
+    if (programs[i].numInsns < 0) {
+      perror("Error optimizing the programs");
+      return -1;
+    }
+    for (int j = 0; j < relocs->num; j++) {
+      relocs->entries[j].insn = pinned[j];
+    }
+    relocate_program(programs[i].insns, relocs, PROBE_KPROBE, 0);
+  }
+
+  for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    struct annotations annotations;
+    if (allocAnnotations(&annotations, programs[i].numInsns) < 0) {
+      perror("Error disassembling");
+      return -1;
+    }
+    for (int j = 0; j < programs[i].numInsns; j++) {
+      const struct bpf_insn *insn = &programs[i].insns[j];
+      if (insn->code == (BPF_LD | BPF_IMM | BPF_DW) &&
+          insn->src_reg == BPF_PSEUDO_MAP_FD && insn->imm > 0 &&
+          insn->imm < (int)(sizeof(mapNames) / sizeof(mapNames[0]))) {
+        annotations.comments[j] = mapNames[insn->imm];
+      }
+    }
+    annotations.labels[0] = programs[i].name;
+    options->label = labelAt;
+    options->annotate = commentAt;
+    options->cookie = &annotations;
+    int rc = print(programs[i].name, programs[i].insns, programs[i].numInsns,
+                   options);
+    freeAnnotations(&annotations);
+    if (rc == 0 && opt_a) {
+      printf("  optimizer: removed %d of %d instructions\n",
+             programs[i].numAssembled - programs[i].numInsns,
+             programs[i].numAssembled);
+      rc = ferror(stdout) ? -1 : 0;
+    }
+    if (rc < 0) {
+      perror("Error writing the disassembly");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-a] [-b] [-c] FILE [SECTION]\n"
+          "       %s [-a] [-b] [-c] --pinned PATH\n"
+          "       %s [-a] [-b] [-c] --opensnoop\n",
+          argv0, argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+  struct disasm_options options = {};
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0' &&
+         argv[argi][1] != '-';
+       argi++) {
+    for (const char *flag = &argv[argi][1]; *flag != '\0'; flag++) {
+      if (*flag == 'a') {
+        opt_a = 1;
+      } else if (*flag == 'b') {
+        options.showBytes = 1;
+      } else if (*flag == 'c') {
+        opt_c = 1;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+  }
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+  int rc;
+  if (argi + 1 == argc && strcmp(argv[argi], "--opensnoop") == 0) {
+    rc = disassembleOpensnoop(&options);
+  } else if (argi + 2 == argc && strcmp(argv[argi], "--pinned") == 0) {
+    rc = disassemblePinned(argv[argi + 1], &options);
+  } else if (argi < argc && argi + 2 >= argc &&
+             strncmp(argv[argi], "--", 2) != 0) {
+    rc = disassembleFile(argv[argi], argi + 1 < argc ? argv[argi + 1] : NULL,
+                         &options);
+  } else {
+    usage(argv[0]);
+    return 1;
+  }
+  if (fflush(stdout) != 0) {
+    perror("Error writing the disassembly");
+    rc = -1;
+  }
+  return rc < 0 || analysisFailed ? 1 : 0;
+}
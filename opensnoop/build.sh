@@ -1,5 +1,4 @@
 #!/bin/sh
 # Note the generated opensnoop executable must be run with sudo.
 set -e
-python opensnoop.py
-clang opensnoop.c -O3 -o opensnoop /usr/lib/x86_64-linux-gnu/libbpf.so
+clang opensnoop.c analyzer.c capture.c disasm.c drain.c hist.c merge.c optimizer.c output.c perfbuf.c programs.c ringbuf.c stats.c top.c trampoline.c -O3 -o opensnoop /usr/lib/x86_64-linux-gnu/libbpf.so -lpthread
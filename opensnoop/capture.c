@@ -0,0 +1,190 @@
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned int paddedSize(unsigned int size) { return (size + 7) & ~7U; }
+
+static long long clockNanos(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void appendRecord(struct capture_writer *writer, unsigned int type,
+                         const void *payload, unsigned int size) {
+  static const char padding[8];
+  struct capture_record record = {.type = type, .size = size};
+  output_append_bytes(&writer->out, &record, sizeof(record));
+  output_append_bytes(&writer->out, payload, size);
+  output_append_bytes(&writer->out, padding, paddedSize(size) - size);
+  writer->offset += sizeof(record) + paddedSize(size);
+}
+
+static void appendIndex(struct capture_writer *writer) {
+  unsigned long long indexOffset = writer->offset;
+  writer->pending.prev_index_offset = writer->lastIndexOffset;
+  appendRecord(writer, CAPTURE_RECORD_INDEX, &writer->pending,
+               sizeof(writer->pending));
+  writer->lastIndexOffset = indexOffset;
+  memset(&writer->pending, 0, sizeof(writer->pending));
+}
+
+int capture_writer_open(struct capture_writer *writer, const char *path,
+                        int flushIntervalMs) {
+  memset(writer, 0, sizeof(*writer));
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (output_writer_init(&writer->out, fd, flushIntervalMs) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  struct capture_header header = {
+      .format_version = CAPTURE_FORMAT_VERSION,
+      .event_version = EVENT_VERSION,
+      .header_size = sizeof(struct capture_header),
+      .index_interval = CAPTURE_INDEX_INTERVAL,
+      .boot_time_offset_ns =
+          clockNanos(CLOCK_REALTIME) - clockNanos(CLOCK_MONOTONIC),
+  };
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  output_append_bytes(&writer->out, &header, sizeof(header));
+  writer->offset = sizeof(header);
+  return 0;
+}
+
+void capture_writer_append_event(struct capture_writer *writer,
+                                 const struct event_t *event, size_t size) {
+  if (writer->pending.num_events == 0) {
+    writer->pending.first_event_offset = writer->offset;
+    writer->pending.first_ts = event->ts;
+  }
+  writer->pending.num_events++;
+  writer->pending.last_ts = event->ts;
+
+  appendRecord(writer, CAPTURE_RECORD_EVENT, event, size);
+  if (writer->pending.num_events == CAPTURE_INDEX_INTERVAL) {
+    appendIndex(writer);
+  }
+}
+
+void capture_writer_append_lost(struct capture_writer *writer,
+                                const struct capture_lost *lost) {
+  appendRecord(writer, CAPTURE_RECORD_LOST, lost, sizeof(*lost));
+}
+
+int capture_writer_close(struct capture_writer *writer) {
+  if (writer->pending.num_events != 0) {
+    appendIndex(writer);
+  }
+
+  int rc = output_writer_flush(&writer->out);
+  if (rc == 0 && writer->lastIndexOffset != 0) {
+    unsigned long long lastIndexOffset = writer->lastIndexOffset;
+    if (pwrite(writer->out.fd, &lastIndexOffset, sizeof(lastIndexOffset),
+               offsetof(struct capture_header, last_index_offset)) !=
+        sizeof(lastIndexOffset)) {
+      rc = -1;
+    }
+  }
+
+  int savedErrno = errno;
+  if (close(writer->out.fd) < 0 && rc == 0) {
+    savedErrno = errno;
+    rc = -1;
+  }
+  output_writer_free(&writer->out);
+  errno = savedErrno;
+  return rc;
+}
+
+int capture_reader_open(struct capture_reader *reader, const char *path) {
+  memset(reader, 0, sizeof(*reader));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size < sizeof(struct capture_header)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int savedErrno = errno;
+  close(fd);
+  if (base == MAP_FAILED) {
+    errno = savedErrno;
+    return -1;
+  }
+  // Replay reads the file front to back exactly once.
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+  reader->base = base;
+  reader->size = st.st_size;
+  reader->header = base;
+  if (memcmp(reader->header->magic, CAPTURE_MAGIC,
+             sizeof(reader->header->magic)) != 0 ||
+      reader->header->format_version != CAPTURE_FORMAT_VERSION ||
+      reader->header->event_version != EVENT_VERSION ||
+      reader->header->header_size < sizeof(struct capture_header) ||
+      reader->header->header_size > reader->size ||
+      reader->header->header_size % 8 != 0) {
+    capture_reader_close(reader);
+    errno = EINVAL;
+    return -1;
+  }
+
+  reader->offset = reader->header->header_size;
+  return 0;
+}
+
+int capture_reader_next(struct capture_reader *reader, const void **payload,
+                        unsigned int *size) {
+  if (reader->offset == reader->size) {
+    return 0;
+  }
+
+  size_t remaining = reader->size - reader->offset;
+  if (remaining < sizeof(struct capture_record)) {
+    return -1;
+  }
+
+  const struct capture_record *record =
+      (const struct capture_record *)(reader->base + reader->offset);
+  remaining -= sizeof(struct capture_record);
+  if (record->size > remaining) {
+    return -1;
+  }
+
+  *payload = record + 1;
+  *size = record->size;
+  // The padding of the last record may be missing if the writer was killed.
+  size_t recordSize = sizeof(struct capture_record) + paddedSize(record->size);
+  if (recordSize > reader->size - reader->offset) {
+    recordSize = reader->size - reader->offset;
+  }
+  reader->offset += recordSize;
+  return record->type;
+}
+
+void capture_reader_close(struct capture_reader *reader) {
+  if (reader->base != NULL) {
+    munmap((void *)reader->base, reader->size);
+  }
+  memset(reader, 0, sizeof(*reader));
+}
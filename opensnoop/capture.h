@@ -0,0 +1,135 @@
+/**
+ * Binary capture files for opensnoop --write and --read.
+ *
+ * A capture file is a struct capture_header followed by a sequence of
+ * records, each of which is a struct capture_record followed by size bytes
+ * of payload, padded so that the next record starts on an 8-byte boundary.
+ * Because everything is 8-byte aligned, a reader can mmap the file and use
+ * the payloads in place.
+ *
+ * CAPTURE_RECORD_EVENT payloads are struct event_t exactly as they were
+ * received from the kernel, whose layout is identified by
+ * capture_header.event_version. Every CAPTURE_INDEX_INTERVAL events, the
+ * writer appends a CAPTURE_RECORD_INDEX whose payload is a struct
+ * capture_index describing those events, so tools can find a point in time
+ * without decoding every event.
+ *
+ * CAPTURE_RECORD_LOST payloads are struct capture_lost, giving the running
+ * totals of submitted and lost events for one CPU, so that a reader knows
+ * where the capture has gaps and how large they are.
+ */
+#pragma once
+
+#include "opensnoop.h"
+#include "output.h"
+#include <stddef.h>
+
+#define CAPTURE_MAGIC "OSNOOPCF"
+#define CAPTURE_FORMAT_VERSION 1
+#define CAPTURE_INDEX_INTERVAL 4096
+
+enum capture_record_type {
+  CAPTURE_RECORD_EVENT = 1,
+  CAPTURE_RECORD_INDEX = 2,
+  CAPTURE_RECORD_LOST = 3,
+};
+
+struct capture_header {
+  char magic[8];
+  // Version of the framing described above.
+  unsigned int format_version;
+  // EVENT_VERSION of the struct event_t payloads.
+  unsigned int event_version;
+  // sizeof(struct capture_header), so fields can be added at the end.
+  unsigned int header_size;
+  unsigned int index_interval;
+  // CLOCK_REALTIME - CLOCK_MONOTONIC when the capture started, in
+  // nanoseconds. Adding this to event_t.ts (from bpf_ktime_get_ns()) gives
+  // the wall-clock time of the event.
+  long long boot_time_offset_ns;
+  // File offset of the last CAPTURE_RECORD_INDEX, filled in when the capture
+  // is closed cleanly. 0 if the writer did not get that far, in which case
+  // the file can still be read sequentially.
+  unsigned long long last_index_offset;
+};
+
+struct capture_record {
+  unsigned int type;
+  unsigned int size;
+};
+
+struct capture_index {
+  // File offset of the previous CAPTURE_RECORD_INDEX, or 0 for the first.
+  unsigned long long prev_index_offset;
+  // File offset of the record of the first event described by this index.
+  unsigned long long first_event_offset;
+  unsigned long long first_ts;
+  unsigned long long last_ts;
+  unsigned int num_events;
+  unsigned int reserved;
+};
+
+struct capture_lost {
+  // CLOCK_MONOTONIC time at which the totals were read, comparable with
+  // event_t.ts.
+  unsigned long long ts;
+  // Totals since the capture started, not since the previous record.
+  unsigned long long submitted;
+  unsigned long long lost;
+  unsigned int cpu;
+  unsigned int reserved;
+};
+
+struct capture_writer {
+  struct output_writer out;
+  // Number of bytes appended to the file so far.
+  unsigned long long offset;
+  unsigned long long lastIndexOffset;
+  // The events since the last CAPTURE_RECORD_INDEX.
+  struct capture_index pending;
+};
+
+/**
+ * Creates (or truncates) the file at path and writes the header. Returns 0 on
+ * success or -1 with errno set.
+ */
+int capture_writer_open(struct capture_writer *writer, const char *path,
+                        int flushIntervalMs);
+
+/** Appends one event of size bytes. */
+void capture_writer_append_event(struct capture_writer *writer,
+                                 const struct event_t *event, size_t size);
+
+void capture_writer_append_lost(struct capture_writer *writer,
+                                const struct capture_lost *lost);
+
+/**
+ * Writes the final index, records it in the header and closes the file.
+ * Returns 0 on success or -1 with errno set.
+ */
+int capture_writer_close(struct capture_writer *writer);
+
+struct capture_reader {
+  const unsigned char *base;
+  size_t size;
+  const struct capture_header *header;
+  // Offset of the next record to return.
+  size_t offset;
+};
+
+/**
+ * mmaps the capture file at path and validates its header. Returns 0 on
+ * success or -1 with errno set (EINVAL if it is not a capture file that this
+ * version of opensnoop understands).
+ */
+int capture_reader_open(struct capture_reader *reader, const char *path);
+
+/**
+ * Returns the type of the next record and points *payload and *size at its
+ * contents, 0 at the end of the file, or -1 if the next record is truncated
+ * (as happens if the writer was killed).
+ */
+int capture_reader_next(struct capture_reader *reader, const void **payload,
+                        unsigned int *size);
+
+void capture_reader_close(struct capture_reader *reader);
@@ -0,0 +1,508 @@
+#include "disasm.h"
+#include <string.h>
+
+// Sign-extending loads, which older <linux/bpf.h> do not define.
+#ifndef BPF_MEMSX
+#define BPF_MEMSX 0x80
+#endif
+
+// Older <linux/bpf.h> pass FN() just the name, newer ones the ID too.
+#define HELPER_NAME(name, ...) [BPF_FUNC_##name] = "bpf_" #name
+static const char *helperNames[] = {__BPF_FUNC_MAPPER(HELPER_NAME)};
+
+const char *disasm_helper_name(int func) {
+  if (func <= BPF_FUNC_unspec ||
+      func >= (int)(sizeof(helperNames) / sizeof(helperNames[0]))) {
+    return NULL;
+  }
+  return helperNames[func];
+}
+
+/** A line being formatted, which is truncated rather than overrun. */
+struct line {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+static void append(struct line *line, const char *s) {
+  while (*s != '\0' && line->len + 1 < line->size) {
+    line->buf[line->len++] = *s++;
+  }
+  line->buf[line->len] = '\0';
+}
+
+static void appendUnsigned(struct line *line, unsigned long long value,
+                           int base) {
+  char digits[24];
+  int i = sizeof(digits) - 1;
+  digits[i] = '\0';
+  do {
+    digits[--i] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value != 0);
+  if (base == 16) {
+    append(line, "0x");
+  }
+  append(line, &digits[i]);
+}
+
+static void appendSigned(struct line *line, long long value) {
+  if (value < 0) {
+    append(line, "-");
+    appendUnsigned(line, -(unsigned long long)value, 10);
+  } else {
+    appendUnsigned(line, value, 10);
+  }
+}
+
+/** Appends a jump offset, e.g. "+5 <12>", where 12 is the target. */
+static void appendTarget(struct line *line, size_t index, long long off) {
+  unsigned long long distance = off < 0 ? -off : off;
+  append(line, off < 0 ? "-" : "+");
+  appendUnsigned(line, distance, 10);
+  append(line, " <");
+  appendSigned(line, (long long)index + 1 + off);
+  append(line, ">");
+}
+
+static void appendReg(struct line *line, int is32, int reg) {
+  append(line, is32 ? "w" : "r");
+  appendUnsigned(line, reg, 10);
+}
+
+/** Appends "reg + off" or "reg - off". */
+static void appendAddress(struct line *line, int reg, int off) {
+  appendReg(line, 0, reg);
+  append(line, off < 0 ? " - " : " + ");
+  appendUnsigned(line, off < 0 ? -(long long)off : off, 10);
+}
+
+static const char *sizeName(int size, int isSigned) {
+  switch (size) {
+  case BPF_B:
+    return isSigned ? "s8" : "u8";
+  case BPF_H:
+    return isSigned ? "s16" : "u16";
+  case BPF_W:
+    return isSigned ? "s32" : "u32";
+  default:
+    return isSigned ? "s64" : "u64";
+  }
+}
+
+/** Appends a memory operand, e.g. "*(u64 *)(r10 - 24)". */
+static void appendMemory(struct line *line, int size, int isSigned, int reg,
+                         int off) {
+  append(line, "*(");
+  append(line, sizeName(size, isSigned));
+  append(line, " *)(");
+  appendAddress(line, reg, off);
+  append(line, ")");
+}
+
+static void appendInvalid(struct line *line, const char *what,
+                          unsigned int value) {
+  append(line, "invalid ");
+  append(line, what);
+  append(line, " ");
+  appendUnsigned(line, value, 16);
+}
+
+/** Returns the operator of an ALU op, or NULL. */
+static const char *aluOperator(int op, int isSigned) {
+  switch (op) {
+  case BPF_ADD:
+    return "+=";
+  case BPF_SUB:
+    return "-=";
+  case BPF_MUL:
+    return "*=";
+  case BPF_DIV:
+    return isSigned ? "s/=" : "/=";
+  case BPF_MOD:
+    return isSigned ? "s%=" : "%=";
+  case BPF_OR:
+    return "|=";
+  case BPF_AND:
+    return "&=";
+  case BPF_LSH:
+    return "<<=";
+  case BPF_RSH:
+    return ">>=";
+  case BPF_ARSH:
+    return "s>>=";
+  case BPF_XOR:
+    return "^=";
+  case BPF_MOV:
+    return "=";
+  default:
+    return NULL;
+  }
+}
+
+static void formatAlu(struct line *line, const struct bpf_insn *insn) {
+  int is32 = BPF_CLASS(insn->code) == BPF_ALU;
+  int op = BPF_OP(insn->code);
+  int isReg = BPF_SRC(insn->code) == BPF_X;
+  if (op == BPF_NEG) {
+    appendReg(line, is32, insn->dst_reg);
+    append(line, " = -");
+    appendReg(line, is32, insn->dst_reg);
+    return;
+  }
+  if (op == BPF_END) {
+    if (insn->imm != 16 && insn->imm != 32 && insn->imm != 64) {
+      appendInvalid(line, "byte swap width", insn->imm);
+      return;
+    }
+    // BPF_ALU64 swaps unconditionally; BPF_ALU converts to an endianness.
+    appendReg(line, 0, insn->dst_reg);
+    append(line, !is32 ? " = bswap" : isReg ? " = be" : " = le");
+    appendUnsigned(line, insn->imm, 10);
+    append(line, " ");
+    appendReg(line, 0, insn->dst_reg);
+    return;
+  }
+  // Signed division and sign-extending moves are told apart by off.
+  const char *symbol = aluOperator(op, insn->off == 1);
+  if (symbol == NULL) {
+    appendInvalid(line, "ALU op", op);
+    return;
+  }
+  appendReg(line, is32, insn->dst_reg);
+  append(line, " ");
+  append(line, symbol);
+  append(line, " ");
+  if (op == BPF_MOV && isReg &&
+      (insn->off == 8 || insn->off == 16 || insn->off == 32)) {
+    append(line, "(s");
+    appendUnsigned(line, insn->off, 10);
+    append(line, ")");
+  }
+  if (isReg) {
+    appendReg(line, is32, insn->src_reg);
+  } else {
+    appendSigned(line, insn->imm);
+  }
+}
+
+/** Returns the operator of a conditional jump, or NULL. */
+static const char *jumpOperator(int op) {
+  switch (op) {
+  case BPF_JEQ:
+    return "==";
+  case BPF_JNE:
+    return "!=";
+  case BPF_JGT:
+    return ">";
+  case BPF_JGE:
+    return ">=";
+  case BPF_JLT:
+    return "<";
+  case BPF_JLE:
+    return "<=";
+  case BPF_JSET:
+    return "&";
+  case BPF_JSGT:
+    return "s>";
+  case BPF_JSGE:
+    return "s>=";
+  case BPF_JSLT:
+    return "s<";
+  case BPF_JSLE:
+    return "s<=";
+  default:
+    return NULL;
+  }
+}
+
+static void formatJump(struct line *line, const struct bpf_insn *insn,
+                       size_t index) {
+  int is32 = BPF_CLASS(insn->code) == BPF_JMP32;
+  int op = BPF_OP(insn->code);
+  if (op == BPF_JA) {
+    // The 32-bit form keeps its offset in imm, for jumps past 32K.
+    append(line, is32 ? "gotol " : "goto ");
+    appendTarget(line, index, is32 ? insn->imm : insn->off);
+    return;
+  }
+  if (op == BPF_EXIT && !is32) {
+    append(line, "exit");
+    return;
+  }
+  if (op == BPF_CALL && !is32) {
+    const char *name = disasm_helper_name(insn->imm);
+    if (insn->src_reg == BPF_PSEUDO_CALL) {
+      append(line, "call ");
+      appendTarget(line, index, insn->imm);
+    } else if (insn->src_reg == BPF_PSEUDO_KFUNC_CALL) {
+      append(line, "call kfunc#");
+      appendSigned(line, insn->imm);
+    } else {
+      append(line, "call ");
+      append(line, name != NULL ? name : "unknown");
+      append(line, "#");
+      appendSigned(line, insn->imm);
+    }
+    return;
+  }
+  const char *symbol = jumpOperator(op);
+  if (symbol == NULL) {
+    appendInvalid(line, "jump op", op);
+    return;
+  }
+  append(line, "if ");
+  appendReg(line, is32, insn->dst_reg);
+  append(line, " ");
+  append(line, symbol);
+  append(line, " ");
+  if (BPF_SRC(insn->code) == BPF_X) {
+    appendReg(line, is32, insn->src_reg);
+  } else {
+    appendSigned(line, insn->imm);
+  }
+  append(line, " goto ");
+  appendTarget(line, index, insn->off);
+}
+
+/** Returns the number of instructions consumed, as disasm_insn() does. */
+static int formatLoadImm64(struct line *line, const struct bpf_insn *insns,
+                           size_t remaining, size_t index,
+                           const struct disasm_options *options) {
+  const struct bpf_insn *insn = &insns[0];
+  if (remaining < 2 || insns[1].code != 0) {
+    append(line, "invalid ld_imm64 without a second half");
+    return 1;
+  }
+  appendReg(line, 0, insn->dst_reg);
+  append(line, " = ");
+  int isMapValue = 0;
+  switch (insn->src_reg) {
+  case 0:
+    appendUnsigned(line,
+                   (unsigned int)insn->imm |
+                       (unsigned long long)(unsigned int)insns[1].imm << 32,
+                   16);
+    append(line, " ll");
+    return 2;
+  case BPF_PSEUDO_MAP_VALUE:
+    isMapValue = 1;
+    // Fall through.
+  case BPF_PSEUDO_MAP_FD:
+    append(line, options != NULL && options->mapIds ? "map[id:" : "map[fd:");
+    break;
+  case BPF_PSEUDO_MAP_IDX_VALUE:
+    isMapValue = 1;
+    // Fall through.
+  case BPF_PSEUDO_MAP_IDX:
+    append(line, "map[idx:");
+    break;
+  case BPF_PSEUDO_BTF_ID:
+    append(line, "btf_id[");
+    break;
+  case BPF_PSEUDO_FUNC:
+    append(line, "func ");
+    appendTarget(line, index, insn->imm);
+    return 2;
+  default:
+    line->len = 0;
+    appendInvalid(line, "ld_imm64 source", insn->src_reg);
+    return 2;
+  }
+  appendSigned(line, insn->imm);
+  append(line, "]");
+  if (isMapValue) {
+    append(line, "[0]+");
+    appendUnsigned(line, (unsigned int)insns[1].imm, 10);
+  }
+  return 2;
+}
+
+static void formatLoad(struct line *line, const struct bpf_insn *insn) {
+  int mode = BPF_MODE(insn->code);
+  if (mode != BPF_ABS && mode != BPF_IND) {
+    appendInvalid(line, "load mode", mode);
+    return;
+  }
+  // The legacy packet loads, which read from the skb in r6 into r0.
+  append(line, "r0 = *(");
+  append(line, sizeName(BPF_SIZE(insn->code), 0));
+  append(line, " *)skb[");
+  if (mode == BPF_IND) {
+    appendReg(line, 0, insn->src_reg);
+    append(line, " + ");
+  }
+  appendSigned(line, insn->imm);
+  append(line, "]");
+}
+
+static void formatAtomic(struct line *line, const struct bpf_insn *insn) {
+  int size = BPF_SIZE(insn->code);
+  int is32 = size == BPF_W;
+  int op = insn->imm & ~BPF_FETCH;
+  static const struct {
+    int op;
+    const char *symbol;
+    const char *name;
+  } arithmetic[] = {
+      {BPF_ADD, "+=", "add"},
+      {BPF_AND, "&=", "and"},
+      {BPF_OR, "|=", "or"},
+      {BPF_XOR, "^=", "xor"},
+  };
+  if (size != BPF_W && size != BPF_DW) {
+    appendInvalid(line, "atomic size", size);
+    return;
+  }
+
+  if (insn->imm == BPF_XCHG || insn->imm == BPF_CMPXCHG) {
+    int isCmp = insn->imm == BPF_CMPXCHG;
+    appendReg(line, is32, isCmp ? BPF_REG_0 : insn->src_reg);
+    append(line, isCmp ? " = cmpxchg" : " = xchg");
+    append(line, is32 ? "32_32(" : "_64(");
+    appendAddress(line, insn->dst_reg, insn->off);
+    append(line, ", ");
+    if (isCmp) {
+      appendReg(line, is32, BPF_REG_0);
+      append(line, ", ");
+    }
+    appendReg(line, is32, insn->src_reg);
+    append(line, ")");
+    return;
+  }
+  for (size_t i = 0; i < sizeof(arithmetic) / sizeof(arithmetic[0]); i++) {
+    if (arithmetic[i].op != op) {
+      continue;
+    }
+    if (insn->imm & BPF_FETCH) {
+      appendReg(line, is32, insn->src_reg);
+      append(line, " = atomic_fetch_");
+      append(line, arithmetic[i].name);
+      append(line, "((");
+      append(line, sizeName(size, 0));
+      append(line, " *)(");
+      appendAddress(line, insn->dst_reg, insn->off);
+      append(line, "), ");
+    } else {
+      append(line, "lock ");
+      appendMemory(line, size, 0, insn->dst_reg, insn->off);
+      append(line, " ");
+      append(line, arithmetic[i].symbol);
+      append(line, " ");
+    }
+    appendReg(line, is32, insn->src_reg);
+    if (insn->imm & BPF_FETCH) {
+      append(line, ")");
+    }
+    return;
+  }
+  appendInvalid(line, "atomic op", insn->imm);
+}
+
+static void formatMemory(struct line *line, const struct bpf_insn *insn) {
+  int cls = BPF_CLASS(insn->code);
+  int mode = BPF_MODE(insn->code);
+  int size = BPF_SIZE(insn->code);
+  if (cls == BPF_LDX && (mode == BPF_MEM ||
+                         (mode == BPF_MEMSX && size != BPF_DW))) {
+    appendReg(line, 0, insn->dst_reg);
+    append(line, " = ");
+    appendMemory(line, size, mode == BPF_MEMSX, insn->src_reg, insn->off);
+  } else if (cls != BPF_LDX && mode == BPF_MEM) {
+    appendMemory(line, size, 0, insn->dst_reg, insn->off);
+    append(line, " = ");
+    if (cls == BPF_ST) {
+      appendSigned(line, insn->imm);
+    } else {
+      appendReg(line, 0, insn->src_reg);
+    }
+  } else if (cls == BPF_STX && mode == BPF_ATOMIC) {
+    formatAtomic(line, insn);
+  } else {
+    appendInvalid(line, "memory mode", mode);
+  }
+}
+
+int disasm_insn(const struct bpf_insn *insns, size_t remaining, size_t index,
+                const struct disasm_options *options, char *buf,
+                size_t size) {
+  struct line line = {.buf = buf, .size = size};
+  const struct bpf_insn *insn = &insns[0];
+  int consumed = 1;
+  if (size > 0) {
+    buf[0] = '\0';
+  }
+  switch (BPF_CLASS(insn->code)) {
+  case BPF_ALU:
+  case BPF_ALU64:
+    formatAlu(&line, insn);
+    break;
+  case BPF_JMP:
+  case BPF_JMP32:
+    formatJump(&line, insn, index);
+    break;
+  case BPF_LD:
+    if (insn->code == (BPF_LD | BPF_IMM | BPF_DW)) {
+      consumed = formatLoadImm64(&line, insns, remaining, index, options);
+    } else {
+      formatLoad(&line, insn);
+    }
+    break;
+  default:
+    formatMemory(&line, insn);
+    break;
+  }
+  return consumed;
+}
+
+static void appendBytes(struct line *line, const struct bpf_insn *insn) {
+  const unsigned char *bytes = (const unsigned char *)insn;
+  for (size_t i = 0; i < sizeof(*insn); i++) {
+    char hex[] = {"0123456789abcdef"[bytes[i] >> 4],
+                  "0123456789abcdef"[bytes[i] & 0xf], ' ', '\0'};
+    append(line, hex);
+  }
+}
+
+int disasm_print(FILE *out, const struct bpf_insn *insns, size_t numInsns,
+                 const struct disasm_options *options) {
+  // Room for the index, both halves of an ld_imm64 and a comment.
+  char buf[DISASM_MAX_LINE * 3];
+  size_t index = 0;
+  while (index < numInsns) {
+    const char *label = options != NULL && options->label != NULL
+                            ? options->label(options->cookie, index)
+                            : NULL;
+    if (label != NULL) {
+      fputs(label, out);
+      fputs(":\n", out);
+    }
+
+    struct line line = {.buf = buf, .size = sizeof(buf)};
+    char text[DISASM_MAX_LINE];
+    int consumed = disasm_insn(&insns[index], numInsns - index, index,
+                               options, text, sizeof(text));
+    char number[24];
+    snprintf(number, sizeof(number), "%6zu:\t", index);
+    append(&line, number);
+    if (options != NULL && options->showBytes) {
+      for (int i = 0; i < consumed; i++) {
+        appendBytes(&line, &insns[index + i]);
+      }
+      append(&line, "\t");
+    }
+    append(&line, text);
+    const char *comment = options != NULL && options->annotate != NULL
+                              ? options->annotate(options->cookie, index)
+                              : NULL;
+    if (comment != NULL) {
+      append(&line, "  ; ");
+      append(&line, comment);
+    }
+    append(&line, "\n");
+    fputs(buf, out);
+    index += consumed;
+  }
+  return ferror(out) ? -1 : 0;
+}
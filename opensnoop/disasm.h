@@ -0,0 +1,63 @@
+/**
+ * A disassembler for BPF instructions, covering ALU and ALU64, JMP and
+ * JMP32, LD, LDX, ST, STX and the atomic operations, every form of ld_imm64
+ * and every helper in enum bpf_func_id.
+ *
+ * The syntax is that of llvm-objdump, so that its output can be compared
+ * with that of the toolchain: 32-bit operations are shown on w registers,
+ * and helper calls are named as bpftool does, e.g.
+ * "call bpf_map_lookup_elem#1". Jumps show both their offset and the
+ * instruction they land on. An instruction that cannot be decoded is shown
+ * as such rather than skipped, and decoding carries on from the next one.
+ *
+ * Only <linux/bpf.h> is needed, so the code in c/ can use this too.
+ */
+#pragma once
+
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Enough for any instruction disasm_insn() formats.
+#define DISASM_MAX_LINE 128
+
+struct disasm_options {
+  // Print the bytes of each instruction before it.
+  int showBytes;
+  // ld_imm64 with BPF_PSEUDO_MAP_FD holds a map ID rather than an fd, as in
+  // the instructions of a loaded program read back from the kernel.
+  int mapIds;
+  // If not NULL, returns a comment for instruction index (e.g. the symbol a
+  // relocation refers to) or NULL, which is printed after the instruction.
+  const char *(*annotate)(void *cookie, size_t index);
+  // If not NULL, returns a label (e.g. a function name) to print on a line
+  // of its own before instruction index, or NULL.
+  const char *(*label)(void *cookie, size_t index);
+  void *cookie;
+};
+
+/**
+ * Returns the name of helper func, e.g. "bpf_map_lookup_elem", or NULL if
+ * there is no such helper.
+ */
+const char *disasm_helper_name(int func);
+
+/**
+ * Formats insns[0], the instruction at index, into buf, where remaining is
+ * the number of instructions available from insns[0] on, so that both
+ * halves of an ld_imm64 can be read. options may be NULL.
+ *
+ * Returns the number of instructions consumed: 2 for an ld_imm64 and 1
+ * otherwise, even if the instruction is invalid.
+ */
+int disasm_insn(const struct bpf_insn *insns, size_t remaining, size_t index,
+                const struct disasm_options *options, char *buf,
+                size_t size);
+
+/**
+ * Prints numInsns instructions to out, one per line, each preceded by its
+ * index. options may be NULL. Returns 0, or -1 if out could not be
+ * written.
+ */
+int disasm_print(FILE *out, const struct bpf_insn *insns, size_t numInsns,
+                 const struct disasm_options *options);
@@ -0,0 +1,242 @@
+#include "drain.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// How often a drain thread with nothing to read checks whether it should
+// stop.
+#define STOP_CHECK_INTERVAL_MS 50
+#define MAX_EPOLL_EVENTS 64
+
+// Size of a record that fills the rest of the ring so that the next record
+// starts at offset 0 rather than being split across the end.
+#define PADDING_RECORD UINT32_MAX
+
+struct record_header {
+  unsigned int size;
+  int tag;
+};
+
+static size_t paddedSize(size_t size) { return (size + 7) & ~(size_t)7; }
+
+int drain_pool_init(struct drain_pool *pool, int numThreads, size_t queueSize,
+                    int readIntervalMs) {
+  memset(pool, 0, sizeof(*pool));
+  pool->readIntervalMs = readIntervalMs;
+  pool->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool->wakeFd < 0) {
+    return -1;
+  }
+
+  pool->threads = calloc(numThreads, sizeof(struct drain_thread));
+  if (pool->threads == NULL) {
+    drain_pool_free(pool);
+    return -1;
+  }
+  pool->numThreads = numThreads;
+  for (int i = 0; i < numThreads; i++) {
+    struct drain_thread *thread = &pool->threads[i];
+    thread->pool = pool;
+    thread->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    thread->queue.buf = malloc(queueSize);
+    thread->queue.capacity = queueSize;
+    if (thread->epollFd < 0 || thread->queue.buf == NULL) {
+      drain_pool_free(pool);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct drain_thread *drain_pool_thread_for(struct drain_pool *pool,
+                                           int cpuIndex, int numCpu) {
+  return &pool->threads[(long long)cpuIndex * pool->numThreads / numCpu];
+}
+
+int drain_thread_add_reader(struct drain_thread *thread,
+                            struct perf_reader *reader) {
+  struct perf_reader **readers = realloc(
+      thread->readers, (thread->numReaders + 1) * sizeof(struct perf_reader *));
+  if (readers == NULL) {
+    return -1;
+  }
+  thread->readers = readers;
+  thread->readers[thread->numReaders++] = reader;
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = reader};
+  return epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, perf_reader_fd(reader),
+                   &event);
+}
+
+static long long monotonicMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static void wakeConsumer(struct drain_pool *pool) {
+  uint64_t one = 1;
+  // EAGAIN just means the counter is saturated, and so already readable.
+  write(pool->wakeFd, &one, sizeof(one));
+}
+
+int drain_thread_push(struct drain_thread *thread, int tag, const void *data,
+                      int size) {
+  struct spsc_queue *q = &thread->queue;
+  size_t recordSize = sizeof(struct record_header) + paddedSize(size);
+  if (recordSize > q->capacity / 2) {
+    // Cannot happen for struct event_t, whose size is bounded by PATH_MAX.
+    return -1;
+  }
+
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t offset = tail & (q->capacity - 1);
+  size_t contiguous = q->capacity - offset;
+  size_t needed =
+      recordSize <= contiguous ? recordSize : contiguous + recordSize;
+  while (q->capacity -
+             (tail - atomic_load_explicit(&q->head, memory_order_acquire)) <
+         needed) {
+    // The consumer stops reading before it joins this thread.
+    if (atomic_load_explicit(&thread->pool->stopping, memory_order_relaxed)) {
+      return -1;
+    }
+    wakeConsumer(thread->pool);
+    sched_yield();
+  }
+
+  if (recordSize > contiguous) {
+    struct record_header padding = {.size = PADDING_RECORD};
+    memcpy(q->buf + offset, &padding, sizeof(padding));
+    tail += contiguous;
+    offset = 0;
+  }
+  struct record_header header = {.size = size, .tag = tag};
+  memcpy(q->buf + offset, &header, sizeof(header));
+  memcpy(q->buf + offset + sizeof(header), data, size);
+  atomic_store_explicit(&q->tail, tail + recordSize, memory_order_release);
+  return 0;
+}
+
+static void *drainThreadMain(void *arg) {
+  struct drain_thread *thread = arg;
+  int readIntervalMs = thread->pool->readIntervalMs;
+  long long nextReadAllMs = monotonicMillis() + readIntervalMs;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  while (!atomic_load_explicit(&thread->pool->stopping,
+                               memory_order_relaxed)) {
+    int timeout = STOP_CHECK_INTERVAL_MS;
+    if (readIntervalMs > 0) {
+      long long untilReadAll = nextReadAllMs - monotonicMillis();
+      if (untilReadAll < timeout) {
+        timeout = untilReadAll < 0 ? 0 : untilReadAll;
+      }
+    }
+    int numReady =
+        epoll_wait(thread->epollFd, events, MAX_EPOLL_EVENTS, timeout);
+    for (int i = 0; i < numReady; i++) {
+      // Invokes raw_cb, which calls drain_thread_push(), for every sample.
+      perf_reader_event_read((struct perf_reader *)events[i].data.ptr);
+    }
+
+    int readAll = readIntervalMs > 0 && monotonicMillis() >= nextReadAllMs;
+    if (readAll) {
+      for (int i = 0; i < thread->numReaders; i++) {
+        perf_reader_event_read(thread->readers[i]);
+      }
+      nextReadAllMs = monotonicMillis() + readIntervalMs;
+    }
+    if (numReady > 0 || readAll) {
+      wakeConsumer(thread->pool);
+    }
+  }
+  return NULL;
+}
+
+int drain_pool_start(struct drain_pool *pool) {
+  for (int i = 0; i < pool->numThreads; i++) {
+    struct drain_thread *thread = &pool->threads[i];
+    int rc = pthread_create(&thread->thread, NULL, &drainThreadMain, thread);
+    if (rc != 0) {
+      errno = rc;
+      return -1;
+    }
+    thread->started = 1;
+  }
+  return 0;
+}
+
+int drain_pool_wait(struct drain_pool *pool, int timeout) {
+  struct pollfd pfd = {.fd = pool->wakeFd, .events = POLLIN};
+  if (poll(&pfd, 1, timeout) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  // Reset the eventfd; it is nonblocking, so this is harmless if it is 0.
+  uint64_t count;
+  read(pool->wakeFd, &count, sizeof(count));
+  return 0;
+}
+
+int drain_pool_consume(struct drain_pool *pool, drain_cb cb, void *cookie) {
+  int numConsumed = 0;
+  for (int i = 0; i < pool->numThreads; i++) {
+    struct spsc_queue *q = &pool->threads[i].queue;
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    while (head != tail) {
+      size_t offset = head & (q->capacity - 1);
+      struct record_header header;
+      memcpy(&header, q->buf + offset, sizeof(header));
+      if (header.size == PADDING_RECORD) {
+        head += q->capacity - offset;
+        continue;
+      }
+
+      cb(cookie, header.tag, q->buf + offset + sizeof(header), header.size);
+      numConsumed++;
+      head += sizeof(header) + paddedSize(header.size);
+      // Release the space as we go so a blocked producer can continue.
+      atomic_store_explicit(&q->head, head, memory_order_release);
+    }
+    atomic_store_explicit(&q->head, head, memory_order_release);
+  }
+  return numConsumed;
+}
+
+void drain_pool_stop(struct drain_pool *pool) {
+  atomic_store(&pool->stopping, 1);
+  for (int i = 0; i < pool->numThreads; i++) {
+    struct drain_thread *thread = &pool->threads[i];
+    if (thread->started) {
+      pthread_join(thread->thread, NULL);
+      thread->started = 0;
+    }
+  }
+}
+
+void drain_pool_free(struct drain_pool *pool) {
+  if (pool->threads != NULL) {
+    drain_pool_stop(pool);
+    for (int i = 0; i < pool->numThreads; i++) {
+      struct drain_thread *thread = &pool->threads[i];
+      if (thread->epollFd > 0) {
+        close(thread->epollFd);
+      }
+      free(thread->readers);
+      free(thread->queue.buf);
+    }
+    free(pool->threads);
+  }
+  if (pool->wakeFd > 0) {
+    close(pool->wakeFd);
+  }
+  memset(pool, 0, sizeof(*pool));
+}
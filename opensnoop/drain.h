@@ -0,0 +1,113 @@
+/**
+ * Reads the per-CPU perf buffers on a pool of threads for --threads.
+ *
+ * Each thread owns a contiguous, disjoint group of CPUs' perf readers and
+ * waits on them with its own epoll set, so busy CPUs are drained in parallel
+ * rather than one after another by perf_reader_poll(). Records are copied
+ * out of the perf buffer into a single-producer/single-consumer queue per
+ * thread, and a single consumer (the main thread) drains all of the queues,
+ * so everything downstream (filters, --ordered, formatting and stdout) stays
+ * single-threaded.
+ */
+#pragma once
+
+#include <bcc/perf_reader.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * Lock-free byte ring holding variable-length records. Only the drain thread
+ * advances tail and only the consumer advances head; both only ever grow and
+ * are reduced modulo capacity, which must be a power of 2.
+ */
+struct spsc_queue {
+  unsigned char *buf;
+  size_t capacity;
+  _Atomic size_t head;
+  _Atomic size_t tail;
+};
+
+struct drain_pool;
+
+struct drain_thread {
+  struct drain_pool *pool;
+  pthread_t thread;
+  int started;
+  int epollFd;
+  struct perf_reader **readers;
+  int numReaders;
+  struct spsc_queue queue;
+};
+
+struct drain_pool {
+  struct drain_thread *threads;
+  int numThreads;
+  // eventfd that drain threads signal after pushing to their queues, so the
+  // consumer can sleep while they are all empty.
+  int wakeFd;
+  // If nonzero, each thread also reads all of its perf buffers this often,
+  // whether or not they woke it up.
+  int readIntervalMs;
+  atomic_int stopping;
+};
+
+/** Invoked by drain_pool_consume() with what drain_thread_push() was given. */
+typedef void (*drain_cb)(void *cookie, int tag, void *data, int size);
+
+/**
+ * Creates numThreads threads (not yet started), each with a queue of
+ * queueSize bytes (a power of 2). readIntervalMs is for perf buffers that
+ * batch wakeups; see struct drain_pool. Returns 0 on success or -1 with errno
+ * set.
+ */
+int drain_pool_init(struct drain_pool *pool, int numThreads, size_t queueSize,
+                    int readIntervalMs);
+
+/**
+ * Returns the thread that should own the perf buffer at cpuIndex of numCpu,
+ * so that each thread gets a contiguous group of CPUs.
+ */
+struct drain_thread *drain_pool_thread_for(struct drain_pool *pool,
+                                           int cpuIndex, int numCpu);
+
+/**
+ * Adds reader to thread's epoll set. Must be called before
+ * drain_pool_start(). Returns 0 on success or -1 with errno set.
+ */
+int drain_thread_add_reader(struct drain_thread *thread,
+                            struct perf_reader *reader);
+
+/**
+ * Copies size bytes of data into thread's queue. Called from a perf reader's
+ * raw_cb on the drain thread, and waits for the consumer if the queue is
+ * full, leaving the perf buffer to absorb the backlog.
+ *
+ * Returns 0, or -1 if the record was dropped because the pool is stopping
+ * and the queue is full, so that the caller can count it as lost.
+ */
+int drain_thread_push(struct drain_thread *thread, int tag, const void *data,
+                      int size);
+
+/** Returns 0 on success or -1 with errno set. */
+int drain_pool_start(struct drain_pool *pool);
+
+/**
+ * Waits up to timeout milliseconds (-1 to wait forever) for a drain thread
+ * to push something. Returns -1 on error.
+ */
+int drain_pool_wait(struct drain_pool *pool, int timeout);
+
+/**
+ * Invokes cb for everything in every queue. Returns the number of records
+ * consumed.
+ */
+int drain_pool_consume(struct drain_pool *pool, drain_cb cb, void *cookie);
+
+/**
+ * Stops and joins the threads. Records they had already pushed can still be
+ * consumed afterwards.
+ */
+void drain_pool_stop(struct drain_pool *pool);
+
+void drain_pool_free(struct drain_pool *pool);
@@ -0,0 +1,198 @@
+#include "hist.h"
+#include <bcc/libbpf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Width of the bars of a histogram, in characters.
+#define HIST_BAR_WIDTH 40
+
+static int reserve(struct hist_table *table, size_t capacity) {
+  if (capacity <= table->capacity) {
+    return 0;
+  }
+
+  struct hist_entry *entries =
+      realloc(table->entries, capacity * sizeof(struct hist_entry));
+  if (entries == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  table->entries = entries;
+  table->capacity = capacity;
+  return 0;
+}
+
+int hist_table_collect(struct hist_table *table, int mapFd, int numCpus,
+                       int reset) {
+  table->len = 0;
+  table->total = 0;
+  if (table->numCpus != numCpus) {
+    unsigned long long *values =
+        realloc(table->values, numCpus * sizeof(unsigned long long));
+    if (values == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    table->values = values;
+    table->numCpus = numCpus;
+  }
+
+  // As in top_table_collect(), collect every key before deleting any.
+  while (1) {
+    if (table->len == table->capacity &&
+        reserve(table, 2 * table->capacity + 64) < 0) {
+      return -1;
+    }
+    struct hist_key_t *prev =
+        table->len == 0 ? NULL : &table->entries[table->len - 1].key;
+    struct hist_key_t *next = &table->entries[table->len].key;
+    if (bpf_get_next_key(mapFd, prev, next) < 0) {
+      if (errno == ENOENT) {
+        break;
+      }
+      return -1;
+    }
+    table->len++;
+  }
+
+  size_t numFound = 0;
+  for (size_t i = 0; i < table->len; i++) {
+    struct hist_entry *entry = &table->entries[i];
+    if (bpf_lookup_elem(mapFd, &entry->key, table->values) < 0) {
+      // Deleted since we saw its key.
+      continue;
+    }
+    if (reset) {
+      bpf_delete_elem(mapFd, &entry->key);
+    }
+    entry->count = 0;
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+      entry->count += table->values[cpu];
+    }
+    table->total += entry->count;
+    table->entries[numFound++] = *entry;
+  }
+  table->len = numFound;
+  return 0;
+}
+
+/** Compares everything but the slot. */
+static int compareHistograms(const struct hist_key_t *x,
+                             const struct hist_key_t *y) {
+  int cmp = strncmp(x->comm, y->comm, TASK_COMM_LEN);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return x->err < y->err ? -1 : x->err > y->err;
+}
+
+static int compareEntries(const void *a, const void *b) {
+  const struct hist_key_t *x = &((const struct hist_entry *)a)->key;
+  const struct hist_key_t *y = &((const struct hist_entry *)b)->key;
+  int cmp = compareHistograms(x, y);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+void hist_table_sort(struct hist_table *table) {
+  qsort(table->entries, table->len, sizeof(struct hist_entry),
+        &compareEntries);
+}
+
+/**
+ * Appends the histogram made up of the n entries, which all have the same
+ * comm and err and are sorted by slot.
+ */
+static int appendHistogram(struct output_writer *writer,
+                           const struct hist_entry *entries, size_t n) {
+  unsigned long long counts[HIST_NUM_SLOTS] = {};
+  unsigned long long maxCount = 0;
+  int firstSlot = HIST_NUM_SLOTS, lastSlot = -1;
+  for (size_t i = 0; i < n; i++) {
+    int slot = entries[i].key.slot;
+    if (slot < 0 || slot >= HIST_NUM_SLOTS) {
+      continue;
+    }
+    counts[slot] += entries[i].count;
+    if (counts[slot] > maxCount) {
+      maxCount = counts[slot];
+    }
+    firstSlot = slot < firstSlot ? slot : firstSlot;
+    lastSlot = slot > lastSlot ? slot : lastSlot;
+  }
+
+  output_append_str(writer, "         nsecs           : count    "
+                            "distribution\n");
+  // "%10llu -> %-10llu : %-8llu |%-40s|\n"
+  for (int slot = firstSlot; slot <= lastSlot; slot++) {
+    if (output_writer_maybe_flush(writer) < 0) {
+      return -1;
+    }
+
+    unsigned long long low = slot == 0 ? 0 : 1ULL << (slot - 1);
+    unsigned long long high = slot == 0 ? 0 : (1ULL << (slot - 1)) * 2 - 1;
+    int numStars = counts[slot] * HIST_BAR_WIDTH / maxCount;
+    output_append_int(writer, low, 10, /* leftAlign */ 0);
+    output_append_str(writer, " -> ");
+    output_append_int(writer, high, 10, /* leftAlign */ 1);
+    output_append_str(writer, " : ");
+    output_append_int(writer, counts[slot], 8, /* leftAlign */ 1);
+    output_append_str(writer, " |");
+    char bar[HIST_BAR_WIDTH];
+    memset(bar, '*', numStars);
+    memset(bar + numStars, ' ', HIST_BAR_WIDTH - numStars);
+    output_append_bytes(writer, bar, HIST_BAR_WIDTH);
+    output_append_str(writer, "|\n");
+  }
+  return 0;
+}
+
+int output_append_hist(struct output_writer *writer,
+                       const struct hist_table *table, enum hist_by histBy) {
+  // "\n%H:%M:%S  %llu opens\n"
+  char clock[16];
+  time_t now = time(NULL);
+  struct tm local;
+  strftime(clock, sizeof(clock), "%H:%M:%S", localtime_r(&now, &local));
+  output_append_str(writer, "\n");
+  output_append_str(writer, clock);
+  output_append_str(writer, "  ");
+  output_append_int(writer, table->total, 0, /* leftAlign */ 0);
+  output_append_str(writer, " opens\n");
+
+  size_t start = 0;
+  while (start < table->len) {
+    size_t end = start + 1;
+    while (end < table->len &&
+           compareHistograms(&table->entries[start].key,
+                             &table->entries[end].key) == 0) {
+      end++;
+    }
+
+    const struct hist_key_t *key = &table->entries[start].key;
+    if (histBy == HIST_BY_COMM) {
+      output_append_str(writer, "\ncomm = ");
+      output_append_padded_str(writer, key->comm, TASK_COMM_LEN, 0);
+      output_append_str(writer, "\n");
+    } else if (histBy == HIST_BY_ERRNO) {
+      output_append_str(writer, "\nerr = ");
+      output_append_int(writer, key->err, 0, /* leftAlign */ 0);
+      output_append_str(writer, "\n");
+    }
+    if (appendHistogram(writer, &table->entries[start], end - start) < 0) {
+      return -1;
+    }
+    start = end;
+  }
+  return 0;
+}
+
+void hist_table_free(struct hist_table *table) {
+  free(table->entries);
+  free(table->values);
+  memset(table, 0, sizeof(*table));
+}
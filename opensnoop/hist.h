@@ -0,0 +1,54 @@
+/**
+ * Userspace half of histogram mode (--hist).
+ *
+ * The return program counts each open in the log2 bucket of its latency in a
+ * BPF_MAP_TYPE_PERCPU_HASH from struct hist_key_t to a count, so, as with
+ * --top, nothing crosses to userspace per event. opensnoop sums the per-CPU
+ * counts of every bucket and prints one histogram per comm or errno (or a
+ * single one) either periodically or at exit.
+ */
+#pragma once
+
+#include "opensnoop.h"
+#include "output.h"
+#include "programs.h"
+#include <stddef.h>
+
+struct hist_entry {
+  struct hist_key_t key;
+  // Summed over every CPU.
+  unsigned long long count;
+};
+
+struct hist_table {
+  struct hist_entry *entries;
+  size_t len;
+  size_t capacity;
+  // Sum of the counts of every entry.
+  unsigned long long total;
+  // Scratch space for bpf_lookup_elem(), with room for numCpus values.
+  unsigned long long *values;
+  int numCpus;
+};
+
+/**
+ * Replaces the contents of table with those of the per-CPU map mapFd, which
+ * has a value for each of numCpus possible CPUs, deleting each entry from the
+ * map once it has been read if reset is nonzero. (An open counted between the
+ * read and the delete is lost.) Returns 0 on success or -1 with errno set.
+ */
+int hist_table_collect(struct hist_table *table, int mapFd, int numCpus,
+                       int reset);
+
+/** Sorts by comm, then errno, then bucket, so histograms are contiguous. */
+void hist_table_sort(struct hist_table *table);
+
+/**
+ * Appends a summary line and a histogram for each distinct key of table,
+ * labelled according to histBy. table must be sorted. Returns 0 on success or
+ * -1 with errno set if the writer had to flush and failed.
+ */
+int output_append_hist(struct output_writer *writer,
+                       const struct hist_table *table, enum hist_by histBy);
+
+void hist_table_free(struct hist_table *table);
@@ -0,0 +1,347 @@
+/*
+ * Runs the programs from programs.c in the userspace interpreter, so that
+ * changes to them can be checked and measured without root. Recommended
+ * usage:
+ *
+ * clang -O3 interp_benchmark.c interpreter.c optimizer.c programs.c \
+ *     -o interp_benchmark
+ * ./interp_benchmark [NUM_OPENS]
+ *
+ * For each configuration below, this simulates NUM_OPENS opens, half of
+ * which fail, by running the entry and return programs as the kprobes would
+ * (or only the return program, as fexit without --latency would). The
+ * programs run twice: as assembled, and after the optimiser has been over
+ * them as it is in opensnoop. It checks the number of events or aggregated
+ * opens against what the configuration should produce, and that both runs
+ * produced identical events and stats. It prints the instructions each
+ * optimised program executed per open, how many fewer that is than before,
+ * and the time the interpreter took per open.
+ */
+#include "interpreter.h"
+#include "opensnoop.h"
+#include "optimizer.h"
+#include "programs.h"
+#include <asm/ptrace.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PID 4242
+#define COMM "benchmark"
+#define PATH "/etc/ld.so.cache"
+// do_sys_openat2(dfd, filename, how), as seen by fexit.
+#define TRAMPOLINE_NUM_ARGS 3
+
+enum output_mode {
+  OUTPUT_EVENTS,
+  OUTPUT_TOP,
+  OUTPUT_HIST,
+};
+
+struct configuration {
+  const char *name;
+  enum output_mode mode;
+  int failedOnly;
+  // -n, or NULL.
+  const char *comm;
+  // -p, or 0.
+  unsigned int pid;
+  // Whether the opens are by a PID that is not traced.
+  int filteredOut;
+  // Whether the return program runs alone, as for fexit without an entry
+  // program.
+  int noEntry;
+};
+
+static const struct configuration configurations[] = {
+    {"default", OUTPUT_EVENTS},
+    {"-x", OUTPUT_EVENTS, .failedOnly = 1},
+    {"-n match", OUTPUT_EVENTS, .comm = "bench"},
+    {"-n other", OUTPUT_EVENTS, .comm = "sshd"},
+    {"-p match", OUTPUT_EVENTS, .pid = PID},
+    {"-p other", OUTPUT_EVENTS, .pid = PID + 1, .filteredOut = 1},
+    {"--top", OUTPUT_TOP},
+    {"--hist", OUTPUT_HIST},
+    {"fexit only", OUTPUT_EVENTS, .noEntry = 1},
+};
+
+struct output {
+  int numEvents;
+  // FNV-1a hash of every byte submitted.
+  unsigned long long hash;
+  // The last event, with room for its path.
+  union {
+    struct event_t event;
+    char bytes[sizeof(struct event_t) + NAME_MAX + 1];
+  } last;
+};
+
+/** What one run of the programs for a configuration produced. */
+struct run {
+  struct output output;
+  struct stats_t stats;
+  unsigned long long entrySteps;
+  unsigned long long returnSteps;
+  double elapsed;
+};
+
+static int outputCb(void *cookie, const void *data, int size) {
+  struct output *output = cookie;
+  const unsigned char *bytes = data;
+  output->numEvents++;
+  for (int i = 0; i < size; i++) {
+    output->hash = (output->hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  if (size <= (int)sizeof(output->last)) {
+    memcpy(&output->last, data, size);
+  }
+  return 0;
+}
+
+static double nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/**
+ * Runs the optimiser over a program as opensnoop does, keeping the
+ * instructions in relocs for relocate_program(). Returns the new number of
+ * instructions, or -1 with errno set.
+ */
+static int optimize(struct bpf_insn *insns, int numInsns,
+                    struct relocs *relocs) {
+  int pinned[MAX_RELOCS];
+  for (int i = 0; i < relocs->num; i++) {
+    pinned[i] = relocs->entries[i].insn;
+  }
+  numInsns = optimize_program(insns, numInsns, pinned, relocs->num, NULL);
+  for (int i = 0; i < relocs->num; i++) {
+    relocs->entries[i].insn = pinned[i];
+  }
+  return numInsns;
+}
+
+/**
+ * Runs numOpens opens through the programs for config, optimised if
+ * optimized is nonzero, into *run. Returns 0, or prints why not and returns
+ * -1.
+ */
+static int runPrograms(const struct configuration *config, int numOpens,
+                       int optimized, struct run *run) {
+  struct interp interp;
+  memset(run, 0, sizeof(*run));
+  run->output.hash = 0xcbf29ce484222325ULL;
+  interp_init(&interp);
+  interp.pidTgid = (unsigned long long)PID << 32 | PID;
+  strncpy(interp.comm, COMM, sizeof(interp.comm) - 1);
+  interp.output_cb = outputCb;
+  interp.cookie = &run->output;
+
+  int fnameMax = NAME_MAX + 1;
+  int infotmpFd = interp_create_map(&interp, BPF_MAP_TYPE_HASH,
+                                    sizeof(unsigned long long),
+                                    sizeof(struct val_t), 10240);
+  int configFd = interp_create_map(&interp, BPF_MAP_TYPE_ARRAY, sizeof(int),
+                                   sizeof(struct config_t), 1);
+  int statsFd = interp_create_map(&interp, BPF_MAP_TYPE_PERCPU_ARRAY,
+                                  sizeof(int), sizeof(struct stats_t), 1);
+  int scratchFd =
+      interp_create_map(&interp, BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(int),
+                        sizeof(struct event_t) + fnameMax, 1);
+  int eventsFd = interp_create_map(&interp, BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+                                   sizeof(int), sizeof(int), 1);
+  int topFd = -1, histFd = -1, filterFd = -1;
+  if (config->mode == OUTPUT_TOP) {
+    topFd = interp_create_map(&interp, BPF_MAP_TYPE_HASH,
+                              sizeof(struct top_key_t),
+                              sizeof(struct top_value_t), 1024);
+  } else if (config->mode == OUTPUT_HIST) {
+    histFd = interp_create_map(&interp, BPF_MAP_TYPE_PERCPU_HASH,
+                               sizeof(struct hist_key_t),
+                               sizeof(unsigned long long), 1024);
+  }
+  if (config->pid != 0) {
+    filterFd = interp_create_map(&interp, BPF_MAP_TYPE_HASH,
+                                 sizeof(struct filter_key_t), sizeof(int),
+                                 1024);
+    struct filter_key_t key = {.id = config->pid, .type = FILTER_PID};
+    int one = 1;
+    interp_map_update(&interp, filterFd, &key, &one, BPF_ANY);
+  }
+
+  int zero = 0;
+  struct config_t configValue = {.failed_only = config->failedOnly};
+  if (config->comm != NULL) {
+    configValue.has_name = 1;
+    size_t len = strlen(config->comm);
+    memcpy(configValue.name, config->comm, len);
+    memset(configValue.name_mask, 0xff, len);
+  }
+  interp_map_update(&interp, configFd, &zero, &configValue, BPF_ANY);
+
+  struct trace_entry_params entryParams = {
+      .infotmpFd = infotmpFd,
+      .filterFd = filterFd,
+      .cgroupFd = -1,
+      .statsFd = statsFd,
+  };
+  struct trace_return_params returnParams = {
+      .infotmpFd = config->noEntry ? -1 : infotmpFd,
+      .filterFd = filterFd,
+      .cgroupFd = -1,
+      .eventsFd = eventsFd,
+      .configFd = configFd,
+      .scratchFd = scratchFd,
+      .statsFd = statsFd,
+      .topFd = topFd,
+      .histFd = histFd,
+      .histBy = HIST_BY_NONE,
+      .fnameMax = fnameMax,
+  };
+  enum probe_type probeType = config->noEntry ? PROBE_TRAMPOLINE : PROBE_KPROBE;
+
+  static struct bpf_insn entryInsns[MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS];
+  static struct bpf_insn returnInsns[MAX_NUM_TRACE_RETURN_INSTRUCTIONS];
+  struct relocs entryRelocs = {}, returnRelocs = {};
+  int numEntryInsns =
+      assemble_trace_entry(entryInsns, &entryParams, &entryRelocs);
+  int numReturnInsns =
+      assemble_trace_return(returnInsns, &returnParams, &returnRelocs);
+  if (numEntryInsns < 0 || numReturnInsns < 0) {
+    printf("%-12s assembly failed: %s\n", config->name, strerror(errno));
+    interp_free(&interp);
+    return -1;
+  }
+  if (optimized) {
+    numEntryInsns = optimize(entryInsns, numEntryInsns, &entryRelocs);
+    numReturnInsns = optimize(returnInsns, numReturnInsns, &returnRelocs);
+    if (numEntryInsns < 0 || numReturnInsns < 0) {
+      printf("%-12s optimization failed: %s\n", config->name,
+             strerror(errno));
+      interp_free(&interp);
+      return -1;
+    }
+  }
+  relocate_program(entryInsns, &entryRelocs, probeType, TRAMPOLINE_NUM_ARGS);
+  relocate_program(returnInsns, &returnRelocs, probeType,
+                   TRAMPOLINE_NUM_ARGS);
+
+  // The fake pt_regs of the kprobes, or the arguments and return value of
+  // do_sys_openat2() for fexit.
+  struct pt_regs regs = {};
+  unsigned long long args[TRAMPOLINE_NUM_ARGS + 1] = {};
+  regs.rsi = (unsigned long)PATH;
+  args[1] = (unsigned long long)(unsigned long)PATH;
+  void *ctx = config->noEntry ? (void *)args : (void *)&regs;
+  size_t ctxSize = config->noEntry ? sizeof(args) : sizeof(regs);
+
+  unsigned long long ret;
+  double start = nowNanos();
+  for (int i = 0; i < numOpens; i++) {
+    int rc = i % 2 == 0 ? 3 : -ENOENT;
+    regs.rax = rc;
+    args[TRAMPOLINE_NUM_ARGS] = rc;
+    interp.ktimeNs = 1000000ULL * i;
+    if (!config->noEntry) {
+      if (interp_run(&interp, entryInsns, numEntryInsns, ctx, ctxSize,
+                     &ret) < 0) {
+        printf("%-12s entry program failed: %s\n", config->name,
+               interp.error);
+        interp_free(&interp);
+        return -1;
+      }
+      run->entrySteps += interp.lastSteps;
+    }
+    interp.ktimeNs += 1000 + i % 5000;
+    if (interp_run(&interp, returnInsns, numReturnInsns, ctx, ctxSize,
+                   &ret) < 0) {
+      printf("%-12s return program failed: %s\n", config->name,
+             interp.error);
+      interp_free(&interp);
+      return -1;
+    }
+    run->returnSteps += interp.lastSteps;
+  }
+  run->elapsed = nowNanos() - start;
+
+  memcpy(&run->stats, interp_map_lookup(&interp, statsFd, &zero),
+         sizeof(run->stats));
+  interp_free(&interp);
+  return 0;
+}
+
+/**
+ * Runs numOpens opens through the programs for config, as assembled and
+ * optimised. Returns 0 and prints a line of results, or prints why not and
+ * returns -1.
+ */
+static int runConfiguration(const struct configuration *config,
+                            int numOpens) {
+  static struct run assembled, optimized;
+  if (runPrograms(config, numOpens, 0, &assembled) < 0 ||
+      runPrograms(config, numOpens, 1, &optimized) < 0) {
+    return -1;
+  }
+
+  // Every open is recorded, except those filtered out.
+  int expected = numOpens;
+  if (config->filteredOut ||
+      (config->comm != NULL && strstr(COMM, config->comm) == NULL)) {
+    expected = 0;
+  } else if (config->failedOnly) {
+    expected = numOpens / 2;
+  }
+  const struct stats_t *stats = &optimized.stats;
+  const struct output *output = &optimized.output;
+  const char *problem = NULL;
+  if ((int)stats->submitted != expected) {
+    problem = "wrong number of submissions";
+  } else if (config->mode == OUTPUT_EVENTS && output->numEvents != expected) {
+    problem = "wrong number of events";
+  } else if (config->mode == OUTPUT_EVENTS && expected > 0 &&
+             (strcmp(output->last.event.fname, PATH) != 0 ||
+              strcmp(output->last.event.comm, COMM) != 0 ||
+              output->last.event.ret != (numOpens % 2 == 0 ? -ENOENT : 3))) {
+    problem = "wrong contents of the last event";
+  } else if (stats->missed_entries != 0 || stats->stale_entries != 0 ||
+             stats->failed_updates != 0) {
+    problem = "unmatched entries";
+  } else if (output->numEvents != assembled.output.numEvents ||
+             output->hash != assembled.output.hash) {
+    problem = "events differ when optimised";
+  } else if (memcmp(stats, &assembled.stats, sizeof(*stats)) != 0) {
+    problem = "stats differ when optimised";
+  }
+
+  unsigned long long steps = optimized.entrySteps + optimized.returnSteps;
+  unsigned long long assembledSteps =
+      assembled.entrySteps + assembled.returnSteps;
+  printf("%-12s %8.1f %8.1f %8.1f %10.1f  %s\n", config->name,
+         (double)optimized.entrySteps / numOpens,
+         (double)optimized.returnSteps / numOpens,
+         ((double)assembledSteps - steps) / numOpens,
+         optimized.elapsed / numOpens, problem != NULL ? problem : "ok");
+  return problem != NULL ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+  int numOpens = argc > 1 ? atoi(argv[1]) : 100000;
+  if (numOpens <= 0) {
+    fprintf(stderr, "usage: %s [NUM_OPENS]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-12s %8s %8s %8s %10s  %s\n", "CONFIG", "ENTRY", "RETURN", "SAVED",
+         "NS/OPEN", "CHECK");
+  int exitCode = 0;
+  for (size_t i = 0; i < sizeof(configurations) / sizeof(configurations[0]);
+       i++) {
+    if (runConfiguration(&configurations[i], numOpens) < 0) {
+      exitCode = 1;
+    }
+  }
+  return exitCode;
+}
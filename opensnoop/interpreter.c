@@ -0,0 +1,744 @@
+#include "interpreter.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Map fds are offset so that they are not mistaken for real ones.
+#define MAP_FD_BASE 1000
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_USED,
+  SLOT_DELETED,
+};
+
+static int isArray(enum bpf_map_type type) {
+  return type == BPF_MAP_TYPE_ARRAY || type == BPF_MAP_TYPE_PERCPU_ARRAY;
+}
+
+static int isHash(enum bpf_map_type type) {
+  return type == BPF_MAP_TYPE_HASH || type == BPF_MAP_TYPE_PERCPU_HASH ||
+         type == BPF_MAP_TYPE_LRU_HASH ||
+         type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+static int isLru(enum bpf_map_type type) {
+  return type == BPF_MAP_TYPE_LRU_HASH ||
+         type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+void interp_init(struct interp *interp) { memset(interp, 0, sizeof(*interp)); }
+
+void interp_free(struct interp *interp) {
+  for (int i = 0; i < interp->numMaps; i++) {
+    struct interp_map *map = &interp->maps[i];
+    free(map->keys);
+    free(map->values);
+    free(map->state);
+    free(map->lastUsed);
+  }
+  memset(interp, 0, sizeof(*interp));
+}
+
+int interp_create_map(struct interp *interp, enum bpf_map_type type,
+                      unsigned int keySize, unsigned int valueSize,
+                      unsigned int maxEntries) {
+  if (interp->numMaps == INTERP_MAX_MAPS) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if ((!isArray(type) && !isHash(type) &&
+       type != BPF_MAP_TYPE_PERF_EVENT_ARRAY &&
+       type != BPF_MAP_TYPE_RINGBUF) ||
+      (isArray(type) && keySize != sizeof(unsigned int)) || maxEntries == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct interp_map *map = &interp->maps[interp->numMaps];
+  memset(map, 0, sizeof(*map));
+  map->type = type;
+  map->keySize = keySize;
+  map->valueSize = valueSize;
+  map->maxEntries = maxEntries;
+  if (isArray(type)) {
+    map->values = calloc(maxEntries, valueSize);
+    if (map->values == NULL) {
+      return -1;
+    }
+  } else if (isHash(type)) {
+    // At most half full, so that probe sequences stay short.
+    map->numSlots = 8;
+    while (map->numSlots < 2 * maxEntries) {
+      map->numSlots *= 2;
+    }
+    map->keys = calloc(map->numSlots, keySize);
+    map->values = calloc(map->numSlots, valueSize);
+    map->state = calloc(map->numSlots, 1);
+    map->lastUsed = calloc(map->numSlots, sizeof(unsigned long long));
+    if (map->keys == NULL || map->values == NULL || map->state == NULL ||
+        map->lastUsed == NULL) {
+      free(map->keys);
+      free(map->values);
+      free(map->state);
+      free(map->lastUsed);
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  return MAP_FD_BASE + interp->numMaps++;
+}
+
+static struct interp_map *mapForFd(struct interp *interp, int mapFd) {
+  int index = mapFd - MAP_FD_BASE;
+  if (index < 0 || index >= interp->numMaps) {
+    return NULL;
+  }
+  return &interp->maps[index];
+}
+
+/** Returns the map whose address a program loaded, or NULL. */
+static struct interp_map *mapForPointer(struct interp *interp,
+                                        unsigned long long ptr) {
+  for (int i = 0; i < interp->numMaps; i++) {
+    if (ptr == (uintptr_t)&interp->maps[i]) {
+      return &interp->maps[i];
+    }
+  }
+  return NULL;
+}
+
+static unsigned int hashKey(const struct interp_map *map, const void *key) {
+  const unsigned char *bytes = key;
+  unsigned int hash = 2166136261u;
+  for (unsigned int i = 0; i < map->keySize; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Returns the slot of a hash map that holds key, or -1. If freeSlot is not
+ * NULL, it is set to the first slot in key's probe sequence that an insert
+ * could use, or -1.
+ */
+static int findSlot(const struct interp_map *map, const void *key,
+                    int *freeSlot) {
+  unsigned int mask = map->numSlots - 1;
+  unsigned int slot = hashKey(map, key) & mask;
+  if (freeSlot != NULL) {
+    *freeSlot = -1;
+  }
+  for (unsigned int i = 0; i < map->numSlots; i++, slot = (slot + 1) & mask) {
+    if (map->state[slot] == SLOT_FREE) {
+      if (freeSlot != NULL && *freeSlot == -1) {
+        *freeSlot = slot;
+      }
+      return -1;
+    }
+    if (map->state[slot] == SLOT_DELETED) {
+      if (freeSlot != NULL && *freeSlot == -1) {
+        *freeSlot = slot;
+      }
+    } else if (memcmp(map->keys + (size_t)slot * map->keySize, key,
+                      map->keySize) == 0) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+static void *mapLookup(struct interp *interp, struct interp_map *map,
+                       const void *key) {
+  if (isArray(map->type)) {
+    unsigned int index;
+    memcpy(&index, key, sizeof(index));
+    return index < map->maxEntries
+               ? map->values + (size_t)index * map->valueSize
+               : NULL;
+  }
+  if (!isHash(map->type)) {
+    return NULL;
+  }
+  int slot = findSlot(map, key, NULL);
+  if (slot < 0) {
+    return NULL;
+  }
+  map->lastUsed[slot] = ++interp->clock;
+  return map->values + (size_t)slot * map->valueSize;
+}
+
+/**
+ * Frees an entry's slot. A slot followed by a free one ends every probe
+ * sequence through it, so it and the deleted slots before it become free
+ * rather than tombstones that every miss has to step over.
+ */
+static void removeSlot(struct interp_map *map, unsigned int slot) {
+  unsigned int mask = map->numSlots - 1;
+  map->numEntries--;
+  if (map->state[(slot + 1) & mask] != SLOT_FREE) {
+    map->state[slot] = SLOT_DELETED;
+    return;
+  }
+  do {
+    map->state[slot] = SLOT_FREE;
+    slot = (slot - 1) & mask;
+  } while (map->state[slot] == SLOT_DELETED);
+}
+
+/** Removes the least recently used entry of a full LRU map. */
+static void evictLru(struct interp_map *map) {
+  int oldest = -1;
+  for (unsigned int i = 0; i < map->numSlots; i++) {
+    if (map->state[i] == SLOT_USED &&
+        (oldest == -1 || map->lastUsed[i] < map->lastUsed[oldest])) {
+      oldest = i;
+    }
+  }
+  removeSlot(map, oldest);
+}
+
+/** Returns 0 or a negative errno, as the map_update_elem helper does. */
+static int mapUpdate(struct interp *interp, struct interp_map *map,
+                     const void *key, const void *value,
+                     unsigned long long flags) {
+  if (flags > BPF_EXIST) {
+    return -EINVAL;
+  }
+  if (isArray(map->type)) {
+    void *dst = mapLookup(interp, map, key);
+    if (dst == NULL) {
+      return -E2BIG;
+    }
+    if (flags == BPF_NOEXIST) {
+      return -EEXIST;
+    }
+    memcpy(dst, value, map->valueSize);
+    return 0;
+  }
+  if (!isHash(map->type)) {
+    return -EINVAL;
+  }
+
+  int freeSlot;
+  int slot = findSlot(map, key, &freeSlot);
+  if (slot >= 0 && flags == BPF_NOEXIST) {
+    return -EEXIST;
+  }
+  if (slot < 0) {
+    if (flags == BPF_EXIST) {
+      return -ENOENT;
+    }
+    if (map->numEntries == map->maxEntries) {
+      if (!isLru(map->type)) {
+        return -E2BIG;
+      }
+      evictLru(map);
+      findSlot(map, key, &freeSlot);
+    }
+    slot = freeSlot;
+    map->state[slot] = SLOT_USED;
+    map->numEntries++;
+    memcpy(map->keys + (size_t)slot * map->keySize, key, map->keySize);
+  }
+  memcpy(map->values + (size_t)slot * map->valueSize, value, map->valueSize);
+  map->lastUsed[slot] = ++interp->clock;
+  return 0;
+}
+
+static int mapDelete(struct interp_map *map, const void *key) {
+  if (!isHash(map->type)) {
+    return -EINVAL;
+  }
+  int slot = findSlot(map, key, NULL);
+  if (slot < 0) {
+    return -ENOENT;
+  }
+  removeSlot(map, slot);
+  return 0;
+}
+
+const void *interp_map_address(struct interp *interp, int mapFd) {
+  return mapForFd(interp, mapFd);
+}
+
+void *interp_map_lookup(struct interp *interp, int mapFd, const void *key) {
+  struct interp_map *map = mapForFd(interp, mapFd);
+  return map != NULL ? mapLookup(interp, map, key) : NULL;
+}
+
+int interp_map_update(struct interp *interp, int mapFd, const void *key,
+                      const void *value, unsigned long long flags) {
+  struct interp_map *map = mapForFd(interp, mapFd);
+  int rc = map != NULL ? mapUpdate(interp, map, key, value, flags) : -EBADF;
+  if (rc < 0) {
+    errno = -rc;
+    return -1;
+  }
+  return 0;
+}
+
+int interp_map_delete(struct interp *interp, int mapFd, const void *key) {
+  struct interp_map *map = mapForFd(interp, mapFd);
+  int rc = map != NULL ? mapDelete(map, key) : -EBADF;
+  if (rc < 0) {
+    errno = -rc;
+    return -1;
+  }
+  return 0;
+}
+
+static int fail(struct interp_frame *run, const char *format, ...) {
+  int len = snprintf(run->interp->error, sizeof(run->interp->error),
+                     "insn %d: ", run->pc);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(run->interp->error + len, sizeof(run->interp->error) - len,
+            format, args);
+  va_end(args);
+  return -1;
+}
+
+static int inRegion(unsigned long long addr, size_t size, const void *start,
+                    size_t regionSize) {
+  uintptr_t begin = (uintptr_t)start;
+  return addr >= begin && size <= regionSize &&
+         addr - begin <= regionSize - size;
+}
+
+/**
+ * Returns nonzero if the program may access size bytes at addr: they must
+ * be on the stack, in ctx or in the values of a map.
+ */
+static int canAccess(const struct interp_frame *run, unsigned long long addr,
+                     size_t size) {
+  if (inRegion(addr, size, run->stack, INTERP_STACK_SIZE) ||
+      inRegion(addr, size, run->ctx, run->ctxSize)) {
+    return 1;
+  }
+  const struct interp *interp = run->interp;
+  for (int i = 0; i < interp->numMaps; i++) {
+    const struct interp_map *map = &interp->maps[i];
+    size_t numValues = isArray(map->type) ? map->maxEntries : map->numSlots;
+    if (map->values != NULL &&
+        inRegion(addr, size, map->values, numValues * map->valueSize)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Copies a string of at most size bytes, including the NUL. */
+static long long readStr(void *dst, unsigned int size,
+                         unsigned long long src) {
+  if (size == 0) {
+    return 0;
+  }
+  if (src == 0) {
+    memset(dst, 0, size);
+    return -EFAULT;
+  }
+  const char *s = (const char *)(uintptr_t)src;
+  size_t len = strnlen(s, size - 1);
+  memcpy(dst, s, len);
+  ((char *)dst)[len] = '\0';
+  return len + 1;
+}
+
+int interp_call_helper(struct interp_frame *run, int func,
+                       const unsigned long long args[5],
+                       unsigned long long *ret) {
+  struct interp *interp = run->interp;
+  struct interp_map *map;
+  switch (func) {
+  case BPF_FUNC_map_lookup_elem:
+  case BPF_FUNC_map_update_elem:
+  case BPF_FUNC_map_delete_elem: {
+    map = mapForPointer(interp, args[0]);
+    if (map == NULL) {
+      return fail(run, "helper %d: r1 is not a map", func);
+    }
+    if (!canAccess(run, args[1], map->keySize)) {
+      return fail(run, "helper %d: bad key pointer", func);
+    }
+    const void *key = (const void *)(uintptr_t)args[1];
+    if (func == BPF_FUNC_map_lookup_elem) {
+      *ret = (uintptr_t)mapLookup(interp, map, key);
+    } else if (func == BPF_FUNC_map_delete_elem) {
+      *ret = mapDelete(map, key);
+    } else {
+      if (!canAccess(run, args[2], map->valueSize)) {
+        return fail(run, "helper %d: bad value pointer", func);
+      }
+      *ret = mapUpdate(interp, map, key, (const void *)(uintptr_t)args[2],
+                       args[3]);
+    }
+    return 0;
+  }
+  case BPF_FUNC_probe_read:
+  case BPF_FUNC_probe_read_user:
+  case BPF_FUNC_probe_read_kernel:
+    if (!canAccess(run, args[0], (unsigned int)args[1])) {
+      return fail(run, "helper %d: bad destination", func);
+    }
+    if (args[2] == 0) {
+      memset((void *)(uintptr_t)args[0], 0, (unsigned int)args[1]);
+      *ret = -EFAULT;
+    } else {
+      memcpy((void *)(uintptr_t)args[0], (const void *)(uintptr_t)args[2],
+             (unsigned int)args[1]);
+      *ret = 0;
+    }
+    return 0;
+  case BPF_FUNC_probe_read_str:
+  case BPF_FUNC_probe_read_user_str:
+  case BPF_FUNC_probe_read_kernel_str:
+    if (!canAccess(run, args[0], (unsigned int)args[1])) {
+      return fail(run, "helper %d: bad destination", func);
+    }
+    *ret = readStr((void *)(uintptr_t)args[0], args[1], args[2]);
+    return 0;
+  case BPF_FUNC_ktime_get_ns:
+    *ret = interp->ktimeNs;
+    return 0;
+  case BPF_FUNC_get_current_pid_tgid:
+    *ret = interp->pidTgid;
+    return 0;
+  case BPF_FUNC_get_current_cgroup_id:
+    *ret = interp->cgroupId;
+    return 0;
+  case BPF_FUNC_get_current_comm: {
+    unsigned int size = args[1];
+    if (size == 0 || !canAccess(run, args[0], size)) {
+      return fail(run, "helper %d: bad buffer", func);
+    }
+    char *dst = (char *)(uintptr_t)args[0];
+    strncpy(dst, interp->comm, size);
+    dst[size - 1] = '\0';
+    *ret = 0;
+    return 0;
+  }
+  case BPF_FUNC_perf_event_output:
+  case BPF_FUNC_ringbuf_output: {
+    int isPerf = func == BPF_FUNC_perf_event_output;
+    map = mapForPointer(interp, args[isPerf ? 1 : 0]);
+    unsigned long long data = args[isPerf ? 3 : 1];
+    unsigned long long size = args[isPerf ? 4 : 2];
+    if (map == NULL ||
+        map->type != (isPerf ? BPF_MAP_TYPE_PERF_EVENT_ARRAY
+                             : BPF_MAP_TYPE_RINGBUF)) {
+      return fail(run, "helper %d: wrong map", func);
+    }
+    if (!canAccess(run, data, size)) {
+      return fail(run, "helper %d: bad data pointer", func);
+    }
+    *ret = interp->output_cb != NULL
+               ? interp->output_cb(interp->cookie,
+                                   (const void *)(uintptr_t)data, size)
+               : 0;
+    return 0;
+  }
+  default:
+    return fail(run, "unsupported helper %d", func);
+  }
+}
+
+static int sizeInBytes(int size) {
+  switch (size) {
+  case BPF_B:
+    return 1;
+  case BPF_H:
+    return 2;
+  case BPF_W:
+    return 4;
+  default:
+    return 8;
+  }
+}
+
+static unsigned long long load(unsigned long long addr, int bytes) {
+  unsigned char b;
+  unsigned short h;
+  unsigned int w;
+  unsigned long long dw;
+  const void *src = (const void *)(uintptr_t)addr;
+  switch (bytes) {
+  case 1:
+    memcpy(&b, src, 1);
+    return b;
+  case 2:
+    memcpy(&h, src, 2);
+    return h;
+  case 4:
+    memcpy(&w, src, 4);
+    return w;
+  default:
+    memcpy(&dw, src, 8);
+    return dw;
+  }
+}
+
+static void store(unsigned long long addr, int bytes,
+                  unsigned long long value) {
+  unsigned char b = value;
+  unsigned short h = value;
+  unsigned int w = value;
+  void *dst = (void *)(uintptr_t)addr;
+  switch (bytes) {
+  case 1:
+    memcpy(dst, &b, 1);
+    break;
+  case 2:
+    memcpy(dst, &h, 2);
+    break;
+  case 4:
+    memcpy(dst, &w, 4);
+    break;
+  default:
+    memcpy(dst, &value, 8);
+    break;
+  }
+}
+
+/** Returns dst op src for an ALU or ALU64 instruction. */
+static int alu(struct interp_frame *run, int op, int is64,
+               unsigned long long dst, unsigned long long src, int imm,
+               unsigned long long *result) {
+  // BPF_END is always BPF_ALU, but swaps all 64 bits when imm is 64.
+  if (!is64 && op != BPF_END) {
+    dst = (unsigned int)dst;
+    src = (unsigned int)src;
+  }
+  int bits = is64 ? 64 : 32;
+  switch (op) {
+  case BPF_ADD:
+    *result = dst + src;
+    break;
+  case BPF_SUB:
+    *result = dst - src;
+    break;
+  case BPF_MUL:
+    *result = dst * src;
+    break;
+  case BPF_DIV:
+    *result = src == 0 ? 0 : dst / src;
+    break;
+  case BPF_MOD:
+    *result = src == 0 ? dst : dst % src;
+    break;
+  case BPF_OR:
+    *result = dst | src;
+    break;
+  case BPF_AND:
+    *result = dst & src;
+    break;
+  case BPF_XOR:
+    *result = dst ^ src;
+    break;
+  case BPF_LSH:
+    *result = dst << (src & (bits - 1));
+    break;
+  case BPF_RSH:
+    *result = dst >> (src & (bits - 1));
+    break;
+  case BPF_ARSH:
+    *result = is64 ? (unsigned long long)((long long)dst >> (src & 63))
+                   : (unsigned int)((int)dst >> (src & 31));
+    break;
+  case BPF_NEG:
+    *result = -dst;
+    break;
+  case BPF_MOV:
+    *result = src;
+    break;
+  case BPF_END:
+    // src is BPF_TO_LE or BPF_TO_BE and imm the width; this is little-endian.
+    if (imm != 16 && imm != 32 && imm != 64) {
+      return fail(run, "bad byte swap width %d", imm);
+    }
+    if (src == BPF_TO_BE) {
+      dst = imm == 16   ? __builtin_bswap16(dst)
+            : imm == 32 ? __builtin_bswap32(dst)
+                        : __builtin_bswap64(dst);
+    }
+    *result = imm == 64 ? dst : dst & ((1ULL << imm) - 1);
+    return 0;
+  default:
+    return fail(run, "unsupported ALU op %#x", op);
+  }
+  if (!is64) {
+    *result = (unsigned int)*result;
+  }
+  return 0;
+}
+
+/** Returns whether a conditional jump is taken. */
+static int jumpTaken(int op, int is64, unsigned long long dst,
+                     unsigned long long src) {
+  long long sdst = is64 ? (long long)dst : (int)dst;
+  long long ssrc = is64 ? (long long)src : (int)src;
+  if (!is64) {
+    dst = (unsigned int)dst;
+    src = (unsigned int)src;
+  }
+  switch (op) {
+  case BPF_JEQ:
+    return dst == src;
+  case BPF_JNE:
+    return dst != src;
+  case BPF_JGT:
+    return dst > src;
+  case BPF_JGE:
+    return dst >= src;
+  case BPF_JLT:
+    return dst < src;
+  case BPF_JLE:
+    return dst <= src;
+  case BPF_JSET:
+    return (dst & src) != 0;
+  case BPF_JSGT:
+    return sdst > ssrc;
+  case BPF_JSGE:
+    return sdst >= ssrc;
+  case BPF_JSLT:
+    return sdst < ssrc;
+  default:
+    return sdst <= ssrc;
+  }
+}
+
+int interp_run(struct interp *interp, const struct bpf_insn *insns,
+               int numInsns, void *ctx, size_t ctxSize,
+               unsigned long long *ret) {
+  unsigned char stack[INTERP_STACK_SIZE] __attribute__((aligned(8)));
+  unsigned long long reg[MAX_BPF_REG] = {0};
+  struct interp_frame run = {
+      .interp = interp, .stack = stack, .ctx = ctx, .ctxSize = ctxSize};
+  unsigned long long steps = 0;
+  int rc = 0;
+  reg[BPF_REG_1] = (uintptr_t)ctx;
+  reg[BPF_REG_10] = (uintptr_t)(stack + INTERP_STACK_SIZE);
+  interp->error[0] = '\0';
+
+  for (;;) {
+    if (run.pc < 0 || run.pc >= numInsns) {
+      rc = fail(&run, "jumped out of the program");
+      break;
+    }
+    if (++steps > INTERP_MAX_STEPS) {
+      rc = fail(&run, "more than %d instructions executed", INTERP_MAX_STEPS);
+      break;
+    }
+    const struct bpf_insn *insn = &insns[run.pc];
+    int code = insn->code, dst = insn->dst_reg, src = insn->src_reg;
+    int cls = BPF_CLASS(code);
+    if (dst >= MAX_BPF_REG || src >= MAX_BPF_REG) {
+      rc = fail(&run, "bad register");
+      break;
+    }
+    // Only stores may name r10 as their destination, as a base address.
+    if (dst == BPF_REG_10 && cls != BPF_ST && cls != BPF_STX &&
+        cls != BPF_JMP && cls != BPF_JMP32) {
+      rc = fail(&run, "r10 is read-only");
+      break;
+    }
+
+    if (cls == BPF_ALU || cls == BPF_ALU64) {
+      int op = BPF_OP(code);
+      unsigned long long operand =
+          BPF_SRC(code) == BPF_X ? reg[src] : (unsigned long long)insn->imm;
+      if (op == BPF_END) {
+        operand = BPF_SRC(code);
+      }
+      if (alu(&run, op, cls == BPF_ALU64, reg[dst], operand, insn->imm,
+              &reg[dst]) < 0) {
+        rc = -1;
+        break;
+      }
+      run.pc++;
+    } else if (cls == BPF_JMP || cls == BPF_JMP32) {
+      int op = BPF_OP(code);
+      if (op == BPF_EXIT && cls == BPF_JMP) {
+        *ret = reg[BPF_REG_0];
+        break;
+      } else if (op == BPF_CALL && cls == BPF_JMP) {
+        if (interp_call_helper(&run, insn->imm, &reg[BPF_REG_1],
+                               &reg[BPF_REG_0]) < 0) {
+          rc = -1;
+          break;
+        }
+        // r1-r5 are clobbered by calls; make a program that relies on them
+        // fail visibly.
+        for (int i = BPF_REG_1; i <= BPF_REG_5; i++) {
+          reg[i] = 0xdeadbeefdeadbeefULL;
+        }
+        run.pc++;
+      } else if (op == BPF_JA) {
+        run.pc += 1 + insn->off;
+      } else {
+        unsigned long long operand = BPF_SRC(code) == BPF_X
+                                         ? reg[src]
+                                         : (unsigned long long)insn->imm;
+        int taken = jumpTaken(op, cls == BPF_JMP, reg[dst], operand);
+        run.pc += 1 + (taken ? insn->off : 0);
+      }
+    } else if (code == (BPF_LD | BPF_IMM | BPF_DW)) {
+      if (run.pc + 1 >= numInsns) {
+        rc = fail(&run, "truncated 64-bit immediate");
+        break;
+      }
+      if (src == BPF_PSEUDO_MAP_FD) {
+        struct interp_map *map = mapForFd(interp, insn->imm);
+        if (map == NULL) {
+          rc = fail(&run, "unknown map fd %d", insn->imm);
+          break;
+        }
+        reg[dst] = (uintptr_t)map;
+      } else if (src == 0) {
+        reg[dst] = (unsigned int)insn->imm |
+                   (unsigned long long)insns[run.pc + 1].imm << 32;
+      } else {
+        rc = fail(&run, "unsupported 64-bit immediate type %d", src);
+        break;
+      }
+      run.pc += 2;
+    } else if (cls == BPF_LDX || cls == BPF_ST || cls == BPF_STX) {
+      int bytes = sizeInBytes(BPF_SIZE(code));
+      int mode = BPF_MODE(code);
+      unsigned long long addr =
+          (cls == BPF_LDX ? reg[src] : reg[dst]) + insn->off;
+      if (mode != BPF_MEM && !(cls == BPF_STX && mode == BPF_XADD)) {
+        rc = fail(&run, "unsupported memory mode %#x", mode);
+        break;
+      }
+      if (!canAccess(&run, addr, bytes)) {
+        rc = fail(&run, "out of bounds %d-byte access", bytes);
+        break;
+      }
+      if (cls == BPF_LDX) {
+        reg[dst] = load(addr, bytes);
+      } else if (cls == BPF_ST) {
+        store(addr, bytes, (unsigned long long)insn->imm);
+      } else if (mode == BPF_MEM) {
+        store(addr, bytes, reg[src]);
+      } else if (insn->imm == BPF_ADD && (bytes == 4 || bytes == 8)) {
+        // Single-threaded, so the atomic add needs no atomics.
+        store(addr, bytes, load(addr, bytes) + reg[src]);
+      } else {
+        rc = fail(&run, "unsupported atomic operation %#x", insn->imm);
+        break;
+      }
+      run.pc++;
+    } else {
+      rc = fail(&run, "unsupported opcode %#x", code);
+      break;
+    }
+  }
+
+  interp->lastSteps = steps;
+  interp->totalSteps += steps;
+  return rc;
+}
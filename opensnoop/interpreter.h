@@ -0,0 +1,135 @@
+/**
+ * A userspace interpreter for BPF programs, so that the programs from
+ * programs.c can be run, checked and measured without root or a kernel that
+ * supports them.
+ *
+ * Maps live in memory and are created with interp_create_map(), whose fd
+ * only means something to the interpreter: pass it wherever the programs
+ * take a map fd. The helpers the programs call are stubs that see the fake
+ * task in struct interp (pid_tgid, comm, cgroup and the clock), read
+ * "kernel" and "user" memory directly from this process, and hand submitted
+ * records to output_cb.
+ *
+ * There is no verifier. Instead every load and store is checked against the
+ * stack, ctx and map values, and a program that misbehaves stops with an
+ * error rather than corrupting the process.
+ */
+#pragma once
+
+#include <bcc/libbpf.h>
+#include <stddef.h>
+
+#define INTERP_MAX_MAPS 16
+#define INTERP_STACK_SIZE 512
+// Bound on the instructions executed by one run, in case of a loop.
+#define INTERP_MAX_STEPS 1000000
+
+/**
+ * Called for each record passed to bpf_perf_event_output() or
+ * bpf_ringbuf_output(). Returns 0, or a negative errno for the helper to
+ * return, e.g. to simulate a full buffer.
+ */
+typedef int (*interp_output_cb)(void *cookie, const void *data, int size);
+
+struct interp_map {
+  enum bpf_map_type type;
+  unsigned int keySize;
+  unsigned int valueSize;
+  unsigned int maxEntries;
+  // Arrays have maxEntries values. Hashes are open-addressed tables of
+  // numSlots keys and values, where state[i] says whether slot i is free,
+  // used or deleted and lastUsed[i] orders used slots for LRU eviction.
+  unsigned char *keys;
+  unsigned char *values;
+  unsigned char *state;
+  unsigned long long *lastUsed;
+  unsigned int numSlots;
+  unsigned int numEntries;
+};
+
+struct interp {
+  struct interp_map maps[INTERP_MAX_MAPS];
+  int numMaps;
+
+  // What the helpers report about the current task and time.
+  unsigned long long pidTgid;
+  unsigned long long cgroupId;
+  unsigned long long ktimeNs;
+  char comm[16];
+
+  interp_output_cb output_cb;
+  void *cookie;
+
+  // Instructions executed by the last interp_run(), and by all of them.
+  unsigned long long lastSteps;
+  unsigned long long totalSteps;
+  // Why the last interp_run() failed.
+  char error[128];
+
+  // Advances on every map access, for LRU eviction.
+  unsigned long long clock;
+};
+
+/** Zeroes interp, which must later be released with interp_free(). */
+void interp_init(struct interp *interp);
+
+void interp_free(struct interp *interp);
+
+/**
+ * Creates an empty map. Per-CPU maps have a single CPU, so their values are
+ * valueSize bytes. Returns the map's fd, or -1 with errno set.
+ */
+int interp_create_map(struct interp *interp, enum bpf_map_type type,
+                      unsigned int keySize, unsigned int valueSize,
+                      unsigned int maxEntries);
+
+/**
+ * Returns what loading mapFd with BPF_PSEUDO_MAP_FD gives a program, which
+ * is what the helpers take as a map, or NULL if there is no such map.
+ */
+const void *interp_map_address(struct interp *interp, int mapFd);
+
+/** As bpf_lookup_elem(): returns a pointer to the value, or NULL. */
+void *interp_map_lookup(struct interp *interp, int mapFd, const void *key);
+
+/** As bpf_update_elem(). Returns 0, or -1 with errno set. */
+int interp_map_update(struct interp *interp, int mapFd, const void *key,
+                      const void *value, unsigned long long flags);
+
+/** As bpf_delete_elem(). Returns 0, or -1 with errno set. */
+int interp_map_delete(struct interp *interp, int mapFd, const void *key);
+
+/** The memory that a running program may access. */
+struct interp_frame {
+  struct interp *interp;
+  // INTERP_STACK_SIZE bytes, the top of which is r10.
+  unsigned char *stack;
+  void *ctx;
+  size_t ctxSize;
+  // Index of the instruction being executed, for error messages.
+  int pc;
+};
+
+/**
+ * Calls helper func, as a program running in frame would, with r1-r5 in
+ * args, and sets *ret to what the helper returns in r0. This is for other
+ * ways of running programs to share the helpers of interp_run().
+ *
+ * Returns 0, or -1 with frame->interp->error describing why the call is
+ * invalid.
+ */
+int interp_call_helper(struct interp_frame *frame, int func,
+                       const unsigned long long args[5],
+                       unsigned long long *ret);
+
+/**
+ * Runs numInsns instructions with r1 pointing to the ctxSize bytes at ctx,
+ * and sets *ret to r0 on exit. interp->lastSteps is the number of
+ * instructions executed.
+ *
+ * Returns 0, or -1 with interp->error describing the instruction that
+ * failed.
+ */
+int interp_run(struct interp *interp, const struct bpf_insn *insns,
+               int numInsns, void *ctx, size_t ctxSize,
+               unsigned long long *ret);
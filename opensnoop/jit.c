@@ -0,0 +1,669 @@
+#include "jit.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// x86-64 register numbers, as encoded in ModRM and REX.
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R9 = 9,
+  R11 = 11,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+// Where each BPF register lives. r1-r5 are the System V argument registers,
+// so helpers are called without moving them, and r6-r10 are callee-saved, so
+// they survive the calls.
+static const int regMap[MAX_BPF_REG] = {
+    [BPF_REG_0] = RAX, [BPF_REG_1] = RDI, [BPF_REG_2] = RSI,
+    [BPF_REG_3] = RDX, [BPF_REG_4] = RCX, [BPF_REG_5] = R8,
+    [BPF_REG_6] = RBX, [BPF_REG_7] = R13, [BPF_REG_8] = R14,
+    [BPF_REG_9] = R15, [BPF_REG_10] = RBP,
+};
+
+// Scratch register, free for any instruction to use.
+#define AUX R11
+// Holds the struct jit_state of the run.
+#define STATE R12
+
+// Bound on the bytes of code for one BPF instruction, the longest being a
+// helper call or a division.
+#define MAX_INSN_BYTES 64
+// Bound on the bytes of the prologue and epilogue.
+#define MAX_FRAME_BYTES 64
+
+/** What compiled code reaches through STATE. */
+struct jit_state {
+  struct interp_frame frame;
+  // The top of frame.stack, which is r10.
+  unsigned long long stackTop;
+  // The helper being called.
+  int func;
+  // Set when a helper call fails, which ends the program.
+  int failed;
+};
+
+typedef unsigned long long (*jit_func)(void *ctx, struct jit_state *state);
+
+/** A rel32 to be pointed at an instruction, or at the epilogue. */
+struct fixup {
+  size_t at;
+  // Index of the instruction, or numInsns for the epilogue.
+  int target;
+};
+
+struct compiler {
+  struct interp *interp;
+  const struct bpf_insn *insns;
+  int numInsns;
+  int pc;
+  unsigned char *code;
+  size_t len;
+  size_t capacity;
+  // Offset of the code of each instruction, and of the epilogue.
+  size_t *addrs;
+  struct fixup *fixups;
+  int numFixups;
+};
+
+static int fail(struct compiler *comp, const char *format, ...) {
+  int len = snprintf(comp->interp->error, sizeof(comp->interp->error),
+                     "insn %d: ", comp->pc);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(comp->interp->error + len, sizeof(comp->interp->error) - len,
+            format, args);
+  va_end(args);
+  return -1;
+}
+
+static void emitByte(struct compiler *comp, int byte) {
+  if (comp->len < comp->capacity) {
+    comp->code[comp->len] = byte;
+  }
+  comp->len++;
+}
+
+static void emitImm32(struct compiler *comp, int imm) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(comp, (unsigned int)imm >> (8 * i));
+  }
+}
+
+static void emitImm64(struct compiler *comp, unsigned long long imm) {
+  emitImm32(comp, imm);
+  emitImm32(comp, imm >> 32);
+}
+
+/** Emits a REX prefix if the operation is 64-bit or uses r8-r15. */
+static void emitRex(struct compiler *comp, int is64, int reg, int rm) {
+  if (is64 || reg >= 8 || rm >= 8) {
+    emitByte(comp, 0x40 | is64 << 3 | (reg >> 3) << 2 | rm >> 3);
+  }
+}
+
+static void emitModRmReg(struct compiler *comp, int reg, int rm) {
+  emitByte(comp, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/** Emits opcode with reg (or an opcode extension) and rm registers. */
+static void emitRegOp(struct compiler *comp, int is64, int opcode, int reg,
+                      int rm) {
+  emitRex(comp, is64, reg, rm);
+  if (opcode > 0xff) {
+    emitByte(comp, opcode >> 8);
+  }
+  emitByte(comp, opcode);
+  emitModRmReg(comp, reg, rm);
+}
+
+/**
+ * Emits opcode with reg (or an opcode extension) and [base + off], sized by
+ * bytes: 2 adds an operand size prefix and 8 sets REX.W.
+ */
+static void emitMemOp(struct compiler *comp, int bytes, int opcode, int reg,
+                      int base, int off) {
+  if (bytes == 2) {
+    emitByte(comp, 0x66);
+  }
+  // Without a REX prefix, byte registers 4-7 are ah-bh rather than spl-dil.
+  if (bytes == 1 && reg >= RSP && reg <= RDI) {
+    emitByte(comp, 0x40 | (base >> 3));
+  } else {
+    emitRex(comp, bytes == 8, reg, base);
+  }
+  if (opcode > 0xff) {
+    emitByte(comp, opcode >> 8);
+  }
+  emitByte(comp, opcode);
+  emitByte(comp, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) {
+    // rsp and r12 as a base need a SIB byte.
+    emitByte(comp, 0x24);
+  }
+  emitImm32(comp, off);
+}
+
+static void emitMov(struct compiler *comp, int is64, int dst, int src) {
+  emitRegOp(comp, is64, 0x89, src, dst);
+}
+
+/** Moves imm to dst, sign-extended if is64 and zero-extended otherwise. */
+static void emitMovImm(struct compiler *comp, int is64, int dst, int imm) {
+  if (is64) {
+    emitRegOp(comp, 1, 0xc7, 0, dst);
+  } else {
+    emitRex(comp, 0, 0, dst);
+    emitByte(comp, 0xb8 + (dst & 7));
+  }
+  emitImm32(comp, imm);
+}
+
+static void emitMovImm64(struct compiler *comp, int dst,
+                         unsigned long long imm) {
+  emitRex(comp, 1, 0, dst);
+  emitByte(comp, 0xb8 + (dst & 7));
+  emitImm64(comp, imm);
+}
+
+/**
+ * Emits a jmp (cc < 0) or jcc to instruction target, or to the epilogue if
+ * target is numInsns.
+ */
+static void emitJump(struct compiler *comp, int cc, int target) {
+  if (cc < 0) {
+    emitByte(comp, 0xe9);
+  } else {
+    emitByte(comp, 0x0f);
+    emitByte(comp, 0x80 | cc);
+  }
+  comp->fixups[comp->numFixups++] =
+      (struct fixup){.at = comp->len, .target = target};
+  emitImm32(comp, 0);
+}
+
+/** Emits a jmp or jcc within an instruction, to be bound by bindLocal(). */
+static size_t emitLocalJump(struct compiler *comp, int cc) {
+  emitJump(comp, cc, 0);
+  comp->numFixups--;
+  return comp->len - 4;
+}
+
+static void bindLocal(struct compiler *comp, size_t at) {
+  int rel = comp->len - (at + 4);
+  if (at + 4 <= comp->capacity) {
+    memcpy(comp->code + at, &rel, 4);
+  }
+}
+
+/** The helper called by compiled code, with r1-r5 in place. */
+static unsigned long long callHelper(unsigned long long r1,
+                                     unsigned long long r2,
+                                     unsigned long long r3,
+                                     unsigned long long r4,
+                                     unsigned long long r5,
+                                     struct jit_state *state) {
+  unsigned long long args[5] = {r1, r2, r3, r4, r5}, ret = 0;
+  if (interp_call_helper(&state->frame, state->func, args, &ret) < 0) {
+    state->failed = 1;
+  }
+  return ret;
+}
+
+static void emitCall(struct compiler *comp, int func) {
+  emitMemOp(comp, 4, 0xc7, 0, STATE,
+            offsetof(struct jit_state, frame.pc));
+  emitImm32(comp, comp->pc);
+  emitMemOp(comp, 4, 0xc7, 0, STATE, offsetof(struct jit_state, func));
+  emitImm32(comp, func);
+  emitMov(comp, 1, R9, STATE);
+  emitMovImm64(comp, RAX, (uintptr_t)callHelper);
+  // call rax
+  emitByte(comp, 0xff);
+  emitModRmReg(comp, 2, RAX);
+  // cmp dword [state->failed], 0; jne epilogue
+  emitMemOp(comp, 4, 0x83, 7, STATE, offsetof(struct jit_state, failed));
+  emitByte(comp, 0);
+  emitJump(comp, 0x5, comp->numInsns);
+}
+
+/** Shifts dst by src (in a register) with opcode extension ext. */
+static void emitShiftReg(struct compiler *comp, int is64, int ext, int dst,
+                         int src) {
+  // The count must be in cl, but rcx is r4.
+  emitMov(comp, 1, AUX, RCX);
+  if (src != RCX) {
+    emitMov(comp, 1, RCX, src);
+  }
+  int target = dst == RCX ? AUX : dst;
+  emitRegOp(comp, is64, 0xd3, ext, target);
+  // Restores rcx, or sets it to the result if it was dst.
+  emitMov(comp, 1, RCX, AUX);
+}
+
+/** Divides dst by the divisor in AUX, as BPF does: x / 0 = 0, x % 0 = x. */
+static void emitDivide(struct compiler *comp, int is64, int isMod, int dst) {
+  emitRegOp(comp, is64, 0x85, AUX, AUX);
+  size_t nonzero = emitLocalJump(comp, 0x5);
+  if (!isMod) {
+    emitRegOp(comp, 0, 0x31, dst, dst);
+  } else if (!is64) {
+    emitMov(comp, 0, dst, dst);
+  }
+  size_t done = emitLocalJump(comp, -1);
+
+  bindLocal(comp, nonzero);
+  // div takes rdx:rax, which are r3 and r0.
+  emitByte(comp, 0x50 + RAX);
+  emitByte(comp, 0x50 + RDX);
+  if (dst != RAX) {
+    emitMov(comp, is64, RAX, dst);
+  }
+  emitRegOp(comp, 0, 0x31, RDX, RDX);
+  emitRegOp(comp, is64, 0xf7, 6, AUX);
+  emitMov(comp, 1, AUX, isMod ? RDX : RAX);
+  emitByte(comp, 0x58 + RDX);
+  emitByte(comp, 0x58 + RAX);
+  emitMov(comp, is64, dst, AUX);
+  bindLocal(comp, done);
+}
+
+static int compileAlu(struct compiler *comp, const struct bpf_insn *insn) {
+  int is64 = BPF_CLASS(insn->code) == BPF_ALU64;
+  int op = BPF_OP(insn->code);
+  int isReg = BPF_SRC(insn->code) == BPF_X;
+  int dst = regMap[insn->dst_reg], src = regMap[insn->src_reg];
+  int opcode, ext;
+  switch (op) {
+  case BPF_ADD:
+    opcode = 0x01, ext = 0;
+    break;
+  case BPF_OR:
+    opcode = 0x09, ext = 1;
+    break;
+  case BPF_AND:
+    opcode = 0x21, ext = 4;
+    break;
+  case BPF_SUB:
+    opcode = 0x29, ext = 5;
+    break;
+  case BPF_XOR:
+    opcode = 0x31, ext = 6;
+    break;
+  case BPF_MOV:
+    if (isReg) {
+      emitMov(comp, is64, dst, src);
+    } else {
+      emitMovImm(comp, is64, dst, insn->imm);
+    }
+    return 0;
+  case BPF_MUL:
+    if (isReg) {
+      emitRegOp(comp, is64, 0x0faf, dst, src);
+    } else {
+      emitRegOp(comp, is64, 0x69, dst, dst);
+      emitImm32(comp, insn->imm);
+    }
+    return 0;
+  case BPF_DIV:
+  case BPF_MOD:
+    if (isReg) {
+      emitMov(comp, is64, AUX, src);
+    } else {
+      emitMovImm(comp, is64, AUX, insn->imm);
+    }
+    emitDivide(comp, is64, op == BPF_MOD, dst);
+    return 0;
+  case BPF_NEG:
+    emitRegOp(comp, is64, 0xf7, 3, dst);
+    return 0;
+  case BPF_LSH:
+  case BPF_RSH:
+  case BPF_ARSH:
+    ext = op == BPF_LSH ? 4 : op == BPF_RSH ? 5 : 7;
+    if (isReg) {
+      emitShiftReg(comp, is64, ext, dst, src);
+    } else {
+      emitRegOp(comp, is64, 0xc1, ext, dst);
+      emitByte(comp, insn->imm & (is64 ? 63 : 31));
+    }
+    return 0;
+  case BPF_END:
+    // BPF_SRC() is BPF_TO_LE or BPF_TO_BE and imm the width; this is
+    // little-endian.
+    if (insn->imm != 16 && insn->imm != 32 && insn->imm != 64) {
+      return fail(comp, "bad byte swap width %d", insn->imm);
+    }
+    if (isReg && insn->imm == 16) {
+      // rol dst16, 8
+      emitByte(comp, 0x66);
+      emitRegOp(comp, 0, 0xc1, 0, dst);
+      emitByte(comp, 8);
+    } else if (isReg) {
+      emitRex(comp, insn->imm == 64, 0, dst);
+      emitByte(comp, 0x0f);
+      emitByte(comp, 0xc8 + (dst & 7));
+    }
+    if (insn->imm == 16) {
+      emitRegOp(comp, 0, 0x0fb7, dst, dst);
+    } else if (insn->imm == 32) {
+      emitMov(comp, 0, dst, dst);
+    }
+    return 0;
+  default:
+    return fail(comp, "unsupported ALU op %#x", op);
+  }
+
+  if (isReg) {
+    emitRegOp(comp, is64, opcode, src, dst);
+  } else {
+    emitRegOp(comp, is64, 0x81, ext, dst);
+    emitImm32(comp, insn->imm);
+  }
+  return 0;
+}
+
+/** Returns the x86 condition code of a conditional jump, or -1. */
+static int conditionCode(int op) {
+  switch (op) {
+  case BPF_JEQ:
+    return 0x4;
+  case BPF_JNE:
+  case BPF_JSET:
+    return 0x5;
+  case BPF_JGT:
+    return 0x7;
+  case BPF_JGE:
+    return 0x3;
+  case BPF_JLT:
+    return 0x2;
+  case BPF_JLE:
+    return 0x6;
+  case BPF_JSGT:
+    return 0xf;
+  case BPF_JSGE:
+    return 0xd;
+  case BPF_JSLT:
+    return 0xc;
+  case BPF_JSLE:
+    return 0xe;
+  default:
+    return -1;
+  }
+}
+
+static int compileJump(struct compiler *comp, const struct bpf_insn *insn) {
+  int cls = BPF_CLASS(insn->code);
+  int op = BPF_OP(insn->code);
+  int dst = regMap[insn->dst_reg], src = regMap[insn->src_reg];
+  if (op == BPF_EXIT && cls == BPF_JMP) {
+    if (comp->pc != comp->numInsns - 1) {
+      emitJump(comp, -1, comp->numInsns);
+    }
+    return 0;
+  }
+  if (op == BPF_CALL && cls == BPF_JMP) {
+    emitCall(comp, insn->imm);
+    return 0;
+  }
+
+  int target = comp->pc + 1 + insn->off;
+  if (target < 0 || target >= comp->numInsns) {
+    return fail(comp, "jumped out of the program");
+  }
+  if (op == BPF_JA && cls == BPF_JMP) {
+    emitJump(comp, -1, target);
+    return 0;
+  }
+  int cc = conditionCode(op);
+  if (cc < 0) {
+    return fail(comp, "unsupported jump op %#x", op);
+  }
+  int is64 = cls == BPF_JMP;
+  if (BPF_SRC(insn->code) == BPF_X) {
+    // test or cmp dst, src
+    emitRegOp(comp, is64, op == BPF_JSET ? 0x85 : 0x39, src, dst);
+  } else {
+    // test dst, imm or cmp dst, imm
+    emitRegOp(comp, is64, op == BPF_JSET ? 0xf7 : 0x81,
+              op == BPF_JSET ? 0 : 7, dst);
+    emitImm32(comp, insn->imm);
+  }
+  emitJump(comp, cc, target);
+  return 0;
+}
+
+static int sizeInBytes(int size) {
+  switch (size) {
+  case BPF_B:
+    return 1;
+  case BPF_H:
+    return 2;
+  case BPF_W:
+    return 4;
+  default:
+    return 8;
+  }
+}
+
+static int compileMemory(struct compiler *comp, const struct bpf_insn *insn) {
+  int cls = BPF_CLASS(insn->code);
+  int mode = BPF_MODE(insn->code);
+  int bytes = sizeInBytes(BPF_SIZE(insn->code));
+  int dst = regMap[insn->dst_reg], src = regMap[insn->src_reg];
+  if (cls == BPF_LDX && mode == BPF_MEM) {
+    // movzx for bytes and halves; 32-bit loads zero-extend anyway.
+    int opcode = bytes == 1 ? 0x0fb6 : bytes == 2 ? 0x0fb7 : 0x8b;
+    emitMemOp(comp, bytes == 8 ? 8 : 4, opcode, dst, src, insn->off);
+  } else if (cls == BPF_ST && mode == BPF_MEM) {
+    emitMemOp(comp, bytes, bytes == 1 ? 0xc6 : 0xc7, 0, dst, insn->off);
+    if (bytes == 1) {
+      emitByte(comp, insn->imm);
+    } else if (bytes == 2) {
+      emitByte(comp, insn->imm);
+      emitByte(comp, insn->imm >> 8);
+    } else {
+      emitImm32(comp, insn->imm);
+    }
+  } else if (cls == BPF_STX && mode == BPF_MEM) {
+    emitMemOp(comp, bytes, bytes == 1 ? 0x88 : 0x89, src, dst, insn->off);
+  } else if (cls == BPF_STX && mode == BPF_XADD) {
+    if (insn->imm != BPF_ADD || (bytes != 4 && bytes != 8)) {
+      return fail(comp, "unsupported atomic operation %#x", insn->imm);
+    }
+    // lock add [dst + off], src
+    emitByte(comp, 0xf0);
+    emitMemOp(comp, bytes, 0x01, src, dst, insn->off);
+  } else {
+    return fail(comp, "unsupported memory mode %#x", mode);
+  }
+  return 0;
+}
+
+static int compileLoadImm64(struct compiler *comp,
+                            const struct bpf_insn *insn) {
+  if (comp->pc + 1 >= comp->numInsns) {
+    return fail(comp, "truncated 64-bit immediate");
+  }
+  unsigned long long value;
+  if (insn->src_reg == BPF_PSEUDO_MAP_FD) {
+    const void *map = interp_map_address(comp->interp, insn->imm);
+    if (map == NULL) {
+      return fail(comp, "unknown map fd %d", insn->imm);
+    }
+    value = (uintptr_t)map;
+  } else if (insn->src_reg == 0) {
+    value = (unsigned int)insn->imm | (unsigned long long)insn[1].imm << 32;
+  } else {
+    return fail(comp, "unsupported 64-bit immediate type %d", insn->src_reg);
+  }
+  emitMovImm64(comp, regMap[insn->dst_reg], value);
+  return 0;
+}
+
+static int compileInsn(struct compiler *comp, const struct bpf_insn *insn) {
+  int cls = BPF_CLASS(insn->code);
+  if (insn->dst_reg >= MAX_BPF_REG || insn->src_reg >= MAX_BPF_REG) {
+    return fail(comp, "bad register");
+  }
+  // Only stores may name r10 as their destination, as a base address.
+  if (insn->dst_reg == BPF_REG_10 && cls != BPF_ST && cls != BPF_STX &&
+      cls != BPF_JMP && cls != BPF_JMP32) {
+    return fail(comp, "r10 is read-only");
+  }
+  if (cls == BPF_ALU || cls == BPF_ALU64) {
+    return compileAlu(comp, insn);
+  } else if (cls == BPF_JMP || cls == BPF_JMP32) {
+    return compileJump(comp, insn);
+  } else if (insn->code == (BPF_LD | BPF_IMM | BPF_DW)) {
+    return compileLoadImm64(comp, insn);
+  } else if (cls == BPF_LDX || cls == BPF_ST || cls == BPF_STX) {
+    return compileMemory(comp, insn);
+  }
+  return fail(comp, "unsupported opcode %#x", insn->code);
+}
+
+static void emitPrologue(struct compiler *comp) {
+  static const int saved[] = {RBP, RBX, R12, R13, R14, R15};
+  for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++) {
+    emitRex(comp, 0, 0, saved[i]);
+    emitByte(comp, 0x50 + (saved[i] & 7));
+  }
+  // sub rsp, 8, so that calls find the stack 16-byte aligned.
+  emitRegOp(comp, 1, 0x83, 5, RSP);
+  emitByte(comp, 8);
+  // r1 (rdi) is already ctx.
+  emitMov(comp, 1, STATE, RSI);
+  emitMemOp(comp, 8, 0x8b, RBP, STATE, offsetof(struct jit_state, stackTop));
+  emitRegOp(comp, 0, 0x31, RAX, RAX);
+}
+
+static void emitEpilogue(struct compiler *comp) {
+  static const int saved[] = {R15, R14, R13, R12, RBX, RBP};
+  emitRegOp(comp, 1, 0x83, 0, RSP);
+  emitByte(comp, 8);
+  for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); i++) {
+    emitRex(comp, 0, 0, saved[i]);
+    emitByte(comp, 0x58 + (saved[i] & 7));
+  }
+  emitByte(comp, 0xc3);
+}
+
+int jit_compile(struct interp *interp, const struct bpf_insn *insns,
+                int numInsns, struct jit_program *prog) {
+  struct compiler comp = {
+      .interp = interp, .insns = insns, .numInsns = numInsns};
+  int rc = -1;
+  prog->code = NULL;
+  prog->size = 0;
+  interp->error[0] = '\0';
+  if (numInsns <= 0) {
+    snprintf(interp->error, sizeof(interp->error), "empty program");
+    return -1;
+  }
+
+  comp.capacity = (size_t)numInsns * MAX_INSN_BYTES + MAX_FRAME_BYTES;
+  comp.code = malloc(comp.capacity);
+  comp.addrs = calloc(numInsns + 1, sizeof(comp.addrs[0]));
+  comp.fixups = calloc(numInsns, sizeof(comp.fixups[0]));
+  if (comp.code == NULL || comp.addrs == NULL || comp.fixups == NULL) {
+    snprintf(interp->error, sizeof(interp->error), "out of memory");
+    goto error;
+  }
+
+  emitPrologue(&comp);
+  for (comp.pc = 0; comp.pc < numInsns; comp.pc++) {
+    const struct bpf_insn *insn = &insns[comp.pc];
+    comp.addrs[comp.pc] = comp.len;
+    if (compileInsn(&comp, insn) < 0) {
+      goto error;
+    }
+    if (insn->code == (BPF_LD | BPF_IMM | BPF_DW)) {
+      comp.addrs[++comp.pc] = comp.len;
+    }
+  }
+  // The last instruction must not fall through into the epilogue.
+  const struct bpf_insn *last = &insns[numInsns - 1];
+  if (last->code != (BPF_JMP | BPF_EXIT) && last->code != (BPF_JMP | BPF_JA)) {
+    comp.pc = numInsns - 1;
+    fail(&comp, "falls off the end of the program");
+    goto error;
+  }
+  comp.addrs[numInsns] = comp.len;
+  emitEpilogue(&comp);
+  if (comp.len > comp.capacity) {
+    snprintf(interp->error, sizeof(interp->error), "code buffer overflowed");
+    goto error;
+  }
+
+  for (int i = 0; i < comp.numFixups; i++) {
+    const struct fixup *fixup = &comp.fixups[i];
+    int rel = comp.addrs[fixup->target] - (fixup->at + 4);
+    memcpy(comp.code + fixup->at, &rel, 4);
+  }
+
+  void *code = mmap(NULL, comp.len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    snprintf(interp->error, sizeof(interp->error), "mmap: %s",
+             strerror(errno));
+    goto error;
+  }
+  memcpy(code, comp.code, comp.len);
+  if (mprotect(code, comp.len, PROT_READ | PROT_EXEC) < 0) {
+    snprintf(interp->error, sizeof(interp->error), "mprotect: %s",
+             strerror(errno));
+    munmap(code, comp.len);
+    goto error;
+  }
+  prog->code = code;
+  prog->size = comp.len;
+  rc = 0;
+
+error:
+  free(comp.code);
+  free(comp.addrs);
+  free(comp.fixups);
+  return rc;
+}
+
+int jit_run(struct interp *interp, const struct jit_program *prog, void *ctx,
+            size_t ctxSize, unsigned long long *ret) {
+  unsigned char stack[INTERP_STACK_SIZE] __attribute__((aligned(8)));
+  struct jit_state state = {
+      .frame = {.interp = interp,
+                .stack = stack,
+                .ctx = ctx,
+                .ctxSize = ctxSize},
+      .stackTop = (uintptr_t)(stack + INTERP_STACK_SIZE),
+  };
+  interp->error[0] = '\0';
+  unsigned long long result = ((jit_func)prog->code)(ctx, &state);
+  if (state.failed) {
+    return -1;
+  }
+  *ret = result;
+  return 0;
+}
+
+void jit_free(struct jit_program *prog) {
+  if (prog->code != NULL) {
+    munmap(prog->code, prog->size);
+    prog->code = NULL;
+  }
+}
@@ -0,0 +1,44 @@
+/**
+ * A userspace JIT that compiles BPF programs to x86-64, so that millions of
+ * recorded opens can be replayed through the programs from programs.c much
+ * faster than interp_run() manages.
+ *
+ * A compiled program runs against a struct interp, whose maps, fake task and
+ * output_cb it shares with the interpreter, and its calls go to the same
+ * helpers through interp_call_helper(). Unlike the interpreter, compiled code
+ * does not check its loads and stores or bound its loops, so only compile
+ * programs that have already run cleanly in the interpreter or that the
+ * kernel verifier accepts.
+ */
+#pragma once
+
+#include "interpreter.h"
+#include <stddef.h>
+
+struct jit_program {
+  // size bytes of read-only, executable memory.
+  void *code;
+  size_t size;
+};
+
+/**
+ * Compiles numInsns instructions. Map fds are resolved against interp, which
+ * is the only struct interp the program may then be run with.
+ *
+ * Returns 0, or -1 with interp->error describing the instruction that could
+ * not be compiled.
+ */
+int jit_compile(struct interp *interp, const struct bpf_insn *insns,
+                int numInsns, struct jit_program *prog);
+
+/**
+ * As interp_run(), but runs the compiled program. interp->lastSteps is not
+ * updated, since compiled code does not count instructions.
+ *
+ * Returns 0, or -1 with interp->error describing the helper call that
+ * failed.
+ */
+int jit_run(struct interp *interp, const struct jit_program *prog, void *ctx,
+            size_t ctxSize, unsigned long long *ret);
+
+void jit_free(struct jit_program *prog);
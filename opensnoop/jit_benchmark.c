@@ -0,0 +1,386 @@
+/*
+ * Replays the opens recorded by opensnoop --write through the programs from
+ * programs.c, once in the userspace interpreter and once compiled by the
+ * JIT, so that new filters can be evaluated against real traffic without
+ * root. Recommended usage:
+ *
+ * clang -O3 jit_benchmark.c capture.c interpreter.c jit.c optimizer.c \
+ *     output.c programs.c -o jit_benchmark -lpthread
+ * sudo ./opensnoop --write opens.cap
+ * ./jit_benchmark opens.cap [NUM_PASSES]
+ *
+ * Each event in the capture becomes an open by its task, of its path, that
+ * took its latency and returned its return value, seen by the entry and
+ * return kprobe programs. For each configuration below, the events are
+ * replayed NUM_PASSES times by each engine, running the programs after the
+ * optimiser has been over them as it is in opensnoop, and the time per open
+ * of both is printed. So is whether both produced identical events and
+ * stats, and whether those match a third replay of the programs as
+ * assembled, in the interpreter.
+ */
+#include "capture.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "opensnoop.h"
+#include "optimizer.h"
+#include "programs.h"
+#include <asm/ptrace.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct configuration {
+  const char *name;
+  int failedOnly;
+  // Whether -n and -p select the task of the first recorded event.
+  int firstComm;
+  int firstPid;
+};
+
+static const struct configuration configurations[] = {
+    {"default"},
+    {"-x", .failedOnly = 1},
+    {"-n first", .firstComm = 1},
+    {"-p first", .firstPid = 1},
+};
+
+struct output {
+  unsigned long long numEvents;
+  // FNV-1a hash of every byte submitted.
+  unsigned long long hash;
+};
+
+/** The maps and programs of one engine. */
+struct replay {
+  struct interp interp;
+  struct output output;
+  int statsFd;
+  struct bpf_insn entryInsns[MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS];
+  struct bpf_insn returnInsns[MAX_NUM_TRACE_RETURN_INSTRUCTIONS];
+  int numEntryInsns;
+  int numReturnInsns;
+  struct jit_program entryJit;
+  struct jit_program returnJit;
+};
+
+static int outputCb(void *cookie, const void *data, int size) {
+  struct output *output = cookie;
+  const unsigned char *bytes = data;
+  output->numEvents++;
+  for (int i = 0; i < size; i++) {
+    output->hash = (output->hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return 0;
+}
+
+static double nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/**
+ * Runs the optimiser over a program as opensnoop does, keeping the
+ * instructions in relocs for relocate_program(). Returns the new number of
+ * instructions, or -1 with errno set.
+ */
+static int optimize(struct bpf_insn *insns, int numInsns,
+                    struct relocs *relocs) {
+  int pinned[MAX_RELOCS];
+  for (int i = 0; i < relocs->num; i++) {
+    pinned[i] = relocs->entries[i].insn;
+  }
+  numInsns = optimize_program(insns, numInsns, pinned, relocs->num, NULL);
+  for (int i = 0; i < relocs->num; i++) {
+    relocs->entries[i].insn = pinned[i];
+  }
+  return numInsns;
+}
+
+/**
+ * Creates the maps and assembles the programs for config, optimising them
+ * if optimized and compiling them if useJit. Returns 0, or prints why not
+ * and returns -1.
+ */
+static int setUpReplay(struct replay *replay,
+                       const struct configuration *config,
+                       const struct event_t *first, int optimized,
+                       int useJit) {
+  struct interp *interp = &replay->interp;
+  interp_init(interp);
+  replay->output.numEvents = 0;
+  replay->output.hash = 0xcbf29ce484222325ULL;
+  interp->output_cb = outputCb;
+  interp->cookie = &replay->output;
+
+  int fnameMax = NAME_MAX + 1;
+  int infotmpFd = interp_create_map(interp, BPF_MAP_TYPE_HASH,
+                                    sizeof(unsigned long long),
+                                    sizeof(struct val_t), 10240);
+  int configFd = interp_create_map(interp, BPF_MAP_TYPE_ARRAY, sizeof(int),
+                                   sizeof(struct config_t), 1);
+  replay->statsFd = interp_create_map(interp, BPF_MAP_TYPE_PERCPU_ARRAY,
+                                      sizeof(int), sizeof(struct stats_t), 1);
+  int scratchFd =
+      interp_create_map(interp, BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(int),
+                        sizeof(struct event_t) + fnameMax, 1);
+  int eventsFd = interp_create_map(interp, BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+                                   sizeof(int), sizeof(int), 1);
+  int filterFd = -1;
+  if (config->firstPid) {
+    filterFd = interp_create_map(interp, BPF_MAP_TYPE_HASH,
+                                 sizeof(struct filter_key_t), sizeof(int),
+                                 1024);
+    struct filter_key_t key = {.id = first->id >> 32, .type = FILTER_PID};
+    int one = 1;
+    interp_map_update(interp, filterFd, &key, &one, BPF_ANY);
+  }
+
+  int zero = 0;
+  struct config_t configValue = {.failed_only = config->failedOnly};
+  if (config->firstComm) {
+    configValue.has_name = 1;
+    size_t len = strnlen(first->comm, TASK_COMM_LEN);
+    memcpy(configValue.name, first->comm, len);
+    memset(configValue.name_mask, 0xff, len);
+  }
+  interp_map_update(interp, configFd, &zero, &configValue, BPF_ANY);
+
+  struct trace_entry_params entryParams = {
+      .infotmpFd = infotmpFd,
+      .filterFd = filterFd,
+      .cgroupFd = -1,
+      .statsFd = replay->statsFd,
+  };
+  struct trace_return_params returnParams = {
+      .infotmpFd = infotmpFd,
+      .filterFd = filterFd,
+      .cgroupFd = -1,
+      .eventsFd = eventsFd,
+      .configFd = configFd,
+      .scratchFd = scratchFd,
+      .statsFd = replay->statsFd,
+      .topFd = -1,
+      .histFd = -1,
+      .histBy = HIST_BY_NONE,
+      .fnameMax = fnameMax,
+  };
+  struct relocs entryRelocs = {}, returnRelocs = {};
+  replay->numEntryInsns =
+      assemble_trace_entry(replay->entryInsns, &entryParams, &entryRelocs);
+  replay->numReturnInsns = assemble_trace_return(
+      replay->returnInsns, &returnParams, &returnRelocs);
+  if (replay->numEntryInsns < 0 || replay->numReturnInsns < 0) {
+    printf("%-10s assembly failed: %s\n", config->name, strerror(errno));
+    return -1;
+  }
+  if (optimized) {
+    replay->numEntryInsns =
+        optimize(replay->entryInsns, replay->numEntryInsns, &entryRelocs);
+    replay->numReturnInsns =
+        optimize(replay->returnInsns, replay->numReturnInsns, &returnRelocs);
+    if (replay->numEntryInsns < 0 || replay->numReturnInsns < 0) {
+      printf("%-10s optimization failed: %s\n", config->name,
+             strerror(errno));
+      return -1;
+    }
+  }
+  relocate_program(replay->entryInsns, &entryRelocs, PROBE_KPROBE, 0);
+  relocate_program(replay->returnInsns, &returnRelocs, PROBE_KPROBE, 0);
+
+  if (useJit &&
+      (jit_compile(interp, replay->entryInsns, replay->numEntryInsns,
+                   &replay->entryJit) < 0 ||
+       jit_compile(interp, replay->returnInsns, replay->numReturnInsns,
+                   &replay->returnJit) < 0)) {
+    printf("%-10s compilation failed: %s\n", config->name, interp->error);
+    return -1;
+  }
+  return 0;
+}
+
+static void tearDownReplay(struct replay *replay) {
+  jit_free(&replay->entryJit);
+  jit_free(&replay->returnJit);
+  interp_free(&replay->interp);
+}
+
+static int runProgram(struct replay *replay, int useJit, int isReturn,
+                      struct pt_regs *regs) {
+  struct interp *interp = &replay->interp;
+  unsigned long long ret;
+  if (useJit) {
+    return jit_run(interp, isReturn ? &replay->returnJit : &replay->entryJit,
+                   regs, sizeof(*regs), &ret);
+  }
+  return interp_run(interp,
+                    isReturn ? replay->returnInsns : replay->entryInsns,
+                    isReturn ? replay->numReturnInsns : replay->numEntryInsns,
+                    regs, sizeof(*regs), &ret);
+}
+
+/**
+ * Replays the events numPasses times. Returns the nanoseconds taken, or
+ * prints why not and returns -1.
+ */
+static double replayEvents(struct replay *replay, int useJit,
+                           const struct configuration *config,
+                           const struct event_t **events, size_t numEvents,
+                           int numPasses) {
+  struct interp *interp = &replay->interp;
+  struct pt_regs regs = {};
+  double start = nowNanos();
+  for (int pass = 0; pass < numPasses; pass++) {
+    for (size_t i = 0; i < numEvents; i++) {
+      const struct event_t *event = events[i];
+      interp->pidTgid = event->id;
+      memcpy(interp->comm, event->comm, TASK_COMM_LEN);
+      regs.rsi = event->fname_len > 0 ? (unsigned long)event->fname : 0;
+      regs.rax = event->ret;
+
+      interp->ktimeNs = event->ts - event->latency;
+      if (runProgram(replay, useJit, 0, &regs) < 0) {
+        printf("%-10s entry program failed: %s\n", config->name,
+               interp->error);
+        return -1;
+      }
+      interp->ktimeNs = event->ts;
+      if (runProgram(replay, useJit, 1, &regs) < 0) {
+        printf("%-10s return program failed: %s\n", config->name,
+               interp->error);
+        return -1;
+      }
+    }
+  }
+  return nowNanos() - start;
+}
+
+/**
+ * Replays the events through both engines, and through the interpreter
+ * without the optimiser, for config. Returns 0 and prints a line of
+ * results, or prints why not and returns -1.
+ */
+static int runConfiguration(const struct configuration *config,
+                            const struct event_t **events, size_t numEvents,
+                            int numPasses) {
+  static struct replay assembledReplay, interpReplay, jitReplay;
+  int rc = -1;
+  double interpNanos, jitNanos;
+  if (setUpReplay(&assembledReplay, config, events[0], 0, 0) < 0 ||
+      setUpReplay(&interpReplay, config, events[0], 1, 0) < 0 ||
+      setUpReplay(&jitReplay, config, events[0], 1, 1) < 0) {
+    goto error;
+  }
+  if (replayEvents(&assembledReplay, 0, config, events, numEvents,
+                   numPasses) < 0) {
+    goto error;
+  }
+  interpNanos = replayEvents(&interpReplay, 0, config, events, numEvents,
+                             numPasses);
+  if (interpNanos < 0) {
+    goto error;
+  }
+  jitNanos =
+      replayEvents(&jitReplay, 1, config, events, numEvents, numPasses);
+  if (jitNanos < 0) {
+    goto error;
+  }
+
+  int zero = 0;
+  const struct stats_t *assembledStats = interp_map_lookup(
+      &assembledReplay.interp, assembledReplay.statsFd, &zero);
+  const struct stats_t *interpStats = interp_map_lookup(
+      &interpReplay.interp, interpReplay.statsFd, &zero);
+  const struct stats_t *jitStats =
+      interp_map_lookup(&jitReplay.interp, jitReplay.statsFd, &zero);
+  const char *problem = NULL;
+  if (interpReplay.output.numEvents != jitReplay.output.numEvents ||
+      interpReplay.output.hash != jitReplay.output.hash) {
+    problem = "different events";
+  } else if (memcmp(interpStats, jitStats, sizeof(struct stats_t)) != 0) {
+    problem = "different stats";
+  } else if (interpReplay.output.numEvents !=
+                 assembledReplay.output.numEvents ||
+             interpReplay.output.hash != assembledReplay.output.hash) {
+    problem = "events differ when optimised";
+  } else if (memcmp(interpStats, assembledStats, sizeof(struct stats_t)) !=
+             0) {
+    problem = "stats differ when optimised";
+  }
+
+  double numOpens = (double)numEvents * numPasses;
+  printf("%-10s %10llu %10.1f %10.1f %8.1fx  %s\n", config->name,
+         interpReplay.output.numEvents / numPasses, interpNanos / numOpens,
+         jitNanos / numOpens, interpNanos / jitNanos,
+         problem != NULL ? problem : "ok");
+  rc = problem != NULL ? -1 : 0;
+
+error:
+  tearDownReplay(&assembledReplay);
+  tearDownReplay(&interpReplay);
+  tearDownReplay(&jitReplay);
+  return rc;
+}
+
+int main(int argc, char **argv) {
+  int numPasses = argc > 2 ? atoi(argv[2]) : 10;
+  if (argc < 2 || numPasses <= 0) {
+    fprintf(stderr, "usage: %s CAPTURE_FILE [NUM_PASSES]\n", argv[0]);
+    return 1;
+  }
+
+  struct capture_reader reader;
+  if (capture_reader_open(&reader, argv[1]) < 0) {
+    perror("Error opening the capture file");
+    return 1;
+  }
+  if (reader.header->event_version != EVENT_VERSION) {
+    fprintf(stderr, "The capture has events of version %u, not %u\n",
+            reader.header->event_version, EVENT_VERSION);
+    capture_reader_close(&reader);
+    return 1;
+  }
+  // The events stay in the mapped file, so only pointers are collected.
+  const struct event_t **events = NULL;
+  size_t numEvents = 0, capacity = 0;
+  const void *payload;
+  unsigned int size;
+  int type;
+  while ((type = capture_reader_next(&reader, &payload, &size)) > 0) {
+    if (type != CAPTURE_RECORD_EVENT || size < sizeof(struct event_t)) {
+      continue;
+    }
+    if (numEvents == capacity) {
+      capacity = capacity == 0 ? 4096 : capacity * 2;
+      events = realloc(events, capacity * sizeof(events[0]));
+      if (events == NULL) {
+        perror("Error reading the capture file");
+        capture_reader_close(&reader);
+        return 1;
+      }
+    }
+    events[numEvents++] = payload;
+  }
+  if (numEvents == 0) {
+    fprintf(stderr, "The capture has no events\n");
+    capture_reader_close(&reader);
+    return 1;
+  }
+
+  printf("%zu events, %d passes\n", numEvents, numPasses);
+  printf("%-10s %10s %10s %10s %9s  %s\n", "CONFIG", "EVENTS", "INTERP NS",
+         "JIT NS", "SPEEDUP", "CHECK");
+  int exitCode = 0;
+  for (size_t i = 0; i < sizeof(configurations) / sizeof(configurations[0]);
+       i++) {
+    if (runConfiguration(&configurations[i], events, numEvents, numPasses) <
+        0) {
+      exitCode = 1;
+    }
+  }
+  free(events);
+  capture_reader_close(&reader);
+  return exitCode;
+}
@@ -0,0 +1,205 @@
+#include "merge.h"
+#include "opensnoop.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NANOS_PER_MILLI 1000000LL
+#define INITIAL_QUEUE_CAPACITY 64
+
+struct merge_event {
+  unsigned long long ts;
+  int size;
+  unsigned char data[];
+};
+
+static unsigned long long headTs(const struct merger *merger, int queue) {
+  const struct merge_queue *q = &merger->queues[queue];
+  return q->events[q->head]->ts;
+}
+
+static void swapHeap(struct merger *merger, int i, int j) {
+  int tmp = merger->heap[i];
+  merger->heap[i] = merger->heap[j];
+  merger->heap[j] = tmp;
+}
+
+static void siftUp(struct merger *merger, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (headTs(merger, merger->heap[parent]) <=
+        headTs(merger, merger->heap[i])) {
+      break;
+    }
+    swapHeap(merger, i, parent);
+    i = parent;
+  }
+}
+
+static void siftDown(struct merger *merger, int i) {
+  while (1) {
+    int smallest = i;
+    int left = 2 * i + 1, right = 2 * i + 2;
+    if (left < merger->heapLen && headTs(merger, merger->heap[left]) <
+                                      headTs(merger, merger->heap[smallest])) {
+      smallest = left;
+    }
+    if (right < merger->heapLen &&
+        headTs(merger, merger->heap[right]) <
+            headTs(merger, merger->heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    swapHeap(merger, i, smallest);
+    i = smallest;
+  }
+}
+
+int merger_init(struct merger *merger, int numQueues, long long windowNs,
+                size_t maxEvents, size_t maxBytes, perf_reader_raw_cb emit,
+                void *emitCookie) {
+  memset(merger, 0, sizeof(*merger));
+  merger->queues = calloc(numQueues, sizeof(struct merge_queue));
+  merger->heap = calloc(numQueues, sizeof(int));
+  if (merger->queues == NULL || merger->heap == NULL) {
+    merger_free(merger);
+    return -1;
+  }
+
+  merger->numQueues = numQueues;
+  for (int i = 0; i < numQueues; i++) {
+    merger->queues[i].merger = merger;
+  }
+  merger->windowNs = windowNs;
+  merger->maxEvents = maxEvents;
+  merger->maxBytes = maxBytes;
+  merger->emit = emit;
+  merger->emitCookie = emitCookie;
+  return 0;
+}
+
+void merger_free(struct merger *merger) {
+  if (merger->queues != NULL) {
+    for (int i = 0; i < merger->numQueues; i++) {
+      struct merge_queue *q = &merger->queues[i];
+      for (size_t j = 0; j < q->len; j++) {
+        free(q->events[(q->head + j) % q->capacity]);
+      }
+      free(q->events);
+    }
+  }
+  free(merger->queues);
+  free(merger->heap);
+  memset(merger, 0, sizeof(*merger));
+}
+
+/** Emits and frees the oldest buffered event. heapLen must be nonzero. */
+static void popOldest(struct merger *merger) {
+  int queue = merger->heap[0];
+  struct merge_queue *q = &merger->queues[queue];
+  struct merge_event *event = q->events[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->len--;
+
+  if (q->len == 0) {
+    merger->heap[0] = merger->heap[--merger->heapLen];
+  }
+  // Either way, the root has changed (or its ts has grown).
+  siftDown(merger, 0);
+
+  merger->numEvents--;
+  merger->numBytes -= event->size;
+  merger->emit(merger->emitCookie, event->data, event->size);
+  free(event);
+}
+
+static int push(struct merge_queue *q, struct merge_event *event) {
+  if (q->len == q->capacity) {
+    size_t newCapacity =
+        q->capacity == 0 ? INITIAL_QUEUE_CAPACITY : 2 * q->capacity;
+    struct merge_event **events =
+        malloc(newCapacity * sizeof(struct merge_event *));
+    if (events == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < q->len; i++) {
+      events[i] = q->events[(q->head + i) % q->capacity];
+    }
+    free(q->events);
+    q->events = events;
+    q->head = 0;
+    q->capacity = newCapacity;
+  }
+
+  q->events[(q->head + q->len) % q->capacity] = event;
+  q->len++;
+  return 0;
+}
+
+void merger_raw_callback(void *cb_cookie, void *raw, int raw_size) {
+  struct merge_queue *q = cb_cookie;
+  struct merger *merger = q->merger;
+
+  // Let the real callback report malformed events; they have no ts to sort
+  // by anyway.
+  if (raw_size < (int)sizeof(struct event_t)) {
+    merger->emit(merger->emitCookie, raw, raw_size);
+    return;
+  }
+
+  struct merge_event *event = malloc(sizeof(struct merge_event) + raw_size);
+  if (event != NULL) {
+    event->ts = ((struct event_t *)raw)->ts;
+    event->size = raw_size;
+    memcpy(event->data, raw, raw_size);
+  }
+  if (event == NULL || push(q, event) < 0) {
+    // Out of memory: give up on ordering this event rather than losing it.
+    free(event);
+    merger->numForced++;
+    merger->emit(merger->emitCookie, raw, raw_size);
+    return;
+  }
+  merger->numEvents++;
+  merger->numBytes += raw_size;
+
+  if (q->len == 1) {
+    merger->heap[merger->heapLen] = q - merger->queues;
+    siftUp(merger, merger->heapLen++);
+  }
+
+  while ((merger->maxEvents != 0 && merger->numEvents > merger->maxEvents) ||
+         (merger->maxBytes != 0 && merger->numBytes > merger->maxBytes)) {
+    merger->numForced++;
+    popOldest(merger);
+  }
+}
+
+void merger_release(struct merger *merger, long long nowNs) {
+  while (merger->heapLen > 0 &&
+         (long long)headTs(merger, merger->heap[0]) + merger->windowNs <=
+             nowNs) {
+    popOldest(merger);
+  }
+}
+
+void merger_flush(struct merger *merger) {
+  while (merger->heapLen > 0) {
+    popOldest(merger);
+  }
+}
+
+int merger_timeout_ms(const struct merger *merger, long long nowNs) {
+  if (merger->heapLen == 0) {
+    return -1;
+  }
+
+  long long remainingNs =
+      (long long)headTs(merger, merger->heap[0]) + merger->windowNs - nowNs;
+  if (remainingNs <= 0) {
+    return 0;
+  }
+  return (remainingNs + NANOS_PER_MILLI - 1) / NANOS_PER_MILLI;
+}
@@ -0,0 +1,84 @@
+/**
+ * Restores timestamp order across per-CPU perf buffers.
+ *
+ * perf_reader_poll() drains one CPU's buffer at a time, so events from busy
+ * CPUs come out interleaved in whatever order the buffers were visited.
+ * Within a single CPU's buffer, however, events are already in ts order. So
+ * each CPU gets a FIFO, and a min-heap of the CPUs keyed by the ts of the
+ * event at the front of each FIFO yields the oldest buffered event in
+ * O(log numCpu).
+ *
+ * An event is only released once it is older than the reorder window, since
+ * an event with an earlier ts could still be sitting unread in another CPU's
+ * buffer. The window bounds the latency that ordering adds; maxEvents and
+ * maxBytes bound the memory it uses, at the cost of releasing events early
+ * (and so possibly out of order) when a burst exceeds them.
+ */
+#pragma once
+
+#include <bcc/libbpf.h>
+#include <stddef.h>
+
+struct merge_event;
+struct merger;
+
+struct merge_queue {
+  struct merger *merger;
+  // Circular buffer of events in the order they were read.
+  struct merge_event **events;
+  size_t head;
+  size_t len;
+  size_t capacity;
+};
+
+struct merger {
+  struct merge_queue *queues;
+  int numQueues;
+  // Indexes into queues of the non-empty queues, as a binary min-heap keyed
+  // by the ts of the first event in each queue.
+  int *heap;
+  int heapLen;
+
+  long long windowNs;
+  // 0 means no limit.
+  size_t maxEvents;
+  size_t maxBytes;
+  size_t numEvents;
+  size_t numBytes;
+  // Number of events released early because of maxEvents or maxBytes.
+  unsigned long long numForced;
+
+  perf_reader_raw_cb emit;
+  void *emitCookie;
+};
+
+/**
+ * Returns 0 on success or -1 with errno set. Released events are passed to
+ * emit(emitCookie, raw, raw_size).
+ */
+int merger_init(struct merger *merger, int numQueues, long long windowNs,
+                size_t maxEvents, size_t maxBytes, perf_reader_raw_cb emit,
+                void *emitCookie);
+
+void merger_free(struct merger *merger);
+
+/**
+ * A perf_reader_raw_cb whose cb_cookie must be &merger->queues[i], where i
+ * identifies the CPU whose perf buffer the event came from.
+ */
+void merger_raw_callback(void *cb_cookie, void *raw, int raw_size);
+
+/**
+ * Emits, in ts order, every buffered event whose ts is at least windowNs
+ * older than nowNs (a CLOCK_MONOTONIC time, like bpf_ktime_get_ns()).
+ */
+void merger_release(struct merger *merger, long long nowNs);
+
+/** Emits every buffered event, in ts order. */
+void merger_flush(struct merger *merger);
+
+/**
+ * Returns how many milliseconds until merger_release() will have something
+ * to emit, or -1 if nothing is buffered. Suitable as a poll(2) timeout.
+ */
+int merger_timeout_ms(const struct merger *merger, long long nowNs);
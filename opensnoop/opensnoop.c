@@ -1,20 +1,48 @@
+// For name_to_handle_at().
+#define _GNU_SOURCE
 #include "opensnoop.h"
-#include "generated_bytecode.h"
+#include "analyzer.h"
+#include "capture.h"
+#include "drain.h"
+#include "hist.h"
+#include "merge.h"
+#include "optimizer.h"
+#include "output.h"
+#include "perfbuf.h"
+#include "programs.h"
+#include "ringbuf.h"
+#include "stats.h"
+#include "top.h"
+#include "trampoline.h"
 #include <bcc/libbpf.h>
 #include <bcc/perf_reader.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <linux/magic.h>
 #include <linux/version.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/statfs.h>
 #include <time.h>
 #include <unistd.h>
 
 char bpf_log_buf[LOG_BUF_SIZE];
 
+// Bytes of events that each --threads drain thread can hold for the main
+// thread before it stops reading its perf buffers.
+#define DRAIN_QUEUE_SIZE (4 << 20)
+
+// Number of buckets --hist can count per interval, across all histograms.
+#define HIST_MAX_ENTRIES 10240
+
+// Number of processes and threads that -p, -t and --pin-filter can trace.
+#define FILTER_MAX_ENTRIES 4096
+
 /**
  * If a positive integer is parsed successfully, returns the value.
  * If not, returns -1 and errno is set.
@@ -33,12 +61,12 @@ int parseNonNegativeInteger(const char *str) {
 }
 
 /**
- * A considerably more laborious implementation of get_online_cpus()
+ * A considerably more laborious implementation of _read_cpu_range()
  * compared to the Python code in the bcc repo:
  * https://github.com/iovisor/bcc/blob/master/src/python/bcc/utils.py#L21-L36.
  */
-int getOnlineCpus(int **cpus, size_t *numCpu) {
-  int fd = open("/sys/devices/system/cpu/online", O_RDONLY | O_CLOEXEC);
+int getCpus(const char *path, int **cpus, size_t *numCpu) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
   if (fd < 0) {
     return -1;
   }
@@ -93,7 +121,7 @@ int getOnlineCpus(int **cpus, size_t *numCpu) {
       int extraSpace = capacity - numElements - numCpusToAdd;
       if (extraSpace < 0) {
         size_t newSize = capacity - extraSpace;
-        *cpus = realloc(cpus, newSize * sizeof(int));
+        *cpus = realloc(*cpus, newSize * sizeof(int));
         if (*cpus == NULL) {
           return -1;
         }
@@ -115,18 +143,345 @@ int getOnlineCpus(int **cpus, size_t *numCpu) {
   return 0;
 }
 
+int getOnlineCpus(int **cpus, size_t *numCpu) {
+  return getCpus("/sys/devices/system/cpu/online", cpus, numCpu);
+}
+
+/**
+ * Returns one more than the highest possible CPU, which is the number of
+ * values in each entry of a per-CPU map, or -1 with errno set.
+ */
+int getNumPossibleCpus() {
+  int *cpus;
+  size_t numCpu;
+  if (getCpus("/sys/devices/system/cpu/possible", &cpus, &numCpu) < 0) {
+    return -1;
+  }
+
+  int numPossible = numCpu == 0 ? 0 : cpus[numCpu - 1] + 1;
+  free(cpus);
+  return numPossible;
+}
+
+/**
+ * Returns the id that bpf_get_current_cgroup_id() gives for tasks in the
+ * cgroup v2 directory at path, which is the kernel's file handle for the
+ * directory. Returns 0 on success or -1 with errno set (EINVAL if path is not
+ * in a cgroup v2 hierarchy).
+ */
+int getCgroupId(const char *path, unsigned long long *id) {
+  struct statfs fs;
+  if (statfs(path, &fs) < 0) {
+    return -1;
+  }
+  if (fs.f_type != CGROUP2_SUPER_MAGIC) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct file_handle *handle = malloc(sizeof(struct file_handle) + sizeof(*id));
+  if (handle == NULL) {
+    return -1;
+  }
+  handle->handle_bytes = sizeof(*id);
+  int mountId;
+  int rc = name_to_handle_at(AT_FDCWD, path, handle, &mountId, /* flags */ 0);
+  if (rc == 0) {
+    memcpy(id, handle->f_handle, sizeof(*id));
+  }
+  free(handle);
+  return rc;
+}
+
+/**
+ * A syscall traced with the syscalls:sys_enter_* and sys_exit_* tracepoints
+ * rather than a kprobe on do_sys_open(), which newer kernels no longer call
+ * for every open (openat2() and io_uring go through do_sys_openat2()).
+ */
+struct syscall_probe {
+  const char *enter;
+  const char *exit;
+  // Decides where the entry program finds the filename.
+  enum probe_type probeType;
+};
+
+static const struct syscall_probe syscallProbes[] = {
+    {"sys_enter_open", "sys_exit_open", PROBE_SYSCALL_OPEN},
+    {"sys_enter_openat", "sys_exit_openat", PROBE_SYSCALL_OPENAT},
+    {"sys_enter_openat2", "sys_exit_openat2", PROBE_SYSCALL_OPENAT},
+};
+#define NUM_SYSCALL_PROBES (sizeof(syscallProbes) / sizeof(syscallProbes[0]))
+
+/**
+ * Returns nonzero if the tracepoint syscalls:name exists. Not every kernel
+ * has every syscall (open() is missing on arm64 and openat2() before Linux
+ * 5.6), and none of them do without CONFIG_FTRACE_SYSCALLS.
+ */
+int hasSyscallTracepoint(const char *name) {
+  // The same places bpf_attach_tracepoint() looks.
+  static const char *tracefsRoots[] = {"/sys/kernel/debug/tracing",
+                                       "/sys/kernel/tracing"};
+  for (size_t i = 0; i < sizeof(tracefsRoots) / sizeof(tracefsRoots[0]);
+       i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/events/syscalls/%s", tracefsRoots[i],
+             name);
+    if (access(path, F_OK) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Runs the static analyser over a program that is about to be loaded, and
+ * prints its report to stderr if printReport is nonzero. A bad program is
+ * caught here, with the instruction at fault, rather than by the verifier.
+ *
+ * Returns 0, or -1 with errno set to EINVAL after printing what is wrong.
+ */
+int analyzeProgram(const char *name, const struct bpf_insn *insns,
+                   int numInsns, int printReport) {
+  struct analysis analysis;
+  int rc = analyze_program(insns, numInsns, &analysis);
+  if (rc < 0 || printReport) {
+    analyze_print(stderr, name, insns, numInsns, &analysis);
+  }
+  analyze_free(&analysis);
+  if (rc < 0) {
+    errno = EINVAL;
+  }
+  return rc;
+}
+
+/**
+ * Checks a freshly assembled program with analyzeProgram() and runs the
+ * peephole optimiser over it, keeping the instructions in relocs for
+ * relocate_program(). If printReport is nonzero, the number of instructions
+ * removed and the report on the optimised program are printed to stderr.
+ *
+ * Returns the new number of instructions, or -1 with errno set.
+ */
+int optimizeProgram(const char *name, struct bpf_insn *insns, int numInsns,
+                    struct relocs *relocs, int printReport) {
+  int pinned[MAX_RELOCS];
+  if (analyzeProgram(name, insns, numInsns, /* printReport */ 0) < 0) {
+    return -1;
+  }
+  for (int i = 0; i < relocs->num; i++) {
+    pinned[i] = relocs->entries[i].insn;
+  }
+  int numOptimized =
+      optimize_program(insns, numInsns, pinned, relocs->num, NULL);
+  if (numOptimized < 0) {
+    perror("Error optimizing the BPF program");
+    return -1;
+  }
+  for (int i = 0; i < relocs->num; i++) {
+    relocs->entries[i].insn = pinned[i];
+  }
+  if (printReport) {
+    fprintf(stderr, "%s: optimizer removed %d of %d instructions\n", name,
+            numInsns - numOptimized, numInsns);
+  }
+  if (analyzeProgram(name, insns, numOptimized, printReport) < 0) {
+    return -1;
+  }
+  return numOptimized;
+}
+
+// Functions that --attach fentry can trace, in order of preference. Since
+// Linux 5.6, do_sys_openat2() is what open(), openat() and openat2() call,
+// and do_sys_open() is only a wrapper for some of them.
+static const char *trampolineFuncs[] = {"do_sys_openat2", "do_sys_open"};
+
+/**
+ * Loads and attaches the programs for --attach fentry to the first of
+ * trampolineFuncs in the kernel's BTF: an fexit program made from
+ * returnParams and, if needEntry is nonzero, an fentry program made from
+ * entryParams that records the time of entry for it. Otherwise the fexit
+ * program gets everything it needs from the arguments of the function and
+ * the infotmp map is not used at all. printReports is passed on to
+ * optimizeProgram().
+ *
+ * Returns 0 on success, or -1 with errno set and none of the fds open.
+ */
+int attachTrampolines(const struct trace_entry_params *entryParams,
+                      const struct trace_return_params *returnParams,
+                      int needEntry, int printReports, int *entryProgFd,
+                      int *fentryFd, int *returnProgFd, int *fexitFd) {
+  int *fds[] = {fexitFd, returnProgFd, fentryFd, entryProgFd};
+  int btfId = -1, numArgs;
+  for (size_t i = 0;
+       btfId < 0 && i < sizeof(trampolineFuncs) / sizeof(trampolineFuncs[0]);
+       i++) {
+    btfId = trampoline_find_func(trampolineFuncs[i], &numArgs);
+  }
+  if (btfId < 0) {
+    return -1;
+  }
+
+  struct bpf_insn insns[MAX_NUM_TRACE_RETURN_INSTRUCTIONS];
+  struct relocs relocs = {};
+  int savedErrno;
+  struct trace_return_params fexitParams = *returnParams;
+  if (needEntry) {
+    int numInsns = assemble_trace_entry(insns, entryParams, &relocs);
+    if (numInsns < 0 ||
+        (numInsns = optimizeProgram("trace_entry", insns, numInsns, &relocs,
+                                    printReports)) < 0) {
+      goto error;
+    }
+    relocate_program(insns, &relocs, PROBE_TRAMPOLINE, numArgs);
+    *entryProgFd =
+        trampoline_prog_load("opensnoop_entry", insns, numInsns,
+                             BPF_TRACE_FENTRY, btfId, bpf_log_buf,
+                             LOG_BUF_SIZE);
+    if (*entryProgFd < 0 || (*fentryFd = trampoline_attach(*entryProgFd)) < 0) {
+      goto error;
+    }
+  } else {
+    fexitParams.infotmpFd = -1;
+  }
+
+  relocs.num = 0;
+  int numInsns = assemble_trace_return(insns, &fexitParams, &relocs);
+  if (numInsns < 0 ||
+      (numInsns = optimizeProgram("trace_return", insns, numInsns, &relocs,
+                                  printReports)) < 0) {
+    goto error;
+  }
+  relocate_program(insns, &relocs, PROBE_TRAMPOLINE, numArgs);
+  *returnProgFd = trampoline_prog_load("opensnoop_return", insns, numInsns,
+                                       BPF_TRACE_FEXIT, btfId, bpf_log_buf,
+                                       LOG_BUF_SIZE);
+  if (*returnProgFd < 0 || (*fexitFd = trampoline_attach(*returnProgFd)) < 0) {
+    goto error;
+  }
+  return 0;
+
+error:
+  savedErrno = errno;
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+    }
+    *fds[i] = -1;
+  }
+  errno = savedErrno;
+  return -1;
+}
+
+/** Values for --attach. */
+enum attach_mode {
+  ATTACH_AUTO,
+  ATTACH_KPROBE,
+  ATTACH_TRACEPOINT,
+  ATTACH_FENTRY,
+};
+
 int opt_timestamp = 0;
 int opt_failed = 0;
-int opt_pid = -1;
-int opt_tid = -1;
+int *opt_pids = NULL;
+int opt_num_pids = 0;
+int *opt_tids = NULL;
+int opt_num_tids = 0;
 int opt_duration = -1;
 char *opt_name = NULL;
+int opt_ringbuf_pages = 256;
+int opt_no_ringbuf = 0;
+int opt_long_paths = 0;
+int opt_flush_interval = 100;
+char *opt_write = NULL;
+char *opt_read = NULL;
+int opt_ordered = 0;
+int opt_reorder_window = 50;
+int opt_reorder_events = 0;
+int opt_reorder_memory = 64;
+int opt_stats_interval = 10;
+int opt_threads = 0;
+int opt_perf_pages = 64;
+int opt_wakeup_events = 1;
+int opt_wakeup_bytes = 0;
+int opt_wakeup_latency = 50;
+int opt_perf_memory = 0;
+char *opt_perf_profile = NULL;
+int opt_top = 0;
+int opt_top_interval = 1;
+int opt_top_entries = 10240;
+int opt_latency = 0;
+int opt_hist = 0;
+enum hist_by opt_hist_by = HIST_BY_NONE;
+int opt_hist_interval = 0;
+char *opt_pin_filter = NULL;
+char **opt_cgroups = NULL;
+int opt_num_cgroups = 0;
+enum bpf_map_type opt_entry_map_type = BPF_MAP_TYPE_HASH;
+unsigned int opt_entry_map_flags = 0;
+int opt_entry_map_size = 10240;
+enum attach_mode opt_attach = ATTACH_AUTO;
+int opt_analyze = 0;
+
+// Values for options that only have a long form.
+enum {
+  OPT_RINGBUF_PAGES = 256,
+  OPT_NO_RINGBUF,
+  OPT_LONG_PATHS,
+  OPT_FLUSH_INTERVAL,
+  OPT_WRITE,
+  OPT_READ,
+  OPT_ORDERED,
+  OPT_REORDER_WINDOW,
+  OPT_REORDER_EVENTS,
+  OPT_REORDER_MEMORY,
+  OPT_STATS_INTERVAL,
+  OPT_THREADS,
+  OPT_PERF_PAGES,
+  OPT_WAKEUP_EVENTS,
+  OPT_WAKEUP_BYTES,
+  OPT_WAKEUP_LATENCY,
+  OPT_PERF_MEMORY,
+  OPT_PERF_PROFILE,
+  OPT_TOP,
+  OPT_TOP_INTERVAL,
+  OPT_TOP_ENTRIES,
+  OPT_LATENCY,
+  OPT_HIST,
+  OPT_HIST_BY,
+  OPT_HIST_INTERVAL,
+  OPT_PIN_FILTER,
+  OPT_CGROUP,
+  OPT_ENTRY_MAP,
+  OPT_ENTRY_MAP_SIZE,
+  OPT_ATTACH,
+  OPT_ANALYZE,
+};
 
 void usage(FILE *fd) {
   fprintf(
       fd,
-      "usage: opensnoop.py [-h] [-T] [-x] [-p PID] [-t TID] [-d DURATION] [-n "
+      "usage: opensnoop [-h] [-T] [-x] [-p PID] [-t TID] [-d DURATION] [-n "
       "NAME]\n"
+      "                 [--ringbuf-pages PAGES] [--no-ringbuf] "
+      "[--long-paths]\n"
+      "                 [--flush-interval MS] [--write FILE] [--read FILE]\n"
+      "                 [--ordered] [--reorder-window MS] "
+      "[--reorder-events N]\n"
+      "                 [--reorder-memory MB] [--stats-interval "
+      "SECONDS]\n"
+      "                 [--threads N] [--perf-pages PAGES] "
+      "[--wakeup-events N]\n"
+      "                 [--wakeup-bytes BYTES] [--wakeup-latency MS]\n"
+      "                 [--perf-memory MB] [--perf-profile FILE]\n"
+      "                 [--top N] [--top-interval SECONDS] "
+      "[--top-entries N]\n"
+      "                 [--latency] [--hist] [--hist-by {comm,errno}]\n"
+      "                 [--hist-interval SECONDS] [--pin-filter PATH]\n"
+      "                 [--cgroup PATH] [--entry-map "
+      "{hash,lru,lru-percpu}]\n"
+      "                 [--entry-map-size N]\n"
+      "                 [--attach {auto,kprobe,tracepoint,fentry}] "
+      "[--analyze]\n"
       "\n"
       "Trace open() syscalls\n"
       "\n"
@@ -134,11 +489,95 @@ void usage(FILE *fd) {
       "  -h, --help            show this help message and exit\n"
       "  -T, --timestamp       include timestamp on output\n"
       "  -x, --failed          only show failed opens\n"
-      "  -p PID, --pid PID     trace this PID only\n"
-      "  -t TID, --tid TID     trace this TID only\n"
+      "  -p PID, --pid PID     trace this PID only (may be repeated)\n"
+      "  -t TID, --tid TID     trace this TID only (may be repeated)\n"
       "  -d DURATION, --duration DURATION\n"
       "                        total duration of trace in seconds\n"
       "  -n NAME, --name NAME  only print process names containing this name\n"
+      "  --ringbuf-pages PAGES\n"
+      "                        size of the shared ring buffer in pages (a\n"
+      "                        power of 2, default 256)\n"
+      "  --no-ringbuf          use per-CPU perf buffers even if the kernel\n"
+      "                        supports BPF ring buffers\n"
+      "  --long-paths          read up to PATH_MAX bytes of each path rather\n"
+      "                        than NAME_MAX\n"
+      "  --flush-interval MS   write buffered output at least this often\n"
+      "                        (default 100, 0 writes every batch of events)\n"
+      "  --write FILE          save raw events to a capture file instead of\n"
+      "                        printing them\n"
+      "  --read FILE           print the events in a capture file rather than\n"
+      "                        tracing (does not require root)\n"
+      "  --ordered             sort events from the per-CPU perf buffers by\n"
+      "                        timestamp (the ring buffer is already ordered)\n"
+      "  --reorder-window MS   how long --ordered holds events back waiting\n"
+      "                        for older ones from other CPUs (default 50)\n"
+      "  --reorder-events N    also release events once more than N are held\n"
+      "                        back (default 0, no limit)\n"
+      "  --reorder-memory MB   also release events once they use more than MB\n"
+      "                        of memory (default 64)\n"
+      "  --stats-interval SECONDS\n"
+      "                        report events lost in the last SECONDS, if\n"
+      "                        any (default 10, 0 only reports at exit)\n"
+      "  --threads N           read the per-CPU perf buffers on N threads,\n"
+      "                        each with its own group of CPUs (implies\n"
+      "                        --no-ringbuf)\n"
+      "  --perf-pages PAGES    size of each per-CPU perf buffer in pages (a\n"
+      "                        power of 2, default 64)\n"
+      "  --wakeup-events N     only wake up for every N events in a perf\n"
+      "                        buffer (default 1)\n"
+      "  --wakeup-bytes BYTES  only wake up once a perf buffer holds BYTES\n"
+      "                        (overrides --wakeup-events)\n"
+      "  --wakeup-latency MS   with --wakeup-events or --wakeup-bytes, still\n"
+      "                        read every perf buffer this often (default "
+      "50)\n"
+      "  --perf-memory MB      divide MB between the per-CPU perf buffers\n"
+      "                        according to --perf-profile (or evenly)\n"
+      "                        rather than using --perf-pages for each\n"
+      "  --perf-profile FILE   size perf buffers by the event rate of each\n"
+      "                        CPU recorded in FILE, and update FILE on exit\n"
+      "  --top N               count opens by process name, path and error\n"
+      "                        in the kernel and periodically print the N\n"
+      "                        most frequent instead of every open\n"
+      "  --top-interval SECONDS\n"
+      "                        how often --top prints and resets the counts\n"
+      "                        (default 1)\n"
+      "  --top-entries N       number of distinct opens --top can count per\n"
+      "                        interval (default 10240)\n"
+      "  --latency             include the time spent in each open, in\n"
+      "                        microseconds, on output\n"
+      "  --hist                build log2 histograms of open latency in the\n"
+      "                        kernel and print them instead of every open\n"
+      "  --hist-by {comm,errno}\n"
+      "                        print a separate --hist histogram for each\n"
+      "                        process name or error\n"
+      "  --hist-interval SECONDS\n"
+      "                        how often --hist prints and resets the\n"
+      "                        histograms (default 0, only at exit)\n"
+      "  --pin-filter PATH     pin the set of PIDs and TIDs to trace at PATH\n"
+      "                        in bpffs so it can be changed while tracing\n"
+      "                        (the set starts with -p and -t, if any)\n"
+      "  --cgroup PATH         only trace tasks in the cgroup v2 directory\n"
+      "                        PATH (not its descendants; may be repeated)\n"
+      "  --entry-map {hash,lru,lru-percpu}\n"
+      "                        map that holds each open between entry and\n"
+      "                        return: a plain hash fails new opens when it\n"
+      "                        is full, while an LRU hash evicts the oldest\n"
+      "                        (with a separate LRU list per CPU for\n"
+      "                        lru-percpu; default hash)\n"
+      "  --entry-map-size N    number of opens --entry-map can hold at once\n"
+      "                        (default 10240)\n"
+      "  --attach {auto,kprobe,tracepoint,fentry}\n"
+      "                        trace do_sys_open() with a kprobe, the open,\n"
+      "                        openat and openat2 syscalls with their\n"
+      "                        tracepoints, which are cheaper and also see\n"
+      "                        openat2() on newer kernels, or\n"
+      "                        do_sys_openat2() with fentry and fexit, which\n"
+      "                        are cheaper still but need BTF (default auto,\n"
+      "                        which picks the cheapest that works)\n"
+      "  --analyze             print the static analysis of each BPF program\n"
+      "                        before it is loaded: the instructions the\n"
+      "                        optimizer removed, its stack depth, helpers\n"
+      "                        and shortest and longest paths\n"
       "\n"
       "examples:\n"
       "    ./opensnoop           # trace all open() syscalls\n"
@@ -146,9 +585,41 @@ void usage(FILE *fd) {
       "    ./opensnoop -x        # only show failed opens\n"
       "    ./opensnoop -p 181    # only trace PID 181\n"
       "    ./opensnoop -t 123    # only trace TID 123\n"
+      "    ./opensnoop -p 181 -p 182  # only trace PIDs 181 and 182\n"
+      "    ./opensnoop --cgroup /sys/fs/cgroup/system.slice/foo.service\n"
       "    ./opensnoop -d 10     # trace for 10 seconds only\n"
       "    ./opensnoop -n main   # only print process names containing "
-      "\"main\"\n");
+      "\"main\"\n"
+      "    ./opensnoop --top 20  # the 20 most frequent opens every second\n"
+      "    ./opensnoop --hist --hist-by comm  # open latency by process\n"
+      "    ./opensnoop --write open.cap  # record opens to open.cap\n"
+      "    ./opensnoop --read open.cap -x  # show failed opens in open.cap\n");
+}
+
+/** Parses arg as a PID or TID for flag and appends it to *ids. */
+void appendId(int **ids, int *numIds, const char *arg, const char *flag) {
+  int id = parseNonNegativeInteger(arg);
+  if (id == -1) {
+    fprintf(stderr, "Invalid value for %s: '%s'\n", flag, arg);
+    exit(1);
+  }
+
+  *ids = realloc(*ids, (*numIds + 1) * sizeof(int));
+  if (*ids == NULL) {
+    perror("Failed to realloc for -p or -t argument.");
+    exit(1);
+  }
+  (*ids)[(*numIds)++] = id;
+}
+
+/** Returns nonzero if id is one of the numIds in ids. */
+int containsId(const int *ids, int numIds, int id) {
+  for (int i = 0; i < numIds; i++) {
+    if (ids[i] == id) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 void parseArgs(int argc, char **argv) {
@@ -163,6 +634,37 @@ void parseArgs(int argc, char **argv) {
         {"tid", required_argument, 0, 't'},
         {"duration", required_argument, 0, 'd'},
         {"name", required_argument, 0, 'n'},
+        {"ringbuf-pages", required_argument, 0, OPT_RINGBUF_PAGES},
+        {"no-ringbuf", no_argument, 0, OPT_NO_RINGBUF},
+        {"long-paths", no_argument, 0, OPT_LONG_PATHS},
+        {"flush-interval", required_argument, 0, OPT_FLUSH_INTERVAL},
+        {"write", required_argument, 0, OPT_WRITE},
+        {"read", required_argument, 0, OPT_READ},
+        {"ordered", no_argument, 0, OPT_ORDERED},
+        {"reorder-window", required_argument, 0, OPT_REORDER_WINDOW},
+        {"reorder-events", required_argument, 0, OPT_REORDER_EVENTS},
+        {"reorder-memory", required_argument, 0, OPT_REORDER_MEMORY},
+        {"stats-interval", required_argument, 0, OPT_STATS_INTERVAL},
+        {"threads", required_argument, 0, OPT_THREADS},
+        {"perf-pages", required_argument, 0, OPT_PERF_PAGES},
+        {"wakeup-events", required_argument, 0, OPT_WAKEUP_EVENTS},
+        {"wakeup-bytes", required_argument, 0, OPT_WAKEUP_BYTES},
+        {"wakeup-latency", required_argument, 0, OPT_WAKEUP_LATENCY},
+        {"perf-memory", required_argument, 0, OPT_PERF_MEMORY},
+        {"perf-profile", required_argument, 0, OPT_PERF_PROFILE},
+        {"top", required_argument, 0, OPT_TOP},
+        {"top-interval", required_argument, 0, OPT_TOP_INTERVAL},
+        {"top-entries", required_argument, 0, OPT_TOP_ENTRIES},
+        {"latency", no_argument, 0, OPT_LATENCY},
+        {"hist", no_argument, 0, OPT_HIST},
+        {"hist-by", required_argument, 0, OPT_HIST_BY},
+        {"hist-interval", required_argument, 0, OPT_HIST_INTERVAL},
+        {"pin-filter", required_argument, 0, OPT_PIN_FILTER},
+        {"cgroup", required_argument, 0, OPT_CGROUP},
+        {"entry-map", required_argument, 0, OPT_ENTRY_MAP},
+        {"entry-map-size", required_argument, 0, OPT_ENTRY_MAP_SIZE},
+        {"attach", required_argument, 0, OPT_ATTACH},
+        {"analyze", no_argument, 0, OPT_ANALYZE},
         {0, 0, 0, 0}};
     int option_index = 0;
     c = getopt_long(argc, argv, "hTxp:t:d:n:", long_options, &option_index);
@@ -184,19 +686,11 @@ void parseArgs(int argc, char **argv) {
       break;
 
     case 'p':
-      opt_pid = parseNonNegativeInteger(optarg);
-      if (opt_pid == -1) {
-        fprintf(stderr, "Invalid value for -p: '%s'\n", optarg);
-        exit(1);
-      }
+      appendId(&opt_pids, &opt_num_pids, optarg, "-p");
       break;
 
     case 't':
-      opt_tid = parseNonNegativeInteger(optarg);
-      if (opt_tid == -1) {
-        fprintf(stderr, "Invalid value for -t: '%s'\n", optarg);
-        exit(1);
-      }
+      appendId(&opt_tids, &opt_num_tids, optarg, "-t");
       break;
 
     case 'd':
@@ -217,6 +711,238 @@ void parseArgs(int argc, char **argv) {
       strcpy(opt_name, optarg);
       break;
 
+    case OPT_RINGBUF_PAGES:
+      opt_ringbuf_pages = parseNonNegativeInteger(optarg);
+      // The kernel requires the size of a ring buffer to be a power of 2.
+      if (opt_ringbuf_pages <= 0 ||
+          (opt_ringbuf_pages & (opt_ringbuf_pages - 1)) != 0) {
+        fprintf(stderr, "Invalid value for --ringbuf-pages: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_NO_RINGBUF:
+      opt_no_ringbuf = 1;
+      break;
+
+    case OPT_LONG_PATHS:
+      opt_long_paths = 1;
+      break;
+
+    case OPT_FLUSH_INTERVAL:
+      opt_flush_interval = parseNonNegativeInteger(optarg);
+      if (opt_flush_interval == -1) {
+        fprintf(stderr, "Invalid value for --flush-interval: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_WRITE:
+      opt_write = optarg;
+      break;
+
+    case OPT_READ:
+      opt_read = optarg;
+      break;
+
+    case OPT_ORDERED:
+      opt_ordered = 1;
+      break;
+
+    case OPT_REORDER_WINDOW:
+      opt_reorder_window = parseNonNegativeInteger(optarg);
+      if (opt_reorder_window == -1) {
+        fprintf(stderr, "Invalid value for --reorder-window: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_REORDER_EVENTS:
+      opt_reorder_events = parseNonNegativeInteger(optarg);
+      if (opt_reorder_events == -1) {
+        fprintf(stderr, "Invalid value for --reorder-events: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_REORDER_MEMORY:
+      opt_reorder_memory = parseNonNegativeInteger(optarg);
+      if (opt_reorder_memory == -1) {
+        fprintf(stderr, "Invalid value for --reorder-memory: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_STATS_INTERVAL:
+      opt_stats_interval = parseNonNegativeInteger(optarg);
+      if (opt_stats_interval == -1) {
+        fprintf(stderr, "Invalid value for --stats-interval: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_THREADS:
+      opt_threads = parseNonNegativeInteger(optarg);
+      if (opt_threads == -1) {
+        fprintf(stderr, "Invalid value for --threads: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_PERF_PAGES:
+      opt_perf_pages = parseNonNegativeInteger(optarg);
+      // Like the ring buffer, a perf buffer must be a power of 2 pages.
+      if (opt_perf_pages <= 0 || (opt_perf_pages & (opt_perf_pages - 1)) != 0) {
+        fprintf(stderr, "Invalid value for --perf-pages: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_WAKEUP_EVENTS:
+      opt_wakeup_events = parseNonNegativeInteger(optarg);
+      if (opt_wakeup_events <= 0) {
+        fprintf(stderr, "Invalid value for --wakeup-events: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_WAKEUP_BYTES:
+      opt_wakeup_bytes = parseNonNegativeInteger(optarg);
+      if (opt_wakeup_bytes == -1) {
+        fprintf(stderr, "Invalid value for --wakeup-bytes: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_WAKEUP_LATENCY:
+      opt_wakeup_latency = parseNonNegativeInteger(optarg);
+      if (opt_wakeup_latency <= 0) {
+        fprintf(stderr, "Invalid value for --wakeup-latency: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_PERF_MEMORY:
+      opt_perf_memory = parseNonNegativeInteger(optarg);
+      if (opt_perf_memory <= 0) {
+        fprintf(stderr, "Invalid value for --perf-memory: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_PERF_PROFILE:
+      opt_perf_profile = optarg;
+      break;
+
+    case OPT_TOP:
+      opt_top = parseNonNegativeInteger(optarg);
+      if (opt_top <= 0) {
+        fprintf(stderr, "Invalid value for --top: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_TOP_INTERVAL:
+      opt_top_interval = parseNonNegativeInteger(optarg);
+      if (opt_top_interval <= 0) {
+        fprintf(stderr, "Invalid value for --top-interval: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_TOP_ENTRIES:
+      opt_top_entries = parseNonNegativeInteger(optarg);
+      if (opt_top_entries <= 0) {
+        fprintf(stderr, "Invalid value for --top-entries: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_LATENCY:
+      opt_latency = 1;
+      break;
+
+    case OPT_HIST:
+      opt_hist = 1;
+      break;
+
+    case OPT_HIST_BY:
+      if (strcmp(optarg, "comm") == 0) {
+        opt_hist_by = HIST_BY_COMM;
+      } else if (strcmp(optarg, "errno") == 0) {
+        opt_hist_by = HIST_BY_ERRNO;
+      } else {
+        fprintf(stderr, "Invalid value for --hist-by: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_HIST_INTERVAL:
+      opt_hist_interval = parseNonNegativeInteger(optarg);
+      if (opt_hist_interval == -1) {
+        fprintf(stderr, "Invalid value for --hist-interval: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_PIN_FILTER:
+      opt_pin_filter = optarg;
+      break;
+
+    case OPT_CGROUP:
+      opt_cgroups =
+          realloc(opt_cgroups, (opt_num_cgroups + 1) * sizeof(char *));
+      if (opt_cgroups == NULL) {
+        perror("Failed to realloc for --cgroup argument.");
+        exit(1);
+      }
+      opt_cgroups[opt_num_cgroups++] = optarg;
+      break;
+
+    case OPT_ENTRY_MAP:
+      if (strcmp(optarg, "hash") == 0) {
+        opt_entry_map_type = BPF_MAP_TYPE_HASH;
+        opt_entry_map_flags = 0;
+      } else if (strcmp(optarg, "lru") == 0) {
+        opt_entry_map_type = BPF_MAP_TYPE_LRU_HASH;
+        opt_entry_map_flags = 0;
+      } else if (strcmp(optarg, "lru-percpu") == 0) {
+        opt_entry_map_type = BPF_MAP_TYPE_LRU_HASH;
+        opt_entry_map_flags = BPF_F_NO_COMMON_LRU;
+      } else {
+        fprintf(stderr, "Invalid value for --entry-map: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_ENTRY_MAP_SIZE:
+      opt_entry_map_size = parseNonNegativeInteger(optarg);
+      if (opt_entry_map_size <= 0) {
+        fprintf(stderr, "Invalid value for --entry-map-size: '%s'\n",
+                optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_ATTACH:
+      if (strcmp(optarg, "auto") == 0) {
+        opt_attach = ATTACH_AUTO;
+      } else if (strcmp(optarg, "kprobe") == 0) {
+        opt_attach = ATTACH_KPROBE;
+      } else if (strcmp(optarg, "tracepoint") == 0) {
+        opt_attach = ATTACH_TRACEPOINT;
+      } else if (strcmp(optarg, "fentry") == 0) {
+        opt_attach = ATTACH_FENTRY;
+      } else {
+        fprintf(stderr, "Invalid value for --attach: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case OPT_ANALYZE:
+      opt_analyze = 1;
+      break;
+
     case 'h':
       usage(stdout);
       exit(0);
@@ -228,20 +954,84 @@ void parseArgs(int argc, char **argv) {
       break;
     }
   }
+
+  if (opt_top != 0 && (opt_write != NULL || opt_read != NULL)) {
+    fprintf(stderr, "--top cannot be combined with --write or --read.\n");
+    exit(1);
+  }
+  // Events do not record their cgroup.
+  if (opt_num_cgroups > 0 && opt_read != NULL) {
+    fprintf(stderr, "--cgroup cannot be combined with --read.\n");
+    exit(1);
+  }
+  if (opt_hist && (opt_top != 0 || opt_write != NULL || opt_read != NULL)) {
+    fprintf(stderr,
+            "--hist cannot be combined with --top, --write or --read.\n");
+    exit(1);
+  }
 }
 
-void printHeader() {
-  if (opt_timestamp) {
-    printf("%-14s", "TIME(s)");
+/**
+ * Translates -x and -n into the struct config_t read by the return program.
+ */
+void initConfig(struct config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->failed_only = opt_failed;
+  if (opt_name != NULL) {
+    config->has_name = 1;
+    // comm is at most TASK_COMM_LEN - 1 characters, so a longer name can
+    // never match, which is also true of its first TASK_COMM_LEN bytes.
+    size_t len = strlen(opt_name);
+    if (len > TASK_COMM_LEN) {
+      len = TASK_COMM_LEN;
+    }
+    memcpy(config->name, opt_name, len);
+    memset(config->name_mask, 0xff, len);
   }
-  printf("%-6s %-16s %4s %3s %s\n", opt_tid != -1 ? "TID" : "PID", "COMM", "FD",
-         "ERR", "PATH");
 }
 
+// All output to stdout goes through this writer so that lines are never
+// interleaved with stdio's buffer.
+struct output_writer stdoutWriter;
+
+// Destination of events when --write is specified.
+struct capture_writer captureWriter;
+
+// Sorts events from the per-CPU perf buffers when --ordered is specified.
+struct merger merger;
+
+// Reads the perf buffers when --threads is specified.
+struct drain_pool drainPool;
+
+// The most recent counts read back in --top mode.
+struct top_table topTable;
+
+// The most recent buckets read back in --hist mode.
+struct hist_table histTable;
+
+// Events that the kernel produced but that never reached
+// perf_reader_raw_callback().
+struct loss_stats lossStats;
+
+// Set by the SIGINT/SIGTERM handler so the main loop can flush stdoutWriter
+// before exiting.
+volatile sig_atomic_t exiting = 0;
+
+void handleExitSignal(int sig) { exiting = 1; }
+
 long long initialTimestamp = 0;
-const float NANOS_PER_SECOND = 1000000000;
 void perf_reader_raw_callback(void *cb_cookie, void *raw, int raw_size) {
-  struct data_t *event = (struct data_t *)raw;
+  struct event_t *event = (struct event_t *)raw;
+  // raw_size may include padding added by the perf buffer, so it is only
+  // used to check that the record is not truncated.
+  if (raw_size < sizeof(struct event_t) || event->version != EVENT_VERSION ||
+      event->fname_len > raw_size - sizeof(struct event_t)) {
+    fprintf(stderr, "Ignoring malformed event of %d bytes.\n", raw_size);
+    return;
+  }
+
+  // The return program has already applied these filters, so they are
+  // expected to be no-ops here.
   if (opt_failed && event->ret >= 0) {
     return;
   }
@@ -250,35 +1040,272 @@ void perf_reader_raw_callback(void *cb_cookie, void *raw, int raw_size) {
     return;
   }
 
-  int fd_s, err;
-  if (event->ret >= 0) {
-    fd_s = event->ret;
-    err = 0;
-  } else {
-    fd_s = -1;
-    err = -event->ret;
+  // -p and -t are normally applied by the entry program, but not when
+  // replaying a capture file. (While tracing, the set may have been changed
+  // through --pin-filter, so the entry program has the final say.)
+  if (opt_read != NULL && (opt_num_pids > 0 || opt_num_tids > 0) &&
+      !containsId(opt_pids, opt_num_pids, event->id >> 32) &&
+      !containsId(opt_tids, opt_num_tids, (int)event->id)) {
+    return;
+  }
+
+  if (opt_write != NULL) {
+    capture_writer_append_event(&captureWriter, event,
+                                sizeof(struct event_t) + event->fname_len);
+    return;
   }
 
+  long long delta = 0;
   if (opt_timestamp) {
     if (initialTimestamp == 0) {
       initialTimestamp = event->ts;
     }
 
-    long long delta = event->ts - initialTimestamp;
-    printf("%-14.9f", delta / NANOS_PER_SECOND);
+    delta = event->ts - initialTimestamp;
+  }
+
+  output_append_event(&stdoutWriter, event, opt_timestamp, delta,
+                      opt_latency);
+}
+
+/** cb_cookie of the perf buffer of one online CPU. */
+struct perf_buffer_cookie {
+  int cpu;
+  int cpuIndex;
+  // Where events go when --ordered is specified, otherwise NULL.
+  struct merge_queue *queue;
+  // The thread that reads this perf buffer when --threads is specified,
+  // otherwise NULL.
+  struct drain_thread *drain;
+};
+
+void dispatchPerfEvent(struct perf_buffer_cookie *cookie, void *raw,
+                       int raw_size) {
+  if (cookie->queue != NULL) {
+    merger_raw_callback(cookie->queue, raw, raw_size);
+  } else {
+    perf_reader_raw_callback(/* cb_cookie */ NULL, raw, raw_size);
+  }
+}
+
+void perfBufferRawCallback(void *cb_cookie, void *raw, int raw_size) {
+  struct perf_buffer_cookie *cookie = cb_cookie;
+  if (cookie->drain != NULL) {
+    // On a drain thread: the main thread will pick this up in
+    // drainedEventCallback(), unless it has already stopped reading.
+    if (drain_thread_push(cookie->drain, cookie->cpuIndex, raw, raw_size) <
+        0) {
+      loss_stats_add_lost(&lossStats, cookie->cpu, 1);
+    }
+  } else {
+    dispatchPerfEvent(cookie, raw, raw_size);
+  }
+}
+
+/** cb_cookie is the array of every perf_buffer_cookie. */
+void drainedEventCallback(void *cb_cookie, int cpuIndex, void *raw,
+                          int raw_size) {
+  struct perf_buffer_cookie *cookies = cb_cookie;
+  dispatchPerfEvent(&cookies[cpuIndex], raw, raw_size);
+}
+
+void perfBufferLostCallback(void *cb_cookie, uint64_t lost) {
+  struct perf_buffer_cookie *cookie = cb_cookie;
+  loss_stats_add_lost(&lossStats, cookie->cpu, lost);
+}
+
+/**
+ * Implementation of --read: feeds every event in the capture file at path
+ * through perf_reader_raw_callback(), just as if it were coming from the
+ * kernel.
+ */
+int replayCapture(const char *path) {
+  struct capture_reader reader;
+  if (capture_reader_open(&reader, path) < 0) {
+    if (errno == EINVAL) {
+      fprintf(stderr, "%s is not a capture file in a supported format.\n",
+              path);
+    } else {
+      perror("Error opening capture file");
+    }
+    return 1;
+  }
+
+  output_append_header(&stdoutWriter, opt_timestamp, opt_num_tids > 0,
+                       opt_latency);
+  loss_stats_init(&lossStats, /* numCpus */ 0, /* statsMapFd */ -1,
+                  /* intervalMs */ 0, /* nowNs */ 0);
+  int exitCode = 0;
+  const void *payload;
+  unsigned int size;
+  int type;
+  while ((type = capture_reader_next(&reader, &payload, &size)) > 0) {
+    if (type == CAPTURE_RECORD_EVENT) {
+      perf_reader_raw_callback(/* cb_cookie */ NULL, (void *)payload, size);
+      if (output_writer_maybe_flush(&stdoutWriter) < 0) {
+        perror("Error writing to stdout");
+        exitCode = 1;
+        break;
+      }
+    } else if (type == CAPTURE_RECORD_LOST &&
+               size >= sizeof(struct capture_lost)) {
+      // Each record has the running totals, so the last one for each CPU
+      // wins.
+      const struct capture_lost *lost = payload;
+      loss_stats_set(&lossStats, lost->cpu, lost->submitted, lost->lost);
+    }
+  }
+  if (type < 0) {
+    fprintf(stderr, "Capture file %s is truncated.\n", path);
+  }
+
+  if (output_writer_flush(&stdoutWriter) < 0) {
+    exitCode = 1;
+  }
+  loss_stats_report(&lossStats, stderr, /* nowNs */ 0, /* final */ 1);
+  loss_stats_free(&lossStats);
+  capture_reader_close(&reader);
+  return exitCode;
+}
+
+/** The clock used by bpf_ktime_get_ns(). */
+long long monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Prints the events lost since the last report to stderr. With --write, also
+ * records the totals of each CPU that lost any in the meantime (or, if final,
+ * of every CPU that submitted any) in the capture file. Returns 0 on success
+ * or -1 with errno set.
+ */
+int reportLoss(long long nowNs, int final) {
+  if (loss_stats_refresh(&lossStats) < 0) {
+    return -1;
+  }
+
+  for (int cpu = 0; opt_write != NULL && cpu < lossStats.numCpus; cpu++) {
+    struct capture_lost record = {
+        .ts = nowNs,
+        .submitted = lossStats.current[cpu].submitted,
+        .lost = loss_stats_lost(&lossStats, cpu),
+        .cpu = cpu,
+    };
+    if (final ? record.submitted != 0
+              : record.lost != lossStats.reported[cpu].lost) {
+      capture_writer_append_lost(&captureWriter, &record);
+    }
+  }
+
+  loss_stats_report(&lossStats, stderr, nowNs, final);
+  return 0;
+}
+
+/**
+ * Saves the event rate of each CPU during this run to --perf-profile, averaged
+ * with the previous profile so that one unusual run does not skew the sizing
+ * of the next. lossStats must be up to date. Returns 0 on success (including
+ * when the run was too short to measure) or -1 with errno set.
+ */
+int updatePerfProfile(const double *oldRates, int numOldRates,
+                      long long elapsedNs) {
+  if (elapsedNs < 1000000000LL) {
+    return 0;
+  }
+
+  double *rates = calloc(lossStats.numCpus, sizeof(double));
+  if (rates == NULL) {
+    return -1;
+  }
+  for (int cpu = 0; cpu < lossStats.numCpus; cpu++) {
+    rates[cpu] = lossStats.current[cpu].submitted / (elapsedNs / 1e9);
+    if (cpu < numOldRates && oldRates[cpu] > 0) {
+      rates[cpu] = (rates[cpu] + oldRates[cpu]) / 2;
+    }
+  }
+
+  int rc = perfbuf_profile_save(opt_perf_profile, rates, lossStats.numCpus);
+  free(rates);
+  return rc;
+}
+
+/** Prints the --top entries counted since the last call and resets them. */
+int dumpTop(int topMapFd) {
+  if (top_table_collect(&topTable, topMapFd, /* reset */ 1) < 0) {
+    return -1;
   }
+  top_table_sort(&topTable);
+  return output_append_top(&stdoutWriter, &topTable, opt_top);
+}
 
-  int pid = event->id >> 32;
-  printf("%-6d %-16s %4d %3d %s\n", pid, event->comm, fd_s, err, event->fname);
+/**
+ * Prints the --hist histograms counted since the last call and resets them.
+ */
+int dumpHist(int histMapFd, int numPossibleCpus) {
+  if (hist_table_collect(&histTable, histMapFd, numPossibleCpus,
+                         /* reset */ 1) < 0) {
+    return -1;
+  }
+  hist_table_sort(&histTable);
+  return output_append_hist(&stdoutWriter, &histTable, opt_hist_by);
+}
+
+/** Returns the shorter of two poll(2) timeouts, where -1 is infinite. */
+int minTimeout(int a, int b) {
+  if (a == -1) {
+    return b;
+  } else if (b == -1) {
+    return a;
+  } else {
+    return a < b ? a : b;
+  }
 }
 
 int main(int argc, char **argv) {
   parseArgs(argc, argv);
+  if (output_writer_init(&stdoutWriter, STDOUT_FILENO, opt_flush_interval) <
+      0) {
+    perror("Failed to allocate the output buffer");
+    return 1;
+  }
+
+  if (opt_read != NULL) {
+    int rc = replayCapture(opt_read);
+    output_writer_free(&stdoutWriter);
+    return rc;
+  }
+
+  if (opt_write != NULL &&
+      capture_writer_open(&captureWriter, opt_write, opt_flush_interval) < 0) {
+    perror("Error creating capture file");
+    return 1;
+  }
+
+  struct sigaction exitAction = {.sa_handler = handleExitSignal};
+  sigaction(SIGINT, &exitAction, NULL);
+  sigaction(SIGTERM, &exitAction, NULL);
 
   bpf_log_buf[0] = '\0';
-  int hashMapFd = -1, eventsMapFd = -1, entryProgFd = -1, kprobeFd = -1,
-      returnProgFd, kretprobeFd;
+  int hashMapFd = -1, eventsMapFd = -1, configMapFd = -1, scratchMapFd = -1,
+      statsMapFd = -1, topMapFd = -1, histMapFd = -1, filterMapFd = -1,
+      cgroupMapFd = -1, entryProgFd = -1, kprobeFd = -1, returnProgFd = -1,
+      kretprobeFd = -1, fentryFd = -1, fexitFd = -1;
+  // With --attach tracepoint, the entry program and the attached enter and
+  // exit tracepoints for each of syscallProbes.
+  int syscallEntryProgFds[NUM_SYSCALL_PROBES],
+      syscallEnterFds[NUM_SYSCALL_PROBES], syscallExitFds[NUM_SYSCALL_PROBES];
+  for (size_t i = 0; i < NUM_SYSCALL_PROBES; i++) {
+    syscallEntryProgFds[i] = syscallEnterFds[i] = syscallExitFds[i] = -1;
+  }
+  int pinnedFilter = 0;
   struct perf_reader **readers = NULL;
+  struct perf_buffer_cookie *cookies = NULL;
+  int *pageCnts = NULL;
+  double *profileRates = NULL;
+  int numProfileRates = 0;
+  struct ringbuf_reader *ringReader = NULL;
   int exitCode = 1;
   int *cpus = NULL;
   size_t numCpu = 0;
@@ -287,8 +1314,15 @@ int main(int argc, char **argv) {
     goto error;
   }
 
-  readers = malloc(numCpu * sizeof(struct perf_reader *));
-  if (readers == NULL) {
+  readers = calloc(numCpu, sizeof(struct perf_reader *));
+  cookies = calloc(numCpu, sizeof(struct perf_buffer_cookie));
+  if (readers == NULL || cookies == NULL) {
+    goto error;
+  }
+
+  int numPossibleCpus = getNumPossibleCpus();
+  if (numPossibleCpus < 0) {
+    perror("Failure in getNumPossibleCpus()");
     goto error;
   }
 
@@ -304,109 +1338,495 @@ int main(int argc, char **argv) {
   // https://github.com/iovisor/bcc/commit/bfecc243fc8e822417836dd76a9b4028a5d8c2c9.
   unsigned int kern_version = LINUX_VERSION_CODE;
 
-  // BPF_HASH
+  // BPF_HASH, or BPF_MAP_TYPE_LRU_HASH for --entry-map lru. An LRU hash
+  // never fails an update for lack of space, but evicts entries that may
+  // still have a return to come, which then count as missed.
   const char *hashMapName = "hashMap name for debugging";
-  hashMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, hashMapName,
+  hashMapFd = bpf_create_map(opt_entry_map_type, hashMapName,
                              /* key_size */ sizeof(__u64),
                              /* value_size */ sizeof(struct val_t),
-                             /* max_entries */ 10240,
-                             /* map_flags */ 0);
+                             /* max_entries */ opt_entry_map_size,
+                             /* map_flags */ opt_entry_map_flags);
   if (hashMapFd < 0) {
-    perror("Failed to create BPF_HASH");
+    perror("Failed to create --entry-map");
     goto error;
   }
 
-  // BPF_PERF_OUTPUT
-  const char *perfMapName = "perfMap name for debugging";
-  eventsMapFd = bpf_create_map(BPF_MAP_TYPE_PERF_EVENT_ARRAY, perfMapName,
+  // BPF_HASH of struct filter_key_t for -p and -t, which is only consulted
+  // by the entry program if it exists.
+  if (opt_num_pids > 0 || opt_num_tids > 0 || opt_pin_filter != NULL) {
+    const char *filterMapName = "filter name for debugging";
+    filterMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, filterMapName,
+                                 /* key_size */ sizeof(struct filter_key_t),
+                                 /* value_size */ sizeof(unsigned char),
+                                 /* max_entries */ FILTER_MAX_ENTRIES,
+                                 /* map_flags */ 0);
+    if (filterMapFd < 0) {
+      perror("Failed to create filter BPF_HASH");
+      goto error;
+    }
+  }
+  for (int i = 0; i < opt_num_pids + opt_num_tids; i++) {
+    struct filter_key_t key = {
+        .id = i < opt_num_pids ? opt_pids[i] : opt_tids[i - opt_num_pids],
+        .type = i < opt_num_pids ? FILTER_PID : FILTER_TID,
+    };
+    unsigned char one = 1;
+    if (bpf_update_elem(filterMapFd, &key, &one, BPF_ANY) < 0) {
+      perror("Error calling bpf_update_elem() for filter");
+      goto error;
+    }
+  }
+  if (opt_pin_filter != NULL) {
+    if (bpf_obj_pin(filterMapFd, opt_pin_filter) < 0) {
+      perror("Error pinning --pin-filter");
+      goto error;
+    }
+    pinnedFilter = 1;
+  }
+
+  // BPF_HASH of the cgroup ids for --cgroup.
+  if (opt_num_cgroups > 0) {
+    const char *cgroupMapName = "cgroup name for debugging";
+    cgroupMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, cgroupMapName,
+                                 /* key_size */ sizeof(unsigned long long),
+                                 /* value_size */ sizeof(unsigned char),
+                                 /* max_entries */ opt_num_cgroups,
+                                 /* map_flags */ 0);
+    if (cgroupMapFd < 0) {
+      perror("Failed to create cgroup BPF_HASH");
+      goto error;
+    }
+  }
+  for (int i = 0; i < opt_num_cgroups; i++) {
+    unsigned long long cgroupId;
+    if (getCgroupId(opt_cgroups[i], &cgroupId) < 0) {
+      fprintf(stderr, "Error resolving --cgroup %s: %s\n", opt_cgroups[i],
+              errno == EINVAL ? "not a cgroup v2 directory"
+                              : strerror(errno));
+      goto error;
+    }
+    unsigned char one = 1;
+    if (bpf_update_elem(cgroupMapFd, &cgroupId, &one, BPF_ANY) < 0) {
+      perror("Error calling bpf_update_elem() for cgroup");
+      goto error;
+    }
+  }
+
+  // BPF_ARRAY holding the filters for the return program.
+  const char *configMapName = "config name for debugging";
+  configMapFd = bpf_create_map(BPF_MAP_TYPE_ARRAY, configMapName,
                                /* key_size */ sizeof(int),
-                               /* value_size */ sizeof(__u32),
-                               /* max_entries */ numCpu,
+                               /* value_size */ sizeof(struct config_t),
+                               /* max_entries */ 1,
                                /* map_flags */ 0);
+  if (configMapFd < 0) {
+    perror("Failed to create config BPF_ARRAY");
+    goto error;
+  }
 
-  if (eventsMapFd < 0) {
-    perror("Failed to create BPF_PERF_OUTPUT");
+  struct config_t config;
+  initConfig(&config);
+  int configKey = 0;
+  if (bpf_update_elem(configMapFd, &configKey, &config, BPF_ANY) < 0) {
+    perror("Error calling bpf_update_elem() for config");
     goto error;
   }
 
-  const char *prog_name_for_kprobe = "some kprobe";
-  int numTraceEntryInstructions;
-  struct bpf_insn trace_entry_insns[MAX_NUM_TRACE_ENTRY_INSTRUCTIONS];
-  if (opt_tid != -1) {
-    generate_trace_entry_tid(trace_entry_insns, opt_tid, hashMapFd);
-    numTraceEntryInstructions = NUM_TRACE_ENTRY_TID_INSTRUCTIONS;
-  } else if (opt_pid != -1) {
-    generate_trace_entry_pid(trace_entry_insns, opt_pid, hashMapFd);
-    numTraceEntryInstructions = NUM_TRACE_ENTRY_PID_INSTRUCTIONS;
-  } else {
-    numTraceEntryInstructions = NUM_TRACE_ENTRY_INSTRUCTIONS;
-    generate_trace_entry(trace_entry_insns, hashMapFd);
+  // BPF_PERCPU_ARRAY of struct stats_t, so lost events can be reported as a
+  // fraction of those submitted.
+  const char *statsMapName = "stats name for debugging";
+  statsMapFd = bpf_create_map(BPF_MAP_TYPE_PERCPU_ARRAY, statsMapName,
+                              /* key_size */ sizeof(int),
+                              /* value_size */ sizeof(struct stats_t),
+                              /* max_entries */ 1,
+                              /* map_flags */ 0);
+  if (statsMapFd < 0) {
+    perror("Failed to create stats BPF_PERCPU_ARRAY");
+    goto error;
+  }
+  if (loss_stats_init(&lossStats, numPossibleCpus, statsMapFd,
+                      opt_stats_interval * 1000, monotonicNanos()) < 0) {
+    perror("Error calling loss_stats_init()");
+    goto error;
   }
 
-  entryProgFd = bpf_prog_load(
-      BPF_PROG_TYPE_KPROBE, prog_name_for_kprobe, trace_entry_insns,
-      /* prog_len */ numTraceEntryInstructions * sizeof(struct bpf_insn),
-      /* license */ "GPL", kern_version,
-      /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
-  if (entryProgFd == -1) {
-    perror("Error calling bpf_prog_load() for kretprobe");
+  // BPF_HASH of struct top_key_t to struct top_value_t for --top.
+  if (opt_top != 0) {
+    const char *topMapName = "top name for debugging";
+    topMapFd = bpf_create_map(BPF_MAP_TYPE_HASH, topMapName,
+                              /* key_size */ sizeof(struct top_key_t),
+                              /* value_size */ sizeof(struct top_value_t),
+                              /* max_entries */ opt_top_entries,
+                              /* map_flags */ 0);
+    if (topMapFd < 0) {
+      perror("Failed to create top BPF_HASH");
+      goto error;
+    }
+  }
+
+  // BPF_PERCPU_HASH of struct hist_key_t to a count for --hist.
+  if (opt_hist) {
+    const char *histMapName = "hist name for debugging";
+    histMapFd = bpf_create_map(BPF_MAP_TYPE_PERCPU_HASH, histMapName,
+                               /* key_size */ sizeof(struct hist_key_t),
+                               /* value_size */ sizeof(unsigned long long),
+                               /* max_entries */ HIST_MAX_ENTRIES,
+                               /* map_flags */ 0);
+    if (histMapFd < 0) {
+      perror("Failed to create hist BPF_PERCPU_HASH");
+      goto error;
+    }
+  }
+
+  // The return program builds each event in a per-CPU BPF_ARRAY rather than
+  // on the 512-byte BPF stack, which leaves the stack free and means only the
+  // fields have to be written, not the whole record zeroed first. It also
+  // makes room for a path of up to PATH_MAX bytes with --long-paths.
+  int fnameMax = opt_long_paths ? PATH_MAX : NAME_MAX + 1;
+  const char *scratchMapName = "scratch name for debugging";
+  scratchMapFd = bpf_create_map(
+      BPF_MAP_TYPE_PERCPU_ARRAY, scratchMapName,
+      /* key_size */ sizeof(int),
+      /* value_size */ sizeof(struct event_t) + fnameMax,
+      /* max_entries */ 1,
+      /* map_flags */ 0);
+  if (scratchMapFd < 0) {
+    perror("Failed to create scratch BPF_PERCPU_ARRAY");
     goto error;
   }
 
-  kprobeFd = bpf_attach_kprobe(entryProgFd, BPF_PROBE_ENTRY, "p_do_sys_open",
-                               "do_sys_open",
-                               /* fn_offset */ 0);
-  if (kprobeFd < 0) {
-    perror("Error calling bpf_attach_kprobe() for kprobe");
+  // BPF_RINGBUF_OUTPUT, if the kernel supports it (Linux 5.8+). A single
+  // ring shared by all CPUs uses a fraction of the memory of one perf buffer
+  // per CPU and hands us events in the order they were produced.
+  size_t ringbufSize = 0;
+  // --top and --hist read their results from maps instead of either.
+  int aggregate = opt_top != 0 || opt_hist;
+  // The ring buffer is a single ring, so it cannot be split across threads.
+  if (!opt_no_ringbuf && opt_threads == 0 && !aggregate) {
+    ringbufSize = (size_t)opt_ringbuf_pages * sysconf(_SC_PAGESIZE);
+    const char *ringbufMapName = "ringbuf name for debugging";
+    eventsMapFd = bpf_create_map(BPF_MAP_TYPE_RINGBUF, ringbufMapName,
+                                 /* key_size */ 0,
+                                 /* value_size */ 0,
+                                 /* max_entries */ ringbufSize,
+                                 /* map_flags */ 0);
+    // Older kernels reject the unknown map type with EINVAL, in which case
+    // we fall back to BPF_PERF_OUTPUT below.
+  }
+  int useRingbuf = eventsMapFd >= 0;
+  int usePerfBuffers = !useRingbuf && !aggregate;
+
+  // BPF_PERF_OUTPUT
+  if (usePerfBuffers) {
+    const char *perfMapName = "perfMap name for debugging";
+    eventsMapFd = bpf_create_map(BPF_MAP_TYPE_PERF_EVENT_ARRAY, perfMapName,
+                                 /* key_size */ sizeof(int),
+                                 /* value_size */ sizeof(__u32),
+                                 /* max_entries */ numCpu,
+                                 /* map_flags */ 0);
+
+    if (eventsMapFd < 0) {
+      perror("Failed to create BPF_PERF_OUTPUT");
+      goto error;
+    }
+  }
+
+  struct trace_entry_params entryParams = {
+      .infotmpFd = hashMapFd,
+      .filterFd = filterMapFd,
+      .cgroupFd = cgroupMapFd,
+      .statsFd = statsMapFd,
+  };
+  struct trace_return_params returnParams = {
+      .infotmpFd = hashMapFd,
+      .filterFd = filterMapFd,
+      .cgroupFd = cgroupMapFd,
+      .eventsFd = eventsMapFd,
+      .configFd = configMapFd,
+      .scratchFd = scratchMapFd,
+      .statsFd = statsMapFd,
+      .topFd = topMapFd,
+      .histFd = histMapFd,
+      .histBy = opt_hist_by,
+      .useRingbuf = useRingbuf,
+      .fnameMax = fnameMax,
+  };
+
+  // --attach auto prefers fentry and fexit, then the syscall tracepoints and
+  // then the kprobes, which every kernel has.
+  int useTrampolines = 0;
+  if (opt_attach == ATTACH_FENTRY || opt_attach == ATTACH_AUTO) {
+    useTrampolines =
+        attachTrampolines(&entryParams, &returnParams,
+                          /* needEntry */ opt_latency || opt_hist,
+                          opt_analyze, &entryProgFd, &fentryFd,
+                          &returnProgFd, &fexitFd) == 0;
+    if (!useTrampolines && opt_attach == ATTACH_FENTRY) {
+      perror("Error attaching fentry and fexit programs");
+      goto error;
+    }
+    if (!useTrampolines) {
+      // Otherwise nothing says why a BTF kernel ends up on slower probes.
+      fprintf(stderr, "Not using fentry and fexit: %s\n", strerror(errno));
+      if (opt_analyze && bpf_log_buf[0] != '\0') {
+        fprintf(stderr, "%s", bpf_log_buf);
+      }
+      bpf_log_buf[0] = '\0';
+    }
+  }
+  int useTracepoints =
+      !useTrampolines &&
+      (opt_attach == ATTACH_TRACEPOINT ||
+       (opt_attach == ATTACH_AUTO && hasSyscallTracepoint("sys_enter_openat")));
+
+  if (!useTrampolines) {
+    enum bpf_prog_type progType =
+        useTracepoints ? BPF_PROG_TYPE_TRACEPOINT : BPF_PROG_TYPE_KPROBE;
+
+    const char *prog_name_for_kprobe = "some kprobe";
+    struct bpf_insn trace_entry_insns[MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS];
+    struct relocs entryRelocs = {};
+    int numTraceEntryInstructions =
+        assemble_trace_entry(trace_entry_insns, &entryParams, &entryRelocs);
+    if (numTraceEntryInstructions < 0) {
+      perror("Error assembling the entry program");
+      goto error;
+    }
+    numTraceEntryInstructions =
+        optimizeProgram("trace_entry", trace_entry_insns,
+                        numTraceEntryInstructions, &entryRelocs, opt_analyze);
+    if (numTraceEntryInstructions < 0) {
+      goto error;
+    }
+    if (!useTracepoints) {
+      relocate_program(trace_entry_insns, &entryRelocs, PROBE_KPROBE,
+                       /* numArgs */ 0);
+      entryProgFd = bpf_prog_load(
+          BPF_PROG_TYPE_KPROBE, prog_name_for_kprobe, trace_entry_insns,
+          /* prog_len */ numTraceEntryInstructions * sizeof(struct bpf_insn),
+          /* license */ "GPL", kern_version,
+          /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
+      if (entryProgFd == -1) {
+        perror("Error calling bpf_prog_load() for kretprobe");
+        goto error;
+      }
+
+      kprobeFd = bpf_attach_kprobe(entryProgFd, BPF_PROBE_ENTRY,
+                                   "p_do_sys_open", "do_sys_open",
+                                   /* fn_offset */ 0);
+      if (kprobeFd < 0) {
+        perror("Error calling bpf_attach_kprobe() for kprobe");
+        goto error;
+      }
+    } else {
+      int numAttached = 0;
+      for (size_t i = 0; i < NUM_SYSCALL_PROBES; i++) {
+        const struct syscall_probe *probe = &syscallProbes[i];
+        if (!hasSyscallTracepoint(probe->enter)) {
+          continue;
+        }
+
+        // Only where the filename is differs between the syscalls.
+        relocate_program(trace_entry_insns, &entryRelocs, probe->probeType,
+                         /* numArgs */ 0);
+        syscallEntryProgFds[i] = bpf_prog_load(
+            BPF_PROG_TYPE_TRACEPOINT, probe->enter, trace_entry_insns,
+            /* prog_len */ numTraceEntryInstructions * sizeof(struct bpf_insn),
+            /* license */ "GPL", kern_version,
+            /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
+        if (syscallEntryProgFds[i] == -1) {
+          perror("Error calling bpf_prog_load() for sys_enter tracepoint");
+          goto error;
+        }
+
+        syscallEnterFds[i] = bpf_attach_tracepoint(syscallEntryProgFds[i],
+                                                   "syscalls", probe->enter);
+        if (syscallEnterFds[i] < 0) {
+          fprintf(stderr, "Error attaching to syscalls:%s: %s\n",
+                  probe->enter, strerror(errno));
+          goto error;
+        }
+        numAttached++;
+      }
+      if (numAttached == 0) {
+        fprintf(stderr, "No syscalls:sys_enter_open* tracepoints; is tracefs "
+                        "mounted?\n");
+        goto error;
+      }
+    }
+
+    const char *prog_name_for_kretprobe = "some kretprobe";
+    struct bpf_insn trace_return_insns[MAX_NUM_TRACE_RETURN_INSTRUCTIONS];
+    struct relocs returnRelocs = {};
+    int numTraceReturnInstructions =
+        assemble_trace_return(trace_return_insns, &returnParams, &returnRelocs);
+    if (numTraceReturnInstructions < 0) {
+      perror("Error assembling the return program");
+      goto error;
+    }
+    numTraceReturnInstructions = optimizeProgram(
+        "trace_return", trace_return_insns, numTraceReturnInstructions,
+        &returnRelocs, opt_analyze);
+    if (numTraceReturnInstructions < 0) {
+      goto error;
+    }
+    relocate_program(trace_return_insns, &returnRelocs,
+                     useTracepoints ? PROBE_SYSCALL_OPENAT : PROBE_KPROBE,
+                     /* numArgs */ 0);
+
+    returnProgFd = bpf_prog_load(
+        progType, prog_name_for_kretprobe, trace_return_insns,
+        /* prog_len */ numTraceReturnInstructions * sizeof(struct bpf_insn),
+        /* license */ "GPL", kern_version,
+        /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
+    if (returnProgFd == -1) {
+      perror("Error calling bpf_prog_load() for kretprobe");
+      goto error;
+    }
+
+    if (!useTracepoints) {
+      kretprobeFd = bpf_attach_kprobe(returnProgFd, BPF_PROBE_RETURN,
+                                      "r_do_sys_open", "do_sys_open",
+                                      /* fn_offset */ 0);
+      if (kretprobeFd < 0) {
+        perror("Error calling bpf_attach_kprobe() for kretprobe");
+        goto error;
+      }
+    } else {
+      // The same program serves every exit, as they share a layout.
+      for (size_t i = 0; i < NUM_SYSCALL_PROBES; i++) {
+        if (syscallEnterFds[i] == -1) {
+          continue;
+        }
+        syscallExitFds[i] = bpf_attach_tracepoint(returnProgFd, "syscalls",
+                                                  syscallProbes[i].exit);
+        if (syscallExitFds[i] < 0) {
+          fprintf(stderr, "Error attaching to syscalls:%s: %s\n",
+                  syscallProbes[i].exit, strerror(errno));
+          goto error;
+        }
+      }
+    }
+  }
+
+  // Opens made while the probes were attached one at a time, including by
+  // bpf_attach_tracepoint() itself, can have an entry but no return or the
+  // other way around.
+  if (loss_stats_ignore_entries(&lossStats) < 0) {
+    perror("Error calling loss_stats_ignore_entries()");
     goto error;
   }
 
-  const char *prog_name_for_kretprobe = "some kretprobe";
-  struct bpf_insn trace_return_insns[NUM_TRACE_RETURN_INSTRUCTIONS];
-  generate_trace_return(trace_return_insns, hashMapFd, eventsMapFd);
+  if (useRingbuf) {
+    ringReader = ringbuf_reader_new(eventsMapFd, ringbufSize,
+                                    &perf_reader_raw_callback,
+                                    /* cb_cookie */ NULL);
+    if (ringReader == NULL) {
+      perror("Error calling ringbuf_reader_new()");
+      goto error;
+    }
+  }
 
-  returnProgFd = bpf_prog_load(
-      BPF_PROG_TYPE_KPROBE, prog_name_for_kretprobe, trace_return_insns,
-      /* prog_len */ NUM_TRACE_RETURN_INSTRUCTIONS * sizeof(struct bpf_insn),
-      /* license */ "GPL", kern_version,
-      /* log_level */ 1, bpf_log_buf, LOG_BUF_SIZE);
-  if (returnProgFd == -1) {
-    perror("Error calling bpf_prog_load() for kretprobe");
+  // The ring buffer is shared by all CPUs, so it is already in order.
+  int useMerger = opt_ordered && usePerfBuffers;
+  if (useMerger &&
+      merger_init(&merger, numCpu, opt_reorder_window * 1000000LL,
+                  opt_reorder_events, opt_reorder_memory * (size_t)(1 << 20),
+                  &perf_reader_raw_callback, /* emitCookie */ NULL) < 0) {
+    perror("Error calling merger_init()");
     goto error;
   }
 
-  kretprobeFd = bpf_attach_kprobe(returnProgFd, BPF_PROBE_RETURN,
-                                  "r_do_sys_open", "do_sys_open",
-                                  /* fn_offset */ 0);
-  if (kretprobeFd < 0) {
-    perror("Error calling bpf_attach_kprobe() for kretprobe");
+  // Asking the kernel to wake us less often means that events on a quiet
+  // CPU could wait indefinitely, so then every buffer is also read on a
+  // timer.
+  struct perfbuf_wakeup wakeup = {.events = opt_wakeup_events,
+                                  .bytes = opt_wakeup_bytes};
+  int batchWakeups = opt_wakeup_events > 1 || opt_wakeup_bytes > 0;
+  long long readAllIntervalNs = opt_wakeup_latency * 1000000LL;
+
+  // Size each perf buffer, either uniformly or from the memory budget and
+  // the event rates in the profile.
+  if (usePerfBuffers) {
+    pageCnts = malloc(numCpu * sizeof(int));
+    if (pageCnts == NULL) {
+      goto error;
+    }
+    if (opt_perf_profile != NULL &&
+        perfbuf_profile_load(opt_perf_profile, &profileRates,
+                             &numProfileRates) < 0 &&
+        errno != ENOENT) {
+      perror("Error reading --perf-profile");
+      goto error;
+    }
+
+    if (opt_perf_memory > 0 || opt_perf_profile != NULL) {
+      size_t budgetPages =
+          opt_perf_memory > 0
+              ? ((size_t)opt_perf_memory << 20) / sysconf(_SC_PAGESIZE)
+              : (size_t)opt_perf_pages * numCpu;
+      perfbuf_plan_pages(pageCnts, cpus, numCpu, budgetPages, profileRates,
+                         numProfileRates);
+    } else {
+      for (int i = 0; i < numCpu; i++) {
+        pageCnts[i] = opt_perf_pages;
+      }
+    }
+  }
+
+  // There is no point in a thread without a CPU (or without perf buffers).
+  int numThreads = opt_threads < numCpu ? opt_threads : numCpu;
+  if (!usePerfBuffers) {
+    numThreads = 0;
+  }
+  if (numThreads > 0 &&
+      drain_pool_init(&drainPool, numThreads, DRAIN_QUEUE_SIZE,
+                      batchWakeups ? opt_wakeup_latency : 0) < 0) {
+    perror("Error calling drain_pool_init()");
     goto error;
   }
 
-  // Open a perf buffer for each online CPU.
+  // Otherwise, open a perf buffer for each online CPU.
   // (This is what open_perf_buffer() in bcc/table.py does.)
-  for (int cpuIndex = 0; cpuIndex < numCpu; cpuIndex++) {
+  for (int cpuIndex = 0; usePerfBuffers && cpuIndex < numCpu; cpuIndex++) {
     int cpu = cpus[cpuIndex];
-    void *reader = bpf_open_perf_buffer(&perf_reader_raw_callback,
-                                        /* lost_cb */ NULL,
-                                        /* cb_cookie */ NULL,
-                                        /* pid */ -1, cpu,
-                                        /* page_cnt */ 64);
+    cookies[cpuIndex].cpu = cpu;
+    cookies[cpuIndex].cpuIndex = cpuIndex;
+    cookies[cpuIndex].queue = useMerger ? &merger.queues[cpuIndex] : NULL;
+    if (numThreads > 0) {
+      cookies[cpuIndex].drain =
+          drain_pool_thread_for(&drainPool, cpuIndex, numCpu);
+    }
+    struct perf_reader *reader = perfbuf_open(
+        &perfBufferRawCallback, &perfBufferLostCallback, &cookies[cpuIndex],
+        cpu, pageCnts[cpuIndex], &wakeup);
     if (reader == NULL) {
-      fprintf(stderr, "Error calling bpf_open_perf_buffer().\n");
+      perror("Error calling perfbuf_open()");
       goto error;
     }
 
     // The fd is owned by the reader, which will be cleaned up by
     // perf_reader_free().
     int perfReaderFd = perf_reader_fd((struct perf_reader *)reader);
-    readers[cpu] = reader;
+    readers[cpuIndex] = reader;
 
     int rc = bpf_update_elem(eventsMapFd, &cpu, &perfReaderFd, BPF_ANY);
     if (rc < 0) {
       perror("Error calling bpf_update_elem()");
       goto error;
     }
+
+    if (numThreads > 0 &&
+        drain_thread_add_reader(cookies[cpuIndex].drain, reader) < 0) {
+      perror("Error calling drain_thread_add_reader()");
+      goto error;
+    }
+  }
+
+  if (numThreads > 0 && drain_pool_start(&drainPool) < 0) {
+    perror("Error calling drain_pool_start()");
+    goto error;
   }
 
   struct timespec currentTime, endTime;
@@ -420,10 +1840,30 @@ int main(int argc, char **argv) {
     endTime.tv_sec += opt_duration;
   }
 
-  printHeader();
-  // Loop and call perf_buffer_poll(), which has the side-effect of calling
-  // perf_reader_raw_callback() on new events.
-  while (1) {
+  if (opt_write == NULL && !aggregate) {
+    output_append_header(&stdoutWriter, opt_timestamp, opt_num_tids > 0,
+                         opt_latency);
+  }
+  long long startNs = monotonicNanos();
+  long long nextReadAllNs = startNs + readAllIntervalNs;
+  long long topIntervalNs = opt_top_interval * 1000000000LL;
+  long long nextTopNs = startNs + topIntervalNs;
+  long long histIntervalNs = opt_hist_interval * 1000000000LL;
+  long long nextHistNs = startNs + histIntervalNs;
+  // Loop and call perf_buffer_poll() (or ringbuf_reader_poll()), which has
+  // the side-effect of calling perf_reader_raw_callback() on new events.
+  // Polling only blocks for as long as buffered output is allowed to wait.
+  while (!exiting) {
+    if (output_writer_maybe_flush(&stdoutWriter) < 0) {
+      perror("Error writing to stdout");
+      goto error;
+    }
+    if (opt_write != NULL &&
+        output_writer_maybe_flush(&captureWriter.out) < 0) {
+      perror("Error writing to capture file");
+      goto error;
+    }
+
     if (opt_duration != -1) {
       if (clock_gettime(CLOCK_MONOTONIC_COARSE, &currentTime) < 0) {
         perror("Error calling clock_gettime()");
@@ -437,18 +1877,128 @@ int main(int argc, char **argv) {
       }
     }
 
-    // From the implementation, this always appear to return 0.
-    int rc = perf_reader_poll(numCpu, readers, -1);
-    if (rc != 0) {
-      fprintf(stderr, "Unexpected return value from perf_reader_poll(): %d\n.",
-              rc);
+    int timeout = output_writer_timeout_ms(&stdoutWriter);
+    if (opt_duration != -1) {
+      long long untilEndMs = (endTime.tv_sec - currentTime.tv_sec) * 1000LL +
+                             (endTime.tv_nsec - currentTime.tv_nsec) / 1000000;
+      timeout = minTimeout(timeout, untilEndMs <= 0 ? 0 : untilEndMs + 1);
+    }
+    if (useMerger) {
+      timeout =
+          minTimeout(timeout, merger_timeout_ms(&merger, monotonicNanos()));
+    }
+    if (opt_write != NULL) {
+      timeout =
+          minTimeout(timeout, output_writer_timeout_ms(&captureWriter.out));
+    }
+    timeout = minTimeout(timeout,
+                         loss_stats_timeout_ms(&lossStats, monotonicNanos()));
+    if (usePerfBuffers && numThreads == 0 && batchWakeups) {
+      long long untilReadAllNs = nextReadAllNs - monotonicNanos();
+      timeout = minTimeout(
+          timeout, untilReadAllNs <= 0 ? 0 : untilReadAllNs / 1000000 + 1);
+    }
+    if (useRingbuf) {
+      if (ringbuf_reader_poll(ringReader, timeout) < 0) {
+        perror("Error calling ringbuf_reader_poll()");
+        goto error;
+      }
+    } else if (numThreads > 0) {
+      if (drain_pool_wait(&drainPool, timeout) < 0) {
+        perror("Error calling drain_pool_wait()");
+        goto error;
+      }
+      drain_pool_consume(&drainPool, &drainedEventCallback, cookies);
+    } else if (aggregate) {
+      // Nothing to read until it is time to print the counts.
+      if (opt_top != 0 || opt_hist_interval > 0) {
+        long long untilDumpNs =
+            (opt_top != 0 ? nextTopNs : nextHistNs) - monotonicNanos();
+        timeout = minTimeout(
+            timeout, untilDumpNs <= 0 ? 0 : untilDumpNs / 1000000 + 1);
+      }
+      poll(NULL, 0, timeout);
+    } else {
+      // From the implementation, this always appear to return 0.
+      int rc = perf_reader_poll(numCpu, readers, timeout);
+      if (rc != 0) {
+        fprintf(stderr,
+                "Unexpected return value from perf_reader_poll(): %d\n.", rc);
+      }
+
+      if (batchWakeups && monotonicNanos() >= nextReadAllNs) {
+        for (int i = 0; i < numCpu; i++) {
+          perf_reader_event_read(readers[i]);
+        }
+        nextReadAllNs = monotonicNanos() + readAllIntervalNs;
+      }
+    }
+
+    long long now = monotonicNanos();
+    if (useMerger) {
+      merger_release(&merger, now);
+    }
+    if (loss_stats_timeout_ms(&lossStats, now) == 0 &&
+        reportLoss(now, /* final */ 0) < 0) {
+      perror("Error reading the stats map");
+      goto error;
+    }
+    if (opt_top != 0 && now >= nextTopNs) {
+      if (dumpTop(topMapFd) < 0) {
+        perror("Error reading the top map");
+        goto error;
+      }
+      nextTopNs += topIntervalNs;
+    }
+    if (opt_hist && opt_hist_interval > 0 && now >= nextHistNs) {
+      if (dumpHist(histMapFd, numPossibleCpus) < 0) {
+        perror("Error reading the hist map");
+        goto error;
+      }
+      nextHistNs += histIntervalNs;
     }
   }
 
-  exitCode = 0;
+  // Counts since the last interval.
+  if (opt_top != 0 && dumpTop(topMapFd) < 0) {
+    perror("Error reading the top map");
+  }
+  if (opt_hist && dumpHist(histMapFd, numPossibleCpus) < 0) {
+    perror("Error reading the hist map");
+  }
+
+  if (numThreads > 0) {
+    drain_pool_stop(&drainPool);
+    drain_pool_consume(&drainPool, &drainedEventCallback, cookies);
+  }
+  // Pick up whatever was left in the perf buffers because it was not enough
+  // to wake us up. The drain threads are gone, so do it on this thread.
+  for (int i = 0; usePerfBuffers && batchWakeups && i < numCpu; i++) {
+    cookies[i].drain = NULL;
+    perf_reader_event_read(readers[i]);
+  }
+
+  // Nothing else can arrive from the kernel that would need to be sorted
+  // before what is still held back.
+  if (useMerger) {
+    merger_flush(&merger);
+  }
+  if (reportLoss(monotonicNanos(), /* final */ 1) < 0) {
+    perror("Error reading the stats map");
+  }
+  if (opt_perf_profile != NULL && usePerfBuffers &&
+      updatePerfProfile(profileRates, numProfileRates,
+                        monotonicNanos() - startNs) < 0) {
+    perror("Error writing --perf-profile");
+  }
+
+  exitCode = output_writer_flush(&stdoutWriter) < 0 ? 1 : 0;
   goto cleanup;
 
 error:
+  // Whatever was already traced is still worth printing.
+  output_writer_flush(&stdoutWriter);
+
   // If there is anything in the bpf_log_buf, print it
   // as it may be helpful in debugging.
   if (bpf_log_buf[0] != '\0') {
@@ -456,7 +2006,9 @@ error:
   }
 
 cleanup:
-  // readers
+  // readers, after the threads that use them
+  drain_pool_free(&drainPool);
+  ringbuf_reader_free(ringReader);
   if (readers != NULL) {
     for (int i = 0; i < numCpu; i++) {
       struct perf_reader *reader = readers[i];
@@ -464,7 +2016,11 @@ cleanup:
         perf_reader_free((void *)reader);
       }
     }
+    free(readers);
   }
+  free(cookies);
+  free(pageCnts);
+  free(profileRates);
 
   // kprobe
   if (kprobeFd != -1) {
@@ -478,6 +2034,27 @@ cleanup:
   if (kretprobeFd != -1) {
     close(kretprobeFd);
   }
+
+  // fentry and fexit
+  if (fentryFd != -1) {
+    close(fentryFd);
+  }
+  if (fexitFd != -1) {
+    close(fexitFd);
+  }
+
+  // syscall tracepoints
+  for (size_t i = 0; i < NUM_SYSCALL_PROBES; i++) {
+    if (syscallEnterFds[i] != -1) {
+      close(syscallEnterFds[i]);
+    }
+    if (syscallExitFds[i] != -1) {
+      close(syscallExitFds[i]);
+    }
+    if (syscallEntryProgFds[i] != -1) {
+      close(syscallEntryProgFds[i]);
+    }
+  }
   if (returnProgFd != -1) {
     close(returnProgFd);
   }
@@ -486,6 +2063,30 @@ cleanup:
   if (eventsMapFd != -1) {
     close(eventsMapFd);
   }
+  if (configMapFd != -1) {
+    close(configMapFd);
+  }
+  if (scratchMapFd != -1) {
+    close(scratchMapFd);
+  }
+  if (statsMapFd != -1) {
+    close(statsMapFd);
+  }
+  if (topMapFd != -1) {
+    close(topMapFd);
+  }
+  if (histMapFd != -1) {
+    close(histMapFd);
+  }
+  if (filterMapFd != -1) {
+    close(filterMapFd);
+  }
+  if (cgroupMapFd != -1) {
+    close(cgroupMapFd);
+  }
+  if (pinnedFilter) {
+    unlink(opt_pin_filter);
+  }
   if (hashMapFd != -1) {
     close(hashMapFd);
   }
@@ -495,10 +2096,23 @@ cleanup:
     free(cpus);
   }
 
+  merger_free(&merger);
+  loss_stats_free(&lossStats);
+  top_table_free(&topTable);
+  hist_table_free(&histTable);
+  output_writer_free(&stdoutWriter);
+  if (opt_write != NULL && capture_writer_close(&captureWriter) < 0) {
+    perror("Error writing to capture file");
+    exitCode = 1;
+  }
+
   // flags
   if (opt_name != NULL) {
     free(opt_name);
   }
+  free(opt_pids);
+  free(opt_tids);
+  free(opt_cgroups);
 
   return exitCode;
 }
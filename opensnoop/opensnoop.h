@@ -1,7 +1,8 @@
 /**
- * This header contains definitions that are shared with
- * opensnoop.c and opensnoop.py.
+ * This header contains definitions that are shared between
+ * opensnoop.c and the BPF programs assembled by programs.c.
  */
+#pragma once
 
 // This seems like it should be in <linux/sched.h>,
 // but I don't have it there on Ubuntu 18.04.
@@ -11,17 +12,133 @@
 #endif
 
 #define NAME_MAX 255
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
 
 struct val_t {
   unsigned long long id;
   char comm[TASK_COMM_LEN];
   const char *fname;
+  // bpf_ktime_get_ns() on entry to do_sys_open().
+  unsigned long long ts;
 };
 
-struct data_t {
+/**
+ * Compact record submitted by the return program: a fixed header followed by
+ * only the fname_len bytes of the path that bpf_probe_read_str() actually
+ * copied.
+ *
+ * version must be bumped whenever the layout of the header changes so that
+ * consumers can reject records they do not understand.
+ */
+#define EVENT_VERSION 2
+
+struct event_t {
   unsigned long long id;
   unsigned long long ts;
+  // Nanoseconds spent in do_sys_open().
+  unsigned long long latency;
   int ret;
+  unsigned short version;
+  // Number of bytes of fname, including the NUL terminator. 0 if the path
+  // could not be read.
+  unsigned short fname_len;
   char comm[TASK_COMM_LEN];
-  char fname[NAME_MAX];
+  char fname[];
+};
+
+/**
+ * Userspace filters that the return program evaluates before an event is
+ * submitted. There is a single instance at index 0 of a BPF_MAP_TYPE_ARRAY so
+ * that the filters can be changed without reloading the program.
+ *
+ * name and name_mask are read as two 64-bit words each: the return program
+ * slides comm across the pattern one byte at a time and compares the bytes
+ * selected by name_mask, so both arrays must stay 8-byte aligned.
+ */
+struct config_t {
+  // Only submit events whose return value is negative (-x).
+  int failed_only;
+  // Nonzero if comm must contain name (-n).
+  int has_name;
+  char name[TASK_COMM_LEN];
+  char name_mask[TASK_COMM_LEN];
+};
+
+/**
+ * Counters kept by the entry and return programs in a
+ * BPF_MAP_TYPE_PERCPU_ARRAY with a single entry, so the loss ratio can be
+ * computed exactly: submitted counts every event handed to the output helper
+ * and dropped counts those the helper rejected because the perf or ring
+ * buffer was full.
+ *
+ * The rest count opens that were lost before there was an event at all,
+ * because the entry and return programs could not be matched up through the
+ * infotmp map.
+ */
+struct stats_t {
+  unsigned long long submitted;
+  unsigned long long dropped;
+  // Entries that could not be stored, e.g. because the map was full.
+  unsigned long long failed_updates;
+  // Returns with no entry to match, because it was never stored or was
+  // evicted from an LRU map.
+  unsigned long long missed_entries;
+  // Entries that replaced one that no return ever consumed, as happens when
+  // the kretprobe misses a return.
+  unsigned long long stale_entries;
+};
+
+/**
+ * Key of the BPF_HASH that the return program updates instead of submitting
+ * events in aggregation mode (--top). fname_hash is FNV-1a over the path
+ * read as 8-byte words, so paths are only distinguished up to NAME_MAX + 1
+ * bytes.
+ */
+struct top_key_t {
+  char comm[TASK_COMM_LEN];
+  unsigned long long fname_hash;
+  // -ret if the open failed, otherwise 0.
+  int err;
+  int pad;
+};
+
+struct top_value_t {
+  unsigned long long count;
+  // bpf_ktime_get_ns() of the most recent open.
+  unsigned long long last_ts;
+  // The path from the open that created the entry.
+  char fname[NAME_MAX + 1];
+};
+
+/**
+ * Key of the BPF_MAP_TYPE_PERCPU_HASH that the return program updates in
+ * histogram mode (--hist), whose values are unsigned long long counts. Each
+ * key is one bucket of one histogram: comm and err are zero unless the
+ * histograms are split by them, and slot is the bucket of the latency, where
+ * slot n > 0 holds latencies in [2^(n-1), 2^n) nanoseconds.
+ */
+#define HIST_NUM_SLOTS 64
+
+struct hist_key_t {
+  char comm[TASK_COMM_LEN];
+  // -ret if the open failed, otherwise 0.
+  int err;
+  int slot;
+};
+
+/**
+ * Key of the BPF_HASH of processes and threads to trace (-p and -t), which
+ * the entry program checks before recording an open. An open is traced if
+ * its PID is in the set as FILTER_PID or its TID is in the set as
+ * FILTER_TID; values are ignored. With --pin-filter, the set can be changed
+ * while opensnoop is running, e.g. with `bpftool map update pinned`.
+ */
+#define FILTER_PID 1
+#define FILTER_TID 2
+
+struct filter_key_t {
+  unsigned int id;
+  unsigned int type;
 };
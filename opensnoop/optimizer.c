@@ -0,0 +1,1136 @@
+#include "optimizer.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_REGS (BPF_REG_10 + 1)
+#define STACK_SIZE 512
+#define STACK_WORDS (STACK_SIZE / 64)
+
+// Every pass shrinks the program or makes a jump shorter, so this is only a
+// backstop.
+#define MAX_ROUNDS 16
+
+enum insn_flag {
+  // Starts a block.
+  INSN_LEADER = 1,
+  // The second half of an ld_imm64, which is never executed on its own.
+  INSN_SECOND_HALF = 2,
+  // The entry of the program or of a subprogram.
+  INSN_ROOT = 4,
+  // Left exactly as it is, at whatever index it ends up.
+  INSN_PINNED = 8,
+  // To be dropped by compact().
+  INSN_REMOVED = 16,
+};
+
+/** What is known about a register that may be used as a pointer. */
+enum ptr_kind {
+  // Certainly does not point into the stack.
+  PTR_NONE,
+  // Points off bytes from r10 on every path to here.
+  PTR_STACK,
+  // May point anywhere in the stack.
+  PTR_ANY_STACK,
+};
+
+struct ptr {
+  enum ptr_kind kind;
+  int off;
+};
+
+// What trackStack() keeps in optimizer.seen for each block.
+enum block_flag {
+  BLOCK_REACHED = 1,
+  BLOCK_QUEUED = 2,
+};
+
+struct block {
+  int start;
+  // One past the last instruction.
+  int end;
+  // The blocks control can continue in, or -1.
+  int succ[2];
+};
+
+/**
+ * How an instruction uses the stack, as byte ranges relative to r10: it may
+ * read [readLo, readHi), certainly overwrites [writeLo, writeHi) and may
+ * overwrite [clobberLo, clobberHi). Empty ranges have lo >= hi.
+ */
+struct stack_use {
+  int readLo, readHi;
+  int writeLo, writeHi;
+  int clobberLo, clobberHi;
+};
+
+struct optimizer {
+  struct bpf_insn *insns;
+  int numInsns;
+  struct optimize_stats *stats;
+  // enum insn_flag for each instruction.
+  unsigned char *flags;
+  // The block each instruction is in.
+  int *blockOf;
+  struct block *blocks;
+  int numBlocks;
+
+  // Scratch space for the passes, each with room for one entry per
+  // instruction, or per block, which there are no more of.
+  int *stack;
+  unsigned char *seen;
+  struct ptr (*ptrs)[NUM_REGS];
+  struct stack_use *stackUse;
+  unsigned long long (*liveStack)[STACK_WORDS];
+  unsigned short *liveRegs;
+  int *newIndex;
+};
+
+static int isLoadImm64(const struct bpf_insn *insn) {
+  return insn->code == (BPF_LD | BPF_IMM | BPF_DW);
+}
+
+static int isExit(const struct bpf_insn *insn) {
+  return insn->code == (BPF_JMP | BPF_EXIT);
+}
+
+static int isCall(const struct bpf_insn *insn) {
+  return insn->code == (BPF_JMP | BPF_CALL);
+}
+
+/** Returns nonzero for goto and the conditional jumps. */
+static int isJump(const struct bpf_insn *insn) {
+  int cls = BPF_CLASS(insn->code);
+  return (cls == BPF_JMP || cls == BPF_JMP32) && !isExit(insn) &&
+         !isCall(insn);
+}
+
+static int isGoto(const struct bpf_insn *insn) {
+  return isJump(insn) && BPF_OP(insn->code) == BPF_JA;
+}
+
+/** Returns the index the jump at index goes to. */
+static int jumpTarget(const struct bpf_insn *insn, int index) {
+  // The 32-bit goto keeps its offset in imm, for jumps past 32K.
+  int isLong = insn->code == (BPF_JMP32 | BPF_JA);
+  return index + 1 + (isLong ? insn->imm : insn->off);
+}
+
+/**
+ * Points the jump at index to target, if its offset can reach that far.
+ * Returns nonzero if it did.
+ */
+static int setJumpTarget(struct bpf_insn *insn, int index, int target) {
+  int off = target - index - 1;
+  if (insn->code == (BPF_JMP32 | BPF_JA)) {
+    insn->imm = off;
+  } else if (off >= -32768 && off <= 32767) {
+    insn->off = off;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Returns the index that the call or function pointer at index refers to,
+ * or -1 if it is neither.
+ */
+static int functionTarget(const struct bpf_insn *insn, int index) {
+  if ((isCall(insn) && insn->src_reg == BPF_PSEUDO_CALL) ||
+      (isLoadImm64(insn) && insn->src_reg == BPF_PSEUDO_FUNC)) {
+    return index + 1 + insn->imm;
+  }
+  return -1;
+}
+
+static int accessSize(int size) {
+  switch (size) {
+  case BPF_B:
+    return 1;
+  case BPF_H:
+    return 2;
+  case BPF_W:
+    return 4;
+  default:
+    return 8;
+  }
+}
+
+/** Splits the program into blocks, as analyze_program() does. */
+static void buildBlocks(struct optimizer *opt) {
+  int n = opt->numInsns;
+  for (int i = 0; i < n; i++) {
+    opt->flags[i] &= INSN_PINNED;
+  }
+  opt->flags[0] |= INSN_LEADER | INSN_ROOT;
+  for (int i = 0; i < n; i++) {
+    const struct bpf_insn *insn = &opt->insns[i];
+    int function = functionTarget(insn, i);
+    if (isJump(insn)) {
+      opt->flags[jumpTarget(insn, i)] |= INSN_LEADER;
+    } else if (function != -1) {
+      opt->flags[function] |= INSN_LEADER | INSN_ROOT;
+    }
+    if ((isJump(insn) || isExit(insn)) && i + 1 < n) {
+      opt->flags[i + 1] |= INSN_LEADER;
+    }
+    if (isLoadImm64(insn)) {
+      opt->flags[++i] |= INSN_SECOND_HALF;
+    }
+  }
+
+  opt->numBlocks = 0;
+  for (int i = 0; i < n; i++) {
+    if (opt->flags[i] & INSN_LEADER) {
+      opt->blocks[opt->numBlocks++].start = i;
+    }
+    opt->blocks[opt->numBlocks - 1].end = i + 1;
+    opt->blockOf[i] = opt->numBlocks - 1;
+  }
+  for (int b = 0; b < opt->numBlocks; b++) {
+    struct block *block = &opt->blocks[b];
+    int last = block->end - 1;
+    if (opt->flags[last] & INSN_SECOND_HALF) {
+      last--;
+    }
+    const struct bpf_insn *insn = &opt->insns[last];
+    int numSucc = 0;
+    block->succ[0] = block->succ[1] = -1;
+    if (isJump(insn)) {
+      block->succ[numSucc++] = opt->blockOf[jumpTarget(insn, last)];
+    }
+    if (!isExit(insn) && !isGoto(insn) && block->end < n &&
+        (numSucc == 0 || opt->blockOf[block->end] != block->succ[0])) {
+      block->succ[numSucc++] = opt->blockOf[block->end];
+    }
+  }
+}
+
+/** Marks the instruction at index, both halves of an ld_imm64, as removed. */
+static void removeInsn(struct optimizer *opt, int index) {
+  opt->flags[index] |= INSN_REMOVED;
+  if (isLoadImm64(&opt->insns[index])) {
+    opt->flags[index + 1] |= INSN_REMOVED;
+  }
+}
+
+/**
+ * Drops the removed instructions and rewrites every jump, call and function
+ * pointer, and pinned[], to match. A jump to a removed instruction goes to
+ * the next one kept, which is where control would have gone on to.
+ */
+static void compact(struct optimizer *opt, int *pinned, int numPinned) {
+  int n = opt->numInsns;
+  int kept = 0;
+  for (int i = 0; i < n; i++) {
+    opt->newIndex[i] = kept;
+    kept += !(opt->flags[i] & INSN_REMOVED);
+  }
+  opt->newIndex[n] = kept;
+  if (kept == n) {
+    return;
+  }
+  opt->stats->removedInsns += n - kept;
+
+  for (int i = 0; i < n; i++) {
+    struct bpf_insn *insn = &opt->insns[i];
+    int function = functionTarget(insn, i);
+    if (opt->flags[i] & INSN_REMOVED) {
+      continue;
+    }
+    if (isJump(insn)) {
+      setJumpTarget(insn, opt->newIndex[i],
+                    opt->newIndex[jumpTarget(insn, i)]);
+    } else if (function != -1) {
+      insn->imm = opt->newIndex[function] - opt->newIndex[i] - 1;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (!(opt->flags[i] & INSN_REMOVED)) {
+      opt->insns[opt->newIndex[i]] = opt->insns[i];
+      opt->flags[opt->newIndex[i]] = opt->flags[i] & INSN_PINNED;
+    }
+  }
+  for (int i = 0; i < numPinned; i++) {
+    pinned[i] = opt->newIndex[pinned[i]];
+  }
+  opt->numInsns = kept;
+}
+
+/**
+ * Sends jumps to the end of any chain of gotos they land on, and replaces
+ * gotos to an exit with the exit. Returns the number of jumps changed.
+ */
+static int threadJumps(struct optimizer *opt) {
+  int changed = 0;
+  for (int i = 0; i < opt->numInsns; i++) {
+    struct bpf_insn *insn = &opt->insns[i];
+    if (!isJump(insn) || (opt->flags[i] & INSN_PINNED)) {
+      continue;
+    }
+    int target = jumpTarget(insn, i);
+    // A cycle of gotos is left alone, as there is no end to send it to.
+    for (int steps = 0; steps < opt->numInsns; steps++) {
+      const struct bpf_insn *next = &opt->insns[target];
+      if (!isGoto(next) || (opt->flags[target] & INSN_PINNED) ||
+          jumpTarget(next, target) == target) {
+        break;
+      }
+      target = jumpTarget(next, target);
+    }
+    if (target != jumpTarget(insn, i) && setJumpTarget(insn, i, target)) {
+      changed++;
+    }
+    if (isGoto(insn) && isExit(&opt->insns[target])) {
+      *insn = (struct bpf_insn){.code = BPF_JMP | BPF_EXIT};
+      changed++;
+    }
+  }
+  opt->stats->threadedJumps += changed;
+  return changed;
+}
+
+/**
+ * Returns the condition that holds when op does not, or 0 for BPF_JSET,
+ * which has none.
+ */
+static int invertCondition(int op) {
+  switch (op) {
+  case BPF_JEQ:
+    return BPF_JNE;
+  case BPF_JNE:
+    return BPF_JEQ;
+  case BPF_JGT:
+    return BPF_JLE;
+  case BPF_JLE:
+    return BPF_JGT;
+  case BPF_JGE:
+    return BPF_JLT;
+  case BPF_JLT:
+    return BPF_JGE;
+  case BPF_JSGT:
+    return BPF_JSLE;
+  case BPF_JSLE:
+    return BPF_JSGT;
+  case BPF_JSGE:
+    return BPF_JSLT;
+  case BPF_JSLT:
+    return BPF_JSGE;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Turns conditional jumps over a goto around to go where the goto does,
+ * removes jumps to the next instruction, which do nothing whichever way
+ * they go, and removes blocks that nothing leads to.
+ */
+static int removeUselessJumps(struct optimizer *opt) {
+  int removed = 0;
+  memset(opt->seen, 0, opt->numInsns);
+  for (int i = 0; i < opt->numInsns; i++) {
+    const struct bpf_insn *insn = &opt->insns[i];
+    int function = functionTarget(insn, i);
+    if (isJump(insn)) {
+      opt->seen[jumpTarget(insn, i)] = 1;
+    } else if (function != -1) {
+      opt->seen[function] = 1;
+    }
+  }
+  for (int i = 0; i + 1 < opt->numInsns; i++) {
+    struct bpf_insn *insn = &opt->insns[i];
+    const struct bpf_insn *next = &opt->insns[i + 1];
+    int op = invertCondition(BPF_OP(insn->code));
+    if (!isJump(insn) || op == 0 || jumpTarget(insn, i) != i + 2 ||
+        !isGoto(next) || opt->seen[i + 1] ||
+        ((opt->flags[i] | opt->flags[i + 1]) & INSN_PINNED)) {
+      continue;
+    }
+    struct bpf_insn inverted = *insn;
+    inverted.code = BPF_CLASS(insn->code) | op | BPF_SRC(insn->code);
+    if (setJumpTarget(&inverted, i, jumpTarget(next, i + 1))) {
+      *insn = inverted;
+      removeInsn(opt, i + 1);
+      removed++;
+    }
+  }
+  for (int i = 0; i < opt->numInsns; i++) {
+    const struct bpf_insn *insn = &opt->insns[i];
+    if (isJump(insn) && jumpTarget(insn, i) == i + 1 &&
+        !(opt->flags[i] & (INSN_PINNED | INSN_REMOVED))) {
+      removeInsn(opt, i);
+      removed++;
+    }
+  }
+  opt->stats->removedJumps += removed;
+
+  // Walk the blocks from the roots. Those not reached are removed, unless
+  // they hold a pinned instruction, which must stay somewhere.
+  memset(opt->seen, 0, opt->numBlocks);
+  int depth = 0;
+  for (int b = 0; b < opt->numBlocks; b++) {
+    if (opt->flags[opt->blocks[b].start] & INSN_ROOT) {
+      opt->seen[b] = 1;
+      opt->stack[depth++] = b;
+    }
+  }
+  while (depth > 0) {
+    const struct block *block = &opt->blocks[opt->stack[--depth]];
+    for (int i = 0; i < 2; i++) {
+      if (block->succ[i] != -1 && !opt->seen[block->succ[i]]) {
+        opt->seen[block->succ[i]] = 1;
+        opt->stack[depth++] = block->succ[i];
+      }
+    }
+  }
+  int unreachable = 0;
+  for (int b = 0; b < opt->numBlocks; b++) {
+    const struct block *block = &opt->blocks[b];
+    int hasPinned = 0;
+    for (int i = block->start; i < block->end; i++) {
+      hasPinned |= opt->flags[i] & INSN_PINNED;
+    }
+    if (opt->seen[b] || hasPinned) {
+      continue;
+    }
+    for (int i = block->start; i < block->end; i++) {
+      if (!(opt->flags[i] & INSN_REMOVED)) {
+        opt->flags[i] |= INSN_REMOVED;
+        unreachable++;
+      }
+    }
+  }
+  opt->stats->unreachableInsns += unreachable;
+  return removed + unreachable;
+}
+
+static int mayBeStack(const struct ptr *ptr) {
+  return ptr->kind != PTR_NONE;
+}
+
+/** Sets dst to what a load may produce. */
+static void setLoaded(struct ptr *dst, int loadsMayBeStack) {
+  dst->kind = loadsMayBeStack ? PTR_ANY_STACK : PTR_NONE;
+}
+
+/**
+ * Updates regs, what is known about which registers point into the stack,
+ * over insn. Sets *spills if insn may store a pointer into the stack to
+ * memory, and so loadsMayBeStack says whether one may have been.
+ */
+static void stepPtrs(const struct bpf_insn *insn, struct ptr *regs,
+                     int loadsMayBeStack, int *spills) {
+  struct ptr *dst = &regs[insn->dst_reg];
+  const struct ptr *src = &regs[insn->src_reg];
+  int cls = BPF_CLASS(insn->code);
+  int op = BPF_OP(insn->code);
+  int isX = BPF_SRC(insn->code) == BPF_X;
+  switch (cls) {
+  case BPF_ALU64:
+    if (op == BPF_MOV && isX && insn->off == 0) {
+      *dst = *src;
+    } else if (op == BPF_MOV && !isX) {
+      dst->kind = PTR_NONE;
+    } else if ((op == BPF_ADD || op == BPF_SUB) && !isX &&
+               dst->kind == PTR_STACK && insn->imm > -STACK_SIZE &&
+               insn->imm < STACK_SIZE) {
+      dst->off += op == BPF_ADD ? insn->imm : -insn->imm;
+    } else if (mayBeStack(dst) || (isX && mayBeStack(src))) {
+      dst->kind = PTR_ANY_STACK;
+    }
+    break;
+  case BPF_ALU:
+    dst->kind = PTR_NONE;
+    break;
+  case BPF_JMP:
+  case BPF_JMP32:
+    if (isCall(insn)) {
+      // A subprogram may hand back a pointer it was given.
+      int passed = 0;
+      for (int reg = BPF_REG_1; reg <= BPF_REG_5; reg++) {
+        passed |= mayBeStack(&regs[reg]);
+        regs[reg].kind = PTR_NONE;
+      }
+      regs[BPF_REG_0].kind =
+          insn->src_reg == BPF_PSEUDO_CALL && passed ? PTR_ANY_STACK
+                                                     : PTR_NONE;
+    }
+    break;
+  case BPF_LD:
+    if (isLoadImm64(insn)) {
+      dst->kind = PTR_NONE;
+    } else {
+      for (int reg = BPF_REG_0; reg <= BPF_REG_5; reg++) {
+        regs[reg].kind = PTR_NONE;
+      }
+    }
+    break;
+  case BPF_LDX:
+    setLoaded(dst, loadsMayBeStack);
+    break;
+  case BPF_STX:
+    *spills |= mayBeStack(src);
+    if (BPF_MODE(insn->code) == BPF_ATOMIC) {
+      if (insn->imm == BPF_CMPXCHG) {
+        *spills |= mayBeStack(&regs[BPF_REG_0]);
+        setLoaded(&regs[BPF_REG_0], loadsMayBeStack);
+      } else if (insn->imm & BPF_FETCH) {
+        setLoaded(&regs[insn->src_reg], loadsMayBeStack);
+      }
+    }
+    break;
+  }
+}
+
+/** Returns nonzero if into changed by taking in from. */
+static int joinPtrs(struct ptr *into, const struct ptr *from) {
+  int changed = 0;
+  for (int reg = 0; reg < NUM_REGS; reg++) {
+    struct ptr *a = &into[reg];
+    const struct ptr *b = &from[reg];
+    if (a->kind == b->kind && (a->kind != PTR_STACK || a->off == b->off)) {
+      continue;
+    }
+    if (a->kind != PTR_ANY_STACK &&
+        (mayBeStack(a) || mayBeStack(b))) {
+      a->kind = PTR_ANY_STACK;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+/** Sets [*lo, *hi) to [off, off + size) clamped to the stack. */
+static void setRange(int *lo, int *hi, long long off, long long size) {
+  *lo = off < -STACK_SIZE ? -STACK_SIZE : off > 0 ? 0 : off;
+  *hi = off + size < -STACK_SIZE ? -STACK_SIZE
+        : off + size > 0         ? 0
+                                 : off + size;
+}
+
+/**
+ * Works out which registers point into the stack everywhere, and from that
+ * how each instruction uses the stack, into opt->stackUse. An instruction
+ * that may read or write memory through a pointer that may be into the stack
+ * is taken to read all of it.
+ */
+static void trackStack(struct optimizer *opt) {
+  int loadsMayBeStack = 0, spills = 0;
+  // If a stack pointer is stored anywhere, any load may bring it back, so
+  // the whole thing is redone with that in mind.
+  for (int pass = 0; pass < 2; pass++) {
+    memset(opt->seen, 0, opt->numBlocks);
+    int depth = 0;
+    for (int b = 0; b < opt->numBlocks; b++) {
+      if (!(opt->flags[opt->blocks[b].start] & INSN_ROOT)) {
+        continue;
+      }
+      // A subprogram may be given pointers to its caller's stack.
+      for (int reg = 0; reg < NUM_REGS; reg++) {
+        opt->ptrs[b][reg].kind = b != 0 && reg >= BPF_REG_1 &&
+                                         reg <= BPF_REG_5
+                                     ? PTR_ANY_STACK
+                                     : PTR_NONE;
+      }
+      opt->ptrs[b][BPF_REG_10] = (struct ptr){.kind = PTR_STACK};
+      opt->seen[b] = BLOCK_REACHED | BLOCK_QUEUED;
+      opt->stack[depth++] = b;
+    }
+    while (depth > 0) {
+      int b = opt->stack[--depth];
+      const struct block *block = &opt->blocks[b];
+      struct ptr regs[NUM_REGS];
+      memcpy(regs, opt->ptrs[b], sizeof(regs));
+      opt->seen[b] &= ~BLOCK_QUEUED;
+      for (int i = block->start; i < block->end; i++) {
+        if (!(opt->flags[i] & INSN_SECOND_HALF)) {
+          stepPtrs(&opt->insns[i], regs, loadsMayBeStack, &spills);
+        }
+      }
+      for (int i = 0; i < 2; i++) {
+        int succ = block->succ[i];
+        if (succ == -1) {
+          continue;
+        }
+        if (!(opt->seen[succ] & BLOCK_REACHED)) {
+          memcpy(opt->ptrs[succ], regs, sizeof(regs));
+          opt->seen[succ] |= BLOCK_REACHED;
+        } else if (!joinPtrs(opt->ptrs[succ], regs)) {
+          continue;
+        }
+        if (!(opt->seen[succ] & BLOCK_QUEUED)) {
+          opt->seen[succ] |= BLOCK_QUEUED;
+          opt->stack[depth++] = succ;
+        }
+      }
+    }
+    if (!spills || loadsMayBeStack) {
+      break;
+    }
+    loadsMayBeStack = 1;
+  }
+
+  for (int b = 0; b < opt->numBlocks; b++) {
+    const struct block *block = &opt->blocks[b];
+    struct ptr regs[NUM_REGS];
+    memcpy(regs, opt->ptrs[b], sizeof(regs));
+    for (int i = block->start; i < block->end; i++) {
+      const struct bpf_insn *insn = &opt->insns[i];
+      struct stack_use *use = &opt->stackUse[i];
+      int cls = BPF_CLASS(insn->code);
+      int size = accessSize(BPF_SIZE(insn->code));
+      const struct ptr *base =
+          &regs[cls == BPF_LDX ? insn->src_reg : insn->dst_reg];
+      memset(use, 0, sizeof(*use));
+      if (!(opt->seen[b] & BLOCK_REACHED)) {
+        // Unreachable, and so about to be removed.
+        continue;
+      }
+      if (opt->flags[i] & INSN_SECOND_HALF) {
+        continue;
+      }
+      if (isCall(insn)) {
+        // A helper may read from any stack pointer it is passed up to r10.
+        for (int reg = BPF_REG_1; reg <= BPF_REG_5; reg++) {
+          int lo, hi;
+          if (regs[reg].kind == PTR_STACK) {
+            setRange(&lo, &hi, regs[reg].off, -(long long)regs[reg].off);
+          } else if (regs[reg].kind == PTR_ANY_STACK) {
+            setRange(&lo, &hi, -STACK_SIZE, STACK_SIZE);
+          } else {
+            continue;
+          }
+          if (use->readLo >= use->readHi || lo < use->readLo) {
+            use->readLo = lo;
+          }
+          use->readHi = 0;
+        }
+        // It may write there too.
+        use->clobberLo = use->readLo;
+        use->clobberHi = use->readHi;
+      } else if (cls == BPF_LDX ||
+                 (cls == BPF_STX && BPF_MODE(insn->code) == BPF_ATOMIC)) {
+        if (base->kind == PTR_STACK) {
+          setRange(&use->readLo, &use->readHi,
+                   (long long)base->off + insn->off, size);
+        } else if (base->kind == PTR_ANY_STACK) {
+          setRange(&use->readLo, &use->readHi, -STACK_SIZE, STACK_SIZE);
+        }
+        if (cls != BPF_LDX) {
+          use->clobberLo = use->readLo;
+          use->clobberHi = use->readHi;
+        }
+      } else if (cls == BPF_ST || cls == BPF_STX) {
+        if (base->kind == PTR_STACK) {
+          setRange(&use->writeLo, &use->writeHi,
+                   (long long)base->off + insn->off, size);
+          use->clobberLo = use->writeLo;
+          use->clobberHi = use->writeHi;
+        } else if (base->kind == PTR_ANY_STACK) {
+          setRange(&use->clobberLo, &use->clobberHi, -STACK_SIZE, STACK_SIZE);
+        }
+      }
+      stepPtrs(insn, regs, loadsMayBeStack, &spills);
+    }
+  }
+}
+
+static void setBits(unsigned long long *bits, int lo, int hi, int value) {
+  for (int byte = lo; byte < hi; byte++) {
+    int bit = byte + STACK_SIZE;
+    if (value) {
+      bits[bit / 64] |= 1ULL << (bit % 64);
+    } else {
+      bits[bit / 64] &= ~(1ULL << (bit % 64));
+    }
+  }
+}
+
+static int anyBits(const unsigned long long *bits, int lo, int hi) {
+  for (int byte = lo; byte < hi; byte++) {
+    int bit = byte + STACK_SIZE;
+    if (bits[bit / 64] & (1ULL << (bit % 64))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Returns nonzero if the store at index certainly writes only the stack. */
+static int isStackStore(const struct optimizer *opt, int index) {
+  const struct bpf_insn *insn = &opt->insns[index];
+  const struct stack_use *use = &opt->stackUse[index];
+  int cls = BPF_CLASS(insn->code);
+  return (cls == BPF_ST || cls == BPF_STX) &&
+         BPF_MODE(insn->code) == BPF_MEM && use->writeLo < use->writeHi &&
+         use->writeHi - use->writeLo == accessSize(BPF_SIZE(insn->code));
+}
+
+/**
+ * Turns stores of registers that hold a known constant into stores of the
+ * constant. Only stores to the stack are changed, because the verifier does
+ * not allow immediate stores to some other memory, such as ctx.
+ */
+static int foldStores(struct optimizer *opt) {
+  int folded = 0;
+  for (int b = 0; b < opt->numBlocks; b++) {
+    const struct block *block = &opt->blocks[b];
+    long long values[NUM_REGS];
+    unsigned known = 0;
+    for (int i = block->start; i < block->end; i++) {
+      struct bpf_insn *insn = &opt->insns[i];
+      int cls = BPF_CLASS(insn->code);
+      int size = BPF_SIZE(insn->code);
+      if (opt->flags[i] & INSN_SECOND_HALF) {
+        continue;
+      }
+      if (cls == BPF_STX && (known & (1u << insn->src_reg)) &&
+          isStackStore(opt, i) && !(opt->flags[i] & INSN_PINNED)) {
+        long long value = values[insn->src_reg];
+        if (size != BPF_DW || value == (int)value) {
+          *insn = (struct bpf_insn){.code = BPF_ST | size | BPF_MEM,
+                                    .dst_reg = insn->dst_reg,
+                                    .off = insn->off,
+                                    .imm = (int)value};
+          folded++;
+        }
+        continue;
+      }
+
+      // Which registers hold what after insn.
+      int def = -1;
+      if (cls == BPF_ALU64 || cls == BPF_ALU || cls == BPF_LDX) {
+        def = insn->dst_reg;
+      } else if (isLoadImm64(insn)) {
+        def = insn->dst_reg;
+      } else if (isCall(insn) || cls == BPF_LD) {
+        known &= ~0x3fu;
+      } else if (cls == BPF_STX && BPF_MODE(insn->code) == BPF_ATOMIC) {
+        known &= ~(1u << insn->src_reg | 1u << BPF_REG_0);
+      }
+      if (def == -1) {
+        continue;
+      }
+      known &= ~(1u << def);
+      if (insn->code == (BPF_ALU64 | BPF_MOV | BPF_K)) {
+        values[def] = insn->imm;
+      } else if (insn->code == (BPF_ALU | BPF_MOV | BPF_K)) {
+        values[def] = (unsigned int)insn->imm;
+      } else if (isLoadImm64(insn) && insn->src_reg == 0) {
+        values[def] = (unsigned int)insn->imm |
+                      (unsigned long long)(unsigned int)insn[1].imm << 32;
+      } else {
+        continue;
+      }
+      known |= 1u << def;
+    }
+  }
+  opt->stats->foldedStores += folded;
+  return folded;
+}
+
+/**
+ * Merges the immediate stores at first and second, of size bytes at off
+ * and off + size from r10, into one store at first, if that can be
+ * expressed. Returns nonzero if it did.
+ */
+static int mergeStorePair(struct optimizer *opt, int first, int second) {
+  struct bpf_insn *a = &opt->insns[first], *b = &opt->insns[second];
+  int size = accessSize(BPF_SIZE(a->code));
+  const struct bpf_insn *low = a->off < b->off ? a : b;
+  const struct bpf_insn *high = a->off < b->off ? b : a;
+  if (size == 8 || high->off != low->off + size ||
+      low->off % (2 * size) != 0) {
+    return 0;
+  }
+  unsigned long long mask = (1ULL << (8 * size)) - 1;
+  unsigned long long value = ((unsigned long long)low->imm & mask) |
+                             ((unsigned long long)high->imm & mask)
+                                 << (8 * size);
+  static const int wider[] = {[1] = BPF_H, [2] = BPF_W, [4] = BPF_DW};
+  if (size == 4 && (long long)value != (int)value) {
+    // The 64-bit store sign-extends its immediate.
+    return 0;
+  }
+  *a = (struct bpf_insn){.code = BPF_ST | wider[size] | BPF_MEM,
+                         .dst_reg = BPF_REG_10,
+                         .off = low->off,
+                         .imm = (int)value};
+  removeInsn(opt, second);
+  return 1;
+}
+
+static int isMergeableStore(const struct optimizer *opt, int index) {
+  const struct bpf_insn *insn = &opt->insns[index];
+  return BPF_CLASS(insn->code) == BPF_ST &&
+         BPF_MODE(insn->code) == BPF_MEM && insn->dst_reg == BPF_REG_10 &&
+         !(opt->flags[index] & (INSN_PINNED | INSN_REMOVED));
+}
+
+/**
+ * Merges pairs of immediate stores to neighbouring bytes of the stack that
+ * are only separated by instructions that do not read memory, e.g. two
+ * 4-byte zeroes into one 8-byte zero. The second store moves up to the
+ * first, so it may only pass other immediate stores to different bytes.
+ */
+static int mergeStores(struct optimizer *opt) {
+  int merged = 0;
+  for (int i = 0; i < opt->numInsns; i++) {
+    if (!isMergeableStore(opt, i)) {
+      continue;
+    }
+    // The bytes written by the stores passed over, including the first.
+    unsigned long long passed[STACK_WORDS] = {0};
+    setBits(passed, opt->insns[i].off,
+            opt->insns[i].off + accessSize(BPF_SIZE(opt->insns[i].code)), 1);
+    for (int j = i + 1; j < opt->numInsns; j++) {
+      const struct bpf_insn *insn = &opt->insns[j];
+      int cls = BPF_CLASS(insn->code);
+      if (opt->flags[j] & INSN_LEADER) {
+        break;
+      }
+      if (isMergeableStore(opt, j)) {
+        int lo = insn->off, hi = lo + accessSize(BPF_SIZE(insn->code));
+        if (anyBits(passed, lo, hi)) {
+          break;
+        }
+        if (BPF_SIZE(insn->code) == BPF_SIZE(opt->insns[i].code) &&
+            mergeStorePair(opt, i, j)) {
+          merged++;
+          break;
+        }
+        setBits(passed, lo, hi, 1);
+        continue;
+      }
+      if (opt->flags[j] & (INSN_SECOND_HALF | INSN_REMOVED)) {
+        continue;
+      }
+      if (cls != BPF_ALU && cls != BPF_ALU64 && !isLoadImm64(insn)) {
+        break;
+      }
+    }
+  }
+  opt->stats->mergedStores += merged;
+  return merged;
+}
+
+/**
+ * Runs the bytes of the stack that may be read later, live, backwards over
+ * block. If removeDead is nonzero, stores to none of those bytes are removed.
+ * Returns the number removed.
+ */
+static int stepStackLiveness(struct optimizer *opt, int b,
+                             unsigned long long *live, int removeDead) {
+  const struct block *block = &opt->blocks[b];
+  int removed = 0;
+  for (int i = block->end - 1; i >= block->start; i--) {
+    const struct stack_use *use = &opt->stackUse[i];
+    if (opt->flags[i] & (INSN_SECOND_HALF | INSN_REMOVED)) {
+      continue;
+    }
+    if (isExit(&opt->insns[i])) {
+      // The frame is gone.
+      memset(live, 0, STACK_WORDS * sizeof(*live));
+    }
+    if (removeDead && isStackStore(opt, i) &&
+        !(opt->flags[i] & INSN_PINNED) &&
+        !anyBits(live, use->writeLo, use->writeHi)) {
+      removeInsn(opt, i);
+      removed++;
+      continue;
+    }
+    setBits(live, use->writeLo, use->writeHi, 0);
+    setBits(live, use->readLo, use->readHi, 1);
+  }
+  return removed;
+}
+
+/** Removes stores to the stack that are never read. */
+static int removeDeadStores(struct optimizer *opt) {
+  unsigned long long live[STACK_WORDS];
+  int changed = 1;
+  memset(opt->liveStack, 0, opt->numBlocks * sizeof(*opt->liveStack));
+  while (changed) {
+    changed = 0;
+    for (int b = opt->numBlocks - 1; b >= 0; b--) {
+      memset(live, 0, sizeof(live));
+      for (int i = 0; i < 2; i++) {
+        int succ = opt->blocks[b].succ[i];
+        for (int w = 0; succ != -1 && w < STACK_WORDS; w++) {
+          live[w] |= opt->liveStack[succ][w];
+        }
+      }
+      stepStackLiveness(opt, b, live, 0);
+      if (memcmp(live, opt->liveStack[b], sizeof(live)) != 0) {
+        memcpy(opt->liveStack[b], live, sizeof(live));
+        changed = 1;
+      }
+    }
+  }
+
+  int removed = 0;
+  for (int b = 0; b < opt->numBlocks; b++) {
+    memset(live, 0, sizeof(live));
+    for (int i = 0; i < 2; i++) {
+      int succ = opt->blocks[b].succ[i];
+      for (int w = 0; succ != -1 && w < STACK_WORDS; w++) {
+        live[w] |= opt->liveStack[succ][w];
+      }
+    }
+    removed += stepStackLiveness(opt, b, live, 1);
+  }
+  opt->stats->deadStores += removed;
+  return removed;
+}
+
+/**
+ * Sets *use and *def to the registers insn reads and writes. Returns nonzero
+ * if writing *def is all it does, so it can be removed if nothing reads
+ * them.
+ */
+static int regEffects(const struct bpf_insn *insn, unsigned *use,
+                      unsigned *def) {
+  unsigned dst = 1u << insn->dst_reg, src = 1u << insn->src_reg;
+  int cls = BPF_CLASS(insn->code);
+  int op = BPF_OP(insn->code);
+  int isX = BPF_SRC(insn->code) == BPF_X;
+  *use = *def = 0;
+  switch (cls) {
+  case BPF_ALU:
+  case BPF_ALU64:
+    *def = dst;
+    *use = (op != BPF_MOV ? dst : 0) | (isX && op != BPF_END ? src : 0);
+    return 1;
+  case BPF_JMP:
+  case BPF_JMP32:
+    if (isExit(insn)) {
+      *use = 1u << BPF_REG_0;
+    } else if (isCall(insn)) {
+      *use = 0x3eu;
+      *def = 0x3fu;
+    } else if (op != BPF_JA) {
+      *use = dst | (isX ? src : 0);
+    }
+    return 0;
+  case BPF_LD:
+    if (isLoadImm64(insn)) {
+      *def = dst;
+      // A function pointer is a root of the call graph.
+      return insn->src_reg != BPF_PSEUDO_FUNC;
+    }
+    // The legacy packet loads, which can end the program.
+    *use = 1u << BPF_REG_6 | (BPF_MODE(insn->code) == BPF_IND ? src : 0);
+    *def = 0x3fu;
+    return 0;
+  case BPF_LDX:
+    *use = src;
+    *def = dst;
+    return 1;
+  case BPF_ST:
+    *use = dst;
+    return 0;
+  default:
+    *use = dst | src;
+    if (BPF_MODE(insn->code) == BPF_ATOMIC) {
+      if (insn->imm == BPF_CMPXCHG) {
+        *use |= 1u << BPF_REG_0;
+        *def = 1u << BPF_REG_0;
+      } else if (insn->imm & BPF_FETCH) {
+        *def = src;
+      }
+    }
+    return 0;
+  }
+}
+
+/**
+ * Runs the registers that may be read later, live, backwards over block b.
+ * If removeDead is nonzero, instructions that only write registers not in it
+ * are removed. Returns the number removed.
+ */
+static int stepRegLiveness(struct optimizer *opt, int b, unsigned *live,
+                           int removeDead) {
+  const struct block *block = &opt->blocks[b];
+  int removed = 0;
+  for (int i = block->end - 1; i >= block->start; i--) {
+    unsigned use, def;
+    if (opt->flags[i] & (INSN_SECOND_HALF | INSN_REMOVED)) {
+      continue;
+    }
+    int pure = regEffects(&opt->insns[i], &use, &def);
+    if (removeDead && pure && !(def & *live) &&
+        !(opt->flags[i] & INSN_PINNED)) {
+      removeInsn(opt, i);
+      removed++;
+      continue;
+    }
+    *live = (*live & ~def) | use;
+  }
+  return removed;
+}
+
+/** Removes instructions whose only effect is on registers never read. */
+static int removeDeadCode(struct optimizer *opt) {
+  int changed = 1;
+  memset(opt->liveRegs, 0, opt->numBlocks * sizeof(*opt->liveRegs));
+  while (changed) {
+    changed = 0;
+    for (int b = opt->numBlocks - 1; b >= 0; b--) {
+      unsigned live = 0;
+      for (int i = 0; i < 2; i++) {
+        int succ = opt->blocks[b].succ[i];
+        live |= succ != -1 ? opt->liveRegs[succ] : 0;
+      }
+      stepRegLiveness(opt, b, &live, 0);
+      if (live != opt->liveRegs[b]) {
+        opt->liveRegs[b] = live;
+        changed = 1;
+      }
+    }
+  }
+
+  int removed = 0;
+  for (int b = 0; b < opt->numBlocks; b++) {
+    unsigned live = 0;
+    for (int i = 0; i < 2; i++) {
+      int succ = opt->blocks[b].succ[i];
+      live |= succ != -1 ? opt->liveRegs[succ] : 0;
+    }
+    removed += stepRegLiveness(opt, b, &live, 1);
+  }
+  opt->stats->deadInsns += removed;
+  return removed;
+}
+
+/**
+ * Removes loads from the stack of what the register already holds, because
+ * it was loaded from or stored to the same bytes earlier in the block and
+ * nothing can have written them since. A load of what another register
+ * holds becomes a move from it.
+ */
+static int forwardLoads(struct optimizer *opt) {
+  int forwarded = 0;
+  for (int b = 0; b < opt->numBlocks; b++) {
+    const struct block *block = &opt->blocks[b];
+    // The bytes of the stack that each register holds, as [lo, lo + size),
+    // zero-extended if size is less than 8, or size 0 if none.
+    int lo[NUM_REGS] = {0}, size[NUM_REGS] = {0};
+    for (int i = block->start; i < block->end; i++) {
+      struct bpf_insn *insn = &opt->insns[i];
+      const struct stack_use *use = &opt->stackUse[i];
+      int cls = BPF_CLASS(insn->code);
+      int accessed = accessSize(BPF_SIZE(insn->code));
+      int isStackLoad = cls == BPF_LDX && BPF_MODE(insn->code) == BPF_MEM &&
+                        use->readHi - use->readLo == accessed;
+      unsigned regUse, def;
+      if (opt->flags[i] & INSN_SECOND_HALF) {
+        continue;
+      }
+      if (isStackLoad && !(opt->flags[i] & INSN_PINNED)) {
+        int holder = -1;
+        for (int reg = 0; reg < NUM_REGS && holder != insn->dst_reg; reg++) {
+          if (size[reg] == accessed && lo[reg] == use->readLo) {
+            holder = reg;
+          }
+        }
+        if (holder == insn->dst_reg) {
+          removeInsn(opt, i);
+          forwarded++;
+          continue;
+        }
+        if (holder != -1) {
+          *insn = (struct bpf_insn){.code = BPF_ALU64 | BPF_MOV | BPF_X,
+                                    .dst_reg = insn->dst_reg,
+                                    .src_reg = holder};
+          forwarded++;
+        }
+      }
+
+      regEffects(insn, &regUse, &def);
+      for (int reg = 0; reg < NUM_REGS; reg++) {
+        int clobbered = lo[reg] < use->clobberHi &&
+                        lo[reg] + size[reg] > use->clobberLo;
+        if ((def & (1u << reg)) || clobbered) {
+          size[reg] = 0;
+        }
+      }
+      if (isStackLoad) {
+        lo[insn->dst_reg] = use->readLo;
+        size[insn->dst_reg] = accessed;
+      } else if (cls == BPF_STX && accessed == 8 && isStackStore(opt, i)) {
+        lo[insn->src_reg] = use->writeLo;
+        size[insn->src_reg] = 8;
+      }
+    }
+  }
+  opt->stats->forwardedLoads += forwarded;
+  return forwarded;
+}
+
+int optimize_program(struct bpf_insn *insns, int numInsns, int *pinned,
+                     int numPinned, struct optimize_stats *stats) {
+  struct optimize_stats unused;
+  struct optimizer opt = {.insns = insns,
+                          .numInsns = numInsns,
+                          .stats = stats != NULL ? stats : &unused};
+  memset(opt.stats, 0, sizeof(*opt.stats));
+  int n = numInsns;
+  opt.flags = calloc(n, 1);
+  opt.blockOf = malloc(n * sizeof(int));
+  opt.blocks = malloc(n * sizeof(struct block));
+  opt.stack = malloc(n * sizeof(int));
+  opt.seen = malloc(n);
+  opt.ptrs = malloc(n * sizeof(*opt.ptrs));
+  opt.stackUse = malloc(n * sizeof(struct stack_use));
+  opt.liveStack = malloc(n * sizeof(*opt.liveStack));
+  opt.liveRegs = malloc(n * sizeof(*opt.liveRegs));
+  opt.newIndex = malloc((n + 1) * sizeof(int));
+  int rc = -1;
+  if (opt.flags == NULL || opt.blockOf == NULL || opt.blocks == NULL ||
+      opt.stack == NULL || opt.seen == NULL || opt.ptrs == NULL ||
+      opt.stackUse == NULL || opt.liveStack == NULL || opt.liveRegs == NULL ||
+      opt.newIndex == NULL) {
+    errno = ENOMEM;
+    goto out;
+  }
+  for (int i = 0; i < numPinned; i++) {
+    opt.flags[pinned[i]] |= INSN_PINNED;
+  }
+
+  // Each pass sees the program as the one before left it.
+  static int (*const passes[])(struct optimizer *) = {
+      threadJumps, removeUselessJumps, forwardLoads,  foldStores,
+      mergeStores, removeDeadStores,   removeDeadCode,
+  };
+  int numPasses = sizeof(passes) / sizeof(passes[0]);
+  for (int round = 0, changed = 1; changed && round < MAX_ROUNDS; round++) {
+    changed = 0;
+    for (int p = 0; p < numPasses; p++) {
+      buildBlocks(&opt);
+      if (passes[p] == forwardLoads || passes[p] == foldStores ||
+          passes[p] == removeDeadStores) {
+        trackStack(&opt);
+      }
+      if (passes[p](&opt) > 0) {
+        changed = 1;
+        compact(&opt, pinned, numPinned);
+      }
+    }
+  }
+  rc = opt.numInsns;
+
+out:
+  free(opt.flags);
+  free(opt.blockOf);
+  free(opt.blocks);
+  free(opt.stack);
+  free(opt.seen);
+  free(opt.ptrs);
+  free(opt.stackUse);
+  free(opt.liveStack);
+  free(opt.liveRegs);
+  free(opt.newIndex);
+  return rc;
+}
@@ -0,0 +1,66 @@
+/**
+ * A peephole optimiser for BPF programs, run on the instructions before they
+ * are loaded. Every instruction it removes is one that no longer runs on
+ * each open() on the host.
+ *
+ * The passes are repeated until none of them finds anything more to do:
+ * - Jumps to a goto are sent straight to where the goto leads, and a goto to
+ *   an exit becomes the exit.
+ * - A conditional jump over a goto is inverted to go where the goto does.
+ * - Jumps to the next instruction are removed, as is code that threading
+ *   has left unreachable.
+ * - A load from the stack of what a register already holds, because it was
+ *   loaded or stored there earlier in the block, is removed, or becomes a
+ *   move if the value is in another register.
+ * - A register stored to the stack while it holds a known constant is
+ *   stored as an immediate instead, which often leaves the instruction that
+ *   set the register dead.
+ * - Adjacent immediate stores to the stack that fit in one wider store are
+ *   merged, e.g. two 4-byte zeroes into one 8-byte zero.
+ * - Stores to the stack that nothing reads before they are overwritten or
+ *   the program exits are removed.
+ * - Instructions whose only effect is to set a register that is not read
+ *   again are removed.
+ *
+ * Jump offsets and the targets of BPF-to-BPF calls are rewritten to match.
+ * The program must be well formed, as analyze_program() checks, and it
+ * stays so.
+ */
+#pragma once
+
+#include <linux/bpf.h>
+
+/** What optimize_program() did, by pass. */
+struct optimize_stats {
+  // Jumps sent to the end of a chain of gotos, or replaced by an exit.
+  int threadedJumps;
+  // Jumps to the next instruction, or over a goto, and unreachable
+  // instructions removed.
+  int removedJumps;
+  int unreachableInsns;
+  // Loads from the stack removed or turned into moves.
+  int forwardedLoads;
+  // Register stores turned into immediate stores.
+  int foldedStores;
+  // Pairs of stores merged into one.
+  int mergedStores;
+  // Stores whose value was never read, and other instructions whose result
+  // was never read, that were removed.
+  int deadStores;
+  int deadInsns;
+  // In total, counting an ld_imm64 as two.
+  int removedInsns;
+};
+
+/**
+ * Optimises the numInsns instructions in insns in place.
+ *
+ * pinned holds the indices of numPinned instructions that are left exactly
+ * as they are, such as those with relocations still to be patched. Each is
+ * updated to where its instruction ends up. stats may be NULL.
+ *
+ * Returns the new number of instructions, or -1 with errno set to ENOMEM, in
+ * which case insns and pinned are unchanged.
+ */
+int optimize_program(struct bpf_insn *insns, int numInsns, int *pinned,
+                     int numPinned, struct optimize_stats *stats);
@@ -0,0 +1,235 @@
+#include "output.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NANOS_PER_SECOND 1000000000LL
+#define NANOS_PER_MILLI 1000000LL
+
+/** Cheap enough to read for every event, and precise enough for flushing. */
+static long long coarseMonotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
+}
+
+int output_writer_init(struct output_writer *writer, int fd,
+                       int flushIntervalMs) {
+  memset(writer, 0, sizeof(*writer));
+  writer->buf = malloc(OUTPUT_BUFFER_SIZE);
+  if (writer->buf == NULL) {
+    return -1;
+  }
+
+  writer->fd = fd;
+  writer->capacity = OUTPUT_BUFFER_SIZE;
+  writer->flushIntervalNs = flushIntervalMs * NANOS_PER_MILLI;
+  return 0;
+}
+
+void output_writer_free(struct output_writer *writer) {
+  free(writer->buf);
+  writer->buf = NULL;
+}
+
+int output_writer_flush(struct output_writer *writer) {
+  size_t offset = 0;
+  while (offset < writer->len) {
+    ssize_t numWritten =
+        write(writer->fd, writer->buf + offset, writer->len - offset);
+    if (numWritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Drop what could not be written rather than retrying it forever.
+      writer->len = 0;
+      return -1;
+    }
+    offset += numWritten;
+  }
+
+  writer->len = 0;
+  return 0;
+}
+
+int output_writer_maybe_flush(struct output_writer *writer) {
+  if (writer->len == 0) {
+    return 0;
+  }
+
+  if (writer->capacity - writer->len < MAX_OUTPUT_LINE_LENGTH ||
+      coarseMonotonicNanos() - writer->firstPendingNs >=
+          writer->flushIntervalNs) {
+    return output_writer_flush(writer);
+  }
+  return 0;
+}
+
+int output_writer_timeout_ms(const struct output_writer *writer) {
+  if (writer->len == 0) {
+    return -1;
+  }
+
+  long long remainingNs =
+      writer->firstPendingNs + writer->flushIntervalNs - coarseMonotonicNanos();
+  if (remainingNs <= 0) {
+    return 0;
+  }
+  // Round up so that we do not wake up just before the deadline.
+  return (remainingNs + NANOS_PER_MILLI - 1) / NANOS_PER_MILLI;
+}
+
+/**
+ * Returns a pointer to n bytes of space at the end of the buffer. Every
+ * append is bounded by MAX_OUTPUT_LINE_LENGTH per line, and
+ * output_writer_maybe_flush() keeps that much space free, so this only has to
+ * flush when a caller appends several lines without checking.
+ */
+static char *reserve(struct output_writer *writer, size_t n) {
+  if (writer->capacity - writer->len < n) {
+    output_writer_flush(writer);
+  }
+  if (writer->len == 0) {
+    writer->firstPendingNs = coarseMonotonicNanos();
+  }
+
+  char *dest = writer->buf + writer->len;
+  writer->len += n;
+  return dest;
+}
+
+void output_append_bytes(struct output_writer *writer, const void *src,
+                         size_t n) {
+  memcpy(reserve(writer, n), src, n);
+}
+
+static void appendSpaces(struct output_writer *writer, int n) {
+  if (n > 0) {
+    memset(reserve(writer, n), ' ', n);
+  }
+}
+
+void output_append_str(struct output_writer *writer, const char *str) {
+  output_append_bytes(writer, str, strlen(str));
+}
+
+void output_append_padded_str(struct output_writer *writer, const char *str,
+                              int maxLen, int width) {
+  size_t len = strnlen(str, maxLen);
+  output_append_bytes(writer, str, len);
+  appendSpaces(writer, width - (int)len);
+}
+
+/**
+ * Writes the decimal digits of value to the end of digits and returns how
+ * many there are.
+ */
+static int formatUnsigned(unsigned long long value, char *digits, int size) {
+  int i = size;
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  return size - i;
+}
+
+void output_append_int(struct output_writer *writer, long long value,
+                       int width, int leftAlign) {
+  // 20 digits plus a sign is enough for any long long.
+  char digits[21];
+  unsigned long long magnitude =
+      value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+  int len = formatUnsigned(magnitude, digits, sizeof(digits));
+  if (value < 0) {
+    digits[sizeof(digits) - ++len] = '-';
+  }
+
+  if (!leftAlign) {
+    appendSpaces(writer, width - len);
+  }
+  output_append_bytes(writer, digits + sizeof(digits) - len, len);
+  if (leftAlign) {
+    appendSpaces(writer, width - len);
+  }
+}
+
+void output_append_seconds(struct output_writer *writer, long long nanos,
+                           int width) {
+  // Sign, up to 11 digits of seconds, the point and 9 digits of fraction.
+  char text[32];
+  int len = 0;
+  unsigned long long magnitude =
+      nanos < 0 ? -(unsigned long long)nanos : (unsigned long long)nanos;
+  if (nanos < 0) {
+    text[len++] = '-';
+  }
+
+  char digits[20];
+  int numDigits =
+      formatUnsigned(magnitude / NANOS_PER_SECOND, digits, sizeof(digits));
+  memcpy(text + len, digits + sizeof(digits) - numDigits, numDigits);
+  len += numDigits;
+
+  text[len++] = '.';
+  unsigned long long fraction = magnitude % NANOS_PER_SECOND;
+  for (int i = 8; i >= 0; i--) {
+    text[len + i] = '0' + fraction % 10;
+    fraction /= 10;
+  }
+  len += 9;
+
+  output_append_bytes(writer, text, len);
+  appendSpaces(writer, width - len);
+}
+
+void output_append_header(struct output_writer *writer, int withTimestamp,
+                          int tidColumn, int withLatency) {
+  if (withTimestamp) {
+    output_append_padded_str(writer, "TIME(s)", sizeof("TIME(s)"), 14);
+  }
+  // "%-6s %-16s %4s %3s %s\n"
+  output_append_padded_str(writer, tidColumn ? "TID" : "PID", 3, 6);
+  output_append_str(writer, " ");
+  output_append_padded_str(writer, "COMM", 4, 16);
+  output_append_str(writer, withLatency ? "   FD ERR  LAT(us) PATH\n"
+                                        : "   FD ERR PATH\n");
+}
+
+void output_append_event(struct output_writer *writer,
+                         const struct event_t *event, int withTimestamp,
+                         long long deltaNs, int withLatency) {
+  int fd_s, err;
+  if (event->ret >= 0) {
+    fd_s = event->ret;
+    err = 0;
+  } else {
+    fd_s = -1;
+    err = -event->ret;
+  }
+
+  if (withTimestamp) {
+    output_append_seconds(writer, deltaNs, 14);
+  }
+
+  // "%-6d %-16.16s %4d %3d %.*s\n"
+  int pid = event->id >> 32;
+  output_append_int(writer, pid, 6, /* leftAlign */ 1);
+  output_append_bytes(writer, " ", 1);
+  output_append_padded_str(writer, event->comm, TASK_COMM_LEN, 16);
+  output_append_bytes(writer, " ", 1);
+  output_append_int(writer, fd_s, 4, /* leftAlign */ 0);
+  output_append_bytes(writer, " ", 1);
+  output_append_int(writer, err, 3, /* leftAlign */ 0);
+  output_append_bytes(writer, " ", 1);
+  if (withLatency) {
+    // "%8llu "
+    output_append_int(writer, event->latency / 1000, 8, /* leftAlign */ 0);
+    output_append_bytes(writer, " ", 1);
+  }
+  // fname_len counts the NUL, but do not trust it to be there.
+  int fnameLen = event->fname_len > 0 ? event->fname_len - 1 : 0;
+  output_append_bytes(writer, event->fname, strnlen(event->fname, fnameLen));
+  output_append_bytes(writer, "\n", 1);
+}
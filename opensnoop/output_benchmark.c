@@ -0,0 +1,148 @@
+/*
+ * Throughput benchmark for output.c. Recommended usage:
+ *
+ * clang -O3 -I. output_benchmark.c output.c -o output_benchmark
+ * ./output_benchmark [NUM_EVENTS]
+ *
+ * This formats the same synthetic events with the printf() calls that
+ * perf_reader_raw_callback() used to make and with output_append_event(),
+ * first checking that both produce the same bytes (timestamps aside, as the
+ * printf() version rounds them to a float) and then timing each of them
+ * writing to /dev/null.
+ */
+#include "output.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_DISTINCT_EVENTS 1024
+
+static const char *paths[] = {
+    "/etc/ld.so.cache",
+    "/lib/x86_64-linux-gnu/libc.so.6",
+    "/proc/self/stat",
+    "/home/user/src/project/build/CMakeFiles/target.dir/src/main.cc.o.d",
+    ".",
+    "",
+};
+static const char *comms[] = {"bash", "cc1plus", "systemd-journal", "ld"};
+
+static struct event_t *makeEvent(int i) {
+  const char *path = paths[i % (sizeof(paths) / sizeof(paths[0]))];
+  size_t fnameLen = strlen(path) + 1;
+  struct event_t *event = calloc(1, sizeof(struct event_t) + fnameLen);
+  event->id = (unsigned long long)(1000 + i * 37 % 400000) << 32;
+  event->ts = 1000000000ULL * 5000 + i * 123457ULL;
+  event->ret = i % 7 == 0 ? -(i % 40) : 3 + i % 1000;
+  event->version = EVENT_VERSION;
+  event->fname_len = fnameLen;
+  strcpy(event->comm, comms[i % (sizeof(comms) / sizeof(comms[0]))]);
+  memcpy(event->fname, path, fnameLen);
+  return event;
+}
+
+/** The formatting code from perf_reader_raw_callback() prior to output.c. */
+static void printfEvent(FILE *out, const struct event_t *event,
+                        int withTimestamp, long long delta) {
+  const float NANOS_PER_SECOND = 1000000000;
+  int fd_s, err;
+  if (event->ret >= 0) {
+    fd_s = event->ret;
+    err = 0;
+  } else {
+    fd_s = -1;
+    err = -event->ret;
+  }
+
+  if (withTimestamp) {
+    fprintf(out, "%-14.9f", delta / NANOS_PER_SECOND);
+  }
+
+  int fnameLen = event->fname_len > 0 ? event->fname_len - 1 : 0;
+  int pid = event->id >> 32;
+  fprintf(out, "%-6d %-16.16s %4d %3d %.*s\n", pid, event->comm, fd_s, err,
+          fnameLen, event->fname);
+}
+
+static double nowSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static char *readFile(FILE *file, long *size) {
+  fflush(file);
+  *size = ftell(file);
+  char *contents = malloc(*size);
+  rewind(file);
+  fread(contents, 1, *size, file);
+  return contents;
+}
+
+int main(int argc, char **argv) {
+  long numEvents = argc > 1 ? atol(argv[1]) : 10000000;
+  struct event_t *events[NUM_DISTINCT_EVENTS];
+  for (int i = 0; i < NUM_DISTINCT_EVENTS; i++) {
+    events[i] = makeEvent(i);
+  }
+
+  // Check that the two implementations agree.
+  FILE *expected = tmpfile();
+  FILE *actual = tmpfile();
+  struct output_writer writer;
+  if (expected == NULL || actual == NULL ||
+      output_writer_init(&writer, fileno(actual), 0) < 0) {
+    perror("Failed to set up the comparison");
+    return 1;
+  }
+  fprintf(expected, "%-6s %-16s %4s %3s %s\n", "PID", "COMM", "FD", "ERR",
+          "PATH");
+  output_append_header(&writer, 0, 0, 0);
+  for (int i = 0; i < NUM_DISTINCT_EVENTS; i++) {
+    printfEvent(expected, events[i], 0, 0);
+    output_append_event(&writer, events[i], 0, 0, 0);
+  }
+  output_writer_flush(&writer);
+  output_writer_free(&writer);
+
+  long expectedSize, actualSize;
+  char *expectedContents = readFile(expected, &expectedSize);
+  char *actualContents = readFile(actual, &actualSize);
+  if (expectedSize != actualSize ||
+      memcmp(expectedContents, actualContents, expectedSize) != 0) {
+    fprintf(stderr, "output_append_event() does not match printf().\n");
+    return 1;
+  }
+  printf("Output of %d events matches printf().\n", NUM_DISTINCT_EVENTS);
+
+  // Time both against /dev/null, with timestamps.
+  int devNull = open("/dev/null", O_WRONLY);
+  FILE *devNullFile = fdopen(dup(devNull), "w");
+  long long initialTs = events[0]->ts;
+
+  double start = nowSeconds();
+  for (long i = 0; i < numEvents; i++) {
+    struct event_t *event = events[i % NUM_DISTINCT_EVENTS];
+    printfEvent(devNullFile, event, 1, event->ts - initialTs);
+  }
+  fflush(devNullFile);
+  double printfSeconds = nowSeconds() - start;
+
+  output_writer_init(&writer, devNull, 100);
+  start = nowSeconds();
+  for (long i = 0; i < numEvents; i++) {
+    struct event_t *event = events[i % NUM_DISTINCT_EVENTS];
+    output_append_event(&writer, event, 1, event->ts - initialTs, 0);
+    output_writer_maybe_flush(&writer);
+  }
+  output_writer_flush(&writer);
+  double writerSeconds = nowSeconds() - start;
+
+  printf("printf():        %8.0f events/s\n", numEvents / printfSeconds);
+  printf("output_writer:   %8.0f events/s (%.1fx)\n",
+         numEvents / writerSeconds, printfSeconds / writerSeconds);
+  return 0;
+}
@@ -0,0 +1,160 @@
+#include "perfbuf.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PROFILE_HEADER "# opensnoop perf buffer profile: cpu events/s\n"
+
+struct perf_reader *perfbuf_open(perf_reader_raw_cb raw_cb,
+                                 perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                 int cpu, int page_cnt,
+                                 const struct perfbuf_wakeup *wakeup) {
+  struct perf_reader *reader =
+      perf_reader_new(raw_cb, lost_cb, cb_cookie, page_cnt);
+  if (reader == NULL) {
+    return NULL;
+  }
+
+  // The same event that bpf_open_perf_buffer() opens.
+  struct perf_event_attr attr = {};
+  attr.config = PERF_COUNT_SW_BPF_OUTPUT;
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.sample_type = PERF_SAMPLE_RAW;
+  attr.sample_period = 1;
+  if (wakeup->bytes > 0) {
+    attr.watermark = 1;
+    attr.wakeup_watermark = wakeup->bytes;
+  } else {
+    attr.wakeup_events = wakeup->events > 0 ? wakeup->events : 1;
+  }
+
+  int pfd = syscall(__NR_perf_event_open, &attr, /* pid */ -1, cpu,
+                    /* group_fd */ -1, PERF_FLAG_FD_CLOEXEC);
+  if (pfd < 0) {
+    perf_reader_free(reader);
+    return NULL;
+  }
+  // The fd is now owned by the reader.
+  perf_reader_set_fd(reader, pfd);
+
+  if (perf_reader_mmap(reader) < 0 ||
+      ioctl(pfd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+    int savedErrno = errno;
+    perf_reader_free(reader);
+    errno = savedErrno;
+    return NULL;
+  }
+  return reader;
+}
+
+/** Returns the largest power of 2 that is <= n, or 1 if n is 0. */
+static int floorPowerOf2(size_t n) {
+  int result = 1;
+  while ((size_t)result * 2 <= n && result < (1 << 30)) {
+    result *= 2;
+  }
+  return result;
+}
+
+/** Returns the profiled rate of cpu, or 0 if it is unknown. */
+static double rateOf(const double *rates, int numRates, int cpu) {
+  return rates != NULL && cpu < numRates && rates[cpu] > 0 ? rates[cpu] : 0;
+}
+
+void perfbuf_plan_pages(int *pageCnt, const int *cpus, size_t numCpu,
+                        size_t budgetPages, const double *rates,
+                        int numRates) {
+  double known = 0;
+  int numKnown = 0;
+  for (size_t i = 0; i < numCpu; i++) {
+    double rate = rateOf(rates, numRates, cpus[i]);
+    known += rate;
+    numKnown += rate > 0;
+  }
+  double average = numKnown > 0 ? known / numKnown : 1;
+  double total = known + (numCpu - numKnown) * average;
+
+  // Every CPU gets one page up front and a share of the rest. The shares
+  // add up to the budget, and rounding each down to a power of 2 keeps the
+  // sum within it.
+  size_t spare = budgetPages > numCpu ? budgetPages - numCpu : 0;
+  for (size_t i = 0; i < numCpu; i++) {
+    double rate = rateOf(rates, numRates, cpus[i]);
+    double share = (rate > 0 ? rate : average) / total;
+    pageCnt[i] = floorPowerOf2(1 + (size_t)(share * spare));
+  }
+}
+
+int perfbuf_profile_load(const char *path, double **rates, int *numRates) {
+  FILE *file = fopen(path, "re");
+  if (file == NULL) {
+    return -1;
+  }
+
+  *rates = NULL;
+  *numRates = 0;
+  char line[128];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    int cpu;
+    double rate;
+    if (line[0] == '#' || sscanf(line, "%d %lf", &cpu, &rate) != 2 ||
+        cpu < 0 || cpu >= (1 << 16)) {
+      continue;
+    }
+
+    if (cpu >= *numRates) {
+      double *newRates = realloc(*rates, (cpu + 1) * sizeof(double));
+      if (newRates == NULL) {
+        free(*rates);
+        fclose(file);
+        errno = ENOMEM;
+        return -1;
+      }
+      for (int i = *numRates; i <= cpu; i++) {
+        newRates[i] = 0;
+      }
+      *rates = newRates;
+      *numRates = cpu + 1;
+    }
+    (*rates)[cpu] = rate;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+int perfbuf_profile_save(const char *path, const double *rates, int numRates) {
+  // Write to a temporary file and rename it so that a concurrent run never
+  // sees half a profile.
+  size_t tmpLen = strlen(path) + sizeof(".tmp");
+  char *tmpPath = malloc(tmpLen);
+  if (tmpPath == NULL) {
+    return -1;
+  }
+  snprintf(tmpPath, tmpLen, "%s.tmp", path);
+
+  FILE *file = fopen(tmpPath, "we");
+  if (file == NULL) {
+    free(tmpPath);
+    return -1;
+  }
+  fputs(PROFILE_HEADER, file);
+  for (int cpu = 0; cpu < numRates; cpu++) {
+    fprintf(file, "%d %.1f\n", cpu, rates[cpu]);
+  }
+
+  int rc = 0;
+  if (fclose(file) != 0 || rename(tmpPath, path) < 0) {
+    int savedErrno = errno;
+    unlink(tmpPath);
+    errno = savedErrno;
+    rc = -1;
+  }
+  free(tmpPath);
+  return rc;
+}
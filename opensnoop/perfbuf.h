@@ -0,0 +1,58 @@
+/**
+ * Opening and sizing the per-CPU perf buffers.
+ *
+ * bpf_open_perf_buffer() from bcc always asks the kernel for a wakeup after
+ * every sample, which costs a context switch per open() on a busy CPU.
+ * perfbuf_open() builds the same reader from the lower-level perf_reader_*()
+ * functions, but lets the kernel batch wakeups by sample count or by bytes
+ * (the "watermark"). A reader that only wakes up every N samples can leave
+ * a trickle of events sitting in the buffer indefinitely, so callers that
+ * batch must also read every buffer on a timer.
+ *
+ * Buffer sizes can also be chosen per CPU: perfbuf_plan_pages() divides a
+ * total memory budget in proportion to each CPU's event rate, as recorded in
+ * a profile saved by an earlier run.
+ */
+#pragma once
+
+#include <bcc/perf_reader.h>
+#include <stddef.h>
+
+struct perfbuf_wakeup {
+  // Wake the reader after this many samples (0 or 1 for every sample).
+  int events;
+  // If nonzero, wake the reader once this many bytes are in the buffer
+  // instead, and ignore events.
+  int bytes;
+};
+
+/**
+ * Like bpf_open_perf_buffer(raw_cb, lost_cb, cb_cookie, -1, cpu, page_cnt),
+ * but with the given wakeup policy. Returns NULL and sets errno on failure.
+ */
+struct perf_reader *perfbuf_open(perf_reader_raw_cb raw_cb,
+                                 perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                 int cpu, int page_cnt,
+                                 const struct perfbuf_wakeup *wakeup);
+
+/**
+ * Fills pageCnt[i] with the number of data pages for the perf buffer of
+ * cpus[i] so that the total stays within budgetPages. Each CPU gets a share
+ * proportional to rates[cpus[i]] (events per second), where CPUs without a
+ * rate (beyond numRates, or when rates is NULL) are assumed to be average.
+ * Every count is a power of 2, as the kernel requires, and at least 1, so
+ * the total only exceeds budgetPages if that is less than numCpu.
+ */
+void perfbuf_plan_pages(int *pageCnt, const int *cpus, size_t numCpu,
+                        size_t budgetPages, const double *rates,
+                        int numRates);
+
+/**
+ * Reads the per-CPU event rates saved by perfbuf_profile_save(), indexed by
+ * CPU. Returns 0 on success or -1 with errno set (ENOENT if there is no
+ * profile yet). *rates must be freed by the caller.
+ */
+int perfbuf_profile_load(const char *path, double **rates, int *numRates);
+
+/** Returns 0 on success or -1 with errno set. */
+int perfbuf_profile_save(const char *path, const double *rates, int numRates);
@@ -0,0 +1,740 @@
+#include "programs.h"
+#include "bpf_asm.h"
+#include "opensnoop.h"
+#include <errno.h>
+#include <stddef.h>
+
+// PT_REGS_RC(ctx) and PT_REGS_PARM2(ctx) on x86_64, for the return and entry
+// kprobes.
+#define PT_REGS_RC_OFFSET 80
+#define PT_REGS_PARM2_OFFSET 104
+
+// The first and second arguments and the return value in the format of the
+// syscalls:sys_enter_* and sys_exit_* tracepoints, which start with the
+// common fields and __syscall_nr.
+#define TP_SYSCALL_ARG0_OFFSET 16
+#define TP_SYSCALL_ARG1_OFFSET 24
+#define TP_SYSCALL_RET_OFFSET 16
+
+// The second argument in the context of fentry and fexit programs.
+#define TRAMPOLINE_ARG1_OFFSET 8
+
+// BPF_F_CURRENT_CPU for bpf_perf_event_output().
+#define CURRENT_CPU 0xffffffff
+
+// Stack slots used by assemble_trace_return(). Events are built in the
+// scratch map, so the rest of the stack is free for the key and value of the
+// aggregation modes.
+#define STACK_ID -8
+#define STACK_TS -16
+#define STACK_ZERO -24
+// The return value of the open, copied from ctx so that the code that reads
+// it does not depend on the probe type.
+#define STACK_RET -32
+
+// Without an entry program, the struct val_t that it would have stored. The
+// keys for filterFd and cgroupFd, also used when a return has no entry.
+#define STACK_VAL (STACK_RET - (int)sizeof(struct val_t))
+#define STACK_FILTER (STACK_VAL - (int)sizeof(struct filter_key_t))
+#define STACK_CGROUP (STACK_FILTER - 8)
+
+// In aggregation mode, the struct top_value_t and the struct top_key_t.
+#define STACK_TOP_VALUE (STACK_CGROUP - (int)sizeof(struct top_value_t))
+#define STACK_TOP_KEY (STACK_TOP_VALUE - (int)sizeof(struct top_key_t))
+
+// In histogram mode, the struct hist_key_t and the initial count of a new
+// bucket.
+#define STACK_HIST_KEY (STACK_CGROUP - (int)sizeof(struct hist_key_t))
+#define STACK_HIST_COUNT (STACK_HIST_KEY - 8)
+
+// Stack slots used by assemble_trace_entry().
+#define ENTRY_STACK_ID -8
+#define ENTRY_STACK_VAL (ENTRY_STACK_ID - (int)sizeof(struct val_t))
+#define ENTRY_STACK_FILTER \
+  (ENTRY_STACK_VAL - (int)sizeof(struct filter_key_t))
+#define ENTRY_STACK_CGROUP (ENTRY_STACK_FILTER - 8)
+#define ENTRY_STACK_ZERO (ENTRY_STACK_CGROUP - 8)
+
+// 64-bit FNV-1a parameters, for hashing paths in aggregation mode.
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// The values that relocate_program() fills in: where in ctx the filename and
+// the return value of the open are.
+enum program_slot {
+  SLOT_FNAME_OFFSET,
+  SLOT_RET_OFFSET,
+  NUM_PROGRAM_SLOTS,
+};
+
+/**
+ * Emits code that jumps to noMatch unless the comm in the struct val_t
+ * pointed to by r7 contains config->name, where r9 points to the config.
+ * Clobbers r1-r5.
+ *
+ * This is strstr() without a loop so that it also loads on kernels that
+ * predate bounded loops: comm is loaded into r4 (bytes 0-7) and r5 (bytes
+ * 8-15) and, for each start offset, the 16-byte window at that offset is
+ * compared with the pattern under name_mask. Bytes past the end of comm are
+ * shifted in as zeros, which never match a byte of the pattern.
+ */
+static void emitNameFilter(struct program *prog, struct label *noMatch) {
+  struct label match = {};
+  int commOffset = offsetof(struct val_t, comm);
+  int nameOffset = offsetof(struct config_t, name);
+  int maskOffset = offsetof(struct config_t, name_mask);
+
+  _Static_assert(TASK_COMM_LEN == 16, "emitNameFilter() assumes 16 bytes");
+
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_4, BPF_REG_7, commOffset));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_5, BPF_REG_7, commOffset + 8));
+  for (int start = 0; start < TASK_COMM_LEN; start++) {
+    int shift = 8 * (start % 8);
+    if (start < 8) {
+      // r1 = low word of the window.
+      emit(prog, BPF_MOV64_REG(BPF_REG_1, BPF_REG_4));
+      if (shift != 0) {
+        emit(prog, BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, shift));
+        emit(prog, BPF_MOV64_REG(BPF_REG_2, BPF_REG_5));
+        emit(prog, BPF_ALU64_IMM(BPF_LSH, BPF_REG_2, 64 - shift));
+        emit(prog, BPF_ALU64_REG(BPF_OR, BPF_REG_1, BPF_REG_2));
+      }
+      // r2 = high word of the window.
+      emit(prog, BPF_MOV64_REG(BPF_REG_2, BPF_REG_5));
+      if (shift != 0) {
+        emit(prog, BPF_ALU64_IMM(BPF_RSH, BPF_REG_2, shift));
+      }
+    } else {
+      // The high word of the window is all zeros.
+      emit(prog, BPF_MOV64_REG(BPF_REG_1, BPF_REG_5));
+      if (shift != 0) {
+        emit(prog, BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, shift));
+      }
+      emit(prog, BPF_MOV64_IMM(BPF_REG_2, 0));
+    }
+
+    // r1 = ((r1 ^ name[0]) & name_mask[0]) | ((r2 ^ name[1]) & name_mask[1])
+    emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_3, BPF_REG_9, nameOffset));
+    emit(prog, BPF_ALU64_REG(BPF_XOR, BPF_REG_1, BPF_REG_3));
+    emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_3, BPF_REG_9, maskOffset));
+    emit(prog, BPF_ALU64_REG(BPF_AND, BPF_REG_1, BPF_REG_3));
+    emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_3, BPF_REG_9, nameOffset + 8));
+    emit(prog, BPF_ALU64_REG(BPF_XOR, BPF_REG_2, BPF_REG_3));
+    emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_3, BPF_REG_9, maskOffset + 8));
+    emit(prog, BPF_ALU64_REG(BPF_AND, BPF_REG_2, BPF_REG_3));
+    emit(prog, BPF_ALU64_REG(BPF_OR, BPF_REG_1, BPF_REG_2));
+    emitJump(prog, &match, BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0));
+  }
+  emitJump(prog, noMatch, BPF_JMP_IMM(BPF_JA, 0, 0, 0));
+  bindLabel(prog, &match);
+}
+
+/**
+ * Emits code that loads the time since entry to do_sys_open() into dst, where
+ * r7 points to the struct val_t and the return time is at STACK_TS. Clobbers
+ * tmp.
+ */
+static void emitLoadLatency(struct program *prog, int dst, int tmp) {
+  emit(prog, BPF_LDX_MEM(BPF_DW, dst, BPF_REG_10, STACK_TS));
+  emit(prog, BPF_LDX_MEM(BPF_DW, tmp, BPF_REG_7, offsetof(struct val_t, ts)));
+  emit(prog, BPF_ALU64_REG(BPF_SUB, dst, tmp));
+}
+
+/** Emits code that copies valp->comm to the stack at dst. Clobbers r1. */
+static void emitStoreComm(struct program *prog, int dst) {
+  for (int i = 0; i < TASK_COMM_LEN; i += 8) {
+    emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_7,
+                           offsetof(struct val_t, comm) + i));
+    emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, dst + i));
+  }
+}
+
+/**
+ * Emits code that stores the negated return value if the open failed, or
+ * otherwise 0, as an int on the stack at dst. Clobbers r1.
+ */
+static void emitStoreErr(struct program *prog, int dst) {
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_RET));
+  emit(prog, BPF_JMP_IMM(BPF_JSLT, BPF_REG_1, 0, 1));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_1, 0));
+  emit(prog, BPF_ALU64_IMM(BPF_NEG, BPF_REG_1, 0));
+  emit(prog, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, dst));
+}
+
+/**
+ * Emits code that fills in the struct event_t pointed to by r8, where r6 is
+ * ctx and r7 points to the struct val_t, and leaves the number of bytes of
+ * the event to submit in r0. Clobbers r1-r5.
+ *
+ * Only the fields are written: the event is in a per-CPU scratch map rather
+ * than on the stack, so the verifier does not need the rest of it zeroed.
+ * comm is copied 4 bytes at a time rather than with bpf_probe_read() because
+ * the source is map memory, which can be loaded directly.
+ */
+static void emitFillEvent(struct program *prog, int readFunc, int fnameMax) {
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_7,
+                         offsetof(struct val_t, id)));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_8, BPF_REG_1,
+                         offsetof(struct event_t, id)));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_TS));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_8, BPF_REG_1,
+                         offsetof(struct event_t, ts)));
+  emitLoadLatency(prog, BPF_REG_1, BPF_REG_2);
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_8, BPF_REG_1,
+                         offsetof(struct event_t, latency)));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_RET));
+  emit(prog, BPF_STX_MEM(BPF_W, BPF_REG_8, BPF_REG_1,
+                         offsetof(struct event_t, ret)));
+  emit(prog, BPF_ST_MEM(BPF_H, BPF_REG_8, offsetof(struct event_t, version),
+                        EVENT_VERSION));
+  for (int i = 0; i < TASK_COMM_LEN; i += 4) {
+    emit(prog, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7,
+                           offsetof(struct val_t, comm) + i));
+    emit(prog, BPF_STX_MEM(BPF_W, BPF_REG_8, BPF_REG_1,
+                           offsetof(struct event_t, comm) + i));
+  }
+
+  // r0 = readFunc(&event->fname, fnameMax, valp->fname)
+  emit(prog, BPF_MOV64_REG(BPF_REG_1, BPF_REG_8));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1,
+                           offsetof(struct event_t, fname)));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_2, fnameMax));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_3, BPF_REG_7,
+                         offsetof(struct val_t, fname)));
+  emitCall(prog, readFunc);
+
+  // Clamp r0 to [0, fnameMax] so that a failed read submits no path and the
+  // verifier can bound the size passed to the output helper.
+  emit(prog, BPF_JMP_IMM(BPF_JSGT, BPF_REG_0, fnameMax, 1));
+  emit(prog, BPF_JMP_IMM(BPF_JSGE, BPF_REG_0, 0, 1));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_0, 0));
+  emit(prog, BPF_STX_MEM(BPF_H, BPF_REG_8, BPF_REG_0,
+                         offsetof(struct event_t, fname_len)));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_0, sizeof(struct event_t)));
+}
+
+/**
+ * Given the result of the output helper in r0, increments
+ * stats->submitted and, if the helper failed, stats->dropped.
+ * Clobbers r7, which must no longer be needed.
+ */
+static void emitCountSubmission(struct program *prog, int statsFd) {
+  struct label done = {};
+  emit(prog, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+
+  // r0 = stats.lookup(&zero)
+  emitLoadMapFd(prog, BPF_REG_1, statsFd);
+  emitStackAddr(prog, BPF_REG_2, STACK_ZERO);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+
+  // The map is per-CPU, so nothing else can be updating these counters.
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_0,
+                         offsetof(struct stats_t, submitted)));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, 1));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1,
+                         offsetof(struct stats_t, submitted)));
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JSGE, BPF_REG_7, 0, 0));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_0,
+                         offsetof(struct stats_t, dropped)));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, 1));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1,
+                         offsetof(struct stats_t, dropped)));
+  bindLabel(prog, &done);
+}
+
+/**
+ * Emits code that increments the counter at offset in this CPU's struct
+ * stats_t, where the int at zero on the stack is 0. Clobbers r0-r5.
+ */
+static void emitIncrementStat(struct program *prog, int statsFd, int zero,
+                              int offset) {
+  struct label done = {};
+  emitLoadMapFd(prog, BPF_REG_1, statsFd);
+  emitStackAddr(prog, BPF_REG_2, zero);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_0, offset));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, 1));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1, offset));
+  bindLabel(prog, &done);
+}
+
+/**
+ * Emits code that adds the open described by r6 (ctx) and r7 (struct val_t)
+ * to the BPF_HASH topFd, and leaves 0 in r0 if it was counted. Clobbers
+ * r1-r5.
+ *
+ * Like the strings in emitNameFilter(), the path is hashed without a loop:
+ * it is read into a zeroed buffer and then folded in 8 bytes at a time,
+ * stopping at the first all-zero word, which can only come after the NUL.
+ */
+static void emitAggregate(struct program *prog, int topFd) {
+  int key = STACK_TOP_KEY, value = STACK_TOP_VALUE;
+  int fname = value + offsetof(struct top_value_t, fname);
+  int fnameSize = sizeof(((struct top_value_t *)0)->fname);
+  _Static_assert(sizeof(((struct top_value_t *)0)->fname) % 8 == 0,
+                 "emitAggregate() hashes whole words");
+
+  for (int i = 0; i < fnameSize; i += 8) {
+    emit(prog, BPF_ST_MEM(BPF_DW, BPF_REG_10, fname + i, 0));
+  }
+  // bpf_probe_read_str(value.fname, sizeof(value.fname), valp->fname)
+  emitStackAddr(prog, BPF_REG_1, fname);
+  emit(prog, BPF_MOV64_IMM(BPF_REG_2, fnameSize));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_3, BPF_REG_7,
+                         offsetof(struct val_t, fname)));
+  emitCall(prog, BPF_FUNC_probe_read_str);
+
+  // key.comm = valp->comm
+  emitStoreComm(prog, key + offsetof(struct top_key_t, comm));
+  // key.err = ret < 0 ? -ret : 0
+  emitStoreErr(prog, key + offsetof(struct top_key_t, err));
+  emit(prog, BPF_ST_MEM(BPF_W, BPF_REG_10,
+                        key + offsetof(struct top_key_t, pad), 0));
+
+  // key.fname_hash = FNV-1a over the words of value.fname
+  struct label hashed = {};
+  emitLoadImm64(prog, BPF_REG_4, FNV_OFFSET_BASIS);
+  emitLoadImm64(prog, BPF_REG_5, FNV_PRIME);
+  for (int i = 0; i < fnameSize; i += 8) {
+    emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, fname + i));
+    emitJump(prog, &hashed, BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0));
+    emit(prog, BPF_ALU64_REG(BPF_XOR, BPF_REG_4, BPF_REG_1));
+    emit(prog, BPF_ALU64_REG(BPF_MUL, BPF_REG_4, BPF_REG_5));
+  }
+  bindLabel(prog, &hashed);
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_4,
+                         key + offsetof(struct top_key_t, fname_hash)));
+
+  // r0 = top.lookup(&key)
+  struct label found = {}, done = {};
+  emitLoadMapFd(prog, BPF_REG_1, topFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &found, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+
+  // r0 = top.update(&key, &value, BPF_NOEXIST), which fails if the map is
+  // full or another CPU inserted the same key in the meantime. In the latter
+  // case, look the key up again and count the open in that CPU's entry.
+  emit(prog, BPF_ST_MEM(BPF_DW, BPF_REG_10,
+                        value + offsetof(struct top_value_t, count), 1));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_TS));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1,
+                         value + offsetof(struct top_value_t, last_ts)));
+  emitLoadMapFd(prog, BPF_REG_1, topFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitStackAddr(prog, BPF_REG_3, value);
+  emit(prog, BPF_MOV64_IMM(BPF_REG_4, BPF_NOEXIST));
+  emitCall(prog, BPF_FUNC_map_update_elem);
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, -EEXIST, 0));
+  emitLoadMapFd(prog, BPF_REG_1, topFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &found, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_0, -ENOENT));
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JA, 0, 0, 0));
+
+  // The map is shared by all CPUs, so the count needs an atomic add, but
+  // last_ts is allowed to race.
+  bindLabel(prog, &found);
+  emit(prog, BPF_MOV64_IMM(BPF_REG_1, 1));
+  emit(prog, BPF_RAW_INSN(BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_1,
+                          offsetof(struct top_value_t, count), 0));
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_TS));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1,
+                         offsetof(struct top_value_t, last_ts)));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_0, 0));
+  bindLabel(prog, &done);
+}
+
+/**
+ * Emits code that adds the latency of the open described by r6 (ctx) and r7
+ * (struct val_t) to the histograms in the BPF_MAP_TYPE_PERCPU_HASH histFd,
+ * and leaves 0 in r0 if it was counted. Clobbers r1-r5.
+ */
+static void emitHistogram(struct program *prog, int histFd,
+                          enum hist_by histBy) {
+  int key = STACK_HIST_KEY;
+
+  // r2 = floor(log2(latency)) + 1, or 0 if latency is 0, by binary search.
+  emitLoadLatency(prog, BPF_REG_1, BPF_REG_2);
+  emit(prog, BPF_MOV64_IMM(BPF_REG_2, 0));
+  for (int shift = 32; shift > 0; shift /= 2) {
+    emit(prog, BPF_MOV64_REG(BPF_REG_3, BPF_REG_1));
+    emit(prog, BPF_ALU64_IMM(BPF_RSH, BPF_REG_3, shift));
+    emit(prog, BPF_JMP_IMM(BPF_JEQ, BPF_REG_3, 0, 2));
+    emit(prog, BPF_MOV64_REG(BPF_REG_1, BPF_REG_3));
+    emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, shift));
+  }
+  // r1 is now 1 unless latency was 0.
+  emit(prog, BPF_ALU64_REG(BPF_ADD, BPF_REG_2, BPF_REG_1));
+  emit(prog, BPF_JMP_IMM(BPF_JLE, BPF_REG_2, HIST_NUM_SLOTS - 1, 1));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_2, HIST_NUM_SLOTS - 1));
+  emit(prog, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_2,
+                         key + offsetof(struct hist_key_t, slot)));
+
+  int comm = key + offsetof(struct hist_key_t, comm);
+  int err = key + offsetof(struct hist_key_t, err);
+  if (histBy == HIST_BY_COMM) {
+    emitStoreComm(prog, comm);
+  } else {
+    emit(prog, BPF_ST_MEM(BPF_DW, BPF_REG_10, comm, 0));
+    emit(prog, BPF_ST_MEM(BPF_DW, BPF_REG_10, comm + 8, 0));
+  }
+  if (histBy == HIST_BY_ERRNO) {
+    emitStoreErr(prog, err);
+  } else {
+    emit(prog, BPF_ST_MEM(BPF_W, BPF_REG_10, err, 0));
+  }
+
+  // r0 = hist.lookup(&key)
+  struct label found = {}, done = {};
+  emitLoadMapFd(prog, BPF_REG_1, histFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &found, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+
+  // r0 = hist.update(&key, &one, BPF_NOEXIST), which sets this CPU's count
+  // and zeroes the others. As in emitAggregate(), if another CPU inserted
+  // the same bucket in the meantime, look it up again and count the open
+  // there. Only a full map drops it.
+  emit(prog, BPF_ST_MEM(BPF_DW, BPF_REG_10, STACK_HIST_COUNT, 1));
+  emitLoadMapFd(prog, BPF_REG_1, histFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitStackAddr(prog, BPF_REG_3, STACK_HIST_COUNT);
+  emit(prog, BPF_MOV64_IMM(BPF_REG_4, BPF_NOEXIST));
+  emitCall(prog, BPF_FUNC_map_update_elem);
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, -EEXIST, 0));
+  emitLoadMapFd(prog, BPF_REG_1, histFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &found, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_0, -ENOENT));
+  emitJump(prog, &done, BPF_JMP_IMM(BPF_JA, 0, 0, 0));
+
+  // The value is this CPU's, so no atomic add is needed.
+  bindLabel(prog, &found);
+  emit(prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_0, 0));
+  emit(prog, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, 1));
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1, 0));
+  emit(prog, BPF_MOV64_IMM(BPF_REG_0, 0));
+  bindLabel(prog, &done);
+}
+
+/**
+ * Emits code that copies the event to userspace through params->eventsFd,
+ * where r6 is ctx and r7 points to the struct val_t, and leaves the result of
+ * the output helper in r0. Jumps to deleteEntry if there is nowhere to build
+ * the event. Clobbers r1-r5 and r8.
+ */
+static void emitSubmit(struct program *prog,
+                       const struct trace_return_params *params,
+                       struct label *deleteEntry) {
+  // r8 = scratch.lookup(&zero)
+  emitLoadMapFd(prog, BPF_REG_1, params->scratchFd);
+  emitStackAddr(prog, BPF_REG_2, STACK_ZERO);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emit(prog, BPF_MOV64_REG(BPF_REG_8, BPF_REG_0));
+  emitJump(prog, deleteEntry, BPF_JMP_IMM(BPF_JEQ, BPF_REG_8, 0, 0));
+
+  int readFunc = params->useRingbuf ? BPF_FUNC_probe_read_user_str
+                                    : BPF_FUNC_probe_read_str;
+  emitFillEvent(prog, readFunc, params->fnameMax);
+
+  if (params->useRingbuf) {
+    // bpf_ringbuf_output(&events, event, r0, 0)
+    emit(prog, BPF_MOV64_REG(BPF_REG_3, BPF_REG_0));
+    emitLoadMapFd(prog, BPF_REG_1, params->eventsFd);
+    emit(prog, BPF_MOV64_REG(BPF_REG_2, BPF_REG_8));
+    emit(prog, BPF_MOV64_IMM(BPF_REG_4, 0));
+    emitCall(prog, BPF_FUNC_ringbuf_output);
+  } else {
+    // bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, event, r0)
+    emit(prog, BPF_MOV64_REG(BPF_REG_5, BPF_REG_0));
+    emit(prog, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+    emitLoadMapFd(prog, BPF_REG_2, params->eventsFd);
+    emit(prog, BPF_MOV32_IMM(BPF_REG_3, CURRENT_CPU));
+    emit(prog, BPF_MOV64_REG(BPF_REG_4, BPF_REG_8));
+    emitCall(prog, BPF_FUNC_perf_event_output);
+  }
+}
+
+/**
+ * Emits code that jumps to notFound unless the PID or the TID of id, in r7,
+ * is in the BPF_HASH filterFd, using the stack at key for the
+ * struct filter_key_t. Clobbers r0-r5.
+ */
+static void emitFilterLookup(struct program *prog, int filterFd, int key,
+                             struct label *notFound) {
+  struct label found = {};
+
+  // PID is the higher part and TID the lower part of id.
+  // if (filter.lookup(&{id >> 32, FILTER_PID})) goto found
+  emit(prog, BPF_MOV64_REG(BPF_REG_1, BPF_REG_7));
+  emit(prog, BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, 32));
+  emit(prog, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1,
+                         key + offsetof(struct filter_key_t, id)));
+  emit(prog, BPF_ST_MEM(BPF_W, BPF_REG_10,
+                        key + offsetof(struct filter_key_t, type), FILTER_PID));
+  emitLoadMapFd(prog, BPF_REG_1, filterFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, &found, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+
+  // if (!filter.lookup(&{(u32)id, FILTER_TID})) goto notFound
+  emit(prog, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_7,
+                         key + offsetof(struct filter_key_t, id)));
+  emit(prog, BPF_ST_MEM(BPF_W, BPF_REG_10,
+                        key + offsetof(struct filter_key_t, type), FILTER_TID));
+  emitLoadMapFd(prog, BPF_REG_1, filterFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, notFound, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+  bindLabel(prog, &found);
+}
+
+/**
+ * Emits code that jumps to notFound unless the current task's cgroup is in
+ * the BPF_HASH cgroupFd, using the stack at key for the id. Clobbers r0-r5.
+ */
+static void emitCgroupCheck(struct program *prog, int cgroupFd, int key,
+                            struct label *notFound) {
+  emitCall(prog, BPF_FUNC_get_current_cgroup_id);
+  emit(prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0, key));
+  emitLoadMapFd(prog, BPF_REG_1, cgroupFd);
+  emitStackAddr(prog, BPF_REG_2, key);
+  emitCall(prog, BPF_FUNC_map_lookup_elem);
+  emitJump(prog, notFound, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+}
+
+int assemble_trace_entry(struct bpf_insn instructions[],
+                         const struct trace_entry_params *params,
+                         struct relocs *relocs) {
+  struct program prog = {.insns = instructions,
+                         .capacity = MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS,
+                         .relocs = relocs};
+  struct label exit = {};
+  int val = ENTRY_STACK_VAL;
+
+  // r6 = ctx
+  emit(&prog, BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+
+  // if (!cgroups.lookup(bpf_get_current_cgroup_id())) return 0
+  if (params->cgroupFd != -1) {
+    emitCgroupCheck(&prog, params->cgroupFd, ENTRY_STACK_CGROUP, &exit);
+  }
+
+  // r7 = id
+  emitCall(&prog, BPF_FUNC_get_current_pid_tgid);
+  emit(&prog, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+
+  if (params->filterFd != -1) {
+    emitFilterLookup(&prog, params->filterFd, ENTRY_STACK_FILTER, &exit);
+  }
+
+  // if (bpf_get_current_comm(&val.comm, sizeof(val.comm)) != 0) return 0
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_7, ENTRY_STACK_ID));
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_7,
+                          val + offsetof(struct val_t, id)));
+  emitStackAddr(&prog, BPF_REG_1, val + offsetof(struct val_t, comm));
+  emit(&prog, BPF_MOV64_IMM(BPF_REG_2, TASK_COMM_LEN));
+  emitCall(&prog, BPF_FUNC_get_current_comm);
+  emitJump(&prog, &exit, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+
+  // val.fname = filename
+  emitReloc(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_6, 0),
+            SLOT_FNAME_OFFSET);
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1,
+                          val + offsetof(struct val_t, fname)));
+
+  // Read the clock as late as possible so that the latency does not include
+  // this program.
+  emitCall(&prog, BPF_FUNC_ktime_get_ns);
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0,
+                          val + offsetof(struct val_t, ts)));
+
+  // if (infotmp.update(&id, &val, BPF_NOEXIST) == 0) return 0
+  struct label failed = {};
+  emit(&prog, BPF_ST_MEM(BPF_W, BPF_REG_10, ENTRY_STACK_ZERO, 0));
+  for (int flags = BPF_NOEXIST;; flags = BPF_ANY) {
+    emitLoadMapFd(&prog, BPF_REG_1, params->infotmpFd);
+    emitStackAddr(&prog, BPF_REG_2, ENTRY_STACK_ID);
+    emitStackAddr(&prog, BPF_REG_3, val);
+    emit(&prog, BPF_MOV64_IMM(BPF_REG_4, flags));
+    emitCall(&prog, BPF_FUNC_map_update_elem);
+    emitJump(&prog, &exit, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+    if (flags == BPF_ANY) {
+      break;
+    }
+
+    // This thread's previous open never reached the return program, so
+    // count its entry as stale and replace it with BPF_ANY.
+    emitJump(&prog, &failed, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, -EEXIST, 0));
+    emitIncrementStat(&prog, params->statsFd, ENTRY_STACK_ZERO,
+                      offsetof(struct stats_t, stale_entries));
+  }
+  bindLabel(&prog, &failed);
+  emitIncrementStat(&prog, params->statsFd, ENTRY_STACK_ZERO,
+                    offsetof(struct stats_t, failed_updates));
+
+  // return 0
+  bindLabel(&prog, &exit);
+  emit(&prog, BPF_MOV64_IMM(BPF_REG_0, 0));
+  emit(&prog, BPF_EXIT_INSN());
+
+  return programLength(&prog);
+}
+
+int assemble_trace_return(struct bpf_insn instructions[],
+                          const struct trace_return_params *params,
+                          struct relocs *relocs) {
+  struct program prog = {.insns = instructions,
+                         .capacity = MAX_NUM_TRACE_RETURN_INSTRUCTIONS,
+                         .relocs = relocs};
+  int hasEntry = params->infotmpFd != -1;
+  struct label deleteEntry = {}, exit = {}, missedEntry = {};
+
+  // r6 = ctx, id, ts and the return value are saved on the stack.
+  emit(&prog, BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  emitReloc(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_6, 0),
+            SLOT_RET_OFFSET);
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, STACK_RET));
+  emitCall(&prog, BPF_FUNC_get_current_pid_tgid);
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0, STACK_ID));
+  emitCall(&prog, BPF_FUNC_ktime_get_ns);
+  emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0, STACK_TS));
+
+  // r9 = config.lookup(&zero)
+  emit(&prog, BPF_ST_MEM(BPF_W, BPF_REG_10, STACK_ZERO, 0));
+  emitLoadMapFd(&prog, BPF_REG_1, params->configFd);
+  emitStackAddr(&prog, BPF_REG_2, STACK_ZERO);
+  emitCall(&prog, BPF_FUNC_map_lookup_elem);
+  emit(&prog, BPF_MOV64_REG(BPF_REG_9, BPF_REG_0));
+  emitJump(&prog, &deleteEntry, BPF_JMP_IMM(BPF_JEQ, BPF_REG_9, 0, 0));
+
+  // -x: checked first because it does not need the infotmp entry.
+  // if (config->failed_only && ret >= 0) goto deleteEntry
+  emit(&prog, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_9,
+                          offsetof(struct config_t, failed_only)));
+  emit(&prog, BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 2));
+  emit(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_RET));
+  emitJump(&prog, &deleteEntry, BPF_JMP_IMM(BPF_JSGE, BPF_REG_1, 0, 0));
+
+  if (hasEntry) {
+    // r7 = infotmp.lookup(&id)
+    emitLoadMapFd(&prog, BPF_REG_1, params->infotmpFd);
+    emitStackAddr(&prog, BPF_REG_2, STACK_ID);
+    emitCall(&prog, BPF_FUNC_map_lookup_elem);
+    emit(&prog, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+    emitJump(&prog, &missedEntry, BPF_JMP_IMM(BPF_JEQ, BPF_REG_7, 0, 0));
+  } else {
+    // What the entry program would have done, after -x has had its chance
+    // to skip it.
+    if (params->cgroupFd != -1) {
+      emitCgroupCheck(&prog, params->cgroupFd, STACK_CGROUP, &exit);
+    }
+    emit(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_7, BPF_REG_10, STACK_ID));
+    if (params->filterFd != -1) {
+      emitFilterLookup(&prog, params->filterFd, STACK_FILTER, &exit);
+    }
+
+    // val = {id, comm, filename, ts}, with the return time for ts.
+    int val = STACK_VAL;
+    emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_7,
+                            val + offsetof(struct val_t, id)));
+    emitStackAddr(&prog, BPF_REG_1, val + offsetof(struct val_t, comm));
+    emit(&prog, BPF_MOV64_IMM(BPF_REG_2, TASK_COMM_LEN));
+    emitCall(&prog, BPF_FUNC_get_current_comm);
+    emitJump(&prog, &exit, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+    emitReloc(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_6, 0),
+              SLOT_FNAME_OFFSET);
+    emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1,
+                            val + offsetof(struct val_t, fname)));
+    emit(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, STACK_TS));
+    emit(&prog, BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1,
+                            val + offsetof(struct val_t, ts)));
+
+    // r7 = &val
+    emitStackAddr(&prog, BPF_REG_7, val);
+  }
+
+  // -n: if (config->has_name && !strstr(valp->comm, config->name))
+  //       goto deleteEntry
+  struct label submit = {};
+  emit(&prog, BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_9,
+                          offsetof(struct config_t, has_name)));
+  emitJump(&prog, &submit, BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0));
+  emitNameFilter(&prog, &deleteEntry);
+  bindLabel(&prog, &submit);
+
+  if (params->topFd != -1) {
+    emitAggregate(&prog, params->topFd);
+  } else if (params->histFd != -1) {
+    emitHistogram(&prog, params->histFd, params->histBy);
+  } else {
+    emitSubmit(&prog, params, &deleteEntry);
+  }
+  emitCountSubmission(&prog, params->statsFd);
+
+  // infotmp.delete(&id)
+  bindLabel(&prog, &deleteEntry);
+  if (hasEntry) {
+    emitLoadMapFd(&prog, BPF_REG_1, params->infotmpFd);
+    emitStackAddr(&prog, BPF_REG_2, STACK_ID);
+    emitCall(&prog, BPF_FUNC_map_delete_elem);
+  }
+
+  // return 0
+  bindLabel(&prog, &exit);
+  emit(&prog, BPF_MOV64_IMM(BPF_REG_0, 0));
+  emit(&prog, BPF_EXIT_INSN());
+
+  // Kept out of line because it is only taken when the entry program could
+  // not store an entry, it was evicted, or the entry program filtered the
+  // open out. The filters are applied again so that only the first two are
+  // counted.
+  if (hasEntry) {
+    struct label filteredOut = {};
+    bindLabel(&prog, &missedEntry);
+    if (params->cgroupFd != -1) {
+      emitCgroupCheck(&prog, params->cgroupFd, STACK_CGROUP, &filteredOut);
+    }
+    if (params->filterFd != -1) {
+      emit(&prog, BPF_LDX_MEM(BPF_DW, BPF_REG_7, BPF_REG_10, STACK_ID));
+      emitFilterLookup(&prog, params->filterFd, STACK_FILTER, &filteredOut);
+    }
+    emitIncrementStat(&prog, params->statsFd, STACK_ZERO,
+                      offsetof(struct stats_t, missed_entries));
+    bindLabel(&prog, &filteredOut);
+    emit(&prog, BPF_MOV64_IMM(BPF_REG_0, 0));
+    emit(&prog, BPF_EXIT_INSN());
+  }
+
+  return programLength(&prog);
+}
+
+void relocate_program(struct bpf_insn instructions[],
+                      const struct relocs *relocs, enum probe_type probeType,
+                      int numArgs) {
+  long long values[NUM_PROGRAM_SLOTS];
+  switch (probeType) {
+  case PROBE_KPROBE:
+    values[SLOT_FNAME_OFFSET] = PT_REGS_PARM2_OFFSET;
+    values[SLOT_RET_OFFSET] = PT_REGS_RC_OFFSET;
+    break;
+  case PROBE_SYSCALL_OPEN:
+    values[SLOT_FNAME_OFFSET] = TP_SYSCALL_ARG0_OFFSET;
+    values[SLOT_RET_OFFSET] = TP_SYSCALL_RET_OFFSET;
+    break;
+  case PROBE_SYSCALL_OPENAT:
+    values[SLOT_FNAME_OFFSET] = TP_SYSCALL_ARG1_OFFSET;
+    values[SLOT_RET_OFFSET] = TP_SYSCALL_RET_OFFSET;
+    break;
+  case PROBE_TRAMPOLINE:
+    values[SLOT_FNAME_OFFSET] = TRAMPOLINE_ARG1_OFFSET;
+    values[SLOT_RET_OFFSET] = 8 * numArgs;
+    break;
+  }
+  patchProgram(instructions, relocs, values);
+}
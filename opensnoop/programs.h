@@ -0,0 +1,150 @@
+/**
+ * The BPF programs that opensnoop loads, put together at run time with the
+ * assembler in bpf_asm.h so that building opensnoop needs nothing but a C
+ * compiler. The layout of the records they produce is defined by
+ * opensnoop.h.
+ */
+#pragma once
+
+#include "bpf_asm.h"
+#include <bcc/libbpf.h>
+
+// Upper bounds on what assemble_trace_entry() and assemble_trace_return()
+// write to instructions[].
+#define MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS 128
+#define MAX_NUM_TRACE_RETURN_INSTRUCTIONS 1024
+
+/**
+ * What the programs are attached to, which determines the layout of ctx.
+ * All of the syscalls:sys_exit_* tracepoints have the same layout, so any of
+ * the PROBE_SYSCALL_* values will do for the return program.
+ */
+enum probe_type {
+  // A kprobe or kretprobe on do_sys_open(), where ctx is struct pt_regs.
+  PROBE_KPROBE,
+  // syscalls:sys_enter_open, where the filename is the first argument.
+  PROBE_SYSCALL_OPEN,
+  // syscalls:sys_enter_openat or sys_enter_openat2, where the filename is
+  // the second argument.
+  PROBE_SYSCALL_OPENAT,
+  // fentry or fexit on do_sys_openat2() or do_sys_open(), where ctx is an
+  // array of the arguments as 64-bit words, followed by the return value
+  // for fexit. The filename is the second argument of both.
+  PROBE_TRAMPOLINE,
+};
+
+/** Maps and settings used by assemble_trace_entry(). */
+struct trace_entry_params {
+  // BPF_HASH or BPF_MAP_TYPE_LRU_HASH of struct val_t, keyed by pid_tgid.
+  int infotmpFd;
+  // If not -1, a BPF_HASH whose keys are struct filter_key_t, and only opens
+  // by the processes and threads in it are recorded.
+  int filterFd;
+  // If not -1, a BPF_HASH whose keys are cgroup ids (unsigned long long),
+  // and only opens by tasks directly in one of those cgroups are recorded.
+  // This is checked before anything else, so that opens outside them cost
+  // little more than bpf_get_current_cgroup_id() (Linux 4.18+).
+  int cgroupFd;
+  // BPF_MAP_TYPE_PERCPU_ARRAY holding a single struct stats_t, in which
+  // failed and stale infotmp entries are counted.
+  int statsFd;
+};
+
+/**
+ * The entry program, which stores a struct val_t in params->infotmpFd with
+ * the time of entry in val_t.ts, so that the return program can compute the
+ * latency of each open. -p and -t are a set in params->filterFd, so one
+ * program serves any number of targets and the set can change without
+ * reloading it.
+ *
+ * The offsets of the arguments in ctx are left in relocs, to be filled in
+ * by relocate_program() before the program is loaded.
+ *
+ * Returns the number of instructions written, or -1 with errno set to E2BIG
+ * if more than MAX_NUM_ASSEMBLED_ENTRY_INSTRUCTIONS were needed.
+ */
+int assemble_trace_entry(struct bpf_insn instructions[],
+                         const struct trace_entry_params *params,
+                         struct relocs *relocs);
+
+/** How --hist splits its histograms. */
+enum hist_by {
+  HIST_BY_NONE,
+  HIST_BY_COMM,
+  HIST_BY_ERRNO,
+};
+
+/** Maps and settings used by assemble_trace_return(). */
+struct trace_return_params {
+  // BPF_HASH or BPF_MAP_TYPE_LRU_HASH of struct val_t written by the entry
+  // program. If -1, which is only possible with PROBE_TRAMPOLINE, there is
+  // no entry program: the return program reads the filename from the
+  // arguments itself and applies filterFd and cgroupFd, and latency is 0.
+  int infotmpFd;
+  // As in struct trace_entry_params. With infotmpFd, the entry program has
+  // already applied them, so they are only checked for returns with no
+  // entry, which are not counted as missed if they were filtered out.
+  int filterFd;
+  int cgroupFd;
+  // BPF_MAP_TYPE_RINGBUF if useRingbuf is nonzero, otherwise
+  // BPF_MAP_TYPE_PERF_EVENT_ARRAY.
+  int eventsFd;
+  // BPF_ARRAY holding a single struct config_t.
+  int configFd;
+  // BPF_MAP_TYPE_PERCPU_ARRAY with one value of
+  // sizeof(struct event_t) + fnameMax bytes, in which the event is built.
+  int scratchFd;
+  // BPF_MAP_TYPE_PERCPU_ARRAY holding a single struct stats_t, in which
+  // submitted, dropped and missed events are counted.
+  int statsFd;
+  // If not -1, a BPF_HASH from struct top_key_t to struct top_value_t that
+  // is updated instead of submitting events, in which case eventsFd,
+  // scratchFd, useRingbuf and fnameMax are ignored.
+  int topFd;
+  // If not -1, a BPF_MAP_TYPE_PERCPU_HASH from struct hist_key_t to a count
+  // that is updated instead of submitting events, like topFd.
+  int histFd;
+  enum hist_by histBy;
+  int useRingbuf;
+  // Maximum number of bytes of the path to read, including the NUL.
+  int fnameMax;
+};
+
+/**
+ * The return program, which applies the struct config_t in
+ * params->configFd before anything is copied to userspace, so that events
+ * rejected by -x or -n cost neither a perf/ring buffer slot nor a wakeup.
+ *
+ * Events are submitted as variable-length struct event_t records, with
+ * bpf_ringbuf_output() (Linux 5.8+) or bpf_perf_event_output() depending on
+ * params->useRingbuf. (bpf_ringbuf_reserve() only accepts a constant size, so
+ * it cannot be used for variable-length records.) Each submission, and
+ * whether the helper dropped it, is counted in params->statsFd.
+ *
+ * In aggregation mode (params->topFd), each open instead increments a counter
+ * keyed by comm, path and errno, and an entry the full map cannot accept is
+ * counted as dropped. Histogram mode (params->histFd) is the same, except
+ * that the counter is for the log2 bucket of the latency.
+ *
+ * As with assemble_trace_entry(), relocate_program() must be called before
+ * the program is loaded.
+ *
+ * Returns the number of instructions written, or -1 with errno set to E2BIG
+ * if more than MAX_NUM_TRACE_RETURN_INSTRUCTIONS were needed.
+ */
+int assemble_trace_return(struct bpf_insn instructions[],
+                          const struct trace_return_params *params,
+                          struct relocs *relocs);
+
+/**
+ * Fills in the parts of a program from assemble_trace_entry() or
+ * assemble_trace_return() that depend on what it is attached to, using the
+ * relocations that the assembler recorded. numArgs is the number of
+ * arguments of the traced function, and only used for PROBE_TRAMPOLINE.
+ *
+ * This can be called again on the same instructions to attach them to
+ * something else, so each program is only assembled once.
+ */
+void relocate_program(struct bpf_insn instructions[],
+                      const struct relocs *relocs, enum probe_type probeType,
+                      int numArgs);
@@ -0,0 +1,145 @@
+#include "ringbuf.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// These mirror BPF_RINGBUF_BUSY_BIT, BPF_RINGBUF_DISCARD_BIT and
+// BPF_RINGBUF_HDR_SZ from <linux/bpf.h>, which older headers do not have.
+#define RINGBUF_BUSY_BIT (1U << 31)
+#define RINGBUF_DISCARD_BIT (1U << 30)
+#define RINGBUF_HDR_SIZE 8
+
+struct ringbuf_reader {
+  perf_reader_raw_cb raw_cb;
+  void *cb_cookie;
+  int epollFd;
+  size_t pageSize;
+  // dataSize is a power of 2, so (dataSize - 1) masks a position into data.
+  size_t dataSize;
+  // The first page is the consumer position, which we own and write.
+  unsigned long *consumerPos;
+  // The second page is the producer position, followed by the data area,
+  // which the kernel maps twice in a row so that a record that wraps around
+  // the end of the ring can still be read as one contiguous chunk.
+  unsigned long *producerPos;
+  unsigned char *data;
+};
+
+struct ringbuf_reader *ringbuf_reader_new(int mapFd, size_t dataSize,
+                                          perf_reader_raw_cb raw_cb,
+                                          void *cb_cookie) {
+  struct ringbuf_reader *reader = calloc(1, sizeof(struct ringbuf_reader));
+  if (reader == NULL) {
+    return NULL;
+  }
+
+  reader->raw_cb = raw_cb;
+  reader->cb_cookie = cb_cookie;
+  reader->epollFd = -1;
+  reader->pageSize = sysconf(_SC_PAGESIZE);
+  reader->dataSize = dataSize;
+
+  void *consumer = mmap(NULL, reader->pageSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, mapFd, 0);
+  if (consumer == MAP_FAILED) {
+    goto error;
+  }
+  reader->consumerPos = consumer;
+
+  // The kernel only allows the producer page and the data to be mapped
+  // read-only.
+  void *producer = mmap(NULL, reader->pageSize + 2 * dataSize, PROT_READ,
+                        MAP_SHARED, mapFd, reader->pageSize);
+  if (producer == MAP_FAILED) {
+    goto error;
+  }
+  reader->producerPos = producer;
+  reader->data = (unsigned char *)producer + reader->pageSize;
+
+  reader->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (reader->epollFd < 0) {
+    goto error;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN};
+  if (epoll_ctl(reader->epollFd, EPOLL_CTL_ADD, mapFd, &event) < 0) {
+    goto error;
+  }
+
+  return reader;
+
+error:;
+  int savedErrno = errno;
+  ringbuf_reader_free(reader);
+  errno = savedErrno;
+  return NULL;
+}
+
+int ringbuf_reader_consume(struct ringbuf_reader *reader) {
+  int numConsumed = 0;
+  unsigned long consumerPos =
+      __atomic_load_n(reader->consumerPos, __ATOMIC_ACQUIRE);
+  while (1) {
+    unsigned long producerPos =
+        __atomic_load_n(reader->producerPos, __ATOMIC_ACQUIRE);
+    if (consumerPos >= producerPos) {
+      break;
+    }
+
+    while (consumerPos < producerPos) {
+      unsigned int *header =
+          (unsigned int *)(reader->data +
+                           (consumerPos & (reader->dataSize - 1)));
+      unsigned int len = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+      if (len & RINGBUF_BUSY_BIT) {
+        // The producer has reserved this record but not submitted it yet.
+        // Records are committed in order, so nothing after it is ready.
+        goto done;
+      }
+
+      unsigned int sampleSize = len & ~RINGBUF_DISCARD_BIT;
+      consumerPos += (RINGBUF_HDR_SIZE + sampleSize + 7) & ~7UL;
+      if ((len & RINGBUF_DISCARD_BIT) == 0) {
+        reader->raw_cb(reader->cb_cookie,
+                       (unsigned char *)header + RINGBUF_HDR_SIZE, sampleSize);
+        numConsumed++;
+      }
+
+      // Hand the space back to the producer as soon as the record has been
+      // processed so that a slow callback does not cause drops.
+      __atomic_store_n(reader->consumerPos, consumerPos, __ATOMIC_RELEASE);
+    }
+  }
+
+done:
+  return numConsumed;
+}
+
+int ringbuf_reader_poll(struct ringbuf_reader *reader, int timeout) {
+  struct epoll_event event;
+  int rc = epoll_wait(reader->epollFd, &event, 1, timeout);
+  if (rc < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  return ringbuf_reader_consume(reader);
+}
+
+void ringbuf_reader_free(struct ringbuf_reader *reader) {
+  if (reader == NULL) {
+    return;
+  }
+
+  if (reader->epollFd >= 0) {
+    close(reader->epollFd);
+  }
+  if (reader->producerPos != NULL) {
+    munmap(reader->producerPos, reader->pageSize + 2 * reader->dataSize);
+  }
+  if (reader->consumerPos != NULL) {
+    munmap(reader->consumerPos, reader->pageSize);
+  }
+  free(reader);
+}
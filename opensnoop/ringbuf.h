@@ -0,0 +1,35 @@
+/**
+ * Minimal consumer for BPF_MAP_TYPE_RINGBUF maps.
+ *
+ * Unlike the perf buffers from bcc, which are one mmap'd ring per CPU, a BPF
+ * ring buffer is a single ring shared by all CPUs, so events come out in the
+ * order in which they were reserved. The API intentionally mirrors the
+ * perf_reader_*() functions from <bcc/perf_reader.h> so that opensnoop.c can
+ * use either transport with the same callback.
+ */
+#pragma once
+
+#include <bcc/libbpf.h>
+#include <stddef.h>
+
+struct ringbuf_reader;
+
+/**
+ * mmaps the ring buffer identified by mapFd, whose max_entries was dataSize.
+ * Returns NULL and sets errno on failure.
+ */
+struct ringbuf_reader *ringbuf_reader_new(int mapFd, size_t dataSize,
+                                          perf_reader_raw_cb raw_cb,
+                                          void *cb_cookie);
+
+/**
+ * Waits up to timeout milliseconds (-1 to wait forever) for the ring buffer
+ * to become readable and then invokes raw_cb for every committed record.
+ * Returns the number of records consumed or -1 on error.
+ */
+int ringbuf_reader_poll(struct ringbuf_reader *reader, int timeout);
+
+/** Consumes all committed records without waiting. */
+int ringbuf_reader_consume(struct ringbuf_reader *reader);
+
+void ringbuf_reader_free(struct ringbuf_reader *reader);
@@ -0,0 +1,208 @@
+#include "stats.h"
+#include <bcc/libbpf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NANOS_PER_MILLI 1000000LL
+
+/** Grows the per-CPU arrays to hold numCpus CPUs, zeroing the new ones. */
+static int growTo(struct loss_stats *stats, int numCpus) {
+  if (numCpus <= stats->numCpus) {
+    return 0;
+  }
+
+  unsigned long long *lostByCallback = realloc(
+      stats->lostByCallback, numCpus * sizeof(unsigned long long));
+  if (lostByCallback != NULL) {
+    stats->lostByCallback = lostByCallback;
+  }
+  struct cpu_stats *current =
+      realloc(stats->current, numCpus * sizeof(struct cpu_stats));
+  if (current != NULL) {
+    stats->current = current;
+  }
+  struct cpu_stats *reported =
+      realloc(stats->reported, numCpus * sizeof(struct cpu_stats));
+  if (reported != NULL) {
+    stats->reported = reported;
+  }
+  struct stats_t *values =
+      realloc(stats->values, numCpus * sizeof(struct stats_t));
+  if (values != NULL) {
+    stats->values = values;
+  }
+  if (lostByCallback == NULL || current == NULL || reported == NULL ||
+      values == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  int numNew = numCpus - stats->numCpus;
+  memset(lostByCallback + stats->numCpus, 0,
+         numNew * sizeof(unsigned long long));
+  memset(current + stats->numCpus, 0, numNew * sizeof(struct cpu_stats));
+  memset(reported + stats->numCpus, 0, numNew * sizeof(struct cpu_stats));
+  stats->numCpus = numCpus;
+  return 0;
+}
+
+int loss_stats_init(struct loss_stats *stats, int numCpus, int statsMapFd,
+                    int intervalMs, long long nowNs) {
+  memset(stats, 0, sizeof(*stats));
+  stats->statsMapFd = statsMapFd;
+  stats->intervalNs = intervalMs * NANOS_PER_MILLI;
+  stats->lastReportNs = nowNs;
+  if (growTo(stats, numCpus) < 0) {
+    loss_stats_free(stats);
+    return -1;
+  }
+  return 0;
+}
+
+void loss_stats_free(struct loss_stats *stats) {
+  free(stats->lostByCallback);
+  free(stats->current);
+  free(stats->reported);
+  free(stats->values);
+  memset(stats, 0, sizeof(*stats));
+}
+
+void loss_stats_add_lost(struct loss_stats *stats, int cpu,
+                         unsigned long long lost) {
+  // With --threads, lost_cb runs on a drain thread while the main thread
+  // reads lostByCallback.
+  if (cpu >= 0 && cpu < stats->numCpus) {
+    __atomic_fetch_add(&stats->lostByCallback[cpu], lost, __ATOMIC_RELAXED);
+  }
+}
+
+int loss_stats_set(struct loss_stats *stats, int cpu,
+                   unsigned long long submitted, unsigned long long lost) {
+  // cpu comes from a capture file, so it may be anything.
+  if (cpu < 0 || cpu >= LOSS_STATS_MAX_CPUS) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (growTo(stats, cpu + 1) < 0) {
+    return -1;
+  }
+  stats->current[cpu].submitted = submitted;
+  stats->current[cpu].lost = lost;
+  return 0;
+}
+
+int loss_stats_refresh(struct loss_stats *stats) {
+  if (stats->statsMapFd < 0) {
+    return 0;
+  }
+
+  // A lookup in a per-CPU map copies out the value of every possible CPU.
+  int key = 0;
+  if (bpf_lookup_elem(stats->statsMapFd, &key, stats->values) < 0) {
+    return -1;
+  }
+  struct entry_stats entries = {};
+  for (int i = 0; i < stats->numCpus; i++) {
+    stats->current[i].submitted = stats->values[i].submitted;
+    stats->current[i].lost = stats->values[i].dropped;
+    entries.failedUpdates += stats->values[i].failed_updates;
+    entries.missedEntries += stats->values[i].missed_entries;
+    entries.staleEntries += stats->values[i].stale_entries;
+  }
+  entries.failedUpdates -= stats->ignoredEntries.failedUpdates;
+  entries.missedEntries -= stats->ignoredEntries.missedEntries;
+  entries.staleEntries -= stats->ignoredEntries.staleEntries;
+  stats->currentEntries = entries;
+  return 0;
+}
+
+int loss_stats_ignore_entries(struct loss_stats *stats) {
+  if (loss_stats_refresh(stats) < 0) {
+    return -1;
+  }
+  stats->ignoredEntries.failedUpdates += stats->currentEntries.failedUpdates;
+  stats->ignoredEntries.missedEntries += stats->currentEntries.missedEntries;
+  stats->ignoredEntries.staleEntries += stats->currentEntries.staleEntries;
+  memset(&stats->currentEntries, 0, sizeof(stats->currentEntries));
+  memset(&stats->reportedEntries, 0, sizeof(stats->reportedEntries));
+  return 0;
+}
+
+unsigned long long loss_stats_lost(const struct loss_stats *stats, int cpu) {
+  // Both sources count the same drops, but the kernel's count is ahead of
+  // lost_cb until the reader catches up, and lost_cb still works on kernels
+  // where bpf_perf_event_output() does not report failure.
+  unsigned long long lost = stats->current[cpu].lost;
+  unsigned long long lostByCallback =
+      __atomic_load_n(&stats->lostByCallback[cpu], __ATOMIC_RELAXED);
+  return lost > lostByCallback ? lost : lostByCallback;
+}
+
+void loss_stats_report(struct loss_stats *stats, FILE *out, long long nowNs,
+                       int final) {
+  unsigned long long submitted = 0, lost = 0;
+  for (int i = 0; i < stats->numCpus; i++) {
+    submitted += stats->current[i].submitted;
+    lost += loss_stats_lost(stats, i);
+    if (!final) {
+      submitted -= stats->reported[i].submitted;
+      lost -= stats->reported[i].lost;
+    }
+  }
+
+  if ((final && submitted != 0) || lost != 0) {
+    fprintf(out, "Lost %llu of %llu events (%.2f%%)", lost, submitted,
+            submitted == 0 ? 0.0 : 100.0 * lost / submitted);
+    if (!final) {
+      fprintf(out, " in the last %.1f s",
+              (nowNs - stats->lastReportNs) / 1e9);
+    }
+
+    const char *separator = ": ";
+    for (int i = 0; i < stats->numCpus; i++) {
+      unsigned long long cpuLost = loss_stats_lost(stats, i);
+      if (!final) {
+        cpuLost -= stats->reported[i].lost;
+      }
+      if (cpuLost != 0) {
+        fprintf(out, "%sCPU %d: %llu", separator, i, cpuLost);
+        separator = ", ";
+      }
+    }
+    fprintf(out, "\n");
+  }
+
+  struct entry_stats entries = stats->currentEntries;
+  if (!final) {
+    entries.failedUpdates -= stats->reportedEntries.failedUpdates;
+    entries.missedEntries -= stats->reportedEntries.missedEntries;
+    entries.staleEntries -= stats->reportedEntries.staleEntries;
+  }
+  if (entries.failedUpdates != 0 || entries.missedEntries != 0 ||
+      entries.staleEntries != 0) {
+    fprintf(out,
+            "Entries: %llu failed updates, %llu missed, %llu stale%s\n",
+            entries.failedUpdates, entries.missedEntries, entries.staleEntries,
+            final ? "" : " (since last report)");
+  }
+
+  stats->reportedEntries = stats->currentEntries;
+  for (int i = 0; i < stats->numCpus; i++) {
+    stats->reported[i].submitted = stats->current[i].submitted;
+    stats->reported[i].lost = loss_stats_lost(stats, i);
+  }
+  stats->lastReportNs = nowNs;
+}
+
+int loss_stats_timeout_ms(const struct loss_stats *stats, long long nowNs) {
+  if (stats->intervalNs == 0) {
+    return -1;
+  }
+
+  long long remainingNs = stats->lastReportNs + stats->intervalNs - nowNs;
+  if (remainingNs <= 0) {
+    return 0;
+  }
+  return (remainingNs + NANOS_PER_MILLI - 1) / NANOS_PER_MILLI;
+}
@@ -0,0 +1,109 @@
+/**
+ * Accounting of the events that the kernel produced but opensnoop never saw.
+ *
+ * Two sources are combined for each CPU: the struct stats_t counters kept by
+ * the return program, which know exactly how many events were submitted and
+ * how many the output helper dropped, and the lost_cb of each perf buffer,
+ * which reports drops as soon as the reader reaches them. The ring buffer
+ * has no equivalent of lost_cb, so there only the kernel counters are used.
+ *
+ * The same map also counts opens that never became events because the entry
+ * and return programs could not be matched up, which are reported in total
+ * rather than per CPU.
+ */
+#pragma once
+
+#include "opensnoop.h"
+#include <stdio.h>
+
+// Bound on the CPU ids that loss_stats_set() accepts, well above the largest
+// NR_CPUS that the kernel can be configured with.
+#define LOSS_STATS_MAX_CPUS (1 << 16)
+
+struct cpu_stats {
+  unsigned long long submitted;
+  unsigned long long lost;
+};
+
+/** Summed over all CPUs; see struct stats_t. */
+struct entry_stats {
+  unsigned long long failedUpdates;
+  unsigned long long missedEntries;
+  unsigned long long staleEntries;
+};
+
+struct loss_stats {
+  // Number of possible CPUs, which is the length of each array below and of
+  // the values of the per-CPU stats map.
+  int numCpus;
+  // BPF_MAP_TYPE_PERCPU_ARRAY of struct stats_t, or -1 when replaying a
+  // capture file.
+  int statsMapFd;
+  // Totals reported by lost_cb so far.
+  unsigned long long *lostByCallback;
+  // As of the last call to loss_stats_refresh().
+  struct cpu_stats *current;
+  struct entry_stats currentEntries;
+  // As of the last call to loss_stats_report().
+  struct cpu_stats *reported;
+  struct entry_stats reportedEntries;
+  // Counted before loss_stats_ignore_entries(), and left out of the above.
+  struct entry_stats ignoredEntries;
+  long long lastReportNs;
+  // 0 means only report on exit.
+  long long intervalNs;
+  // Scratch space for bpf_lookup_elem() on statsMapFd.
+  struct stats_t *values;
+};
+
+/**
+ * Returns 0 on success or -1 with errno set. intervalMs is how often
+ * loss_stats_timeout_ms() asks for a periodic report.
+ */
+int loss_stats_init(struct loss_stats *stats, int numCpus, int statsMapFd,
+                    int intervalMs, long long nowNs);
+
+void loss_stats_free(struct loss_stats *stats);
+
+/** Records lost events reported by the lost_cb of cpu's perf buffer. */
+void loss_stats_add_lost(struct loss_stats *stats, int cpu,
+                         unsigned long long lost);
+
+/**
+ * Sets the totals for cpu directly, as read back from a capture file, growing
+ * the arrays if cpu is beyond numCpus. Returns 0 on success or -1 with errno
+ * set, which is EINVAL if cpu is negative or not below LOSS_STATS_MAX_CPUS.
+ */
+int loss_stats_set(struct loss_stats *stats, int cpu,
+                   unsigned long long submitted, unsigned long long lost);
+
+/**
+ * Reads the per-CPU counters from statsMapFd into current. Returns 0 on
+ * success or -1 with errno set.
+ */
+int loss_stats_refresh(struct loss_stats *stats);
+
+/**
+ * Leaves the failed, missed and stale entries counted so far out of all
+ * future reports. Returns 0 on success or -1 with errno set.
+ */
+int loss_stats_ignore_entries(struct loss_stats *stats);
+
+/** Returns the total number of events lost on cpu so far. */
+unsigned long long loss_stats_lost(const struct loss_stats *stats, int cpu);
+
+/**
+ * Prints the events lost since the previous report (or in total, if final is
+ * nonzero) to out. Periodic reports are skipped when nothing was lost, but
+ * the final report is always printed if anything was submitted. Entries that
+ * failed, were missed or went stale are printed on a line of their own when
+ * there were any.
+ */
+void loss_stats_report(struct loss_stats *stats, FILE *out, long long nowNs,
+                       int final);
+
+/**
+ * Returns how long poll(2) may block before the next periodic report is due,
+ * in milliseconds, or -1 if there are no periodic reports.
+ */
+int loss_stats_timeout_ms(const struct loss_stats *stats, long long nowNs);
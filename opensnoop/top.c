@@ -0,0 +1,121 @@
+#include "top.h"
+#include <bcc/libbpf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int reserve(struct top_table *table, size_t capacity) {
+  if (capacity <= table->capacity) {
+    return 0;
+  }
+
+  struct top_entry *entries =
+      realloc(table->entries, capacity * sizeof(struct top_entry));
+  if (entries == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  table->entries = entries;
+  table->capacity = capacity;
+  return 0;
+}
+
+int top_table_collect(struct top_table *table, int mapFd, int reset) {
+  table->len = 0;
+  table->total = 0;
+
+  // Collect every key before deleting any: deleting the key that
+  // bpf_get_next_key() was given would restart the walk from the beginning.
+  while (1) {
+    if (table->len == table->capacity &&
+        reserve(table, 2 * table->capacity + 64) < 0) {
+      return -1;
+    }
+    struct top_key_t *prev =
+        table->len == 0 ? NULL : &table->entries[table->len - 1].key;
+    struct top_key_t *next = &table->entries[table->len].key;
+    if (bpf_get_next_key(mapFd, prev, next) < 0) {
+      if (errno == ENOENT) {
+        break;
+      }
+      return -1;
+    }
+    table->len++;
+  }
+
+  size_t numFound = 0;
+  for (size_t i = 0; i < table->len; i++) {
+    struct top_entry *entry = &table->entries[i];
+    if (bpf_lookup_elem(mapFd, &entry->key, &entry->value) < 0) {
+      // Deleted since we saw its key.
+      continue;
+    }
+    if (reset) {
+      bpf_delete_elem(mapFd, &entry->key);
+    }
+    table->total += entry->value.count;
+    table->entries[numFound++] = *entry;
+  }
+  table->len = numFound;
+  return 0;
+}
+
+static int compareEntries(const void *a, const void *b) {
+  const struct top_value_t *x = &((const struct top_entry *)a)->value;
+  const struct top_value_t *y = &((const struct top_entry *)b)->value;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  if (x->last_ts != y->last_ts) {
+    return x->last_ts < y->last_ts ? 1 : -1;
+  }
+  return 0;
+}
+
+void top_table_sort(struct top_table *table) {
+  qsort(table->entries, table->len, sizeof(struct top_entry),
+        &compareEntries);
+}
+
+int output_append_top(struct output_writer *writer,
+                      const struct top_table *table, size_t maxRows) {
+  // "\n%H:%M:%S  %zu paths, %llu opens\n"
+  char clock[16];
+  time_t now = time(NULL);
+  struct tm local;
+  strftime(clock, sizeof(clock), "%H:%M:%S", localtime_r(&now, &local));
+  output_append_str(writer, "\n");
+  output_append_str(writer, clock);
+  output_append_str(writer, "  ");
+  output_append_int(writer, table->len, 0, /* leftAlign */ 0);
+  output_append_str(writer, " paths, ");
+  output_append_int(writer, table->total, 0, /* leftAlign */ 0);
+  output_append_str(writer, " opens\n");
+  output_append_str(writer, "COUNT    ERR COMM             PATH\n");
+
+  // "%-8llu %3d %-16.16s %s\n"
+  for (size_t i = 0; i < table->len && i < maxRows; i++) {
+    if (output_writer_maybe_flush(writer) < 0) {
+      return -1;
+    }
+
+    const struct top_entry *entry = &table->entries[i];
+    output_append_int(writer, entry->value.count, 8, /* leftAlign */ 1);
+    output_append_str(writer, " ");
+    output_append_int(writer, entry->key.err, 3, /* leftAlign */ 0);
+    output_append_str(writer, " ");
+    output_append_padded_str(writer, entry->key.comm, TASK_COMM_LEN, 16);
+    output_append_str(writer, " ");
+    output_append_bytes(writer, entry->value.fname,
+                        strnlen(entry->value.fname,
+                                sizeof(entry->value.fname)));
+    output_append_str(writer, "\n");
+  }
+  return 0;
+}
+
+void top_table_free(struct top_table *table) {
+  free(table->entries);
+  memset(table, 0, sizeof(*table));
+}
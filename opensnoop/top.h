@@ -0,0 +1,47 @@
+/**
+ * Userspace half of aggregation mode (--top).
+ *
+ * The return program counts opens in a BPF_HASH from struct top_key_t to
+ * struct top_value_t rather than submitting them, so nothing crosses to
+ * userspace per event. Every interval, opensnoop reads the whole map back,
+ * clears it, and prints the entries with the highest counts.
+ */
+#pragma once
+
+#include "opensnoop.h"
+#include "output.h"
+#include <stddef.h>
+
+struct top_entry {
+  struct top_key_t key;
+  struct top_value_t value;
+};
+
+struct top_table {
+  struct top_entry *entries;
+  size_t len;
+  size_t capacity;
+  // Sum of the counts of every entry, including those not printed.
+  unsigned long long total;
+};
+
+/**
+ * Replaces the contents of table with those of the BPF_HASH mapFd, deleting
+ * each entry from the map once it has been read if reset is nonzero. (An
+ * open counted between the read and the delete is lost.) Returns 0 on
+ * success or -1 with errno set.
+ */
+int top_table_collect(struct top_table *table, int mapFd, int reset);
+
+/** Sorts by descending count, then by most recently seen. */
+void top_table_sort(struct top_table *table);
+
+/**
+ * Appends a summary line, a header and the first maxRows entries of table.
+ * Returns 0 on success or -1 with errno set if the writer had to flush and
+ * failed.
+ */
+int output_append_top(struct output_writer *writer,
+                      const struct top_table *table, size_t maxRows);
+
+void top_table_free(struct top_table *table);
@@ -0,0 +1,188 @@
+#include "trampoline.h"
+#include <errno.h>
+#include <linux/btf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define VMLINUX_BTF_PATH "/sys/kernel/btf/vmlinux"
+
+static int sysBpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/** Reads all of path into a malloc()ed buffer. Returns NULL on error. */
+static char *readFile(const char *path, size_t *size) {
+  FILE *file = fopen(path, "re");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  // sysfs reports a size of 0 for the file, so read until EOF.
+  size_t capacity = 1 << 20, len = 0;
+  char *buf = malloc(capacity);
+  while (buf != NULL) {
+    len += fread(buf + len, 1, capacity - len, file);
+    if (len < capacity) {
+      break;
+    }
+    char *newBuf = realloc(buf, capacity * 2);
+    if (newBuf == NULL) {
+      free(buf);
+      errno = ENOMEM;
+    }
+    buf = newBuf;
+    capacity *= 2;
+  }
+  if (buf != NULL && ferror(file)) {
+    free(buf);
+    buf = NULL;
+    errno = EIO;
+  }
+  fclose(file);
+  *size = len;
+  return buf;
+}
+
+/**
+ * Returns the number of bytes that follow a struct btf_type of the given
+ * kind with vlen members, or -1 if the kind is unknown.
+ */
+static long extraSize(int kind, int vlen) {
+  switch (kind) {
+  case BTF_KIND_INT:
+  case BTF_KIND_VAR:
+  case BTF_KIND_DECL_TAG:
+    return 4;
+  case BTF_KIND_ARRAY:
+    return sizeof(struct btf_array);
+  case BTF_KIND_STRUCT:
+  case BTF_KIND_UNION:
+    return (long)vlen * sizeof(struct btf_member);
+  case BTF_KIND_ENUM:
+    return (long)vlen * sizeof(struct btf_enum);
+  case BTF_KIND_ENUM64:
+    return (long)vlen * sizeof(struct btf_enum64);
+  case BTF_KIND_FUNC_PROTO:
+    return (long)vlen * sizeof(struct btf_param);
+  case BTF_KIND_DATASEC:
+    return (long)vlen * sizeof(struct btf_var_secinfo);
+  case BTF_KIND_PTR:
+  case BTF_KIND_FWD:
+  case BTF_KIND_TYPEDEF:
+  case BTF_KIND_VOLATILE:
+  case BTF_KIND_CONST:
+  case BTF_KIND_RESTRICT:
+  case BTF_KIND_FUNC:
+  case BTF_KIND_FLOAT:
+  case BTF_KIND_TYPE_TAG:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+int trampoline_find_func(const char *name, int *numArgs) {
+  size_t size;
+  char *data = readFile(VMLINUX_BTF_PATH, &size);
+  if (data == NULL) {
+    return -1;
+  }
+
+  struct btf_header header;
+  if (size < sizeof(header)) {
+    free(data);
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(&header, data, sizeof(header));
+  size_t typesStart = header.hdr_len + header.type_off;
+  size_t typesEnd = typesStart + header.type_len;
+  size_t stringsStart = header.hdr_len + header.str_off;
+  if (header.magic != BTF_MAGIC || typesEnd > size ||
+      stringsStart + header.str_len > size) {
+    free(data);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Type ids are assigned in order starting from 1. Every type's offset is
+  // kept because the FUNC_PROTO of a FUNC can come before or after it.
+  size_t *offsets = NULL;
+  int numTypes = 0, capacity = 0, funcId = -1;
+  size_t offset = typesStart;
+  while (offset + sizeof(struct btf_type) <= typesEnd) {
+    struct btf_type type;
+    memcpy(&type, data + offset, sizeof(type));
+    int kind = BTF_INFO_KIND(type.info);
+    long extra = extraSize(kind, BTF_INFO_VLEN(type.info));
+    if (extra < 0) {
+      break;
+    }
+
+    if (numTypes == capacity) {
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      size_t *newOffsets = realloc(offsets, capacity * sizeof(size_t));
+      if (newOffsets == NULL) {
+        free(offsets);
+        free(data);
+        errno = ENOMEM;
+        return -1;
+      }
+      offsets = newOffsets;
+    }
+    offsets[numTypes++] = offset;
+
+    if (kind == BTF_KIND_FUNC &&
+        type.name_off < header.str_len &&
+        strcmp(data + stringsStart + type.name_off, name) == 0) {
+      funcId = numTypes;
+    }
+    offset += sizeof(type) + extra;
+  }
+
+  int rc = -1;
+  errno = ENOENT;
+  if (funcId != -1) {
+    struct btf_type func, proto;
+    memcpy(&func, data + offsets[funcId - 1], sizeof(func));
+    if (func.type >= 1 && func.type <= (unsigned)numTypes) {
+      memcpy(&proto, data + offsets[func.type - 1], sizeof(proto));
+      if (BTF_INFO_KIND(proto.info) == BTF_KIND_FUNC_PROTO) {
+        *numArgs = BTF_INFO_VLEN(proto.info);
+        rc = funcId;
+      }
+    }
+  }
+  free(offsets);
+  free(data);
+  return rc;
+}
+
+int trampoline_prog_load(const char *name, const struct bpf_insn *insns,
+                         int numInsns, enum bpf_attach_type attachType,
+                         int btfId, char *logBuf, unsigned logBufSize) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_TRACING;
+  attr.expected_attach_type = attachType;
+  attr.attach_btf_id = btfId;
+  attr.insns = (unsigned long)insns;
+  attr.insn_cnt = numInsns;
+  attr.license = (unsigned long)"GPL";
+  attr.log_level = 1;
+  attr.log_buf = (unsigned long)logBuf;
+  attr.log_size = logBufSize;
+  strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+  return sysBpf(BPF_PROG_LOAD, &attr);
+}
+
+int trampoline_attach(int progFd) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  // A NULL name attaches to the function given at load time.
+  attr.raw_tracepoint.prog_fd = progFd;
+  return sysBpf(BPF_RAW_TRACEPOINT_OPEN, &attr);
+}
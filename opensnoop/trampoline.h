@@ -0,0 +1,41 @@
+/**
+ * Attaching programs to a kernel function with fentry and fexit, for
+ * --attach fentry.
+ *
+ * These go through a BPF trampoline (Linux 5.5+) that calls the program
+ * directly from the function's entry or exit rather than through the
+ * breakpoint or optimized jump of a kprobe, and give it the function's
+ * arguments (and, for fexit, its return value) as an array of 64-bit words.
+ * The function is identified by its BTF type id in /sys/kernel/btf/vmlinux,
+ * which only kernels built with CONFIG_DEBUG_INFO_BTF have.
+ *
+ * The bcc API used everywhere else has no way to pass the attach type and
+ * BTF id to the kernel, so this uses the bpf(2) system call directly.
+ */
+#pragma once
+
+#include <bcc/libbpf.h>
+
+/**
+ * Looks up the function name in the kernel's BTF. Returns its BTF type id
+ * and sets *numArgs to its number of arguments, or returns -1 with errno set
+ * (ENOENT if the kernel has no BTF or no such function).
+ */
+int trampoline_find_func(const char *name, int *numArgs);
+
+/**
+ * Loads numInsns instructions as a BPF_PROG_TYPE_TRACING program that will
+ * be attached to the function btfId with attachType (BPF_TRACE_FENTRY or
+ * BPF_TRACE_FEXIT). name may only contain letters, digits, '_' and '.'. The
+ * verifier log is written to logBuf. Returns the program's fd, or -1 with
+ * errno set.
+ */
+int trampoline_prog_load(const char *name, const struct bpf_insn *insns,
+                         int numInsns, enum bpf_attach_type attachType,
+                         int btfId, char *logBuf, unsigned logBufSize);
+
+/**
+ * Attaches a program loaded by trampoline_prog_load(). Returns an fd that
+ * detaches it when closed, or -1 with errno set.
+ */
+int trampoline_attach(int progFd);